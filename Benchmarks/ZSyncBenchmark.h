@@ -0,0 +1,80 @@
+//
+//  ZSyncBenchmark.h
+//  ZSyncBench
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import <Foundation/Foundation.h>
+#import <CoreData/CoreData.h>
+#import "ZSyncShared.h"
+
+/* Base class for the ZSyncBench subcommands.  A benchmark fills -results
+ * while it runs and the tool writes them out as an XML property list so
+ * numbers from different releases can be compared by a script.
+ */
+@interface ZSyncBenchmark : NSObject
+{
+  NSMutableDictionary *results;
+  NSDictionary *arguments;
+
+  BOOL waiting;
+}
+
+@property (nonatomic, readonly) NSMutableDictionary *results;
+@property (nonatomic, retain) NSDictionary *arguments;
+@property (nonatomic, assign, getter=isWaiting) BOOL waiting;
+
+/* Name used on the command line to select the benchmark */
++ (NSString *)name;
+
+/* Monotonic time in seconds */
++ (NSTimeInterval)now;
+
+/* Count, mean, minimum, maximum and the p50/p90/p99/p99.9 percentiles of a
+ * list of NSNumber samples.  The array is sorted in place.
+ */
++ (NSDictionary *)summaryOfSamples:(NSMutableArray *)samples;
+
+/* A buffer of the given length that compresses roughly as well as a
+ * SQLite store: half random bytes and half repeating record text.
+ */
++ (NSData *)payloadOfLength:(NSUInteger)length;
+
+- (void)run;
+
+/* Spins the current run loop until -waiting is cleared by a callback.
+ * Returns NO if the timeout expired first.
+ */
+- (BOOL)runUntilFinishedWithTimeout:(NSTimeInterval)timeout;
+
+- (NSInteger)integerArgument:(NSString *)key defaultValue:(NSInteger)defaultValue;
+- (double)doubleArgument:(NSString *)key defaultValue:(double)defaultValue;
+
+/* The compiled DataModel.xcdatamodel of the samples, read from -model or
+ * from DataModel.mom next to the tool.  Nil if neither exists.
+ */
+- (NSManagedObjectModel *)loadDataModel;
+- (BOOL)writeResultsToPath:(NSString *)path;
+
+@end
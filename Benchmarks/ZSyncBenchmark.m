@@ -0,0 +1,197 @@
+//
+//  ZSyncBenchmark.m
+//  ZSyncBench
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import <mach/mach_time.h>
+#import "ZSyncBenchmark.h"
+
+#define kPayloadBlockLength (1024 * 1024)
+
+@implementation ZSyncBenchmark
+
++ (NSString *)name
+{
+  return nil;
+}
+
++ (NSTimeInterval)now
+{
+  static mach_timebase_info_data_t timebase;
+  if (timebase.denom == 0) {
+    mach_timebase_info(&timebase);
+  }
+
+  return (double)mach_absolute_time() * timebase.numer / timebase.denom / 1e9;
+}
+
++ (NSDictionary *)summaryOfSamples:(NSMutableArray *)samples
+{
+  NSMutableDictionary *summary = [NSMutableDictionary dictionary];
+  NSUInteger count = [samples count];
+  [summary setValue:[NSNumber numberWithUnsignedInteger:count] forKey:@"count"];
+  if (!count) {
+    return summary;
+  }
+
+  [samples sortUsingSelector:@selector(compare:)];
+
+  double total = 0.0;
+  for (NSNumber *sample in samples) {
+    total += [sample doubleValue];
+  }
+
+  [summary setValue:[NSNumber numberWithDouble:(total / count)] forKey:@"mean"];
+  [summary setValue:[samples objectAtIndex:0] forKey:@"min"];
+  [summary setValue:[samples lastObject] forKey:@"max"];
+  [summary setValue:[samples objectAtIndex:(NSUInteger)((count - 1) * 0.5)] forKey:@"p50"];
+  [summary setValue:[samples objectAtIndex:(NSUInteger)((count - 1) * 0.9)] forKey:@"p90"];
+  [summary setValue:[samples objectAtIndex:(NSUInteger)((count - 1) * 0.99)] forKey:@"p99"];
+  [summary setValue:[samples objectAtIndex:(NSUInteger)((count - 1) * 0.999)] forKey:@"p999"];
+
+  return summary;
+}
+
++ (NSData *)payloadOfLength:(NSUInteger)length
+{
+  static NSData *block = nil;
+  if (!block) {
+    NSMutableData *data = [[NSMutableData alloc] initWithLength:kPayloadBlockLength];
+    uint8_t *bytes = [data mutableBytes];
+    const char *record = "INSERT INTO ZTOPLEVELOBJECT VALUES(attribute1, attribute2, attribute3);";
+    size_t recordLength = strlen(record);
+    for (NSUInteger offset = 0; offset < kPayloadBlockLength; offset += 64) {
+      NSUInteger span = MIN((NSUInteger)64, kPayloadBlockLength - offset);
+      for (NSUInteger index = 0; index < span; ++index) {
+        bytes[offset + index] = ((offset / 64) % 2) ? (uint8_t)arc4random() : record[index % recordLength];
+      }
+    }
+    block = data;
+  }
+
+  NSMutableData *payload = [NSMutableData dataWithCapacity:length];
+  while ([payload length] < length) {
+    NSUInteger span = MIN((NSUInteger)kPayloadBlockLength, length - [payload length]);
+    [payload appendBytes:[block bytes] length:span];
+  }
+
+  return payload;
+}
+
+- (id)init
+{
+  if (!(self = [super init])) return nil;
+
+  results = [[NSMutableDictionary alloc] init];
+  [results setValue:[[self class] name] forKey:@"benchmark"];
+  [results setValue:[NSDate date] forKey:@"date"];
+  [results setValue:[[NSProcessInfo processInfo] hostName] forKey:@"host"];
+  [results setValue:[[NSProcessInfo processInfo] operatingSystemVersionString] forKey:@"operatingSystem"];
+
+  return self;
+}
+
+- (void)run
+{
+  ALog(@"%@ does not implement -run", [self class]);
+}
+
+- (BOOL)runUntilFinishedWithTimeout:(NSTimeInterval)timeout
+{
+  NSDate *limit = [NSDate dateWithTimeIntervalSinceNow:timeout];
+  while ([self isWaiting]) {
+    if ([limit timeIntervalSinceNow] < 0) {
+      NSLog(@"%@ timed out after %.0f seconds", [[self class] name], timeout);
+      [self setWaiting:NO];
+      return NO;
+    }
+
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+    [pool drain], pool = nil;
+  }
+
+  return YES;
+}
+
+- (NSInteger)integerArgument:(NSString *)key defaultValue:(NSInteger)defaultValue
+{
+  NSString *value = [[self arguments] valueForKey:key];
+  if (!value) {
+    return defaultValue;
+  }
+
+  return [value integerValue];
+}
+
+- (double)doubleArgument:(NSString *)key defaultValue:(double)defaultValue
+{
+  NSString *value = [[self arguments] valueForKey:key];
+  if (!value) {
+    return defaultValue;
+  }
+
+  return [value doubleValue];
+}
+
+- (NSManagedObjectModel *)loadDataModel
+{
+  NSString *path = [[self arguments] valueForKey:@"model"];
+  if (!path) {
+    NSString *tool = [[[NSProcessInfo processInfo] arguments] objectAtIndex:0];
+    path = [[tool stringByDeletingLastPathComponent] stringByAppendingPathComponent:@"DataModel.mom"];
+  }
+
+  return [[[NSManagedObjectModel alloc] initWithContentsOfURL:[NSURL fileURLWithPath:path]] autorelease];
+}
+
+- (BOOL)writeResultsToPath:(NSString *)path
+{
+  NSString *errorString = nil;
+  NSData *data = [NSPropertyListSerialization dataFromPropertyList:[self results]
+                                                            format:NSPropertyListXMLFormat_v1_0
+                                                  errorDescription:&errorString];
+  if (!data) {
+    NSLog(@"Failed to serialize results: %@", errorString);
+    [errorString release];
+    return NO;
+  }
+
+  return [data writeToFile:path atomically:YES];
+}
+
+- (void)dealloc
+{
+  [results release], results = nil;
+  [arguments release], arguments = nil;
+
+  [super dealloc];
+}
+
+@synthesize results;
+@synthesize arguments;
+@synthesize waiting;
+
+@end
@@ -0,0 +1,50 @@
+//
+//  ZSyncCodecBenchmark.h
+//  ZSyncBench
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+
+#import "ZSyncBenchmark.h"
+
+/* Microbenchmarks for the code that runs on every message of a sync:
+ * gzip and inflate of store chunks across sizes and compression levels,
+ * BLIPProperties encoding and decoding, BLIP frame header parsing and
+ * decoding of the daemon's TXT record.
+ *
+ * Every case is calibrated first so a single sample runs for at least a
+ * millisecond, then warmed up, then sampled.  The per operation times of
+ * the samples are reported with the usual summary so two runs can be
+ * compared on their medians and tails rather than a single mean.
+ *
+ * Options: -iterations <samples per case> (default 50), -warmup <samples>
+ * (default 5), -maxSize <bytes> (default 4 MB, the largest gzip input).
+ */
+@interface ZSyncCodecBenchmark : ZSyncBenchmark
+{
+  NSUInteger iterations;
+  NSUInteger warmup;
+}
+
+@end
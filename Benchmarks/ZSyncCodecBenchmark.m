@@ -0,0 +1,333 @@
+//
+//  ZSyncCodecBenchmark.m
+//  ZSyncBench
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+
+#import "ZSyncCodecBenchmark.h"
+#import "GTMNSData+zlib.h"
+
+#define kDefaultIterations 50
+#define kDefaultWarmup 5
+#define kDefaultMaximumSize (4 * 1024 * 1024)
+#define kMinimumSampleTime 0.001
+#define kMaximumBatch (1 << 20)
+
+/* BLIP frame header as MYNetwork writes it, all fields big endian.  The
+ * reader lives in libMYNetwork so the benchmark decodes the same layout
+ * with the same byte swapping and checks.
+ */
+#define kFrameHeaderMagic 0x9B34F205
+#define kFrameTypeMask 0x000F
+#define kFrameMoreComing 0x0080
+#define kFrameBodySize 4096
+
+typedef struct {
+  UInt32 magic;
+  UInt32 number;
+  UInt16 flags;
+  UInt16 size;
+} ZSyncFrameHeader;
+
+/* Arguments of a benchmarked operation */
+typedef struct {
+  NSData *data;
+  NSDictionary *dictionary;
+  int level;
+} ZSyncCodecCase;
+
+typedef void (*ZSyncCodecOperation)(ZSyncCodecCase *codecCase, NSUInteger count);
+
+/* Results are folded into this so the compiler cannot drop the work */
+static volatile NSUInteger sink;
+
+static void gzipOperation(ZSyncCodecCase *codecCase, NSUInteger count)
+{
+  for (NSUInteger index = 0; index < count; ++index) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    sink += [[NSData gtm_dataByGzippingData:codecCase->data compressionLevel:codecCase->level] length];
+    [pool drain], pool = nil;
+  }
+}
+
+static void inflateOperation(ZSyncCodecCase *codecCase, NSUInteger count)
+{
+  for (NSUInteger index = 0; index < count; ++index) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    sink += [[NSData gtm_dataByInflatingData:codecCase->data] length];
+    [pool drain], pool = nil;
+  }
+}
+
+static void encodePropertiesOperation(ZSyncCodecCase *codecCase, NSUInteger count)
+{
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  for (NSUInteger index = 0; index < count; ++index) {
+    BLIPMutableProperties *properties = [[BLIPMutableProperties alloc] initWithDictionary:codecCase->dictionary];
+    sink += [[properties encodedData] length];
+    [properties release], properties = nil;
+  }
+  [pool drain], pool = nil;
+}
+
+static void decodePropertiesOperation(ZSyncCodecCase *codecCase, NSUInteger count)
+{
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  for (NSUInteger index = 0; index < count; ++index) {
+    ssize_t usedLength = 0;
+    sink += [[BLIPProperties propertiesWithEncodedData:codecCase->data usedLength:&usedLength] count] + usedLength;
+  }
+  [pool drain], pool = nil;
+}
+
+static void parseFrameHeadersOperation(ZSyncCodecCase *codecCase, NSUInteger count)
+{
+  const uint8_t *bytes = [codecCase->data bytes];
+  NSUInteger length = [codecCase->data length];
+
+  for (NSUInteger index = 0; index < count; ++index) {
+    NSUInteger offset = 0;
+    NSUInteger checksum = 0;
+    while (length - offset >= sizeof(ZSyncFrameHeader)) {
+      ZSyncFrameHeader header;
+      memcpy(&header, bytes + offset, sizeof(header));
+      if (NSSwapBigIntToHost(header.magic) != kFrameHeaderMagic) break;
+
+      UInt16 size = NSSwapBigShortToHost(header.size);
+      if (size < sizeof(ZSyncFrameHeader) || size > length - offset) break;
+
+      UInt16 flags = NSSwapBigShortToHost(header.flags);
+      checksum += NSSwapBigIntToHost(header.number) ^ (flags & kFrameTypeMask) ^ (flags & kFrameMoreComing);
+      offset += size;
+    }
+    sink += checksum;
+  }
+}
+
+static void decodeTXTRecordOperation(ZSyncCodecCase *codecCase, NSUInteger count)
+{
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  for (NSUInteger index = 0; index < count; ++index) {
+    sink += [[NSNetService dictionaryFromTXTRecordData:codecCase->data] count];
+  }
+  [pool drain], pool = nil;
+}
+
+@interface ZSyncCodecBenchmark ()
+
+- (NSMutableDictionary *)measureOperation:(ZSyncCodecOperation)operation withCase:(ZSyncCodecCase *)codecCase;
+- (NSArray *)runCompression;
+- (NSDictionary *)runProperties;
+- (NSDictionary *)runFrameHeaders;
+- (NSArray *)runTXTRecords;
+
+@end
+
+@implementation ZSyncCodecBenchmark
+
++ (NSString *)name
+{
+  return @"codec";
+}
+
+- (void)run
+{
+  iterations = MAX([self integerArgument:@"iterations" defaultValue:kDefaultIterations], 1);
+  warmup = MAX([self integerArgument:@"warmup" defaultValue:kDefaultWarmup], 0);
+
+  [[self results] setValue:[NSNumber numberWithUnsignedInteger:iterations] forKey:@"iterations"];
+  [[self results] setValue:[self runCompression] forKey:@"compression"];
+  [[self results] setValue:[self runProperties] forKey:@"properties"];
+  [[self results] setValue:[self runFrameHeaders] forKey:@"frameHeaders"];
+  [[self results] setValue:[self runTXTRecords] forKey:@"txtRecord"];
+}
+
+#pragma mark -
+#pragma mark Local methods
+
+- (NSMutableDictionary *)measureOperation:(ZSyncCodecOperation)operation withCase:(ZSyncCodecCase *)codecCase
+{
+  // Batch fast operations so a sample is not dominated by the clock
+  NSUInteger batch = 1;
+  while (batch < kMaximumBatch) {
+    NSTimeInterval start = [ZSyncBenchmark now];
+    operation(codecCase, batch);
+    if ([ZSyncBenchmark now] - start >= kMinimumSampleTime) break;
+    batch *= 2;
+  }
+
+  for (NSUInteger index = 0; index < warmup; ++index) {
+    operation(codecCase, batch);
+  }
+
+  NSMutableArray *samples = [NSMutableArray arrayWithCapacity:iterations];
+  for (NSUInteger index = 0; index < iterations; ++index) {
+    NSTimeInterval start = [ZSyncBenchmark now];
+    operation(codecCase, batch);
+    [samples addObject:[NSNumber numberWithDouble:(([ZSyncBenchmark now] - start) / batch)]];
+  }
+
+  NSMutableDictionary *result = [NSMutableDictionary dictionaryWithDictionary:[ZSyncBenchmark summaryOfSamples:samples]];
+  [result setValue:[NSNumber numberWithUnsignedInteger:batch] forKey:@"batch"];
+  return result;
+}
+
+- (NSArray *)runCompression
+{
+  NSUInteger maximumSize = [self integerArgument:@"maxSize" defaultValue:kDefaultMaximumSize];
+  int levels[] = { 1, 6, 9 };
+
+  NSMutableArray *entries = [NSMutableArray array];
+  for (NSUInteger size = 1024; size <= maximumSize; size *= 4) {
+    NSData *payload = [ZSyncBenchmark payloadOfLength:size];
+    for (NSUInteger index = 0; index < sizeof(levels) / sizeof(levels[0]); ++index) {
+      NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+
+      ZSyncCodecCase codecCase = { payload, nil, levels[index] };
+      NSMutableDictionary *gzip = [self measureOperation:gzipOperation withCase:&codecCase];
+      [gzip setValue:[NSNumber numberWithDouble:(size / [[gzip valueForKey:@"p50"] doubleValue])] forKey:@"bytesPerSecond"];
+
+      NSData *compressed = [NSData gtm_dataByGzippingData:payload compressionLevel:levels[index]];
+      codecCase.data = compressed;
+      NSMutableDictionary *inflate = [self measureOperation:inflateOperation withCase:&codecCase];
+      [inflate setValue:[NSNumber numberWithDouble:(size / [[inflate valueForKey:@"p50"] doubleValue])] forKey:@"bytesPerSecond"];
+
+      NSMutableDictionary *entry = [NSMutableDictionary dictionary];
+      [entry setValue:[NSNumber numberWithUnsignedInteger:size] forKey:@"size"];
+      [entry setValue:[NSNumber numberWithInt:levels[index]] forKey:@"level"];
+      [entry setValue:[NSNumber numberWithUnsignedInteger:[compressed length]] forKey:@"compressedSize"];
+      [entry setValue:gzip forKey:@"gzip"];
+      [entry setValue:inflate forKey:@"inflate"];
+      [entries addObject:entry];
+      NSLog(@"%u bytes at level %i: gzip %.1f MB/s, inflate %.1f MB/s", size, levels[index], [[gzip valueForKey:@"bytesPerSecond"] doubleValue] / 1e6, [[inflate valueForKey:@"bytesPerSecond"] doubleValue] / 1e6);
+
+      [pool drain], pool = nil;
+    }
+  }
+
+  return entries;
+}
+
+- (NSDictionary *)runProperties
+{
+  // A schema verification and a store chunk, the two most common shapes
+  NSMutableDictionary *control = [NSMutableDictionary dictionary];
+  [control setValue:zsActID(zsActionVerifySchema) forKey:zsAction];
+  [control setValue:@"com.zarrastudios.ZSyncSample" forKey:zsSchemaIdentifier];
+  [control setValue:@"9C3A1D2E-5B47-4F0E-8E61-2D0F6C7B8A91" forKey:zsDeviceGUID];
+  [control setValue:@"Marcus's iPhone" forKey:zsDeviceName];
+  [control setValue:@"3f2a9c0d1b7e4c5a8f6d2e1b0a9c8d7e" forKey:zsModelFingerprint];
+
+  NSMutableDictionary *chunk = [NSMutableDictionary dictionary];
+  [chunk setValue:zsActID(zsActionStoreUpload) forKey:zsAction];
+  [chunk setValue:@"com.zarrastudios.ZSyncSample" forKey:zsSchemaIdentifier];
+  [chunk setValue:@"9C3A1D2E-5B47-4F0E-8E61-2D0F6C7B8A91" forKey:zsDeviceGUID];
+  [chunk setValue:@"persistentStore" forKey:zsStoreIdentifier];
+  [chunk setValue:@"2B1F0E3D-6A58-4C7B-9D02-1E4F7A6B5C83" forKey:zsSyncGUID];
+  [chunk setValue:NSSQLiteStoreType forKey:zsStoreType];
+  [chunk setValue:zsActID(17) forKey:zsChunkIndex];
+  [chunk setValue:zsActID(64) forKey:zsChunkCount];
+  [chunk setValue:@"2228224" forKey:zsChunkOffset];
+
+  NSDictionary *shapes = [NSDictionary dictionaryWithObjectsAndKeys:control, @"control", chunk, @"chunk", nil];
+  NSMutableDictionary *results = [NSMutableDictionary dictionary];
+  for (NSString *shape in shapes) {
+    NSDictionary *dictionary = [shapes objectForKey:shape];
+    BLIPMutableProperties *properties = [[BLIPMutableProperties alloc] initWithDictionary:dictionary];
+    NSData *encoded = [[[properties encodedData] retain] autorelease];
+    [properties release], properties = nil;
+
+    ZSyncCodecCase codecCase = { encoded, dictionary, 0 };
+    NSMutableDictionary *entry = [NSMutableDictionary dictionary];
+    [entry setValue:[NSNumber numberWithUnsignedInteger:[encoded length]] forKey:@"encodedSize"];
+    [entry setValue:[self measureOperation:encodePropertiesOperation withCase:&codecCase] forKey:@"encode"];
+    [entry setValue:[self measureOperation:decodePropertiesOperation withCase:&codecCase] forKey:@"decode"];
+    [results setValue:entry forKey:shape];
+  }
+
+  return results;
+}
+
+- (NSDictionary *)runFrameHeaders
+{
+  // One store upload worth of full frames with a control frame every eight
+  NSMutableData *frames = [NSMutableData data];
+  NSUInteger frameCount = 0;
+  uint8_t body[kFrameBodySize];
+  memset(body, 0, sizeof(body));
+  while ([frames length] < kDefaultMaximumSize) {
+    BOOL control = (frameCount % 8 == 0);
+    NSUInteger bodySize = control ? 96 : kFrameBodySize;
+
+    ZSyncFrameHeader header;
+    header.magic = NSSwapHostIntToBig(kFrameHeaderMagic);
+    header.number = NSSwapHostIntToBig((UInt32)(frameCount / 8 + 1));
+    header.flags = NSSwapHostShortToBig((UInt16)(control ? 0 : kFrameMoreComing));
+    header.size = NSSwapHostShortToBig((UInt16)(sizeof(header) + bodySize));
+    [frames appendBytes:&header length:sizeof(header)];
+    [frames appendBytes:body length:bodySize];
+    ++frameCount;
+  }
+
+  ZSyncCodecCase codecCase = { frames, nil, 0 };
+  NSMutableDictionary *result = [self measureOperation:parseFrameHeadersOperation withCase:&codecCase];
+  double perBuffer = [[result valueForKey:@"p50"] doubleValue];
+  [result setValue:[NSNumber numberWithUnsignedInteger:frameCount] forKey:@"frames"];
+  [result setValue:[NSNumber numberWithDouble:(perBuffer / frameCount)] forKey:@"secondsPerFrame"];
+  [result setValue:[NSNumber numberWithDouble:([frames length] / perBuffer)] forKey:@"bytesPerSecond"];
+
+  return result;
+}
+
+- (NSArray *)runTXTRecords
+{
+  NSMutableArray *entries = [NSMutableArray array];
+  NSUInteger schemaCounts[] = { 1, 8, 32 };
+  for (NSUInteger index = 0; index < sizeof(schemaCounts) / sizeof(schemaCounts[0]); ++index) {
+    // Shaped like the record ZSyncHandler advertises
+    NSMutableDictionary *record = [NSMutableDictionary dictionary];
+    [record setValue:@"7E2C4B1A-0F39-4D8E-A6B5-3C1D2E0F9A84" forKey:zsServerUUID];
+    [record setValue:@"Marcus's MacBook Pro" forKey:zsServerName];
+    [record setValue:zsActID(zsProtocolVersionNumber) forKey:zsTXTProtocolVersion];
+    [record setValue:@"chunks,heartbeat,push,tls" forKey:zsTXTCapabilities];
+    [record setValue:@"5d41402abc4b2a76" forKey:zsTXTSchemaSet];
+    [record setValue:@"2" forKey:zsTXTLoad];
+    [record setValue:@"14" forKey:zsTXTQueueDepth];
+    for (NSUInteger schema = 0; schema < schemaCounts[index]; ++schema) {
+      [record setValue:[NSString stringWithFormat:@"%u", 1000 + schema] forKey:zsChangeCountTXTKey(([NSString stringWithFormat:@"com.example.schema%u", schema]))];
+    }
+
+    NSData *data = [NSNetService dataFromTXTRecordDictionary:record];
+    ZSyncCodecCase codecCase = { data, nil, 0 };
+    NSMutableDictionary *entry = [self measureOperation:decodeTXTRecordOperation withCase:&codecCase];
+    [entry setValue:[NSNumber numberWithUnsignedInteger:schemaCounts[index]] forKey:@"schemas"];
+    [entry setValue:[NSNumber numberWithUnsignedInteger:[data length]] forKey:@"recordSize"];
+    [entries addObject:entry];
+  }
+
+  return entries;
+}
+
+@end
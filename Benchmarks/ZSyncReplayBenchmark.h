@@ -0,0 +1,73 @@
+//
+//  ZSyncReplayBenchmark.h
+//  ZSyncBench
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+
+#import "ZSyncBenchmark.h"
+
+@class ZSyncSessionReader;
+@class ZSyncStoreAssembler;
+
+/* Replays a session captured on a device (see captureDirectory on
+ * ZSyncTouchHandler) against a running daemon.  The recorded requests are
+ * sent again with their properties, bodies and flags.  A request that
+ * followed a response or a daemon request in the capture is held back until
+ * the replay has seen the same response or request, so the causal order of
+ * the session is kept at any speed.  Store chunks pushed by the daemon are
+ * acknowledged the way the device does.
+ *
+ * The daemon must be in the state it was in when the session was captured,
+ * the device paired and its plugin installed, for the responses to match.
+ *
+ * Options: -capture <path> (required), -host <address> (default 127.0.0.1),
+ * -port <port> (default 1123), -speed <factor> (default 1, the captured
+ * timing; 0 sends each request as soon as its dependencies are met),
+ * -timeout <seconds> (default 600).
+ */
+@interface ZSyncReplayBenchmark : ZSyncBenchmark <BLIPConnectionDelegate>
+{
+  BLIPConnection *connection;
+  ZSyncSessionReader *reader;
+  ZSyncStoreAssembler *storeAssembler;
+  NSDictionary *currentEvent;
+
+  double speed;
+  NSTimeInterval lastCapturedSendTime;
+  NSTimeInterval lastSendTime;
+  NSTimeInterval capturedDuration;
+
+  NSMutableDictionary *pendingResponses;
+  NSMutableSet *answeredNumbers;
+  NSMutableDictionary *roundTrips;
+  NSUInteger requestsReceived;
+  NSUInteger capturedRequestsReceived;
+  NSUInteger requestsSent;
+  NSUInteger errorCount;
+  NSString *failureReason;
+  BOOL finished;
+}
+
+@end
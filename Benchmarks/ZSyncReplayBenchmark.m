@@ -0,0 +1,282 @@
+//
+//  ZSyncReplayBenchmark.m
+//  ZSyncBench
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+
+#import "ZSyncReplayBenchmark.h"
+#import "ZSyncSessionRecorder.h"
+#import "ZSyncStoreAssembler.h"
+
+#define kDefaultHost @"127.0.0.1"
+#define kDefaultPort 1123
+#define kDefaultTimeout 600.0
+
+@interface ZSyncReplayBenchmark ()
+
+- (void)advance;
+- (void)sendEvent:(NSDictionary *)event;
+- (void)receiveStoreRequest:(BLIPRequest *)request;
+- (void)finishWithReason:(NSString *)reason;
+
+@end
+
+@implementation ZSyncReplayBenchmark
+
++ (NSString *)name
+{
+  return @"replay";
+}
+
+- (void)run
+{
+  NSString *path = [[self arguments] valueForKey:@"capture"];
+  if (!path) {
+    NSLog(@"The replay needs the -capture file of a device session");
+    return;
+  }
+
+  reader = [[ZSyncSessionReader alloc] initWithPath:path];
+  if (!reader) {
+    NSLog(@"%@ is not a capture file", path);
+    return;
+  }
+  if (![[[reader sessionInfo] valueForKey:zsCaptureRole] isEqualToString:zsCaptureRoleDevice]) {
+    NSLog(@"Only device captures can be replayed, %@ was recorded as %@", path, [[reader sessionInfo] valueForKey:zsCaptureRole]);
+    return;
+  }
+
+  speed = MAX([self doubleArgument:@"speed" defaultValue:1.0], 0.0);
+  pendingResponses = [[NSMutableDictionary alloc] init];
+  answeredNumbers = [[NSMutableSet alloc] init];
+  roundTrips = [[NSMutableDictionary alloc] init];
+  storeAssembler = [[ZSyncStoreAssembler alloc] initWithDirectory:NSTemporaryDirectory() pathExtension:@"zsync"];
+
+  NSString *host = [[self arguments] valueForKey:@"host"];
+  IPAddress *address = [[IPAddress alloc] initWithHostname:(host ? host : kDefaultHost) port:[self integerArgument:@"port" defaultValue:kDefaultPort]];
+  connection = [[BLIPConnection alloc] initToAddress:address];
+  [connection setDelegate:self];
+  [address release], address = nil;
+
+  [self setWaiting:YES];
+  NSTimeInterval start = [ZSyncBenchmark now];
+  [connection open];
+  if (![self runUntilFinishedWithTimeout:[self doubleArgument:@"timeout" defaultValue:kDefaultTimeout]]) {
+    [self finishWithReason:@"Timed out"];
+  }
+  NSTimeInterval elapsed = [ZSyncBenchmark now] - start;
+
+  NSMutableDictionary *latency = [NSMutableDictionary dictionary];
+  for (NSString *action in roundTrips) {
+    [latency setValue:[ZSyncBenchmark summaryOfSamples:[roundTrips objectForKey:action]] forKey:action];
+  }
+
+  [[self results] setValue:[path lastPathComponent] forKey:@"capture"];
+  [[self results] setValue:[NSNumber numberWithDouble:speed] forKey:@"speed"];
+  [[self results] setValue:[NSNumber numberWithDouble:capturedDuration] forKey:@"capturedSeconds"];
+  [[self results] setValue:[NSNumber numberWithDouble:elapsed] forKey:@"seconds"];
+  [[self results] setValue:[NSNumber numberWithUnsignedInteger:requestsSent] forKey:@"requestsSent"];
+  [[self results] setValue:[NSNumber numberWithUnsignedInteger:requestsReceived] forKey:@"requestsReceived"];
+  [[self results] setValue:[NSNumber numberWithUnsignedInteger:errorCount] forKey:@"errors"];
+  [[self results] setValue:failureReason forKey:@"failure"];
+  [[self results] setValue:latency forKey:@"roundTrip"];
+  NSLog(@"Replayed %u requests in %.2f seconds, captured session took %.2f seconds", requestsSent, elapsed, capturedDuration);
+}
+
+#pragma mark -
+#pragma mark Local methods
+
+/* Walks the capture until an event has to wait for the daemon or for the
+ * captured gap between two requests to pass.  Called again whenever a
+ * response or request arrives and when the gap timer fires.
+ */
+- (void)advance
+{
+  [NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(advance) object:nil];
+
+  while (!finished) {
+    if (!currentEvent) {
+      currentEvent = [[reader nextEvent] retain];
+      if (!currentEvent) {
+        [self finishWithReason:nil];
+        return;
+      }
+    }
+
+    NSString *kind = [currentEvent valueForKey:zsCaptureKind];
+    NSTimeInterval capturedTime = [[currentEvent valueForKey:zsCaptureTime] doubleValue];
+
+    if ([kind isEqualToString:zsCaptureKindResponse]) {
+      if (![answeredNumbers containsObject:[currentEvent valueForKey:zsCaptureNumber]]) return;
+    } else if ([kind isEqualToString:zsCaptureKindReceived]) {
+      if (requestsReceived <= capturedRequestsReceived) return;
+      ++capturedRequestsReceived;
+    } else if ([kind isEqualToString:zsCaptureKindSent]) {
+      if (speed > 0.0 && requestsSent) {
+        NSTimeInterval delay = (capturedTime - lastCapturedSendTime) / speed - ([ZSyncBenchmark now] - lastSendTime);
+        if (delay > 0.0) {
+          [self performSelector:@selector(advance) withObject:nil afterDelay:delay];
+          return;
+        }
+      }
+      lastCapturedSendTime = capturedTime;
+      [self sendEvent:currentEvent];
+    }
+
+    capturedDuration = MAX(capturedDuration, capturedTime);
+    [currentEvent release], currentEvent = nil;
+  }
+}
+
+- (void)sendEvent:(NSDictionary *)event
+{
+  BLIPRequest *request = [BLIPRequest requestWithBody:[event valueForKey:zsCaptureBody] properties:[event valueForKey:zsCaptureProperties]];
+  [request setUrgent:[[event valueForKey:zsCaptureUrgent] boolValue]];
+  [request setCompressed:[[event valueForKey:zsCaptureCompressed] boolValue]];
+  [request setNoReply:[[event valueForKey:zsCaptureNoReply] boolValue]];
+
+  lastSendTime = [ZSyncBenchmark now];
+  ++requestsSent;
+  BLIPResponse *response = [connection sendRequest:request];
+  if ([request noReply]) return;
+
+  NSString *action = [request valueOfProperty:zsAction];
+  NSArray *pending = [NSArray arrayWithObjects:[event valueForKey:zsCaptureNumber], (action ? action : @"none"), [NSNumber numberWithDouble:lastSendTime], nil];
+  [pendingResponses setObject:pending forKey:[NSValue valueWithNonretainedObject:response]];
+}
+
+- (void)receiveStoreRequest:(BLIPRequest *)request
+{
+  NSError *error = nil;
+  NSString *path = [storeAssembler addChunkFromRequest:request error:&error];
+  if (error) {
+    [request respondWithErrorCode:kBLIPError_HandlerFailed message:[error localizedDescription]];
+    [self finishWithReason:[NSString stringWithFormat:@"Store download failed: %@", [error localizedDescription]]];
+    return;
+  }
+  BLIPResponse *response = [request response];
+  [response setUrgent:YES];
+  if (!path) {
+    [response setValue:zsActID(zsActionChunkReceived) ofProperty:zsAction];
+    [response send];
+    return;
+  }
+
+  [[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+  [response setValue:zsActID(zsActionFileReceived) ofProperty:zsAction];
+  [response setValue:[request valueOfProperty:zsStoreIdentifier] ofProperty:zsStoreIdentifier];
+  [response send];
+}
+
+- (void)finishWithReason:(NSString *)reason
+{
+  if (finished) return;
+
+  if (reason) {
+    NSLog(@"Replay stopped: %@", reason);
+    failureReason = [reason copy];
+  }
+  finished = YES;
+
+  [NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(advance) object:nil];
+  [storeAssembler discardAllAssemblies];
+  [connection setDelegate:nil];
+  [connection close];
+  [self setWaiting:NO];
+}
+
+#pragma mark -
+#pragma mark BLIPConnectionDelegate methods
+
+- (void)connectionDidOpen:(TCPConnection *)conn
+{
+  [self advance];
+}
+
+- (void)connection:(TCPConnection *)conn failedToOpen:(NSError *)error
+{
+  [self finishWithReason:[NSString stringWithFormat:@"Failed to open: %@", [error localizedDescription]]];
+}
+
+- (void)connectionDidClose:(TCPConnection *)conn
+{
+  [self finishWithReason:@"Connection closed by the server"];
+}
+
+- (void)connection:(BLIPConnection *)conn receivedResponse:(BLIPResponse *)response
+{
+  NSValue *key = [NSValue valueWithNonretainedObject:response];
+  NSArray *pending = [pendingResponses objectForKey:key];
+  if (!pending) return;
+
+  NSString *action = [pending objectAtIndex:1];
+  NSMutableArray *samples = [roundTrips objectForKey:action];
+  if (!samples) {
+    samples = [NSMutableArray array];
+    [roundTrips setObject:samples forKey:action];
+  }
+  [samples addObject:[NSNumber numberWithDouble:([ZSyncBenchmark now] - [[pending objectAtIndex:2] doubleValue])]];
+
+  if ([response error]) {
+    DLog(@"%s error response: %@", __PRETTY_FUNCTION__, [[response error] localizedDescription]);
+    ++errorCount;
+  }
+
+  [answeredNumbers addObject:[pending objectAtIndex:0]];
+  [pendingResponses removeObjectForKey:key];
+  [self advance];
+}
+
+- (BOOL)connection:(BLIPConnection *)conn receivedRequest:(BLIPRequest *)request
+{
+  ++requestsReceived;
+  if ([[request valueOfProperty:zsAction] integerValue] == zsActionStoreUpload) {
+    [self receiveStoreRequest:request];
+  }
+
+  [self advance];
+  return YES;
+}
+
+#pragma mark -
+#pragma mark Memory management and property declarations
+
+- (void)dealloc
+{
+  [NSObject cancelPreviousPerformRequestsWithTarget:self];
+  [connection setDelegate:nil];
+  [connection release], connection = nil;
+  [reader release], reader = nil;
+  [storeAssembler release], storeAssembler = nil;
+  [currentEvent release], currentEvent = nil;
+  [pendingResponses release], pendingResponses = nil;
+  [answeredNumbers release], answeredNumbers = nil;
+  [roundTrips release], roundTrips = nil;
+  [failureReason release], failureReason = nil;
+
+  [super dealloc];
+}
+
+@end
@@ -0,0 +1,71 @@
+//
+//  ZSyncScalingBenchmark.h
+//  ZSyncBench
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import "ZSyncBenchmark.h"
+
+@class ZSyncMessageScheduler;
+@class ZSyncStoreAssembler;
+
+/* Runs a complete sync over loopback for generated stores of growing size
+ * and reports how each phase scales.  For every size a SQLite store built
+ * on DataModel.xcdatamodel is filled by ZSyncDataGenerator, synced, changed
+ * by the generator and synced again:
+ *
+ *   upload    device store sent in chunks to the daemon side
+ *   attach    daemon opens the received store
+ *   merge     daemon copies every object into its own store
+ *   download  merged store sent back to the device side
+ *   swap      device replaces its store and opens the new one
+ *
+ * Each phase reports its time, the bytes it put on the wire and the process
+ * resident size before and after it.  Both sides run in this process, so
+ * the memory of a phase belongs to the side doing the work in it.
+ *
+ * Options: -model <path to DataModel.mom> (default next to the tool),
+ * -minObjects <count> (default 1000), -maxObjects <count> (default 1000000),
+ * -changeRatio <fraction> (default 0.1), -seed <number>,
+ * -compressed <0|1> (default 1, as the device sends).
+ */
+@interface ZSyncScalingBenchmark : ZSyncBenchmark <TCPListenerDelegate, BLIPConnectionDelegate>
+{
+  NSManagedObjectModel *managedObjectModel;
+  NSString *workingDirectory;
+
+  BLIPListener *listener;
+  BLIPConnection *deviceConnection;
+  BLIPConnection *daemonConnection;
+  ZSyncMessageScheduler *deviceScheduler;
+  ZSyncMessageScheduler *daemonScheduler;
+  ZSyncStoreAssembler *deviceAssembler;
+  ZSyncStoreAssembler *daemonAssembler;
+
+  ZSyncMessageScheduler *sendingScheduler;
+  NSString *receivedStorePath;
+  BOOL compressed;
+}
+
+@end
@@ -0,0 +1,462 @@
+//
+//  ZSyncScalingBenchmark.m
+//  ZSyncBench
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import <zlib.h>
+#import "ZSyncScalingBenchmark.h"
+#import "ZSyncMessageScheduler.h"
+#import "ZSyncStoreAssembler.h"
+#import "ZSyncDataGenerator.h"
+#import "ZSyncMemory.h"
+
+#define kBenchmarkPort 11231
+#define kDefaultMinimumObjects 1000
+#define kDefaultMaximumObjects 1000000
+#define kDefaultChangeRatio 0.1
+#define kDefaultSeed 20100701
+#define kTimeout 3600.0
+#define kStoreIdentifier @"ZSyncScalingStore"
+
+@interface ZSyncScalingBenchmark ()
+
+- (BOOL)openConnection;
+- (void)closeConnection;
+- (void)checkTransferFinished;
+- (NSPersistentStoreCoordinator *)coordinatorForStoreAtPath:(NSString *)path error:(NSError **)error;
+- (void)closeStoresOfCoordinator:(NSPersistentStoreCoordinator *)coordinator;
+- (NSMutableDictionary *)phaseSince:(NSTimeInterval)start residentBefore:(NSUInteger)residentBefore;
+- (NSUInteger)wireLengthOfStoreAtPath:(NSString *)path chunkSize:(NSUInteger)chunkSize;
+- (NSString *)transferStoreAtPath:(NSString *)path withScheduler:(ZSyncMessageScheduler *)scheduler;
+- (NSDictionary *)syncStoreAtPath:(NSString *)path directory:(NSString *)directory;
+- (NSDictionary *)measureStoreAtPath:(NSString *)storePath objectCount:(NSUInteger)count seed:(uint64_t)seed;
+- (NSDictionary *)measureObjectCount:(NSUInteger)count;
+
+@end
+
+@implementation ZSyncScalingBenchmark
+
++ (NSString *)name
+{
+  return @"scaling";
+}
+
+- (void)run
+{
+  managedObjectModel = [[self loadDataModel] retain];
+  if (!managedObjectModel) {
+    NSLog(@"Unable to load DataModel.mom, pass its path with -model");
+    return;
+  }
+
+  workingDirectory = [[NSTemporaryDirectory() stringByAppendingPathComponent:[NSString stringWithFormat:@"ZSyncScaling-%i", getpid()]] retain];
+  [[NSFileManager defaultManager] createDirectoryAtPath:workingDirectory withIntermediateDirectories:YES attributes:nil error:nil];
+
+  if (![self openConnection]) {
+    NSLog(@"Unable to open a loopback connection");
+    [[NSFileManager defaultManager] removeItemAtPath:workingDirectory error:nil];
+    return;
+  }
+
+  compressed = [self integerArgument:@"compressed" defaultValue:1];
+
+  NSUInteger minimumObjects = [self integerArgument:@"minObjects" defaultValue:kDefaultMinimumObjects];
+  NSUInteger maximumObjects = [self integerArgument:@"maxObjects" defaultValue:kDefaultMaximumObjects];
+
+  NSMutableArray *sizes = [NSMutableArray array];
+  for (NSUInteger count = minimumObjects; count <= maximumObjects; count *= 10) {
+    NSLog(@"Syncing a store of %u objects", count);
+    NSDictionary *entry = [self measureObjectCount:count];
+    if (!entry) break;
+    [sizes addObject:entry];
+  }
+
+  [[self results] setValue:sizes forKey:@"sizes"];
+  [[self results] setValue:[NSNumber numberWithBool:compressed] forKey:@"compressed"];
+  [[self results] setValue:[NSNumber numberWithDouble:[self doubleArgument:@"changeRatio" defaultValue:kDefaultChangeRatio]] forKey:@"changeRatio"];
+
+  [self closeConnection];
+  [[NSFileManager defaultManager] removeItemAtPath:workingDirectory error:nil];
+}
+
+#pragma mark -
+#pragma mark Local methods
+
+- (BOOL)openConnection
+{
+  listener = [[BLIPListener alloc] initWithPort:kBenchmarkPort];
+  [listener setDelegate:self];
+  [listener setPickAvailablePort:YES];
+
+  NSError *error = nil;
+  if (![listener open:&error]) {
+    NSLog(@"Failed to open listener: %@", [error localizedDescription]);
+    return NO;
+  }
+
+  IPAddress *address = [[IPAddress alloc] initWithHostname:@"127.0.0.1" port:[listener port]];
+  deviceConnection = [[BLIPConnection alloc] initToAddress:address];
+  [address release], address = nil;
+
+  [deviceConnection setDelegate:self];
+  [self setWaiting:YES];
+  [deviceConnection open];
+
+  if (![self runUntilFinishedWithTimeout:30.0] || [deviceConnection status] != kTCP_Open || !daemonConnection) {
+    return NO;
+  }
+
+  deviceScheduler = [[ZSyncMessageScheduler alloc] initWithConnection:deviceConnection];
+  daemonScheduler = [[ZSyncMessageScheduler alloc] initWithConnection:daemonConnection];
+  deviceAssembler = [[ZSyncStoreAssembler alloc] initWithDirectory:workingDirectory pathExtension:@"sqlite"];
+  daemonAssembler = [[ZSyncStoreAssembler alloc] initWithDirectory:workingDirectory pathExtension:@"sqlite"];
+
+  return YES;
+}
+
+- (void)closeConnection
+{
+  [deviceScheduler cancelAllMessages];
+  [daemonScheduler cancelAllMessages];
+  [deviceScheduler release], deviceScheduler = nil;
+  [daemonScheduler release], daemonScheduler = nil;
+  [deviceAssembler release], deviceAssembler = nil;
+  [daemonAssembler release], daemonAssembler = nil;
+
+  [deviceConnection setDelegate:nil];
+  [deviceConnection close];
+  [deviceConnection release], deviceConnection = nil;
+  [daemonConnection setDelegate:nil];
+  [daemonConnection release], daemonConnection = nil;
+
+  [listener close];
+  [listener release], listener = nil;
+}
+
+- (NSPersistentStoreCoordinator *)coordinatorForStoreAtPath:(NSString *)path error:(NSError **)error
+{
+  NSPersistentStoreCoordinator *coordinator = [[NSPersistentStoreCoordinator alloc] initWithManagedObjectModel:managedObjectModel];
+  NSPersistentStore *store = [coordinator addPersistentStoreWithType:NSSQLiteStoreType
+                                                       configuration:nil
+                                                                 URL:[NSURL fileURLWithPath:path]
+                                                             options:nil
+                                                               error:error];
+  if (!store) {
+    [coordinator release], coordinator = nil;
+    return nil;
+  }
+
+  return [coordinator autorelease];
+}
+
+- (void)closeStoresOfCoordinator:(NSPersistentStoreCoordinator *)coordinator
+{
+  for (NSPersistentStore *store in [coordinator persistentStores]) {
+    [coordinator removePersistentStore:store error:nil];
+  }
+}
+
+- (NSMutableDictionary *)phaseSince:(NSTimeInterval)start residentBefore:(NSUInteger)residentBefore
+{
+  NSMutableDictionary *phase = [NSMutableDictionary dictionary];
+  [phase setValue:[NSNumber numberWithDouble:([ZSyncBenchmark now] - start)] forKey:@"seconds"];
+  [phase setValue:[NSNumber numberWithUnsignedInteger:residentBefore] forKey:@"residentBefore"];
+  [phase setValue:[NSNumber numberWithUnsignedInteger:[ZSyncMemory residentSize]] forKey:@"residentAfter"];
+  [phase setValue:[NSNumber numberWithUnsignedInteger:[ZSyncMemory peakResidentSize]] forKey:@"peakResident"];
+
+  return phase;
+}
+
+/* BLIP compresses inside libMYNetwork where the encoded length cannot be
+ * read, so compressed bodies are deflated here chunk by chunk the same way.
+ */
+- (NSUInteger)wireLengthOfStoreAtPath:(NSString *)path chunkSize:(NSUInteger)chunkSize
+{
+  NSData *data = [NSData dataWithContentsOfFile:path options:NSMappedRead error:nil];
+  if (!compressed) {
+    return [data length];
+  }
+
+  NSMutableData *buffer = [NSMutableData dataWithLength:compressBound(chunkSize)];
+  NSUInteger wireLength = 0;
+  for (NSUInteger offset = 0; offset < [data length]; offset += chunkSize) {
+    uLong length = MIN(chunkSize, [data length] - offset);
+    uLongf compressedLength = [buffer length];
+    if (compress2([buffer mutableBytes], &compressedLength, (const Bytef *)[data bytes] + offset, length, Z_DEFAULT_COMPRESSION) != Z_OK) {
+      compressedLength = length;
+    }
+    wireLength += compressedLength;
+  }
+
+  return wireLength;
+}
+
+- (NSString *)transferStoreAtPath:(NSString *)path withScheduler:(ZSyncMessageScheduler *)scheduler
+{
+  NSMutableDictionary *properties = [NSMutableDictionary dictionary];
+  [properties setValue:zsActID(zsActionStoreUpload) forKey:zsAction];
+  [properties setValue:kStoreIdentifier forKey:zsStoreIdentifier];
+
+  [receivedStorePath release], receivedStorePath = nil;
+  sendingScheduler = scheduler;
+  [self setWaiting:YES];
+  [scheduler sendStoreData:[NSData dataWithContentsOfFile:path options:NSMappedRead error:nil] properties:properties compressed:compressed];
+  BOOL finished = [self runUntilFinishedWithTimeout:kTimeout];
+  sendingScheduler = nil;
+
+  return (finished ? receivedStorePath : nil);
+}
+
+- (void)checkTransferFinished
+{
+  if (receivedStorePath && ![sendingScheduler pendingMessageCount]) {
+    [self setWaiting:NO];
+  }
+}
+
+- (NSDictionary *)syncStoreAtPath:(NSString *)path directory:(NSString *)directory
+{
+  NSMutableDictionary *phases = [NSMutableDictionary dictionary];
+  NSFileManager *fileManager = [NSFileManager defaultManager];
+  NSError *error = nil;
+
+  NSUInteger residentBefore = [ZSyncMemory residentSize];
+  NSTimeInterval start = [ZSyncBenchmark now];
+  NSString *uploadedPath = [self transferStoreAtPath:path withScheduler:deviceScheduler];
+  if (!uploadedPath) {
+    NSLog(@"Upload of %@ did not finish", path);
+    return nil;
+  }
+  NSMutableDictionary *phase = [self phaseSince:start residentBefore:residentBefore];
+  // Measured after the phase so deflating does not count against it
+  [phase setValue:[NSNumber numberWithUnsignedInteger:[self wireLengthOfStoreAtPath:uploadedPath chunkSize:[deviceScheduler chunkSize]]] forKey:@"wireBytes"];
+  [phases setValue:phase forKey:@"upload"];
+
+  residentBefore = [ZSyncMemory residentSize];
+  start = [ZSyncBenchmark now];
+  NSPersistentStoreCoordinator *coordinator = [self coordinatorForStoreAtPath:uploadedPath error:&error];
+  if (!coordinator) {
+    NSLog(@"Failed to attach %@: %@", uploadedPath, [error localizedDescription]);
+    return nil;
+  }
+  [phases setValue:[self phaseSince:start residentBefore:residentBefore] forKey:@"attach"];
+
+  // The daemon hands the store to Sync Services, which reads every record
+  // and writes the merged truth back.  A migration to a fresh store does the
+  // same amount of reading and writing without a sync session.
+  NSString *mergedPath = [directory stringByAppendingPathComponent:@"merged.sqlite"];
+  [fileManager removeItemAtPath:mergedPath error:nil];
+  residentBefore = [ZSyncMemory residentSize];
+  start = [ZSyncBenchmark now];
+  NSPersistentStore *store = [[coordinator persistentStores] lastObject];
+  if (![coordinator migratePersistentStore:store toURL:[NSURL fileURLWithPath:mergedPath] options:nil withType:NSSQLiteStoreType error:&error]) {
+    NSLog(@"Failed to merge %@: %@", uploadedPath, [error localizedDescription]);
+    return nil;
+  }
+  [self closeStoresOfCoordinator:coordinator];
+  [phases setValue:[self phaseSince:start residentBefore:residentBefore] forKey:@"merge"];
+  [fileManager removeItemAtPath:uploadedPath error:nil];
+
+  residentBefore = [ZSyncMemory residentSize];
+  start = [ZSyncBenchmark now];
+  NSString *downloadedPath = [self transferStoreAtPath:mergedPath withScheduler:daemonScheduler];
+  if (!downloadedPath) {
+    NSLog(@"Download of %@ did not finish", mergedPath);
+    return nil;
+  }
+  phase = [self phaseSince:start residentBefore:residentBefore];
+  [phase setValue:[NSNumber numberWithUnsignedInteger:[self wireLengthOfStoreAtPath:downloadedPath chunkSize:[daemonScheduler chunkSize]]] forKey:@"wireBytes"];
+  [phases setValue:phase forKey:@"download"];
+  [fileManager removeItemAtPath:mergedPath error:nil];
+
+  residentBefore = [ZSyncMemory residentSize];
+  start = [ZSyncBenchmark now];
+  [fileManager removeItemAtPath:path error:nil];
+  [fileManager moveItemAtPath:downloadedPath toPath:path error:nil];
+  coordinator = [self coordinatorForStoreAtPath:path error:&error];
+  if (!coordinator) {
+    NSLog(@"Failed to open the swapped store %@: %@", path, [error localizedDescription]);
+    return nil;
+  }
+  [self closeStoresOfCoordinator:coordinator];
+  [phases setValue:[self phaseSince:start residentBefore:residentBefore] forKey:@"swap"];
+
+  return phases;
+}
+
+- (NSDictionary *)measureStoreAtPath:(NSString *)storePath objectCount:(NSUInteger)count seed:(uint64_t)seed
+{
+  NSMutableDictionary *entry = [NSMutableDictionary dictionary];
+  NSString *directory = [storePath stringByDeletingLastPathComponent];
+  NSError *error = nil;
+
+  NSUInteger residentBefore = [ZSyncMemory residentSize];
+  NSTimeInterval start = [ZSyncBenchmark now];
+  NSPersistentStoreCoordinator *coordinator = [self coordinatorForStoreAtPath:storePath error:&error];
+  NSManagedObjectContext *context = [[NSManagedObjectContext alloc] init];
+  [context setUndoManager:nil];
+  [context setPersistentStoreCoordinator:coordinator];
+  ZSyncDataGenerator *generator = [[ZSyncDataGenerator alloc] initWithManagedObjectContext:context seed:seed];
+  BOOL success = (coordinator && [generator populateWithObjectCount:count error:&error]);
+  [entry setValue:[NSNumber numberWithUnsignedInteger:[generator insertedCount]] forKey:@"objects"];
+  [entry setValue:[self phaseSince:start residentBefore:residentBefore] forKey:@"generate"];
+  [generator release], generator = nil;
+  [context release], context = nil;
+  [self closeStoresOfCoordinator:coordinator];
+  if (!success) {
+    NSLog(@"Failed to generate %u objects: %@", count, [error localizedDescription]);
+    return nil;
+  }
+
+  NSDictionary *attributes = [[NSFileManager defaultManager] attributesOfItemAtPath:storePath error:nil];
+  [entry setValue:[attributes objectForKey:NSFileSize] forKey:@"storeBytes"];
+
+  NSDictionary *phases = [self syncStoreAtPath:storePath directory:directory];
+  if (!phases) return nil;
+  [entry setValue:phases forKey:@"initialSync"];
+
+  residentBefore = [ZSyncMemory residentSize];
+  start = [ZSyncBenchmark now];
+  coordinator = [self coordinatorForStoreAtPath:storePath error:&error];
+  context = [[NSManagedObjectContext alloc] init];
+  [context setUndoManager:nil];
+  [context setPersistentStoreCoordinator:coordinator];
+  generator = [[ZSyncDataGenerator alloc] initWithManagedObjectContext:context seed:(seed + count)];
+  [generator setChangeRatio:[self doubleArgument:@"changeRatio" defaultValue:kDefaultChangeRatio]];
+  success = (coordinator && [generator changeAllObjects:&error]);
+  NSMutableDictionary *change = [self phaseSince:start residentBefore:residentBefore];
+  [change setValue:[NSNumber numberWithUnsignedInteger:[generator insertedCount]] forKey:@"inserted"];
+  [change setValue:[NSNumber numberWithUnsignedInteger:[generator updatedCount]] forKey:@"updated"];
+  [change setValue:[NSNumber numberWithUnsignedInteger:[generator deletedCount]] forKey:@"deleted"];
+  [entry setValue:change forKey:@"change"];
+  [generator release], generator = nil;
+  [context release], context = nil;
+  [self closeStoresOfCoordinator:coordinator];
+  if (!success) {
+    NSLog(@"Failed to change the store of %u objects: %@", count, [error localizedDescription]);
+    return nil;
+  }
+
+  phases = [self syncStoreAtPath:storePath directory:directory];
+  if (!phases) return nil;
+  [entry setValue:phases forKey:@"changeSync"];
+
+  return entry;
+}
+
+- (NSDictionary *)measureObjectCount:(NSUInteger)count
+{
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+
+  NSString *directory = [workingDirectory stringByAppendingPathComponent:[NSString stringWithFormat:@"%u", count]];
+  [[NSFileManager defaultManager] createDirectoryAtPath:directory withIntermediateDirectories:YES attributes:nil error:nil];
+  NSString *storePath = [directory stringByAppendingPathComponent:@"device.sqlite"];
+  uint64_t seed = [self integerArgument:@"seed" defaultValue:kDefaultSeed];
+
+  NSDictionary *entry = [[self measureStoreAtPath:storePath objectCount:count seed:seed] retain];
+  [[NSFileManager defaultManager] removeItemAtPath:directory error:nil];
+
+  [pool drain], pool = nil;
+
+  return [entry autorelease];
+}
+
+#pragma mark -
+#pragma mark TCPListenerDelegate methods
+
+- (void)listener:(TCPListener *)aListener didAcceptConnection:(TCPConnection *)connection
+{
+  daemonConnection = (BLIPConnection *)[connection retain];
+  [daemonConnection setDelegate:self];
+  if ([deviceConnection status] == kTCP_Open) {
+    [self setWaiting:NO];
+  }
+}
+
+#pragma mark -
+#pragma mark BLIPConnectionDelegate methods
+
+- (void)connectionDidOpen:(TCPConnection *)connection
+{
+  if (connection == deviceConnection && daemonConnection) {
+    [self setWaiting:NO];
+  }
+}
+
+- (void)connection:(TCPConnection *)connection failedToOpen:(NSError *)error
+{
+  NSLog(@"Connection failed to open: %@", [error localizedDescription]);
+  [self setWaiting:NO];
+}
+
+/* Either side receiving a store, every chunk is acknowledged the way the
+ * daemon does so the sending scheduler keeps its window moving.
+ */
+- (BOOL)connection:(BLIPConnection *)connection receivedRequest:(BLIPRequest *)request
+{
+  ZSyncStoreAssembler *assembler = (connection == deviceConnection) ? deviceAssembler : daemonAssembler;
+  NSError *error = nil;
+  NSString *path = [assembler addChunkFromRequest:request error:&error];
+  if (error) {
+    // The transfer never finishes and the benchmark reports it as such
+    NSLog(@"Failed to assemble a store: %@", [error localizedDescription]);
+    [request respondWithErrorCode:kBLIPError_HandlerFailed message:[error localizedDescription]];
+    return YES;
+  }
+
+  BLIPResponse *response = [request response];
+  [response setValue:zsActID(zsActionChunkReceived) ofProperty:zsAction];
+  [response setUrgent:YES];
+  [response send];
+
+  if (path) {
+    [receivedStorePath release];
+    receivedStorePath = [path copy];
+    [self checkTransferFinished];
+  }
+
+  return YES;
+}
+
+- (void)connection:(BLIPConnection *)connection receivedResponse:(BLIPResponse *)response
+{
+  [sendingScheduler responseReceived:response];
+  [self checkTransferFinished];
+}
+
+#pragma mark -
+#pragma mark Memory management and property declarations
+
+- (void)dealloc
+{
+  [self closeConnection];
+  [managedObjectModel release], managedObjectModel = nil;
+  [workingDirectory release], workingDirectory = nil;
+  [receivedStorePath release], receivedStorePath = nil;
+
+  [super dealloc];
+}
+
+@end
@@ -0,0 +1,112 @@
+//
+//  ZSyncSimulatedDevice.h
+//  ZSyncBench
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import "ZSyncShared.h"
+
+@class ZSyncMessageScheduler;
+@class ZSyncStoreAssembler;
+@class ZSyncSimulatedDevice;
+
+typedef enum {
+  ZSyncSimulatedDeviceStateIdle = 0,
+  ZSyncSimulatedDeviceStateConnecting,
+  ZSyncSimulatedDeviceStateVerifying,
+  ZSyncSimulatedDeviceStateUploading,
+  ZSyncSimulatedDeviceStateMerging,
+  ZSyncSimulatedDeviceStateDownloading,
+  ZSyncSimulatedDeviceStateFinished,
+  ZSyncSimulatedDeviceStateFailed
+} ZSyncSimulatedDeviceState;
+
+@protocol ZSyncSimulatedDeviceDelegate <NSObject>
+
+/* Sent once per sync, whether it finished or failed */
+- (void)simulatedDeviceDidFinish:(ZSyncSimulatedDevice *)device;
+
+@end
+
+/* A headless stand-in for ZSyncTouchHandler.  It walks a daemon through the
+ * same requests a device makes: verify schema, store upload, perform sync,
+ * file received for every store sent back and finally complete sync.  The
+ * stores received are acknowledged and thrown away.
+ *
+ * Each device has its own zsDeviceGUID and zsSyncGUID derived from its
+ * index, so the daemon registers one sync client per simulated device and
+ * reuses it on later runs.
+ */
+@interface ZSyncSimulatedDevice : NSObject <BLIPConnectionDelegate>
+{
+  id<ZSyncSimulatedDeviceDelegate> delegate;
+
+  NSString *deviceGUID;
+  NSString *syncGUID;
+  NSString *deviceName;
+  NSString *schemaIdentifier;
+  NSString *modelFingerprint;
+  NSString *storePath;
+  NSString *storeType;
+
+  BLIPConnection *connection;
+  ZSyncMessageScheduler *scheduler;
+  ZSyncStoreAssembler *storeAssembler;
+
+  ZSyncSimulatedDeviceState state;
+  NSString *failureReason;
+  NSMutableDictionary *phaseTimes;
+  NSUInteger bytesSent;
+  NSUInteger bytesReceived;
+}
+
+@property (nonatomic, assign) id<ZSyncSimulatedDeviceDelegate> delegate;
+@property (nonatomic, copy) NSString *deviceGUID;
+@property (nonatomic, copy) NSString *syncGUID;
+@property (nonatomic, copy) NSString *deviceName;
+@property (nonatomic, copy) NSString *schemaIdentifier;
+/* Sent with the verification when set, devices without one are trusted */
+@property (nonatomic, copy) NSString *modelFingerprint;
+@property (nonatomic, copy) NSString *storePath;
+@property (nonatomic, copy) NSString *storeType;
+
+@property (nonatomic, readonly) ZSyncSimulatedDeviceState state;
+@property (nonatomic, readonly) NSString *failureReason;
+@property (nonatomic, readonly) NSUInteger bytesSent;
+@property (nonatomic, readonly) NSUInteger bytesReceived;
+
+- (id)initWithIndex:(NSUInteger)index;
+
+/* Opens a connection and runs one sync, the delegate hears when it is done */
+- (void)syncWithServerAtAddress:(IPAddress *)address;
+
+/* Abandons the sync, for instance when the benchmark gives up waiting */
+- (void)failWithReason:(NSString *)reason;
+
+/* Seconds spent connecting, verifying, uploading, waiting for the merge,
+ * downloading and in total.  Only phases that were reached are present.
+ */
+- (NSDictionary *)phaseDurations;
+
+@end
@@ -0,0 +1,322 @@
+//
+//  ZSyncSimulatedDevice.m
+//  ZSyncBench
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import <CoreData/CoreData.h>
+#import "ZSyncSimulatedDevice.h"
+#import "ZSyncBenchmark.h"
+#import "ZSyncMessageScheduler.h"
+#import "ZSyncStoreAssembler.h"
+
+#define kStoreIdentifier @"ZSyncSwarmStore"
+
+@interface ZSyncSimulatedDevice ()
+
+- (void)markPhase:(NSString *)phase;
+- (void)finishInState:(ZSyncSimulatedDeviceState)finalState;
+- (void)uploadStore;
+- (void)sendPerformSync;
+- (void)receiveStoreRequest:(BLIPRequest *)request;
+
+@end
+
+@implementation ZSyncSimulatedDevice
+
+- (id)initWithIndex:(NSUInteger)index
+{
+  if (!(self = [super init])) return nil;
+
+  [self setDeviceGUID:[NSString stringWithFormat:@"ZSyncSwarm-Device-%04u", index]];
+  [self setSyncGUID:[NSString stringWithFormat:@"ZSyncSwarm-Sync-%04u", index]];
+  [self setDeviceName:[NSString stringWithFormat:@"Simulated Device %u", index]];
+  [self setStoreType:NSSQLiteStoreType];
+  phaseTimes = [[NSMutableDictionary alloc] init];
+
+  return self;
+}
+
+#pragma mark -
+#pragma mark Public methods
+
+- (void)syncWithServerAtAddress:(IPAddress *)address
+{
+  ZAssert(state == ZSyncSimulatedDeviceStateIdle, @"A simulated device only syncs once");
+
+  [self markPhase:@"start"];
+  state = ZSyncSimulatedDeviceStateConnecting;
+
+  connection = [[BLIPConnection alloc] initToAddress:address];
+  [connection setDelegate:self];
+  scheduler = [[ZSyncMessageScheduler alloc] initWithConnection:connection];
+  storeAssembler = [[ZSyncStoreAssembler alloc] initWithDirectory:NSTemporaryDirectory() pathExtension:@"zsync"];
+  [connection open];
+}
+
+- (void)failWithReason:(NSString *)reason
+{
+  if (state == ZSyncSimulatedDeviceStateFinished || state == ZSyncSimulatedDeviceStateFailed) return;
+
+  DLog(@"%s %@ failed: %@", __PRETTY_FUNCTION__, [self deviceName], reason);
+  [failureReason release];
+  failureReason = [reason copy];
+  [self finishInState:ZSyncSimulatedDeviceStateFailed];
+}
+
+- (NSDictionary *)phaseDurations
+{
+  NSArray *marks = [NSArray arrayWithObjects:@"start", @"connected", @"verified", @"uploaded", @"merged", @"downloaded", nil];
+  NSArray *phases = [NSArray arrayWithObjects:@"connect", @"verify", @"upload", @"merge", @"download", nil];
+
+  NSMutableDictionary *durations = [NSMutableDictionary dictionary];
+  for (NSUInteger index = 0; index < [phases count]; ++index) {
+    NSNumber *begin = [phaseTimes objectForKey:[marks objectAtIndex:index]];
+    NSNumber *end = [phaseTimes objectForKey:[marks objectAtIndex:(index + 1)]];
+    if (!begin || !end) break;
+    [durations setValue:[NSNumber numberWithDouble:([end doubleValue] - [begin doubleValue])] forKey:[phases objectAtIndex:index]];
+  }
+
+  NSNumber *begin = [phaseTimes objectForKey:@"start"];
+  NSNumber *end = [phaseTimes objectForKey:@"end"];
+  if (begin && end) {
+    [durations setValue:[NSNumber numberWithDouble:([end doubleValue] - [begin doubleValue])] forKey:@"total"];
+  }
+
+  return durations;
+}
+
+#pragma mark -
+#pragma mark Local methods
+
+- (void)markPhase:(NSString *)phase
+{
+  [phaseTimes setValue:[NSNumber numberWithDouble:[ZSyncBenchmark now]] forKey:phase];
+}
+
+- (void)finishInState:(ZSyncSimulatedDeviceState)finalState
+{
+  [self markPhase:@"end"];
+  state = finalState;
+
+  [scheduler cancelAllMessages];
+  [storeAssembler discardAllAssemblies];
+  [connection setDelegate:nil];
+  [connection close];
+
+  [[self delegate] simulatedDeviceDidFinish:self];
+}
+
+- (void)uploadStore
+{
+  NSData *data = [[NSData alloc] initWithContentsOfMappedFile:[self storePath]];
+  if (!data) {
+    [self failWithReason:[NSString stringWithFormat:@"Unable to read %@", [self storePath]]];
+    return;
+  }
+
+  NSMutableDictionary *requestPropertiesDictionary = [[NSMutableDictionary alloc] init];
+  [requestPropertiesDictionary setValue:zsActID(zsActionStoreUpload) forKey:zsAction];
+  [requestPropertiesDictionary setValue:zsActID(1) forKey:zsSchemaMajorVersion];
+  [requestPropertiesDictionary setValue:zsActID(0) forKey:zsSchemaMinorVersion];
+  [requestPropertiesDictionary setValue:[self deviceName] forKey:zsDeviceName];
+  [requestPropertiesDictionary setValue:[self deviceGUID] forKey:zsDeviceGUID];
+  [requestPropertiesDictionary setValue:kStoreIdentifier forKey:zsStoreIdentifier];
+  [requestPropertiesDictionary setValue:[self syncGUID] forKey:zsSyncGUID];
+  [requestPropertiesDictionary setValue:[self schemaIdentifier] forKey:zsSchemaIdentifier];
+  [requestPropertiesDictionary setValue:[self storeType] forKey:zsStoreType];
+
+  state = ZSyncSimulatedDeviceStateUploading;
+  bytesSent += [data length];
+  [scheduler sendStoreData:data properties:requestPropertiesDictionary compressed:YES];
+
+  [requestPropertiesDictionary release], requestPropertiesDictionary = nil;
+  [data release], data = nil;
+}
+
+- (void)sendPerformSync
+{
+  NSMutableDictionary *requestPropertiesDictionary = [[NSMutableDictionary alloc] init];
+  [requestPropertiesDictionary setValue:zsActID(zsActionPerformSync) forKey:zsAction];
+  [requestPropertiesDictionary setValue:[self schemaIdentifier] forKey:zsSchemaIdentifier];
+
+  BLIPRequest *request = [BLIPRequest requestWithBody:nil properties:requestPropertiesDictionary];
+  [request setNoReply:YES];
+  [scheduler sendRequest:request priority:ZSyncMessagePriorityControl];
+  [requestPropertiesDictionary release], requestPropertiesDictionary = nil;
+
+  state = ZSyncSimulatedDeviceStateMerging;
+}
+
+- (void)receiveStoreRequest:(BLIPRequest *)request
+{
+  if (state == ZSyncSimulatedDeviceStateMerging) {
+    [self markPhase:@"merged"];
+    state = ZSyncSimulatedDeviceStateDownloading;
+  }
+  bytesReceived += [[request body] length];
+
+  NSError *error = nil;
+  NSString *path = [storeAssembler addChunkFromRequest:request error:&error];
+  if (error) {
+    [request respondWithErrorCode:kBLIPError_HandlerFailed message:[error localizedDescription]];
+    [self failWithReason:[NSString stringWithFormat:@"Store download failed: %@", [error localizedDescription]]];
+    return;
+  }
+  BLIPResponse *response = [request response];
+  [response setUrgent:YES];
+  if (!path) {
+    [response setValue:zsActID(zsActionChunkReceived) ofProperty:zsAction];
+    [response send];
+    return;
+  }
+
+  [[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+  [response setValue:zsActID(zsActionFileReceived) ofProperty:zsAction];
+  [response setValue:[request valueOfProperty:zsStoreIdentifier] ofProperty:zsStoreIdentifier];
+  [response send];
+}
+
+#pragma mark -
+#pragma mark BLIPConnectionDelegate methods
+
+- (void)connectionDidOpen:(TCPConnection *)conn
+{
+  [self markPhase:@"connected"];
+  state = ZSyncSimulatedDeviceStateVerifying;
+
+  NSMutableDictionary *requestPropertiesDictionary = [[NSMutableDictionary alloc] init];
+  [requestPropertiesDictionary setValue:zsActID(zsActionVerifySchema) forKey:zsAction];
+  [requestPropertiesDictionary setValue:zsActID(1) forKey:zsSchemaMajorVersion];
+  [requestPropertiesDictionary setValue:zsActID(0) forKey:zsSchemaMinorVersion];
+  [requestPropertiesDictionary setValue:[self deviceName] forKey:zsDeviceName];
+  [requestPropertiesDictionary setValue:[self deviceGUID] forKey:zsDeviceGUID];
+  [requestPropertiesDictionary setValue:[self schemaIdentifier] forKey:zsSchemaIdentifier];
+  [requestPropertiesDictionary setValue:[self modelFingerprint] forKey:zsModelFingerprint];
+
+  NSData *syncGUIDData = [[self syncGUID] dataUsingEncoding:NSUTF8StringEncoding];
+  BLIPRequest *request = [BLIPRequest requestWithBody:syncGUIDData properties:requestPropertiesDictionary];
+  [scheduler sendRequest:request priority:ZSyncMessagePriorityControl];
+  [requestPropertiesDictionary release], requestPropertiesDictionary = nil;
+}
+
+- (void)connection:(TCPConnection *)conn failedToOpen:(NSError *)error
+{
+  [self failWithReason:[NSString stringWithFormat:@"Failed to open: %@", [error localizedDescription]]];
+}
+
+- (void)connectionDidClose:(TCPConnection *)conn
+{
+  [self failWithReason:@"Connection closed by the server"];
+}
+
+- (void)connection:(BLIPConnection *)conn receivedResponse:(BLIPResponse *)response
+{
+  [scheduler responseReceived:response];
+
+  if ([response error]) {
+    [self failWithReason:[NSString stringWithFormat:@"Error response: %@", [[response error] localizedDescription]]];
+    return;
+  }
+
+  NSInteger action = [[response valueOfProperty:zsAction] integerValue];
+  switch (action) {
+    case zsActionSchemaSupported:
+      [self markPhase:@"verified"];
+      [self uploadStore];
+      return;
+
+    case zsActionSchemaUnsupported:
+      [self failWithReason:[NSString stringWithFormat:@"Schema unsupported: %@", [response bodyString]]];
+      return;
+
+    case zsActionFileReceived:
+      [self markPhase:@"uploaded"];
+      [self sendPerformSync];
+      return;
+
+    default:
+      return;
+  }
+}
+
+- (BOOL)connection:(BLIPConnection *)conn receivedRequest:(BLIPRequest *)request
+{
+  NSInteger action = [[request valueOfProperty:zsAction] integerValue];
+  switch (action) {
+    case zsActionStoreUpload:
+      [self receiveStoreRequest:request];
+      return YES;
+
+    case zsActionCompleteSync:
+      [self markPhase:@"downloaded"];
+      [self finishInState:ZSyncSimulatedDeviceStateFinished];
+      return YES;
+
+    case zsActionDataChanged:
+      return YES;
+
+    default:
+      DLog(@"%s ignoring action %i", __PRETTY_FUNCTION__, action);
+      return NO;
+  }
+}
+
+#pragma mark -
+#pragma mark Memory management and property declarations
+
+- (void)dealloc
+{
+  [connection setDelegate:nil];
+  [connection release], connection = nil;
+  [scheduler release], scheduler = nil;
+  [storeAssembler release], storeAssembler = nil;
+
+  [deviceGUID release], deviceGUID = nil;
+  [syncGUID release], syncGUID = nil;
+  [deviceName release], deviceName = nil;
+  [schemaIdentifier release], schemaIdentifier = nil;
+  [modelFingerprint release], modelFingerprint = nil;
+  [storePath release], storePath = nil;
+  [storeType release], storeType = nil;
+  [failureReason release], failureReason = nil;
+  [phaseTimes release], phaseTimes = nil;
+
+  [super dealloc];
+}
+
+@synthesize delegate;
+@synthesize deviceGUID;
+@synthesize syncGUID;
+@synthesize deviceName;
+@synthesize schemaIdentifier;
+@synthesize modelFingerprint;
+@synthesize storePath;
+@synthesize storeType;
+@synthesize state;
+@synthesize failureReason;
+@synthesize bytesSent;
+@synthesize bytesReceived;
+
+@end
@@ -0,0 +1,51 @@
+//
+//  ZSyncSwarmBenchmark.h
+//  ZSyncBench
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import "ZSyncBenchmark.h"
+#import "ZSyncSimulatedDevice.h"
+
+/* Load tests a running daemon with simulated devices.  Waves of 1, 2, 4 and
+ * so on up to -maxDevices devices sync concurrently, each uploading the same
+ * store, and every wave reports syncs per second, bytes per second, sync
+ * time percentiles per phase and failures grouped by reason.
+ *
+ * The daemon needs the plugin for -schema installed.  The store is either
+ * -store <path> or generated from -model <DataModel.mom> with -objects
+ * objects by ZSyncDataGenerator.
+ *
+ * Options: -schema <identifier> (required), -host <address> (default
+ * 127.0.0.1), -port <port> (default 1123, the port the daemon asks for),
+ * -maxDevices <count> (default 64), -fingerprint <model fingerprint>,
+ * -objects <count> (default 10000), -timeout <seconds per wave> (default
+ * 600).
+ */
+@interface ZSyncSwarmBenchmark : ZSyncBenchmark <ZSyncSimulatedDeviceDelegate>
+{
+  NSUInteger runningDevices;
+}
+
+@end
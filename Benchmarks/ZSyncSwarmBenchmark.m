@@ -0,0 +1,210 @@
+//
+//  ZSyncSwarmBenchmark.m
+//  ZSyncBench
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import "ZSyncSwarmBenchmark.h"
+#import "ZSyncDataGenerator.h"
+
+#define kDefaultHost @"127.0.0.1"
+#define kDefaultPort 1123
+#define kDefaultMaximumDevices 64
+#define kDefaultObjects 10000
+#define kDefaultTimeout 600.0
+#define kStoreSeed 20100701
+
+@interface ZSyncSwarmBenchmark ()
+
+- (NSString *)generateStoreWithObjectCount:(NSUInteger)count;
+- (NSDictionary *)runWaveOfDevices:(NSUInteger)count address:(IPAddress *)address storePath:(NSString *)storePath;
+
+@end
+
+@implementation ZSyncSwarmBenchmark
+
++ (NSString *)name
+{
+  return @"swarm";
+}
+
+- (void)run
+{
+  NSString *schema = [[self arguments] valueForKey:@"schema"];
+  if (!schema) {
+    NSLog(@"The swarm needs the -schema of an installed plugin");
+    return;
+  }
+
+  NSString *storePath = [[self arguments] valueForKey:@"store"];
+  NSString *generatedPath = nil;
+  if (!storePath) {
+    generatedPath = [self generateStoreWithObjectCount:[self integerArgument:@"objects" defaultValue:kDefaultObjects]];
+    if (!generatedPath) return;
+    storePath = generatedPath;
+  }
+
+  NSString *host = [[self arguments] valueForKey:@"host"];
+  IPAddress *address = [[IPAddress alloc] initWithHostname:(host ? host : kDefaultHost) port:[self integerArgument:@"port" defaultValue:kDefaultPort]];
+
+  NSUInteger maximumDevices = [self integerArgument:@"maxDevices" defaultValue:kDefaultMaximumDevices];
+  NSMutableArray *waves = [NSMutableArray array];
+  for (NSUInteger count = 1; count <= maximumDevices; count *= 2) {
+    NSLog(@"Syncing %u simulated devices", count);
+    [waves addObject:[self runWaveOfDevices:count address:address storePath:storePath]];
+  }
+  [address release], address = nil;
+
+  NSDictionary *attributes = [[NSFileManager defaultManager] attributesOfItemAtPath:storePath error:nil];
+  [[self results] setValue:[attributes objectForKey:NSFileSize] forKey:@"storeBytes"];
+  [[self results] setValue:schema forKey:@"schema"];
+  [[self results] setValue:waves forKey:@"waves"];
+
+  if (generatedPath) {
+    [[NSFileManager defaultManager] removeItemAtPath:generatedPath error:nil];
+  }
+}
+
+#pragma mark -
+#pragma mark Local methods
+
+- (NSString *)generateStoreWithObjectCount:(NSUInteger)count
+{
+  NSManagedObjectModel *model = [self loadDataModel];
+  if (!model) {
+    NSLog(@"Unable to load DataModel.mom, pass its path with -model or a store with -store");
+    return nil;
+  }
+
+  NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:[NSString stringWithFormat:@"ZSyncSwarm-%i.sqlite", getpid()]];
+  NSPersistentStoreCoordinator *coordinator = [[NSPersistentStoreCoordinator alloc] initWithManagedObjectModel:model];
+  NSManagedObjectContext *context = [[NSManagedObjectContext alloc] init];
+  [context setUndoManager:nil];
+  [context setPersistentStoreCoordinator:coordinator];
+
+  NSError *error = nil;
+  ZSyncDataGenerator *generator = [[ZSyncDataGenerator alloc] initWithManagedObjectContext:context seed:kStoreSeed];
+  BOOL success = ([coordinator addPersistentStoreWithType:NSSQLiteStoreType configuration:nil URL:[NSURL fileURLWithPath:path] options:nil error:&error] &&
+                  [generator populateWithObjectCount:count error:&error]);
+  [generator release], generator = nil;
+  [context release], context = nil;
+  [coordinator release], coordinator = nil;
+
+  if (!success) {
+    NSLog(@"Failed to generate a store of %u objects: %@", count, [error localizedDescription]);
+    [[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+    return nil;
+  }
+
+  return path;
+}
+
+- (NSDictionary *)runWaveOfDevices:(NSUInteger)count address:(IPAddress *)address storePath:(NSString *)storePath
+{
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+
+  NSMutableArray *devices = [NSMutableArray array];
+  for (NSUInteger index = 0; index < count; ++index) {
+    ZSyncSimulatedDevice *device = [[ZSyncSimulatedDevice alloc] initWithIndex:index];
+    [device setDelegate:self];
+    [device setSchemaIdentifier:[[self arguments] valueForKey:@"schema"]];
+    [device setModelFingerprint:[[self arguments] valueForKey:@"fingerprint"]];
+    [device setStorePath:storePath];
+    [devices addObject:device];
+    [device release], device = nil;
+  }
+
+  runningDevices = count;
+  [self setWaiting:YES];
+  NSTimeInterval start = [ZSyncBenchmark now];
+  for (ZSyncSimulatedDevice *device in devices) {
+    [device syncWithServerAtAddress:address];
+  }
+
+  if (![self runUntilFinishedWithTimeout:[self doubleArgument:@"timeout" defaultValue:kDefaultTimeout]]) {
+    for (ZSyncSimulatedDevice *device in devices) {
+      [device failWithReason:@"Timed out"];
+    }
+  }
+  NSTimeInterval elapsed = [ZSyncBenchmark now] - start;
+
+  NSUInteger completed = 0;
+  unsigned long long bytes = 0;
+  NSMutableDictionary *failures = [NSMutableDictionary dictionary];
+  NSMutableDictionary *samples = [NSMutableDictionary dictionary];
+  for (ZSyncSimulatedDevice *device in devices) {
+    [device setDelegate:nil];
+    bytes += [device bytesSent] + [device bytesReceived];
+    if ([device state] != ZSyncSimulatedDeviceStateFinished) {
+      NSString *reason = [device failureReason] ? [device failureReason] : @"Unknown";
+      NSUInteger failed = [[failures valueForKey:reason] unsignedIntegerValue];
+      [failures setValue:[NSNumber numberWithUnsignedInteger:(failed + 1)] forKey:reason];
+      continue;
+    }
+
+    ++completed;
+    NSDictionary *durations = [device phaseDurations];
+    for (NSString *phase in durations) {
+      NSMutableArray *phaseSamples = [samples objectForKey:phase];
+      if (!phaseSamples) {
+        phaseSamples = [NSMutableArray array];
+        [samples setObject:phaseSamples forKey:phase];
+      }
+      [phaseSamples addObject:[durations objectForKey:phase]];
+    }
+  }
+
+  NSMutableDictionary *latency = [NSMutableDictionary dictionary];
+  for (NSString *phase in samples) {
+    [latency setValue:[ZSyncBenchmark summaryOfSamples:[samples objectForKey:phase]] forKey:phase];
+  }
+
+  NSMutableDictionary *wave = [NSMutableDictionary dictionary];
+  [wave setValue:[NSNumber numberWithUnsignedInteger:count] forKey:@"devices"];
+  [wave setValue:[NSNumber numberWithUnsignedInteger:completed] forKey:@"completed"];
+  [wave setValue:[NSNumber numberWithUnsignedInteger:(count - completed)] forKey:@"failed"];
+  [wave setValue:failures forKey:@"failures"];
+  [wave setValue:[NSNumber numberWithDouble:elapsed] forKey:@"seconds"];
+  [wave setValue:[NSNumber numberWithDouble:(completed / elapsed)] forKey:@"syncsPerSecond"];
+  [wave setValue:[NSNumber numberWithDouble:(bytes / elapsed)] forKey:@"bytesPerSecond"];
+  [wave setValue:latency forKey:@"latency"];
+  NSLog(@"%u devices: %u completed in %.1f seconds, %u failed", count, completed, elapsed, count - completed);
+
+  [wave retain];
+  [pool drain], pool = nil;
+
+  return [wave autorelease];
+}
+
+#pragma mark -
+#pragma mark ZSyncSimulatedDeviceDelegate methods
+
+- (void)simulatedDeviceDidFinish:(ZSyncSimulatedDevice *)device
+{
+  if (--runningDevices == 0) {
+    [self setWaiting:NO];
+  }
+}
+
+@end
@@ -0,0 +1,52 @@
+//
+//  ZSyncTransportBenchmark.h
+//  ZSyncBench
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import "ZSyncBenchmark.h"
+
+@class ZSyncMessageScheduler;
+
+/* Opens a BLIPListener and a BLIPConnection over 127.0.0.1 and measures
+ * request/response latency for small control messages, then bulk
+ * throughput over a matrix of body sizes, compression, chunk sizes and
+ * in-flight windows.  Bulk bodies go through ZSyncMessageScheduler exactly
+ * as store uploads do.
+ *
+ * Options: -maxSize <bytes> (default 1 GB), -iterations <count> (default
+ * 2000 latency samples).
+ */
+@interface ZSyncTransportBenchmark : ZSyncBenchmark <TCPListenerDelegate, BLIPConnectionDelegate>
+{
+  BLIPListener *listener;
+  BLIPConnection *clientConnection;
+  ZSyncMessageScheduler *scheduler;
+
+  NSTimeInterval pingStart;
+  NSMutableArray *pingSamples;
+  BOOL pingUnderLoad;
+}
+
+@end
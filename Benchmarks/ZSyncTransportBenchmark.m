@@ -0,0 +1,323 @@
+//
+//  ZSyncTransportBenchmark.m
+//  ZSyncBench
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import "ZSyncTransportBenchmark.h"
+#import "ZSyncMessageScheduler.h"
+
+#define kBenchmarkPort 11230
+#define kDefaultMaximumSize (1024 * 1024 * 1024)
+#define kDefaultIterations 2000
+#define kMinimumBytesPerConfiguration (16 * 1024 * 1024)
+#define kMaximumRepetitions 100
+#define kLoadTransferSize (64 * 1024 * 1024)
+#define kTimeout 600.0
+
+@interface ZSyncTransportBenchmark ()
+
+- (BOOL)openConnection;
+- (void)closeConnection;
+- (void)sendPing;
+- (void)measureLatency;
+- (void)measureThroughput;
+- (void)measureLatencyUnderLoad;
+- (NSDictionary *)transferBodyOfLength:(NSUInteger)length compressed:(BOOL)compressed chunkSize:(NSUInteger)chunkSize window:(NSUInteger)window;
+
+@end
+
+@implementation ZSyncTransportBenchmark
+
++ (NSString *)name
+{
+  return @"transport";
+}
+
+- (void)run
+{
+  if (![self openConnection]) {
+    NSLog(@"Unable to open a loopback connection");
+    return;
+  }
+
+  [self measureLatency];
+  [self measureThroughput];
+  [self measureLatencyUnderLoad];
+
+  [self closeConnection];
+}
+
+#pragma mark -
+#pragma mark Local methods
+
+- (BOOL)openConnection
+{
+  listener = [[BLIPListener alloc] initWithPort:kBenchmarkPort];
+  [listener setDelegate:self];
+  [listener setPickAvailablePort:YES];
+
+  NSError *error = nil;
+  if (![listener open:&error]) {
+    NSLog(@"Failed to open listener: %@", [error localizedDescription]);
+    return NO;
+  }
+
+  IPAddress *address = [[IPAddress alloc] initWithHostname:@"127.0.0.1" port:[listener port]];
+  clientConnection = [[BLIPConnection alloc] initToAddress:address];
+  [address release], address = nil;
+
+  [clientConnection setDelegate:self];
+  [self setWaiting:YES];
+  [clientConnection open];
+
+  return [self runUntilFinishedWithTimeout:30.0] && [clientConnection status] == kTCP_Open;
+}
+
+- (void)closeConnection
+{
+  [clientConnection setDelegate:nil];
+  [clientConnection close];
+  [clientConnection release], clientConnection = nil;
+  [scheduler release], scheduler = nil;
+
+  [listener close];
+  [listener release], listener = nil;
+}
+
+- (void)sendPing
+{
+  NSMutableDictionary *properties = [NSMutableDictionary dictionary];
+  [properties setValue:zsActID(zsActionHeartbeat) forKey:zsAction];
+  BLIPRequest *request = [BLIPRequest requestWithBody:nil properties:properties];
+
+  pingStart = [ZSyncBenchmark now];
+  if (pingUnderLoad) {
+    [scheduler sendRequest:request priority:ZSyncMessagePriorityControl];
+  } else {
+    [clientConnection sendRequest:request];
+  }
+}
+
+- (void)measureLatency
+{
+  NSInteger iterations = [self integerArgument:@"iterations" defaultValue:kDefaultIterations];
+  NSLog(@"Measuring control message latency over %i round trips", iterations);
+
+  pingSamples = [[NSMutableArray alloc] init];
+  for (NSInteger iteration = 0; iteration < iterations; ++iteration) {
+    [self setWaiting:YES];
+    [self sendPing];
+    if (![self runUntilFinishedWithTimeout:30.0]) {
+      break;
+    }
+  }
+
+  [[self results] setValue:[ZSyncBenchmark summaryOfSamples:pingSamples] forKey:@"latency"];
+  [pingSamples release], pingSamples = nil;
+}
+
+- (void)measureThroughput
+{
+  NSUInteger maximumSize = [self integerArgument:@"maxSize" defaultValue:kDefaultMaximumSize];
+  NSArray *chunkSizes = [NSArray arrayWithObjects:[NSNumber numberWithUnsignedInteger:0], [NSNumber numberWithUnsignedInteger:16 * 1024], [NSNumber numberWithUnsignedInteger:128 * 1024], [NSNumber numberWithUnsignedInteger:1024 * 1024], nil];
+  NSArray *windows = [NSArray arrayWithObjects:[NSNumber numberWithUnsignedInteger:1], [NSNumber numberWithUnsignedInteger:4], [NSNumber numberWithUnsignedInteger:16], nil];
+
+  NSMutableArray *throughput = [NSMutableArray array];
+  for (NSUInteger length = 1024; length <= maximumSize; length *= 16) {
+    for (NSUInteger compressed = 0; compressed < 2; ++compressed) {
+      for (NSNumber *chunkSize in chunkSizes) {
+        NSUInteger chunk = [chunkSize unsignedIntegerValue];
+        if (chunk >= length) {
+          continue;
+        }
+
+        for (NSNumber *window in windows) {
+          // A body sent whole is a single message so the window does not apply
+          if (!chunk && [window unsignedIntegerValue] > 1) {
+            continue;
+          }
+
+          NSLog(@"Transferring %u bytes, compressed %i, chunk %u, window %@", length, compressed, chunk, window);
+          NSDictionary *entry = [self transferBodyOfLength:length compressed:compressed chunkSize:chunk window:[window unsignedIntegerValue]];
+          if (entry) {
+            [throughput addObject:entry];
+          }
+        }
+      }
+    }
+  }
+
+  [[self results] setValue:throughput forKey:@"throughput"];
+}
+
+- (NSDictionary *)transferBodyOfLength:(NSUInteger)length compressed:(BOOL)compressed chunkSize:(NSUInteger)chunkSize window:(NSUInteger)window
+{
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  NSData *body = [ZSyncBenchmark payloadOfLength:length];
+
+  NSMutableDictionary *properties = [NSMutableDictionary dictionary];
+  [properties setValue:zsActID(zsActionStoreUpload) forKey:zsAction];
+
+  [scheduler release];
+  scheduler = [[ZSyncMessageScheduler alloc] initWithConnection:clientConnection];
+  [scheduler setChunkSize:(chunkSize ? chunkSize : length)];
+  [scheduler setBulkWindow:window];
+
+  NSUInteger repetitions = MAX((NSUInteger)1, MIN((NSUInteger)kMaximumRepetitions, kMinimumBytesPerConfiguration / length));
+  NSTimeInterval start = [ZSyncBenchmark now];
+  BOOL finished = YES;
+  for (NSUInteger repetition = 0; repetition < repetitions && finished; ++repetition) {
+    [self setWaiting:YES];
+    [scheduler sendStoreData:body properties:properties compressed:compressed];
+    finished = [self runUntilFinishedWithTimeout:kTimeout];
+  }
+  NSTimeInterval elapsed = [ZSyncBenchmark now] - start;
+
+  NSDictionary *entry = nil;
+  if (finished) {
+    NSMutableDictionary *result = [NSMutableDictionary dictionary];
+    [result setValue:[NSNumber numberWithUnsignedInteger:length] forKey:@"bodySize"];
+    [result setValue:[NSNumber numberWithBool:compressed] forKey:@"compressed"];
+    [result setValue:[NSNumber numberWithUnsignedInteger:chunkSize] forKey:@"chunkSize"];
+    [result setValue:[NSNumber numberWithUnsignedInteger:window] forKey:@"window"];
+    [result setValue:[NSNumber numberWithUnsignedInteger:repetitions] forKey:@"repetitions"];
+    [result setValue:[NSNumber numberWithDouble:elapsed] forKey:@"seconds"];
+    [result setValue:[NSNumber numberWithDouble:((double)length * repetitions / elapsed)] forKey:@"bytesPerSecond"];
+    entry = [result retain];
+  }
+
+  [scheduler cancelAllMessages];
+  [pool drain], pool = nil;
+
+  return [entry autorelease];
+}
+
+/* Control messages sent through the scheduler while a store is streaming.
+ * This is the number the scheduler exists to keep small.
+ */
+- (void)measureLatencyUnderLoad
+{
+  NSUInteger length = MIN((NSUInteger)kLoadTransferSize, (NSUInteger)[self integerArgument:@"maxSize" defaultValue:kDefaultMaximumSize]);
+  NSLog(@"Measuring control message latency behind a %u byte transfer", length);
+
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  NSMutableDictionary *properties = [NSMutableDictionary dictionary];
+  [properties setValue:zsActID(zsActionStoreUpload) forKey:zsAction];
+
+  [scheduler release];
+  scheduler = [[ZSyncMessageScheduler alloc] initWithConnection:clientConnection];
+
+  pingSamples = [[NSMutableArray alloc] init];
+  pingUnderLoad = YES;
+
+  [self setWaiting:YES];
+  [scheduler sendStoreData:[ZSyncBenchmark payloadOfLength:length] properties:properties compressed:NO];
+  [self sendPing];
+  [self runUntilFinishedWithTimeout:kTimeout];
+
+  pingUnderLoad = NO;
+  [[self results] setValue:[ZSyncBenchmark summaryOfSamples:pingSamples] forKey:@"latencyUnderLoad"];
+  [[self results] setValue:[scheduler queueStatistics] forKey:@"schedulerStatistics"];
+  [pingSamples release], pingSamples = nil;
+
+  [pool drain], pool = nil;
+}
+
+#pragma mark -
+#pragma mark TCPListenerDelegate methods
+
+- (void)listener:(TCPListener *)aListener didAcceptConnection:(TCPConnection *)connection
+{
+  [connection setDelegate:self];
+}
+
+#pragma mark -
+#pragma mark BLIPConnectionDelegate methods
+
+- (void)connectionDidOpen:(TCPConnection *)connection
+{
+  if (connection == clientConnection) {
+    [self setWaiting:NO];
+  }
+}
+
+- (void)connection:(TCPConnection *)connection failedToOpen:(NSError *)error
+{
+  NSLog(@"Connection failed to open: %@", [error localizedDescription]);
+  [self setWaiting:NO];
+}
+
+/* The listening side.  Pings are echoed with their action so the client can
+ * tell them apart from chunk acknowledgements, everything else gets the
+ * default empty response.
+ */
+- (BOOL)connection:(BLIPConnection *)connection receivedRequest:(BLIPRequest *)request
+{
+  NSInteger action = [[request valueOfProperty:zsAction] integerValue];
+  if (action == zsActionHeartbeat) {
+    BLIPResponse *response = [request response];
+    [response setValue:zsActID(zsActionHeartbeat) ofProperty:zsAction];
+    [response setUrgent:YES];
+    [response send];
+  }
+
+  return YES;
+}
+
+- (void)connection:(BLIPConnection *)connection receivedResponse:(BLIPResponse *)response
+{
+  if ([[response valueOfProperty:zsAction] integerValue] == zsActionHeartbeat) {
+    [pingSamples addObject:[NSNumber numberWithDouble:([ZSyncBenchmark now] - pingStart)]];
+    if (!pingUnderLoad) {
+      [self setWaiting:NO];
+      return;
+    }
+
+    if ([scheduler pendingMessageCount]) {
+      [self sendPing];
+    } else {
+      [self setWaiting:NO];
+    }
+    return;
+  }
+
+  [scheduler responseReceived:response];
+  if (![scheduler pendingMessageCount] && !pingUnderLoad) {
+    [self setWaiting:NO];
+  }
+}
+
+#pragma mark -
+#pragma mark Memory management and property declarations
+
+- (void)dealloc
+{
+  [self closeConnection];
+  [pingSamples release], pingSamples = nil;
+
+  [super dealloc];
+}
+
+@end
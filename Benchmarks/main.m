@@ -0,0 +1,100 @@
+//
+//  main.m
+//  ZSyncBench
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import "ZSyncTransportBenchmark.h"
+#import "ZSyncScalingBenchmark.h"
+#import "ZSyncSwarmBenchmark.h"
+#import "ZSyncReplayBenchmark.h"
+#import "ZSyncCodecBenchmark.h"
+
+/* ZSyncBench <benchmark> [-output <path>] [-<option> <value> ...]
+ *
+ * Runs a single benchmark and writes its results as an XML property list,
+ * <benchmark>-results.plist in the current directory unless -output is given.
+ */
+
+static NSArray *benchmarkClasses()
+{
+  return [NSArray arrayWithObjects:[ZSyncTransportBenchmark class], [ZSyncScalingBenchmark class], [ZSyncSwarmBenchmark class], [ZSyncReplayBenchmark class], [ZSyncCodecBenchmark class], nil];
+}
+
+static void printUsage()
+{
+  fprintf(stderr, "usage: ZSyncBench <benchmark> [-output path] [-option value ...]\n");
+  fprintf(stderr, "benchmarks:\n");
+  for (Class benchmarkClass in benchmarkClasses()) {
+    fprintf(stderr, "  %s\n", [[benchmarkClass name] UTF8String]);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+
+  if (argc < 2) {
+    printUsage();
+    [pool drain], pool = nil;
+    return 1;
+  }
+
+  NSString *name = [NSString stringWithUTF8String:argv[1]];
+  Class benchmarkClass = Nil;
+  for (Class candidate in benchmarkClasses()) {
+    if ([[candidate name] isEqualToString:name]) {
+      benchmarkClass = candidate;
+      break;
+    }
+  }
+
+  if (!benchmarkClass) {
+    printUsage();
+    [pool drain], pool = nil;
+    return 1;
+  }
+
+  NSDictionary *arguments = [[NSUserDefaults standardUserDefaults] volatileDomainForName:NSArgumentDomain];
+  NSString *output = [arguments valueForKey:@"output"];
+  if (!output) {
+    output = [NSString stringWithFormat:@"%@-results.plist", name];
+  }
+
+  ZSyncBenchmark *benchmark = [[benchmarkClass alloc] init];
+  [benchmark setArguments:arguments];
+  [benchmark run];
+
+  int result = 0;
+  if ([benchmark writeResultsToPath:output]) {
+    NSLog(@"Results written to %@", output);
+  } else {
+    NSLog(@"Failed to write results to %@", output);
+    result = 1;
+  }
+  [benchmark release], benchmark = nil;
+
+  [pool drain], pool = nil;
+  return result;
+}
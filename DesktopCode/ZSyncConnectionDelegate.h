@@ -30,10 +30,20 @@
 #import "ZSyncShared.h"
 #import "PairingCodeWindowController.h"
 
+@class ZSyncMessageScheduler;
+@class ZSyncStoreAssembler;
+
 @interface ZSyncConnectionDelegate : NSObject <BLIPConnectionDelegate, NSPersistentStoreCoordinatorSyncing, PairingCodeDelegate>
 {
   PairingCodeWindowController *pairingCodeWindowController;
   BLIPConnection *_connection;
+  ZSyncMessageScheduler *messageScheduler;
+  ZSyncStoreAssembler *storeAssembler;
+  NSDate *lastActivity;
+  NSString *schemaIdentifier;
+  BOOL schemaRejected;
+  BOOL uploadChanged;
+  BOOL syncing;
   NSString *pairingCode;
   NSInteger pairingCodeEntryCount;
   
@@ -42,19 +52,45 @@
   NSManagedObject *syncApplication;
   
   NSManagedObjectModel *managedObjectModel;
+  NSManagedObjectModel *sessionModel;
+  NSManagedObjectModel *deviceModel;
+  NSUInteger pendingMigrations;
+  BOOL syncAfterMigrations;
+  BOOL checkingMappings;
+  NSMutableArray *deferredUploads;
+  BOOL syncCancelled;
   NSPersistentStoreCoordinator *persistentStoreCoordinator;
   NSManagedObjectContext *managedObjectContext;
 }
 
 @property (retain) NSMutableArray *storeFileIdentifiers;
 @property (retain) NSManagedObjectModel *managedObjectModel;
+/* The device's version of the merged model when it cannot be migrated */
+@property (retain) NSManagedObjectModel *sessionModel;
+/* Set when the device runs an older model than the plugin.  Its uploads are
+ * migrated up to the plugin model and migrated back down before returning.
+ */
+@property (retain) NSManagedObjectModel *deviceModel;
 @property (retain) NSPersistentStoreCoordinator *persistentStoreCoordinator;
 @property (retain) NSManagedObjectContext *managedObjectContext;
 @property (retain) NSManagedObject *syncApplication;
 @property (retain) BLIPConnection *connection;
+@property (retain) ZSyncMessageScheduler *messageScheduler;
+@property (retain) ZSyncStoreAssembler *storeAssembler;
+@property (retain) NSDate *lastActivity;
+@property (copy) NSString *schemaIdentifier;
+@property (assign, getter=isSyncing) BOOL syncing;
+/* Read by the migration worker, the accessors take a lock */
+@property (assign, getter=isSyncCancelled) BOOL syncCancelled;
 @property (retain) NSString *pairingCode;
 @property (assign) NSInteger pairingCodeEntryCount;
 
 @property (retain) id pairingCodeWindowController;
 
+/* Closes a session the device has stopped talking to */
+- (void)closeConnection;
+
+/* Tells the device that the data behind its schema changed */
+- (void)sendDataChanged:(NSInteger)changeCount;
+
 @end
\ No newline at end of file
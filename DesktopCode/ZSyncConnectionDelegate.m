@@ -28,9 +28,45 @@
 
 #import "ZSyncConnectionDelegate.h"
 #import "ZSyncDaemon.h"
+#import "ZSyncMessageScheduler.h"
+#import "ZSyncStoreAssembler.h"
+#import "ZSyncPeerTrust.h"
+#import "ZSyncModelCache.h"
+#import "ZSyncTrace.h"
+#import "ZSyncStatistics.h"
+#import "NSManagedObjectModel+ZSExtensions.h"
 
 #define kPasscodeEntryMaxAttempts 3
 
+// When set, the trace is written to this path after every completed sync
+#define kTracePathKey @"ZSyncTracePath"
+
+// Statistics name the devices, only local monitors get them unless this is set
+#define kRemoteStatisticsKey @"ZSyncRemoteStatistics"
+
+#define kMigrationRequestKey @"request"
+#define kMigrationPathKey @"path"
+#define kMigrationStoreTypeKey @"storeType"
+#define kMigrationSourceModelKey @"sourceModel"
+#define kMigrationDestinationModelKey @"destinationModel"
+#define kMigrationPluginKey @"plugin"
+#define kMigrationErrorKey @"error"
+#define kMigrationSyncKey @"sync"
+// Only set for stores migrated back down on their way to the device
+#define kMigrationPropertiesKey @"properties"
+// Set by the worker once it has looked for mappings in both directions
+#define kMigrationMigratableKey @"migratable"
+
+static NSInteger compareStorePriority(id store1, id store2, void *context)
+{
+  NSDictionary *priorities = (NSDictionary *)context;
+  NSInteger priority1 = [[priorities objectForKey:[store1 identifier]] integerValue];
+  NSInteger priority2 = [[priorities objectForKey:[store2 identifier]] integerValue];
+
+  if (priority1 == priority2) return NSOrderedSame;
+  return (priority1 > priority2 ? NSOrderedAscending : NSOrderedDescending);
+}
+
 @implementation ZSyncConnectionDelegate
 
 // TODO: Need to move this out of here
@@ -41,10 +77,14 @@
 
 - (NSManagedObjectModel *)managedObjectModel
 {
+  if (!managedObjectModel && [self sessionModel]) {
+    // The version of the model the device negotiated during verification
+    managedObjectModel = [[self sessionModel] retain];
+  }
+
   if (!managedObjectModel) {
     NSBundle *pluginBundle = [[ZSyncHandler shared] pluginForSchema:[[self syncApplication] valueForKey:@"schema"]];
-    NSArray *bundles = [NSArray arrayWithObject:pluginBundle];
-    managedObjectModel = [[NSManagedObjectModel mergedModelFromBundles:bundles] retain];
+    managedObjectModel = [[[[ZSyncHandler shared] modelCache] currentModelForPlugin:pluginBundle] retain];
   }
 
   return managedObjectModel;
@@ -79,6 +119,24 @@
   return storeFileIdentifiers;
 }
 
+- (ZSyncMessageScheduler *)messageScheduler
+{
+  if (!messageScheduler) {
+    messageScheduler = [[ZSyncMessageScheduler alloc] initWithConnection:[self connection]];
+  }
+
+  return messageScheduler;
+}
+
+- (ZSyncStoreAssembler *)storeAssembler
+{
+  if (!storeAssembler) {
+    storeAssembler = [[ZSyncStoreAssembler alloc] initWithDirectory:NSTemporaryDirectory() pathExtension:@"zsync"];
+  }
+
+  return storeAssembler;
+}
+
 - (id)pairingCodeWindowController
 {
   if (!pairingCodeWindowController) {
@@ -88,6 +146,20 @@
   return pairingCodeWindowController;
 }
 
+- (BOOL)isSyncCancelled
+{
+  @synchronized(self) {
+    return syncCancelled;
+  }
+}
+
+- (void)setSyncCancelled:(BOOL)flag
+{
+  @synchronized(self) {
+    syncCancelled = flag;
+  }
+}
+
 #pragma mark -
 #pragma mark Local methods
 
@@ -102,6 +174,75 @@
   return string;
 }
 
+- (void)noteActivity
+{
+  [self setLastActivity:[NSDate date]];
+}
+
+/* Shared by every way a session ends, whichever side closed it.  Pending
+ * migrations are left to finish on the worker and then discarded.
+ */
+- (void)tearDownSession
+{
+  [[self retain] autorelease];
+
+  [[self messageScheduler] cancelAllMessages];
+  [[self storeAssembler] discardAllAssemblies];
+  [pairingCodeWindowController close];
+  [self setSyncing:NO];
+  [[ZSyncTrace sharedTrace] discardOpenSpansForSync:[[self syncApplication] valueForKey:@"uuid"]];
+  [self setSyncCancelled:YES];
+
+  [[self connection] setDelegate:nil];
+  [[ZSyncHandler shared] connectionClosed:self];
+}
+
+- (void)closeConnection
+{
+  DLog(@"%s", __PRETTY_FUNCTION__);
+  [[[self connection] retain] autorelease];
+  [self tearDownSession];
+  [[self connection] close];
+}
+
+- (void)setSyncing:(BOOL)flag
+{
+  if (flag == syncing) {
+    return;
+  }
+
+  syncing = flag;
+  [[ZSyncHandler shared] setNeedsTXTRecordUpdate];
+}
+
+- (void)sendDataChanged:(NSInteger)changeCount
+{
+  DLog(@"%s %i", __PRETTY_FUNCTION__, changeCount);
+  NSMutableDictionary *requestPropertiesDictionary = [NSMutableDictionary dictionary];
+  [requestPropertiesDictionary setValue:zsActID(zsActionDataChanged) forKey:zsAction];
+  [requestPropertiesDictionary setValue:[self schemaIdentifier] forKey:zsSchemaIdentifier];
+  [requestPropertiesDictionary setValue:zsActID(changeCount) forKey:zsChangeCount];
+
+  BLIPRequest *request = [BLIPRequest requestWithBody:nil properties:requestPropertiesDictionary];
+  [request setNoReply:YES];
+  [[self messageScheduler] sendRequest:request priority:ZSyncMessagePriorityControl];
+}
+
+/* An upload that matches what we sent the device last time carries no
+ * changes for the other devices.
+ */
+- (void)compareUploadedStoreAtPath:(NSString *)filePath identifier:(NSString *)storeIdentifier
+{
+  NSData *data = [[NSData alloc] initWithContentsOfMappedFile:filePath];
+  NSString *digest = [ZSyncHandler digestOfData:data];
+  [data release], data = nil;
+
+  NSString *clientID = [[self syncApplication] valueForKey:@"uuid"];
+  if (![digest isEqualToString:[[ZSyncHandler shared] sentDigestForClient:clientID store:storeIdentifier]]) {
+    uploadChanged = YES;
+  }
+}
+
 - (void)showCodeWindow
 {
   DLog(@"%s", __PRETTY_FUNCTION__);
@@ -109,16 +250,17 @@
   [[self pairingCodeWindowController] showWindow:self];
 }
 
-- (void)addPersistentStore:(BLIPRequest *)request
+- (void)acknowledgeChunk:(BLIPRequest *)request
 {
-  DLog(@"%s", __PRETTY_FUNCTION__);
-  ZAssert([request complete], @"Message is incomplete");
+  BLIPResponse *response = [request response];
+  [response setValue:zsActID(zsActionChunkReceived) ofProperty:zsAction];
+  [response setUrgent:YES];
+  [response send];
+}
 
-  NSString *filePath = NSTemporaryDirectory();
-  filePath = [filePath stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]];
-  filePath = [filePath stringByAppendingPathExtension:@"zsync"];
-  //  DLog(@"%s request length: %i", __PRETTY_FUNCTION__, [[request body] length]);
-  [[request body] writeToFile:filePath atomically:YES];
+- (void)attachPersistentStore:(BLIPRequest *)request atPath:(NSString *)filePath
+{
+  DLog(@"%s", __PRETTY_FUNCTION__);
 
 //  if (!persistentStoreCoordinator) {
 //    if (!managedObjectModel) {
@@ -147,64 +289,294 @@
   BLIPResponse *response = [request response];
   [response setValue:zsActID(zsActionFileReceived) ofProperty:zsAction];
   [response setValue:[persistentStore identifier] ofProperty:zsStoreIdentifier];
+  [response setUrgent:YES];
   [response send];
 }
 
+/* Migrating a large store would stall every other session, so it is done
+ * on a worker and the store is added once it is back on the main thread.
+ */
+- (void)migrateUploadedStore:(BLIPRequest *)request atPath:(NSString *)filePath
+{
+  DLog(@"%s %@", __PRETTY_FUNCTION__, filePath);
+  ++pendingMigrations;
+
+  NSMutableDictionary *migration = [NSMutableDictionary dictionary];
+  [migration setValue:request forKey:kMigrationRequestKey];
+  [migration setValue:filePath forKey:kMigrationPathKey];
+  [migration setValue:[request valueOfProperty:zsStoreType] forKey:kMigrationStoreTypeKey];
+  [migration setValue:[self deviceModel] forKey:kMigrationSourceModelKey];
+  [migration setValue:[self managedObjectModel] forKey:kMigrationDestinationModelKey];
+  [migration setValue:[[ZSyncHandler shared] pluginForSchema:[self schemaIdentifier]] forKey:kMigrationPluginKey];
+  [migration setValue:[[self syncApplication] valueForKey:@"uuid"] forKey:kMigrationSyncKey];
+
+  [self performSelectorInBackground:@selector(performMigration:) withObject:migration];
+}
+
+- (void)runMigration:(NSMutableDictionary *)migration
+{
+  // Set on the main thread, a store already being copied is finished
+  if ([self isSyncCancelled]) {
+    return;
+  }
+
+  CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+  [[ZSyncTrace sharedTrace] beginSpan:zsSpanMigration detail:[migration valueForKey:kMigrationPathKey] sync:[migration valueForKey:kMigrationSyncKey]];
+
+  NSError *error = nil;
+  BOOL success = [[[ZSyncHandler shared] modelCache] migrateStoreAtPath:[migration valueForKey:kMigrationPathKey]
+                                                                   type:[migration valueForKey:kMigrationStoreTypeKey]
+                                                              fromModel:[migration valueForKey:kMigrationSourceModelKey]
+                                                                toModel:[migration valueForKey:kMigrationDestinationModelKey]
+                                                                 plugin:[migration valueForKey:kMigrationPluginKey]
+                                                                  error:&error];
+  if (!success) {
+    [migration setValue:(error ? error : [NSNull null]) forKey:kMigrationErrorKey];
+  }
+  [[ZSyncTrace sharedTrace] endSpan:zsSpanMigration detail:[migration valueForKey:kMigrationPathKey] sync:[migration valueForKey:kMigrationSyncKey]];
+  [[[ZSyncHandler shared] statistics] recordDuration:(CFAbsoluteTimeGetCurrent() - start) forTiming:zsStatTimingMigration];
+}
+
+- (void)performMigration:(NSMutableDictionary *)migration
+{
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  [self runMigration:migration];
+  [self performSelectorOnMainThread:@selector(migrationFinished:) withObject:migration waitUntilDone:NO];
+  [pool drain];
+}
+
+/* Stores on their way to the device are migrated one after the other so
+ * they still reach the bulk queue in priority order.
+ */
+- (void)performMigrations:(NSArray *)migrations
+{
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  for (NSMutableDictionary *migration in migrations) {
+    NSAutoreleasePool *migrationPool = [[NSAutoreleasePool alloc] init];
+    [self runMigration:migration];
+    [self performSelectorOnMainThread:@selector(migrationFinished:) withObject:migration waitUntilDone:NO];
+    [migrationPool drain];
+  }
+  [pool drain];
+}
+
+- (void)migrationFinished:(NSDictionary *)migration
+{
+  DLog(@"%s", __PRETTY_FUNCTION__);
+  --pendingMigrations;
+
+  NSString *filePath = [migration valueForKey:kMigrationPathKey];
+  if ([self isSyncCancelled] || [[self connection] delegate] != self) {
+    DLog(@"%s session cancelled or closed during the migration", __PRETTY_FUNCTION__);
+    [[NSFileManager defaultManager] removeItemAtPath:filePath error:nil];
+    return;
+  }
+
+  id error = [migration valueForKey:kMigrationErrorKey];
+  if (error) {
+    // Syncing without this store would wipe it from the device
+    DLog(@"%s failed to migrate %@: %@", __PRETTY_FUNCTION__, filePath, error);
+    [[NSFileManager defaultManager] removeItemAtPath:filePath error:nil];
+    [self closeConnection];
+    return;
+  }
+
+  NSDictionary *properties = [migration valueForKey:kMigrationPropertiesKey];
+  if (properties) {
+    [self sendStoreAtPath:filePath properties:properties];
+    return;
+  }
+
+  [self setSyncing:YES];
+  [self attachPersistentStore:[migration valueForKey:kMigrationRequestKey] atPath:filePath];
+
+  if (!pendingMigrations && syncAfterMigrations) {
+    syncAfterMigrations = NO;
+    [self performSync];
+  }
+}
+
+- (void)addPersistentStore:(BLIPRequest *)request atPath:(NSString *)filePath
+{
+  if (checkingMappings) {
+    // Which model the store is attached with depends on the answer
+    NSMutableDictionary *upload = [NSMutableDictionary dictionary];
+    [upload setValue:request forKey:kMigrationRequestKey];
+    [upload setValue:filePath forKey:kMigrationPathKey];
+    if (!deferredUploads) {
+      deferredUploads = [[NSMutableArray alloc] init];
+    }
+    [deferredUploads addObject:upload];
+    return;
+  }
+
+  if ([self deviceModel]) {
+    [self migrateUploadedStore:request atPath:filePath];
+    return;
+  }
+
+  [self attachPersistentStore:request atPath:filePath];
+}
+
 - (void)mocSaved:(NSNotification *)notification
 {
   DLog(@"%s info %@", __PRETTY_FUNCTION__, [notification userInfo]);
 }
 
+- (NSInteger)priorityOfStore:(NSPersistentStore *)persistentStore entityPriorities:(NSDictionary *)entityPriorities
+{
+  NSString *configuration = [persistentStore configurationName];
+  NSArray *entities = nil;
+  if (configuration && ![configuration isEqualToString:@"PF_DEFAULT_CONFIGURATION_NAME"]) {
+    entities = [[self managedObjectModel] entitiesForConfiguration:configuration];
+  } else {
+    entities = [[self managedObjectModel] entities];
+  }
+
+  NSInteger priority = 0;
+  for (NSEntityDescription *entity in entities) {
+    priority = MAX(priority, [[entityPriorities objectForKey:[entity name]] integerValue]);
+  }
+
+  return priority;
+}
+
 - (void)transferStoresToDevice
 {
   DLog(@"%s", __PRETTY_FUNCTION__);
 //  storeFileIdentifiers = [[NSMutableArray alloc] init];
 
-  for (NSPersistentStore *persistentStore in [[self persistentStoreCoordinator] persistentStores]) {
-    NSData *data = [[NSData alloc] initWithContentsOfFile:[[persistentStore URL] path]];
-    DLog(@"%s url %@\nIdentifier: %@\nSize: %i", __PRETTY_FUNCTION__, [persistentStore URL], [persistentStore identifier], [data length]);
+  NSBundle *plugin = [[ZSyncHandler shared] pluginForSchema:[self schemaIdentifier]];
+  NSDictionary *entityPriorities = [[plugin infoDictionary] objectForKey:zsEntityPriorities];
+
+  NSMutableDictionary *storePriorities = [NSMutableDictionary dictionary];
+  NSMutableArray *persistentStores = [NSMutableArray arrayWithArray:[[self persistentStoreCoordinator] persistentStores]];
+  for (NSPersistentStore *persistentStore in persistentStores) {
+    NSInteger priority = [self priorityOfStore:persistentStore entityPriorities:entityPriorities];
+    [storePriorities setObject:[NSNumber numberWithInteger:priority] forKey:[persistentStore identifier]];
+  }
+  // The bulk queue is drained in order so urgent stores reach the device first
+  [persistentStores sortUsingFunction:compareStorePriority context:storePriorities];
+
+  NSMutableArray *migrations = [NSMutableArray array];
+  for (NSPersistentStore *persistentStore in persistentStores) {
+    NSString *storePath = [[persistentStore URL] path];
+    NSString *storeIdentifier = [persistentStore identifier];
 
     NSMutableDictionary *requestPropertiesDictionary = [[NSMutableDictionary alloc] init];
-    [requestPropertiesDictionary setValue:[persistentStore identifier] forKey:zsStoreIdentifier];
+    [requestPropertiesDictionary setValue:storeIdentifier forKey:zsStoreIdentifier];
     [requestPropertiesDictionary setValue:[persistentStore configurationName] forKey:zsStoreConfiguration];
     [requestPropertiesDictionary setValue:[persistentStore type] forKey:zsStoreType];
     [requestPropertiesDictionary setValue:zsActID(zsActionStoreUpload) forKey:zsAction];
-
-    BLIPRequest *request = [BLIPRequest requestWithBody:data properties:requestPropertiesDictionary];
-    [request setCompressed:YES];
-    [[self connection] sendRequest:request];
-
-    [data release], data = nil;
-    [requestPropertiesDictionary release], requestPropertiesDictionary = nil;
+    NSInteger priority = [[storePriorities objectForKey:storeIdentifier] integerValue];
+    if (priority > 0) {
+      [requestPropertiesDictionary setValue:zsActID(priority) forKey:zsStorePriority];
+    }
 
     NSError *error = nil;
-    [[NSFileManager defaultManager] removeItemAtPath:[[persistentStore URL] path] error:&error];
-    ZAssert(error == nil, @"Error removing file: %@\n%@", [[persistentStore URL] path], [error localizedDescription]);
-
     if (![[self persistentStoreCoordinator] removePersistentStore:persistentStore error:&error]) {
       ALog(@"Error removing persistent store: %@", [error localizedDescription]);
     }
 
-    DLog(@"%s file uploaded", __PRETTY_FUNCTION__);
-    [[self storeFileIdentifiers] addObject:[persistentStore identifier]];
+    // Counted as outstanding now so an early acknowledgement cannot complete the download
+    [[self storeFileIdentifiers] addObject:storeIdentifier];
+
+    if ([self deviceModel]) {
+      NSMutableDictionary *migration = [NSMutableDictionary dictionary];
+      [migration setValue:storePath forKey:kMigrationPathKey];
+      [migration setValue:[persistentStore type] forKey:kMigrationStoreTypeKey];
+      [migration setValue:[self managedObjectModel] forKey:kMigrationSourceModelKey];
+      [migration setValue:[self deviceModel] forKey:kMigrationDestinationModelKey];
+      [migration setValue:plugin forKey:kMigrationPluginKey];
+      [migration setValue:[[self syncApplication] valueForKey:@"uuid"] forKey:kMigrationSyncKey];
+      [migration setValue:requestPropertiesDictionary forKey:kMigrationPropertiesKey];
+      [migrations addObject:migration];
+    } else {
+      [self sendStoreAtPath:storePath properties:requestPropertiesDictionary];
+    }
+
+    [requestPropertiesDictionary release], requestPropertiesDictionary = nil;
+  }
+
+  if ([migrations count]) {
+    // The mapping was cached before the first upload was attached so this is the copy alone
+    pendingMigrations += [migrations count];
+    [self performSelectorInBackground:@selector(performMigrations:) withObject:migrations];
+  }
+
+  [[ZSyncHandler shared] setNeedsTXTRecordUpdate];
+}
+
+- (void)sendStoreAtPath:(NSString *)storePath properties:(NSDictionary *)properties
+{
+  NSString *storeIdentifier = [properties valueForKey:zsStoreIdentifier];
+  if ([self isSyncCancelled]) {
+    DLog(@"%s sync cancelled, dropping %@", __PRETTY_FUNCTION__, storeIdentifier);
+    [[NSFileManager defaultManager] removeItemAtPath:storePath error:nil];
+    return;
   }
+
+  // The mapping stays valid after the unlink so chunks are cut from it lazily
+  NSData *data = [[NSData alloc] initWithContentsOfMappedFile:storePath];
+  DLog(@"%s path %@\nIdentifier: %@\nSize: %i", __PRETTY_FUNCTION__, storePath, storeIdentifier, [data length]);
+
+  NSError *error = nil;
+  [[NSFileManager defaultManager] removeItemAtPath:storePath error:&error];
+  ZAssert(error == nil, @"Error removing file: %@\n%@", storePath, [error localizedDescription]);
+
+  [[ZSyncTrace sharedTrace] beginSpan:zsSpanStoreDownload detail:storeIdentifier sync:[[self syncApplication] valueForKey:@"uuid"]];
+  [[self messageScheduler] sendStoreData:data properties:properties compressed:YES];
+
+  ZSyncStatistics *statistics = [[ZSyncHandler shared] statistics];
+  [statistics incrementCounter:zsStatStoresSent];
+  [statistics addBytesOut:[data length] forDevice:[[self syncApplication] valueForKeyPath:@"device.uuid"]];
+  [statistics sampleCompressionOfData:data];
+  [[ZSyncHandler shared] setSentDigest:[ZSyncHandler digestOfData:data] forClient:[[self syncApplication] valueForKey:@"uuid"] store:storeIdentifier];
+
+  [data release], data = nil;
+
+  DLog(@"%s file uploaded", __PRETTY_FUNCTION__);
+  [[ZSyncHandler shared] setNeedsTXTRecordUpdate];
 }
 
 - (void)performSync
 {
   DLog(@"%s", __PRETTY_FUNCTION__);
+  if ([self isSyncCancelled]) {
+    return;
+  }
+
+  if (pendingMigrations) {
+    // Picked up again once the last upload has been migrated
+    syncAfterMigrations = YES;
+    return;
+  }
+
   NSError *error = nil;
 
   NSString *clientIdentifier = [[self syncApplication] valueForKey:@"uuid"];
   DLog(@"%s clientID %@", __PRETTY_FUNCTION__, clientIdentifier);
   ISyncClient *syncClient = [[ISyncManager sharedManager] clientWithIdentifier:clientIdentifier];
   ZAssert(syncClient != nil, @"Sync Client not found");
+  [[ZSyncTrace sharedTrace] beginSpan:zsSpanMerge detail:nil sync:clientIdentifier];
+  CFAbsoluteTime mergeStart = CFAbsoluteTimeGetCurrent();
 
   if (![[self persistentStoreCoordinator] syncWithClient:syncClient inBackground:NO handler:self error:&error]) {
     ALog(@"Error starting sync session: %@", [error localizedDescription]);
   }
 
   ZAssert([[self managedObjectContext] save:&error], @"Error saving context: %@", [error localizedDescription]);
+  [[ZSyncTrace sharedTrace] endSpan:zsSpanMerge detail:nil sync:clientIdentifier];
+  [[[ZSyncHandler shared] statistics] recordDuration:(CFAbsoluteTimeGetCurrent() - mergeStart) forTiming:zsStatTimingMerge];
+
+  // The sync session blocks the run loop, do not let the idle reaper count it
+  [self noteActivity];
+  [[ZSyncHandler shared] noteDeviceSyncForClient:clientIdentifier schema:[self schemaIdentifier]];
+
+  if (uploadChanged) {
+    uploadChanged = NO;
+    [[ZSyncHandler shared] noteChangeForSchema:[self schemaIdentifier] fromConnection:self];
+  }
 
   // Sync is complete and saved.  Push the data back to the device.
   [self transferStoresToDevice];
@@ -219,13 +591,16 @@
   DLog(@"%s", __PRETTY_FUNCTION__);
   NSMutableDictionary *requestPropertiesDictionary = [[NSMutableDictionary alloc] init];
   [requestPropertiesDictionary setValue:zsActID(zsActionCompleteSync) forKey:zsAction];
+  // The device is current up to here, later pushes mean newer data
+  [requestPropertiesDictionary setValue:zsActID([[ZSyncHandler shared] changeCountForSchema:[self schemaIdentifier]]) forKey:zsChangeCount];
 
-  BLIPRequest *request = [[self connection] requestWithBody:nil properties:requestPropertiesDictionary];
+  BLIPRequest *request = [BLIPRequest requestWithBody:nil properties:requestPropertiesDictionary];
   [request setNoReply:YES];
   [requestPropertiesDictionary release], requestPropertiesDictionary = nil;
-  [request send];
+  [[self messageScheduler] sendRequest:request priority:ZSyncMessagePriorityControl];
 
   [[NSNotificationCenter defaultCenter] removeObserver:self];
+  [self setSyncing:NO];
 
   [self setManagedObjectContext:nil];
   [self setPersistentStoreCoordinator:nil];
@@ -235,6 +610,12 @@
 //  [managedObjectModel release], managedObjectModel = nil;
 
   [[self syncApplication] setValue:[NSDate date] forKey:@"lastSync"];
+  [[[ZSyncHandler shared] statistics] incrementCounter:zsStatSyncsCompleted];
+
+  NSString *tracePath = [[NSUserDefaults standardUserDefaults] stringForKey:kTracePathKey];
+  if (tracePath) {
+    [[[ZSyncTrace sharedTrace] chromeTraceData] writeToFile:[tracePath stringByExpandingTildeInPath] atomically:YES];
+  }
 }
 
 - (void)deregisterSyncClient:(BLIPRequest *)request
@@ -253,6 +634,7 @@
     [[ISyncManager sharedManager] unregisterClient:syncClient];
   }
 
+  [response setUrgent:YES];
   [response send];
 }
 
@@ -273,6 +655,113 @@
     [[ISyncManager sharedManager] unregisterClient:syncClient];
   }
 
+  [response setUrgent:YES];
+  [response send];
+}
+
+/* A device on an older model syncs against the plugin's current model when
+ * its stores can be migrated both ways, otherwise the session falls back to
+ * the device's own version of the model.  Inferring a mapping compares every
+ * entity of both models, so the worker looks for them and warms the cache
+ * while the verification is answered.  It counts as a pending migration and
+ * uploads wait for the answer.
+ */
+- (void)useDeviceModel:(NSManagedObjectModel *)model plugin:(NSBundle *)plugin
+{
+  NSManagedObjectModel *currentModel = [[[ZSyncHandler shared] modelCache] currentModelForPlugin:plugin];
+  if ([[model zsFingerprint] isEqualToString:[currentModel zsFingerprint]]) {
+    return;
+  }
+
+  ++pendingMigrations;
+  checkingMappings = YES;
+
+  NSMutableDictionary *check = [NSMutableDictionary dictionary];
+  [check setValue:model forKey:kMigrationSourceModelKey];
+  [check setValue:currentModel forKey:kMigrationDestinationModelKey];
+  [check setValue:plugin forKey:kMigrationPluginKey];
+
+  [self performSelectorInBackground:@selector(checkMappings:) withObject:check];
+}
+
+- (void)checkMappings:(NSMutableDictionary *)check
+{
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  if (![self isSyncCancelled]) {
+    ZSyncModelCache *modelCache = [[ZSyncHandler shared] modelCache];
+    NSManagedObjectModel *model = [check valueForKey:kMigrationSourceModelKey];
+    NSManagedObjectModel *currentModel = [check valueForKey:kMigrationDestinationModelKey];
+    NSBundle *plugin = [check valueForKey:kMigrationPluginKey];
+    BOOL migratable = ([modelCache mappingModelFromModel:model toModel:currentModel plugin:plugin] &&
+                       [modelCache mappingModelFromModel:currentModel toModel:model plugin:plugin]);
+    [check setValue:[NSNumber numberWithBool:migratable] forKey:kMigrationMigratableKey];
+  }
+  [self performSelectorOnMainThread:@selector(mappingsChecked:) withObject:check waitUntilDone:NO];
+  [pool drain];
+}
+
+- (void)mappingsChecked:(NSDictionary *)check
+{
+  DLog(@"%s", __PRETTY_FUNCTION__);
+  --pendingMigrations;
+  checkingMappings = NO;
+
+  NSArray *uploads = [deferredUploads autorelease];
+  deferredUploads = nil;
+
+  if ([self isSyncCancelled] || [[self connection] delegate] != self) {
+    DLog(@"%s session cancelled or closed while looking for mappings", __PRETTY_FUNCTION__);
+    for (NSDictionary *upload in uploads) {
+      [[NSFileManager defaultManager] removeItemAtPath:[upload valueForKey:kMigrationPathKey] error:nil];
+    }
+    return;
+  }
+
+  NSManagedObjectModel *model = [check valueForKey:kMigrationSourceModelKey];
+  if ([[check valueForKey:kMigrationMigratableKey] boolValue]) {
+    DLog(@"%s migrating stores from %@", __PRETTY_FUNCTION__, [model zsFingerprint]);
+    [self setDeviceModel:model];
+  } else {
+    [self setSessionModel:model];
+  }
+
+  for (NSDictionary *upload in uploads) {
+    [self addPersistentStore:[upload valueForKey:kMigrationRequestKey] atPath:[upload valueForKey:kMigrationPathKey]];
+  }
+
+  if (!pendingMigrations && syncAfterMigrations) {
+    syncAfterMigrations = NO;
+    [self performSync];
+  }
+}
+
+- (void)sendStatistics:(BLIPRequest *)request
+{
+  DLog(@"%s", __PRETTY_FUNCTION__);
+  BOOL local = ((ntohl([[[self connection] address] ipv4]) >> 24) == 127);
+  if (!local && ![[NSUserDefaults standardUserDefaults] boolForKey:kRemoteStatisticsKey]) {
+    [request respondWithErrorCode:kBLIPError_Forbidden message:@"Statistics are only served to local connections"];
+    return;
+  }
+
+  [[[ZSyncHandler shared] statistics] incrementCounter:zsStatStatisticsRequests];
+
+  NSString *errorDescription = nil;
+  NSData *data = [NSPropertyListSerialization dataFromPropertyList:[[ZSyncHandler shared] statisticsSnapshot]
+                                                            format:NSPropertyListXMLFormat_v1_0
+                                                  errorDescription:&errorDescription];
+  if (!data) {
+    ALog(@"Failed to serialize statistics: %@", errorDescription);
+    [errorDescription release], errorDescription = nil;
+    [request respondWithErrorCode:kBLIPError_HandlerFailed message:@"Failed to serialize statistics"];
+    return;
+  }
+
+  BLIPResponse *response = [request response];
+  [response setValue:zsActID(zsActionStats) ofProperty:zsAction];
+  [response setContentType:@"application/x-plist"];
+  [response setBody:data];
+  [response setCompressed:YES];
   [response send];
 }
 
@@ -287,14 +776,41 @@
   NSString *schemaIdentifier = [request valueOfProperty:zsSchemaIdentifier];
   NSBundle *plugin = [[ZSyncHandler shared] pluginForSchema:schemaIdentifier];
   BLIPResponse *response = [request response];
+  [self setSessionModel:nil];
+  [self setDeviceModel:nil];
   if (!plugin) {
     [response setValue:zsActID(zsActionSchemaUnsupported) ofProperty:zsAction];
     [response setBodyString:[NSString stringWithFormat:NSLocalizedString(@"No Sync Client Registered for %@", @"no sync client registered error message"), schemaIdentifier]];
     [response setValue:zsActID(zsErrorNoSyncClientRegistered) ofProperty:zsErrorCode];
+    // Lets the device skip us until the installed plugins change
+    [response setValue:[[NSUserDefaults standardUserDefaults] valueForKey:zsServerUUID] ofProperty:zsServerUUID];
+    [response setValue:[[ZSyncHandler shared] schemaSetHash] ofProperty:zsSchemaSet];
     [response send];
     return NO;
   }
+
+  // Devices that predate fingerprints are taken on trust
+  NSString *fingerprint = [request valueOfProperty:zsModelFingerprint];
+  if (fingerprint) {
+    NSManagedObjectModel *model = [[ZSyncHandler shared] modelForSchema:schemaIdentifier fingerprint:fingerprint];
+    if (!model) {
+      DLog(@"%s no model in the plugin matches %@", __PRETTY_FUNCTION__, fingerprint);
+      [response setValue:zsActID(zsActionSchemaUnsupported) ofProperty:zsAction];
+      [response setBodyString:[NSString stringWithFormat:NSLocalizedString(@"The data model for %@ does not match the one on the desktop", @"model mismatch error message"), schemaIdentifier]];
+      [response setValue:zsActID(zsErrorModelMismatch) ofProperty:zsErrorCode];
+      [response setValue:[[NSUserDefaults standardUserDefaults] valueForKey:zsServerUUID] ofProperty:zsServerUUID];
+      [response setValue:[[ZSyncHandler shared] schemaSetHash] ofProperty:zsSchemaSet];
+      [response send];
+      return NO;
+    }
+    [self useDeviceModel:model plugin:plugin];
+  }
+
+  [self setSchemaIdentifier:schemaIdentifier];
   [response setValue:zsActID(zsActionSchemaSupported) ofProperty:zsAction];
+  // Devices dialing a cached address confirm they reached the paired server
+  [response setValue:[[NSUserDefaults standardUserDefaults] valueForKey:zsServerUUID] ofProperty:zsServerUUID];
+  [response setUrgent:YES];
   [response send];
 
   return YES;
@@ -328,6 +844,7 @@
 
     [syncClient setShouldSynchronize:YES withClientsOfType:ISyncClientTypeApplication];
     [syncClient setShouldSynchronize:YES withClientsOfType:ISyncClientTypeDevice];
+    [[ZSyncHandler shared] watchSyncClient:syncClient];
   } else {
     DLog(@"%s client already registered: %@", __PRETTY_FUNCTION__, [syncClient displayName]);
   }
@@ -366,7 +883,8 @@
     [requestPropertiesDictionary setValue:zsActID(zsActionAuthenticateFailed) forKey:zsAction];
     [requestPropertiesDictionary setValue:[[NSUserDefaults standardUserDefaults] valueForKey:zsServerUUID] forKey:zsServerUUID];
 
-    [[self connection] sendRequest:[BLIPRequest requestWithBody:nil properties:requestPropertiesDictionary]];
+    BLIPRequest *request = [BLIPRequest requestWithBody:nil properties:requestPropertiesDictionary];
+    [[self messageScheduler] sendRequest:request priority:ZSyncMessagePriorityControl];
     [self setPairingCodeWindowController:nil];
 
     return;
@@ -376,7 +894,7 @@
   [request setValue:zsActID(zsActionAuthenticatePairing) ofProperty:zsAction];
   [request setValue:[[NSUserDefaults standardUserDefaults] valueForKey:zsServerUUID] ofProperty:zsServerUUID];
 
-  [[self connection] sendRequest:request];
+  [[self messageScheduler] sendRequest:request priority:ZSyncMessagePriorityControl];
   [[self pairingCodeWindowController] close];
   [self setPairingCodeWindowController:nil];
 }
@@ -388,7 +906,7 @@
   [requestPropertiesDictionary setValue:zsActID(zsActionCancelPairing) forKey:zsAction];
 
   BLIPRequest *request = [BLIPRequest requestWithBody:nil properties:requestPropertiesDictionary];
-  [[self connection] sendRequest:request];
+  [[self messageScheduler] sendRequest:request priority:ZSyncMessagePriorityControl];
   [[self pairingCodeWindowController] close];
   [self setPairingCodeWindowController:nil];
 }
@@ -443,17 +961,26 @@
 - (BOOL)connectionReceivedCloseRequest:(BLIPConnection *)conn;
 {
   DLog(@"%s entered", __PRETTY_FUNCTION__);
-
-  [conn setDelegate:nil];
-  [[ZSyncHandler shared] connectionClosed:self];
-  [[self pairingCodeWindowController] close];
+  [self tearDownSession];
 
   return YES;
 }
 
+/* A device that left the network without closing, it would otherwise keep
+ * receiving change pushes until the idle sweep.
+ */
+- (void)connectionDidClose:(TCPConnection *)conn
+{
+  DLog(@"%s", __PRETTY_FUNCTION__);
+  [self tearDownSession];
+}
+
 - (void)connection:(BLIPConnection *)con receivedResponse:(BLIPResponse *)response;
 {
   DLog(@"%s", __PRETTY_FUNCTION__);
+  [self noteActivity];
+  [[self messageScheduler] responseReceived:response];
+
   if (![[response properties] valueOfProperty:zsAction]) {
     DLog(@"%s received empty response, ignoring", __PRETTY_FUNCTION__);
     return;
@@ -463,29 +990,55 @@
   NSInteger action = [[[response properties] valueOfProperty:zsAction] integerValue];
   switch (action) {
     case zsActionFileReceived:
+      [[ZSyncTrace sharedTrace] endSpan:zsSpanStoreDownload detail:[[response properties] valueOfProperty:zsStoreIdentifier] sync:[[self syncApplication] valueForKey:@"uuid"]];
+      [[ZSyncHandler shared] setNeedsTXTRecordUpdate];
       [[self storeFileIdentifiers] removeObject:[[response properties] valueOfProperty:zsStoreIdentifier]];
       if ([[self storeFileIdentifiers] count] == 0) {
         [self sendDownloadComplete];
         [self setStoreFileIdentifiers:nil];
       }
       break;
+    case zsActionChunkReceived:
+      break;
     default:
       ALog(@"Unknown action received: %i", action);
       break;
   }
 }
 
+/* The device is not known until its first request arrives, so accepted
+ * device certificates share one unpinned cache.
+ */
+- (BOOL)connection:(TCPConnection *)con authorizeSSLPeer:(SecCertificateRef)peerCert
+{
+  return [[[ZSyncHandler shared] peerTrust] authorizeCertificate:peerCert forPeer:nil];
+}
+
 - (void)connection:(BLIPConnection *)con closeRequestFailedWithError:(NSError *)error;
 {
   ALog(@"%s error %@", __PRETTY_FUNCTION__, error);
 }
 
-- (BOOL)connection:(BLIPConnection *)con receivedRequest:(BLIPRequest *)request
+- (BOOL)handleRequest:(BLIPRequest *)request
 {
   DLog(@"%s entered", __PRETTY_FUNCTION__);
+  [self noteActivity];
 
   NSInteger action = [[[request properties] valueOfProperty:zsAction] integerValue];
   switch (action) {
+    case zsActionHeartbeat: {
+      BLIPResponse *response = [request response];
+      [response setValue:zsActID(zsActionHeartbeat) ofProperty:zsAction];
+      [response setUrgent:YES];
+      [response send];
+      return YES;
+    }
+
+    case zsActionStats:
+      DLog(@"%s zsActionStats", __PRETTY_FUNCTION__);
+      [self sendStatistics:request];
+      return YES;
+
     case zsActionLatentDeregisterClient:
       DLog(@"%s zsActionLatentDeregisterClient", __PRETTY_FUNCTION__);
       [self deregisterLatentSyncClient:request];
@@ -498,7 +1051,9 @@
 
     case zsActionVerifySchema:
       DLog(@"%s zsActionVerifySchema", __PRETTY_FUNCTION__);
-      [self verifySchema:request];
+      [[ZSyncTrace sharedTrace] beginSpan:zsSpanVerifySchema detail:nil sync:[request bodyString]];
+      schemaRejected = ![self verifySchema:request];
+      [[ZSyncTrace sharedTrace] endSpan:zsSpanVerifySchema detail:nil sync:[request bodyString]];
       // We return YES here even if the schema fails to verify because that method handles sending the failure response to the client
       return YES;
 
@@ -512,11 +1067,39 @@
       // TODO: This method should verify that the client is paired properly, responding accordingly
       return YES;
 
-    case zsActionStoreUpload:
+    case zsActionStoreUpload: {
       DLog(@"%s zsActionStoreUpload", __PRETTY_FUNCTION__);
+      if (schemaRejected) {
+        // Devices upload right behind the verification, drop it without touching the disk.
+        // The device acts on the SchemaUnsupported reply to the verification and ignores this one.
+        [request respondWithErrorCode:kBLIPError_Forbidden message:@"Schema verification failed"];
+        return YES;
+      }
+      [self setSyncing:YES];
+      [[[ZSyncHandler shared] statistics] addBytesIn:[[request body] length] forDevice:[request valueOfProperty:zsDeviceGUID]];
+      if ([[request valueOfProperty:zsChunkIndex] integerValue] == 0) {
+        [[ZSyncTrace sharedTrace] beginSpan:zsSpanStoreUpload detail:[request valueOfProperty:zsStoreIdentifier] sync:[request valueOfProperty:zsSyncGUID]];
+      }
+      NSError *error = nil;
+      NSString *filePath = [[self storeAssembler] addChunkFromRequest:request error:&error];
+      if (error) {
+        DLog(@"%s store upload failed: %@", __PRETTY_FUNCTION__, [error localizedDescription]);
+        int errorCode = ([error code] == zsErrorInvalidChunk ? kBLIPError_BadRequest : kBLIPError_HandlerFailed);
+        [request respondWithErrorCode:errorCode message:[error localizedDescription]];
+        [self closeConnection];
+        return YES;
+      }
+      if (!filePath) {
+        [self acknowledgeChunk:request];
+        return YES;
+      }
+      [[ZSyncTrace sharedTrace] endSpan:zsSpanStoreUpload detail:[request valueOfProperty:zsStoreIdentifier] sync:[request valueOfProperty:zsSyncGUID]];
+      [[[ZSyncHandler shared] statistics] incrementCounter:zsStatStoresReceived];
       [self registerSyncClient:request];
-      [self addPersistentStore:request];
+      [self compareUploadedStoreAtPath:filePath identifier:[request valueOfProperty:zsStoreIdentifier]];
+      [self addPersistentStore:request atPath:filePath];
       return YES;
+    }
 
     case zsActionPerformSync:
       DLog(@"%s zsActionPerformSync", __PRETTY_FUNCTION__);
@@ -528,6 +1111,15 @@
       [[self pairingCodeWindowController] close];
       return YES;
 
+    case zsActionCancelSync:
+      // Anything queued for the device is dropped by closeConnection, the flag stops the migration worker
+      DLog(@"%s zsActionCancelSync reason %@", __PRETTY_FUNCTION__, [request valueOfProperty:zsCancelReason]);
+      [self setSyncCancelled:YES];
+      [NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(performSync) object:nil];
+      [[[ZSyncHandler shared] statistics] incrementCounter:zsStatSyncsCancelled];
+      [self closeConnection];
+      return YES;
+
     default:
       DLog(@"%s default", __PRETTY_FUNCTION__);
       ALog(@"Unknown action received: %i", action);
@@ -535,6 +1127,18 @@
   }
 }
 
+/* The handler time shows how much of a slow acknowledgement was spent here,
+ * in addPersistentStore: for uploads, rather than on the network.
+ */
+- (BOOL)connection:(BLIPConnection *)con receivedRequest:(BLIPRequest *)request
+{
+  CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+  BOOL handled = [self handleRequest:request];
+  [ZSyncMessageScheduler recordHandlerTime:(CFAbsoluteTimeGetCurrent() - start) forRequest:request];
+
+  return handled;
+}
+
 #pragma mark -
 #pragma mark Memory management and property declarations
 
@@ -544,6 +1148,13 @@
   [persistentStoreCoordinator release], persistentStoreCoordinator = nil;
   [managedObjectModel release], managedObjectModel = nil;
   [_connection release], _connection = nil;
+  [messageScheduler release], messageScheduler = nil;
+  [storeAssembler release], storeAssembler = nil;
+  [lastActivity release], lastActivity = nil;
+  [schemaIdentifier release], schemaIdentifier = nil;
+  [sessionModel release], sessionModel = nil;
+  [deviceModel release], deviceModel = nil;
+  [deferredUploads release], deferredUploads = nil;
   [managedObjectModel release], managedObjectModel = nil;
   [persistentStoreCoordinator release], persistentStoreCoordinator = nil;
   [managedObjectContext release], managedObjectContext = nil;
@@ -555,9 +1166,16 @@
 }
 
 @synthesize connection = _connection;
+@synthesize messageScheduler;
+@synthesize storeAssembler;
+@synthesize lastActivity;
+@synthesize schemaIdentifier;
+@synthesize syncing;
 @synthesize pairingCode;
 @synthesize pairingCodeEntryCount;
 @synthesize managedObjectModel;
+@synthesize sessionModel;
+@synthesize deviceModel;
 @synthesize persistentStoreCoordinator;
 @synthesize managedObjectContext;
 @synthesize storeFileIdentifiers;
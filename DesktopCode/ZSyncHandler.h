@@ -31,6 +31,10 @@
 #import "ZSyncShared.h"
 #import "ZSyncConnectionDelegate.h"
 
+@class ZSyncPeerTrust;
+@class ZSyncModelCache;
+@class ZSyncStatistics;
+
 @interface ZSyncHandler : NSObject <TCPListenerDelegate>
 {
   NSManagedObjectContext *managedObjectContext;
@@ -38,6 +42,20 @@
   NSString *_serverName;
   
   BLIPListener *_listener;
+  NSTimer *idleConnectionTimer;
+
+  SecIdentityRef sslIdentity;
+  ZSyncPeerTrust *peerTrust;
+
+  NSMutableDictionary *changeCounts;
+  NSMutableDictionary *deviceSyncs;
+
+  NSString *schemaSetHash;
+  NSDate *pluginsModified;
+  NSDictionary *advertisedTXTRecord;
+  NSMutableDictionary *modelFingerprints;
+  ZSyncModelCache *modelCache;
+  ZSyncStatistics *statistics;
   
   id _delegate;
 }
@@ -46,16 +64,79 @@
 @property (assign) id delegate;
 @property (retain) NSString *serverName;
 @property (retain) BLIPListener *listener;
+@property (retain) ZSyncPeerTrust *peerTrust;
+@property (readonly) ZSyncModelCache *modelCache;
+@property (readonly) ZSyncStatistics *statistics;
 
 + (id)shared;
 
+/* Hex SHA-1 of the data */
++ (NSString*)digestOfData:(NSData*)data;
+
 - (void)startBroadcasting;
 - (void)stopBroadcasting;
 
+/* When set before broadcasting starts, devices must connect over TLS and the
+ * device certificates that pass evaluation are cached by fingerprint.
+ */
+- (SecIdentityRef)sslIdentity;
+- (void)setSSLIdentity:(SecIdentityRef)identity;
+
 - (void)connectionClosed:(ZSyncConnectionDelegate*)connection;
 
 - (NSBundle*)pluginForSchema:(NSString*)schema;
 
+/* Drops everything derived from the installed plugins and readvertises the
+ * schema set.  Runs when broadcasting starts and when the idle sweep sees
+ * the plugin directory change.
+ */
+- (void)reloadPlugins;
+
+/* Short hash over every schema a plugin is installed for.  Devices that were
+ * turned away remember it and do not try again until it changes.
+ */
+- (NSString*)schemaSetHash;
+
+/* Finds the merged model of the plugin for the schema, including the merges
+ * with older versions inside a momd, whose zsFingerprint matches.  Returns
+ * nil if the device model is unknown to the plugin.
+ */
+- (NSManagedObjectModel*)modelForSchema:(NSString*)schema fingerprint:(NSString*)fingerprint;
+
+/* The counters and timings plus the current gauges: open and syncing
+ * sessions, queued messages and the model cache hit rate.  The snapshot is
+ * answered to zsActionStats and written to Statistics.plist in the base path
+ * on every idle sweep.
+ */
+- (NSDictionary*)statisticsSnapshot;
+- (void)writeStatisticsSnapshot;
+
+/* The TXT record carries the number of syncing sessions and the messages
+ * queued across all sessions.  Updates are coalesced.
+ */
+- (void)setNeedsTXTRecordUpdate;
+
+/* Every schema has a counter that is bumped whenever its data changes on the
+ * desktop or through another device.  The counters are advertised in the TXT
+ * record and pushed to every open session for the schema except the source.
+ */
+- (NSInteger)changeCountForSchema:(NSString*)schema;
+- (void)noteChangeForSchema:(NSString*)schema fromConnection:(ZSyncConnectionDelegate*)source;
+
+/* Asks SyncServices to alert us when other clients sync the same entities */
+- (void)watchSyncClient:(ISyncClient*)syncClient;
+
+/* Called when a device session for the sync client has finished.  Alerts to
+ * the other clients of the schema shortly after are echoes of that session.
+ */
+- (void)noteDeviceSyncForClient:(NSString*)clientID schema:(NSString*)schema;
+
+/* Digest of the store last sent to a sync client, used to tell whether the
+ * device changed anything before its next upload.
+ */
+- (NSString*)sentDigestForClient:(NSString*)clientID store:(NSString*)storeIdentifier;
+- (void)setSentDigest:(NSString*)digest forClient:(NSString*)clientID store:(NSString*)storeIdentifier;
+
 - (void)unregisterApplication:(NSManagedObject*)applicationObject;
 - (NSManagedObject*)registerDevice:(NSString*)deviceUUID withName:(NSString*)deviceName;
 - (NSManagedObject*)registerApplication:(NSString*)schema withClient:(NSString*)clientUUID withDevice:(NSManagedObject*)device;
@@ -30,8 +30,39 @@
 #import "ZSyncDaemon.h"
 #import "ZSyncHandler.h"
 #import "ZSyncShared.h"
+#import "ZSyncPeerTrust.h"
+#import "ZSyncMessageScheduler.h"
+#import "ZSyncModelCache.h"
+#import "ZSyncStatistics.h"
+#import "ZSyncHistogram.h"
+#import "NSManagedObjectModel+ZSExtensions.h"
+#import "NSData+ZSExtensions.h"
 
 #define kRegisteredDeviceArray @"kRegisteredDeviceArray"
+#define kTrustedDevicesKey @"kTrustedDevicesKey"
+#define kChangeCountsKey @"kChangeCountsKey"
+#define kSentStoreDigestsKey @"kSentStoreDigestsKey"
+
+/* SyncServices alerts the other clients after every device session as well,
+ * those alerts are echoes of changes that were already counted.
+ */
+#define kSyncAlertEchoWindow 10.0
+
+#define kStatisticsFileName @"Statistics.plist"
+
+// Every TXT change is multicast, bursts are folded into one
+#define kTXTRecordUpdateDelay 1.0
+
+@interface ZSyncHandler ()
+
+- (NSMutableDictionary *)changeCounts;
+- (BOOL)isEchoOfDeviceSyncForClient:(NSString *)clientID schema:(NSString *)schema;
+- (void)updateTXTRecord;
+- (NSString *)schemaForSyncClient:(ISyncClient *)syncClient;
+- (NSArray *)supportedSchemas;
+- (void)historySaved:(NSNotification *)notification;
+
+@end
 
 @implementation ZSyncHandler
 
@@ -39,6 +70,7 @@
 @synthesize connections = _connections;
 @synthesize serverName = _serverName;
 @synthesize listener = _listener;
+@synthesize peerTrust;
 
 #pragma mark -
 #pragma mark Class methods
@@ -56,6 +88,11 @@
   return zsSharedSyncHandler;
 }
 
++ (NSString *)digestOfData:(NSData *)data
+{
+  return [data zsDigest];
+}
+
 #pragma mark -
 #pragma mark Overridden getters/setters
 
@@ -96,6 +133,7 @@
 
   managedObjectContext = [[NSManagedObjectContext alloc] init];
   [managedObjectContext setPersistentStoreCoordinator:persistentStoreCoordinator];
+  [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(historySaved:) name:NSManagedObjectContextDidSaveNotification object:managedObjectContext];
   [persistentStoreCoordinator release], persistentStoreCoordinator = nil;
   [managedObjectModel release], managedObjectModel = nil;
 
@@ -109,11 +147,81 @@
     [_listener setDelegate:self];
     [_listener setPickAvailablePort:YES];
     [_listener setBonjourServiceType:zsServiceName];
+    if ([self sslIdentity]) {
+      [_listener setPeerToPeerIdentity:[self sslIdentity]];
+    }
   }
 
   return _listener;
 }
 
+- (ZSyncPeerTrust *)peerTrust
+{
+  if (!peerTrust) {
+    peerTrust = [[ZSyncPeerTrust alloc] initWithDefaultsKey:kTrustedDevicesKey];
+  }
+
+  return peerTrust;
+}
+
+- (ZSyncStatistics *)statistics
+{
+  if (!statistics) {
+    statistics = [[ZSyncStatistics alloc] init];
+  }
+
+  return statistics;
+}
+
+- (ZSyncModelCache *)modelCache
+{
+  if (!modelCache) {
+    modelCache = [[ZSyncModelCache alloc] init];
+  }
+
+  return modelCache;
+}
+
+- (NSMutableDictionary *)changeCounts
+{
+  if (!changeCounts) {
+    changeCounts = [[NSMutableDictionary alloc] initWithDictionary:[[NSUserDefaults standardUserDefaults] dictionaryForKey:kChangeCountsKey]];
+  }
+
+  return changeCounts;
+}
+
+- (NSString *)schemaSetHash
+{
+  if (!schemaSetHash) {
+    NSArray *schemas = [[self supportedSchemas] sortedArrayUsingSelector:@selector(compare:)];
+    NSData *data = [[schemas componentsJoinedByString:@"\n"] dataUsingEncoding:NSUTF8StringEncoding];
+    schemaSetHash = [[[ZSyncHandler digestOfData:data] substringToIndex:8] retain];
+  }
+
+  return schemaSetHash;
+}
+
+- (SecIdentityRef)sslIdentity
+{
+  return sslIdentity;
+}
+
+- (void)setSSLIdentity:(SecIdentityRef)identity
+{
+  if (identity == sslIdentity) {
+    return;
+  }
+
+  if (sslIdentity) {
+    CFRelease(sslIdentity);
+  }
+  sslIdentity = identity;
+  if (sslIdentity) {
+    CFRetain(sslIdentity);
+  }
+}
+
 #pragma mark -
 #pragma mark Local methods
 
@@ -124,6 +232,10 @@
   NSDictionary *dict = [NSDictionary dictionaryWithContentsOfFile:@"/Library/Preferences/SystemConfiguration/preferences.plist"];
   [self setServerName:[dict valueForKeyPath:@"System.System.ComputerName"]];
 
+  // Plugins may have been installed since the last broadcast
+  [advertisedTXTRecord release], advertisedTXTRecord = nil;
+  [self reloadPlugins];
+
   NSString *serverUUID = [[NSUserDefaults standardUserDefaults] valueForKey:zsServerUUID];
   if (!serverUUID) {
     serverUUID = [[NSProcessInfo processInfo] globallyUniqueString];
@@ -133,21 +245,275 @@
   [[self listener] setBonjourServiceName:@""];
   [[self listener] open];
 
-  NSDictionary *txtRecordDictionary = [NSDictionary dictionaryWithObjectsAndKeys:serverUUID, zsServerUUID, [self serverName], zsServerName, nil];
-  [[self listener] setBonjourTXTRecord:txtRecordDictionary];
+  [self updateTXTRecord];
+
+  // Alert handlers do not survive a relaunch
+  NSFetchRequest *fetchRequest = [[NSFetchRequest alloc] init];
+  [fetchRequest setEntity:[NSEntityDescription entityForName:@"Application" inManagedObjectContext:[self managedObjectContext]]];
+  NSError *error = nil;
+  NSArray *applications = [[self managedObjectContext] executeFetchRequest:fetchRequest error:&error];
+  ZAssert(error == nil, @"Failed to retrieve applications: %@\n%@", [error localizedDescription], [error userInfo]);
+  [fetchRequest release], fetchRequest = nil;
+
+  for (NSManagedObject *application in applications) {
+    ISyncClient *syncClient = [[ISyncManager sharedManager] clientWithIdentifier:[application valueForKey:@"uuid"]];
+    if (syncClient) {
+      [self watchSyncClient:syncClient];
+    }
+  }
+
+  [idleConnectionTimer invalidate];
+  idleConnectionTimer = [NSTimer scheduledTimerWithTimeInterval:zsHeartbeatInterval
+                                 target:self
+                                 selector:@selector(reapIdleConnections:)
+                                 userInfo:nil
+                                  repeats:YES];
+}
+
+- (void)reloadPlugins
+{
+  DLog(@"%s", __PRETTY_FUNCTION__);
+  NSDictionary *attributes = [[NSFileManager defaultManager] attributesOfItemAtPath:[ZSyncDaemon pluginPath] error:nil];
+  [pluginsModified release];
+  pluginsModified = [[attributes fileModificationDate] retain];
+
+  [schemaSetHash release], schemaSetHash = nil;
+  [modelFingerprints release], modelFingerprints = nil;
+  [[self modelCache] flush];
+  [self setNeedsTXTRecordUpdate];
 }
 
 - (void)stopBroadcasting;
 {
   DLog(@"%s", __PRETTY_FUNCTION__);
+  [idleConnectionTimer invalidate], idleConnectionTimer = nil;
+  [NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(updateTXTRecord) object:nil];
+  [self writeStatisticsSnapshot];
   [[self listener] close];
   [self setListener:nil];
 }
 
+/* Devices keep their session open and send heartbeats while they are in
+ * the foreground.  A session that has gone quiet belongs to a device that
+ * was suspended or left the network without closing.
+ */
+- (void)reapIdleConnections:(NSTimer *)timer
+{
+  NSDate *cutoff = [NSDate dateWithTimeIntervalSinceNow:-zsSessionIdleTimeout];
+  for (ZSyncConnectionDelegate *connectionDelegate in [[[self connections] copy] autorelease]) {
+    NSDate *lastActivity = [connectionDelegate lastActivity];
+    if (!lastActivity) {
+      [connectionDelegate setLastActivity:[NSDate date]];
+      continue;
+    }
+
+    if ([lastActivity compare:cutoff] == NSOrderedDescending) {
+      continue;
+    }
+
+    DLog(@"%s closing idle connection %@", __PRETTY_FUNCTION__, [connectionDelegate connection]);
+    [connectionDelegate closeConnection];
+  }
+
+  // Adding or removing a plugin changes the modification date of the directory
+  NSDictionary *attributes = [[NSFileManager defaultManager] attributesOfItemAtPath:[ZSyncDaemon pluginPath] error:nil];
+  NSDate *modified = [attributes fileModificationDate];
+  if (modified != pluginsModified && ![modified isEqualToDate:pluginsModified]) {
+    [self reloadPlugins];
+  }
+
+  // The sweep doubles as the scrape interval for the snapshot file
+  [self writeStatisticsSnapshot];
+}
+
+- (NSDictionary *)statisticsSnapshot
+{
+  NSUInteger syncingConnections = 0;
+  NSUInteger queuedMessages = 0;
+  for (ZSyncConnectionDelegate *connectionDelegate in [self connections]) {
+    if ([connectionDelegate isSyncing]) {
+      ++syncingConnections;
+    }
+    queuedMessages += [[connectionDelegate messageScheduler] pendingMessageCount];
+  }
+
+  NSMutableDictionary *gauges = [NSMutableDictionary dictionary];
+  [gauges setObject:[NSNumber numberWithUnsignedInteger:[[self connections] count]] forKey:@"activeConnections"];
+  [gauges setObject:[NSNumber numberWithUnsignedInteger:syncingConnections] forKey:@"syncingConnections"];
+  [gauges setObject:[NSNumber numberWithUnsignedInteger:queuedMessages] forKey:@"queuedMessages"];
+  [gauges setObject:[NSNumber numberWithUnsignedInteger:[[self modelCache] mappingHits]] forKey:@"mappingCacheHits"];
+  [gauges setObject:[NSNumber numberWithUnsignedInteger:[[self modelCache] mappingMisses]] forKey:@"mappingCacheMisses"];
+
+  NSMutableDictionary *snapshot = [[self statistics] snapshot];
+  [snapshot setObject:gauges forKey:@"gauges"];
+  [snapshot setObject:[ZSyncHistogram summaries] forKey:@"latency"];
+
+  return snapshot;
+}
+
+- (void)writeStatisticsSnapshot
+{
+  NSString *path = [[ZSyncDaemon basePath] stringByAppendingPathComponent:kStatisticsFileName];
+  if (![[self statisticsSnapshot] writeToFile:path atomically:YES]) {
+    DLog(@"%s failed to write %@", __PRETTY_FUNCTION__, path);
+  }
+}
+
+- (void)updateTXTRecord
+{
+  NSString *serverUUID = [[NSUserDefaults standardUserDefaults] valueForKey:zsServerUUID];
+  NSMutableDictionary *txtRecordDictionary = [NSMutableDictionary dictionaryWithObjectsAndKeys:serverUUID, zsServerUUID, [self serverName], zsServerName, nil];
+  for (NSString *schema in [self changeCounts]) {
+    [txtRecordDictionary setValue:[[[self changeCounts] valueForKey:schema] stringValue] forKey:zsChangeCountTXTKey(schema)];
+  }
+
+  NSString *capabilities = @"chunks,heartbeat,push";
+  if ([self sslIdentity]) {
+    capabilities = [capabilities stringByAppendingString:@",tls"];
+  }
+
+  NSUInteger load = 0;
+  NSUInteger queueDepth = 0;
+  for (ZSyncConnectionDelegate *connectionDelegate in [self connections]) {
+    if ([connectionDelegate isSyncing]) {
+      ++load;
+    }
+    queueDepth += [[connectionDelegate messageScheduler] pendingMessageCount];
+  }
+
+  [txtRecordDictionary setValue:zsActID(zsProtocolVersionNumber) forKey:zsTXTProtocolVersion];
+  [txtRecordDictionary setValue:capabilities forKey:zsTXTCapabilities];
+  [txtRecordDictionary setValue:[self schemaSetHash] forKey:zsTXTSchemaSet];
+  [txtRecordDictionary setValue:zsActID(load) forKey:zsTXTLoad];
+  [txtRecordDictionary setValue:zsActID(queueDepth) forKey:zsTXTQueueDepth];
+
+  if ([txtRecordDictionary isEqualToDictionary:advertisedTXTRecord]) {
+    return;
+  }
+
+  [advertisedTXTRecord release];
+  advertisedTXTRecord = [txtRecordDictionary copy];
+  [[self listener] setBonjourTXTRecord:txtRecordDictionary];
+}
+
+- (void)setNeedsTXTRecordUpdate
+{
+  [NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(updateTXTRecord) object:nil];
+  [self performSelector:@selector(updateTXTRecord) withObject:nil afterDelay:kTXTRecordUpdateDelay];
+}
+
+- (NSInteger)changeCountForSchema:(NSString *)schema
+{
+  return [[[self changeCounts] valueForKey:[schema lowercaseString]] integerValue];
+}
+
+- (void)noteChangeForSchema:(NSString *)schema fromConnection:(ZSyncConnectionDelegate *)source
+{
+  if (!schema) {
+    return;
+  }
+
+  NSInteger changeCount = [self changeCountForSchema:schema] + 1;
+  DLog(@"%s %@ is now at %i", __PRETTY_FUNCTION__, schema, changeCount);
+  [[self changeCounts] setValue:[NSNumber numberWithInteger:changeCount] forKey:[schema lowercaseString]];
+  [[NSUserDefaults standardUserDefaults] setObject:[self changeCounts] forKey:kChangeCountsKey];
+
+  [self updateTXTRecord];
+
+  for (ZSyncConnectionDelegate *connectionDelegate in [self connections]) {
+    if (connectionDelegate == source) continue;
+    if (![[[connectionDelegate schemaIdentifier] lowercaseString] isEqualToString:[schema lowercaseString]]) continue;
+
+    [connectionDelegate sendDataChanged:changeCount];
+  }
+}
+
+- (void)watchSyncClient:(ISyncClient *)syncClient
+{
+  [syncClient setSyncAlertHandler:self selector:@selector(client:mightWantToSyncEntityNames:)];
+}
+
+- (void)noteDeviceSyncForClient:(NSString *)clientID schema:(NSString *)schema
+{
+  if (!clientID || !schema) {
+    return;
+  }
+
+  if (!deviceSyncs) {
+    deviceSyncs = [[NSMutableDictionary alloc] init];
+  }
+  NSDictionary *session = [NSDictionary dictionaryWithObjectsAndKeys:[schema lowercaseString], @"schema", [NSDate date], @"date", nil];
+  [deviceSyncs setObject:session forKey:clientID];
+}
+
+/* SyncServices does not alert the client that synced, so an alert to that
+ * client is a real change even inside the window.
+ */
+- (BOOL)isEchoOfDeviceSyncForClient:(NSString *)clientID schema:(NSString *)schema
+{
+  BOOL echo = NO;
+  for (NSString *syncedClientID in [deviceSyncs allKeys]) {
+    NSDictionary *session = [deviceSyncs objectForKey:syncedClientID];
+    if (-[[session valueForKey:@"date"] timeIntervalSinceNow] >= kSyncAlertEchoWindow) {
+      [deviceSyncs removeObjectForKey:syncedClientID];
+      continue;
+    }
+    if ([syncedClientID isEqualToString:clientID]) continue;
+    if (![[session valueForKey:@"schema"] isEqualToString:[schema lowercaseString]]) continue;
+
+    echo = YES;
+  }
+  return echo;
+}
+
+- (NSString *)schemaForSyncClient:(ISyncClient *)syncClient
+{
+  NSFetchRequest *fetchRequest = [[NSFetchRequest alloc] init];
+  [fetchRequest setEntity:[NSEntityDescription entityForName:@"Application" inManagedObjectContext:[self managedObjectContext]]];
+  [fetchRequest setPredicate:[NSPredicate predicateWithFormat:@"uuid == %@", [syncClient clientIdentifier]]];
+
+  NSError *error = nil;
+  NSManagedObject *application = [[[self managedObjectContext] executeFetchRequest:fetchRequest error:&error] lastObject];
+  ZAssert(error == nil, @"Failed to retrieve application: %@\n%@", [error localizedDescription], [error userInfo]);
+  [fetchRequest release], fetchRequest = nil;
+
+  return [application valueForKey:@"schema"];
+}
+
+- (NSString *)sentDigestForClient:(NSString *)clientID store:(NSString *)storeIdentifier
+{
+  NSDictionary *digests = [[NSUserDefaults standardUserDefaults] dictionaryForKey:kSentStoreDigestsKey];
+  return [[digests valueForKey:clientID] valueForKey:storeIdentifier];
+}
+
+- (void)setSentDigest:(NSString *)digest forClient:(NSString *)clientID store:(NSString *)storeIdentifier
+{
+  if (!clientID || !storeIdentifier) {
+    return;
+  }
+
+  NSMutableDictionary *digests = [[[NSUserDefaults standardUserDefaults] dictionaryForKey:kSentStoreDigestsKey] mutableCopy];
+  if (!digests) {
+    digests = [[NSMutableDictionary alloc] init];
+  }
+
+  NSMutableDictionary *clientDigests = [[digests valueForKey:clientID] mutableCopy];
+  if (!clientDigests) {
+    clientDigests = [[NSMutableDictionary alloc] init];
+  }
+  [clientDigests setValue:digest forKey:storeIdentifier];
+  [digests setValue:clientDigests forKey:clientID];
+  [[NSUserDefaults standardUserDefaults] setObject:digests forKey:kSentStoreDigestsKey];
+
+  [clientDigests release], clientDigests = nil;
+  [digests release], digests = nil;
+}
+
 - (void)connectionClosed:(ZSyncConnectionDelegate *)connectionDelegate;
 {
   DLog(@"%s", __PRETTY_FUNCTION__);
   [[self connections] removeObject:connectionDelegate];
+  [self setNeedsTXTRecordUpdate];
 }
 
 - (void)unregisterApplication:(NSManagedObject *)applicationObject;
@@ -213,6 +579,84 @@
   return application;
 }
 
+- (NSArray *)supportedSchemas
+{
+  NSError *error = nil;
+  NSArray *pluginArray = [[NSFileManager defaultManager] contentsOfDirectoryAtPath:[ZSyncDaemon pluginPath] error:&error];
+  ZAssert(pluginArray != nil && error == nil, @"Error fetching plugins: %@\n%@", [error localizedDescription], [error userInfo]);
+
+  NSMutableArray *schemas = [NSMutableArray array];
+  for (NSString *filename in pluginArray) {
+    if (![filename hasSuffix:@"zsyncPlugin"]) {
+      continue;
+    }
+
+    NSBundle *bundle = [NSBundle bundleWithPath:[[ZSyncDaemon pluginPath] stringByAppendingPathComponent:filename]];
+    NSString *schemaID = [[bundle infoDictionary] objectForKey:zsSchemaIdentifier];
+    if (schemaID) {
+      [schemas addObject:[schemaID lowercaseString]];
+    }
+  }
+
+  return schemas;
+}
+
+- (NSManagedObjectModel *)modelForSchema:(NSString *)schema fingerprint:(NSString *)fingerprint
+{
+  NSBundle *plugin = [self pluginForSchema:schema];
+  if (!plugin) {
+    return nil;
+  }
+
+  if (!modelFingerprints) {
+    modelFingerprints = [[NSMutableDictionary alloc] init];
+  }
+
+  // Fingerprinting means loading every model, only do it once per plugin
+  NSMutableDictionary *pluginModels = [modelFingerprints objectForKey:[plugin bundlePath]];
+  [[self statistics] incrementCounter:(pluginModels ? zsStatPluginCacheHits : zsStatPluginCacheMisses)];
+  if (!pluginModels) {
+    pluginModels = [NSMutableDictionary dictionary];
+
+    NSManagedObjectModel *currentModel = [[self modelCache] currentModelForPlugin:plugin];
+    if (currentModel) {
+      [pluginModels setObject:currentModel forKey:[currentModel zsFingerprint]];
+    }
+
+    // Devices merge their bundle like the session does, so every older version is merged with the rest of the plugin
+    NSArray *modelPaths = [plugin pathsForResourcesOfType:@"mom" inDirectory:nil];
+    NSArray *versionedModelPaths = [plugin pathsForResourcesOfType:@"momd" inDirectory:nil];
+    for (NSString *versionedModelPath in versionedModelPaths) {
+      for (NSString *versionPath in [plugin pathsForResourcesOfType:@"mom" inDirectory:[versionedModelPath lastPathComponent]]) {
+        NSMutableArray *paths = [NSMutableArray arrayWithArray:modelPaths];
+        [paths addObject:versionPath];
+        for (NSString *otherModelPath in versionedModelPaths) {
+          if (otherModelPath == versionedModelPath) continue;
+          [paths addObject:otherModelPath];
+        }
+
+        NSMutableArray *models = [NSMutableArray array];
+        for (NSString *path in paths) {
+          NSManagedObjectModel *model = [[self modelCache] modelAtURL:[NSURL fileURLWithPath:path]];
+          if (model) {
+            [models addObject:model];
+          }
+        }
+
+        NSManagedObjectModel *mergedModel = [NSManagedObjectModel modelByMergingModels:models];
+        if (mergedModel && ![pluginModels objectForKey:[mergedModel zsFingerprint]]) {
+          [pluginModels setObject:mergedModel forKey:[mergedModel zsFingerprint]];
+        }
+      }
+    }
+
+    DLog(@"%s %i models in %@", __PRETTY_FUNCTION__, [pluginModels count], [plugin bundlePath]);
+    [modelFingerprints setObject:pluginModels forKey:[plugin bundlePath]];
+  }
+
+  return [pluginModels objectForKey:fingerprint];
+}
+
 - (NSBundle *)pluginForSchema:(NSString *)schema;
 {
   DLog(@"%s", __PRETTY_FUNCTION__);
@@ -242,6 +686,38 @@
   return nil;
 }
 
+#pragma mark -
+#pragma mark SyncHistory
+
+- (void)historySaved:(NSNotification *)notification
+{
+  NSDictionary *userInfo = [notification userInfo];
+  NSUInteger objects = [[userInfo objectForKey:NSInsertedObjectsKey] count];
+  objects += [[userInfo objectForKey:NSUpdatedObjectsKey] count];
+  objects += [[userInfo objectForKey:NSDeletedObjectsKey] count];
+
+  [[self statistics] incrementCounter:zsStatHistoryWrites];
+  [[self statistics] incrementCounter:zsStatHistoryObjectsWritten by:objects];
+}
+
+#pragma mark -
+#pragma mark ISyncClient alert handler
+
+/* Another client, usually the desktop application, synced entities that a
+ * device client also syncs.  The device is told instead of joining.
+ */
+- (void)client:(ISyncClient *)syncClient mightWantToSyncEntityNames:(NSArray *)entityNames
+{
+  DLog(@"%s %@ %@", __PRETTY_FUNCTION__, [syncClient displayName], entityNames);
+  NSString *schema = [self schemaForSyncClient:syncClient];
+  if ([self isEchoOfDeviceSyncForClient:[syncClient clientIdentifier] schema:schema]) {
+    DLog(@"%s ignoring the echo of a device sync", __PRETTY_FUNCTION__);
+    return;
+  }
+
+  [self noteChangeForSchema:schema fromConnection:nil];
+}
+
 #pragma mark -
 #pragma mark TCPListenerDelegate methods
 
@@ -250,9 +726,12 @@
   DLog(@"%s fired", __PRETTY_FUNCTION__);
   ZSyncConnectionDelegate *connectionDelegate = [[ZSyncConnectionDelegate alloc] init];
   [connectionDelegate setConnection:connection];
+  [connectionDelegate setLastActivity:[NSDate date]];
   [connection setDelegate:connectionDelegate];
   [[self connections] addObject:connectionDelegate];
   [connectionDelegate release], connectionDelegate = nil;
+  [[self statistics] incrementCounter:zsStatConnectionsAccepted];
+  [self setNeedsTXTRecordUpdate];
 }
 
 #pragma mark -
@@ -0,0 +1,76 @@
+//
+//  ZSyncModelCache.h
+//  ZSyncDaemon
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import <CoreData/CoreData.h>
+
+/* Models and mapping models shared by every connection.  Loading a model and
+ * inferring a mapping are both expensive, so each is done once per plugin
+ * version and kept until the plugins are rescanned.  Mapping models are keyed
+ * by the zsFingerprint of their source and destination, a pair with no
+ * mapping is remembered as well so it is not searched for again.
+ *
+ * The cache is safe to use from the migration workers.
+ */
+@interface ZSyncModelCache : NSObject
+{
+  NSLock *lock;
+  NSMutableDictionary *models;
+  NSMutableDictionary *currentModels;
+  NSMutableDictionary *mappingModels;
+
+  NSUInteger mappingHits;
+  NSUInteger mappingMisses;
+}
+
+@property (readonly) NSUInteger mappingHits;
+@property (readonly) NSUInteger mappingMisses;
+
+- (NSManagedObjectModel *)modelAtURL:(NSURL *)url;
+
+/* The merged model of every current version in the plugin */
+- (NSManagedObjectModel *)currentModelForPlugin:(NSBundle *)plugin;
+
+/* Looks for a mapping model in the plugin first and falls back to an inferred
+ * lightweight mapping where Core Data supports it.  Returns nil if the source
+ * cannot be migrated to the destination.
+ */
+- (NSMappingModel *)mappingModelFromModel:(NSManagedObjectModel *)sourceModel
+                                  toModel:(NSManagedObjectModel *)destinationModel
+                                   plugin:(NSBundle *)plugin;
+
+/* Migrates the store into a file next to it and swaps it into place */
+- (BOOL)migrateStoreAtPath:(NSString *)path
+                      type:(NSString *)storeType
+                 fromModel:(NSManagedObjectModel *)sourceModel
+                   toModel:(NSManagedObjectModel *)destinationModel
+                    plugin:(NSBundle *)plugin
+                     error:(NSError **)error;
+
+/* Forgets everything, called when the plugins may have changed */
+- (void)flush;
+
+@end
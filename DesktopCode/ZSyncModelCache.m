@@ -0,0 +1,209 @@
+//
+//  ZSyncModelCache.m
+//  ZSyncDaemon
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import "ZSyncModelCache.h"
+#import "ZSyncShared.h"
+#import "NSManagedObjectModel+ZSExtensions.h"
+
+/* Inferred mapping models arrived with 10.6, the 10.5 SDK does not declare
+ * the method so it is only called when the class responds to it.
+ */
+@interface NSMappingModel (ZSSnowLeopard)
+
++ (NSMappingModel *)inferredMappingModelForSourceModel:(NSManagedObjectModel *)sourceModel
+                                      destinationModel:(NSManagedObjectModel *)destinationModel
+                                                 error:(NSError **)error;
+
+@end
+
+@implementation ZSyncModelCache
+
+- (id)init
+{
+  if (!(self = [super init])) return nil;
+
+  lock = [[NSLock alloc] init];
+  models = [[NSMutableDictionary alloc] init];
+  currentModels = [[NSMutableDictionary alloc] init];
+  mappingModels = [[NSMutableDictionary alloc] init];
+
+  return self;
+}
+
+#pragma mark -
+#pragma mark Public methods
+
+- (NSManagedObjectModel *)modelAtURL:(NSURL *)url
+{
+  [lock lock];
+  NSManagedObjectModel *model = [[[models objectForKey:url] retain] autorelease];
+  [lock unlock];
+
+  if (model) {
+    return model;
+  }
+
+  model = [[[NSManagedObjectModel alloc] initWithContentsOfURL:url] autorelease];
+  if (!model) {
+    DLog(@"%s failed to load model at %@", __PRETTY_FUNCTION__, url);
+    return nil;
+  }
+
+  [lock lock];
+  [models setObject:model forKey:url];
+  [lock unlock];
+
+  return model;
+}
+
+- (NSManagedObjectModel *)currentModelForPlugin:(NSBundle *)plugin
+{
+  [lock lock];
+  NSManagedObjectModel *model = [[[currentModels objectForKey:[plugin bundlePath]] retain] autorelease];
+  [lock unlock];
+
+  if (model) {
+    return model;
+  }
+
+  model = [NSManagedObjectModel mergedModelFromBundles:[NSArray arrayWithObject:plugin]];
+  if (!model) {
+    return nil;
+  }
+
+  [lock lock];
+  [currentModels setObject:model forKey:[plugin bundlePath]];
+  [lock unlock];
+
+  return model;
+}
+
+- (NSMappingModel *)mappingModelFromModel:(NSManagedObjectModel *)sourceModel
+                                  toModel:(NSManagedObjectModel *)destinationModel
+                                   plugin:(NSBundle *)plugin
+{
+  NSString *key = [NSString stringWithFormat:@"%@>%@", [sourceModel zsFingerprint], [destinationModel zsFingerprint]];
+
+  [lock lock];
+  id mappingModel = [[[mappingModels objectForKey:key] retain] autorelease];
+  if (mappingModel) {
+    ++mappingHits;
+  } else {
+    ++mappingMisses;
+  }
+  [lock unlock];
+
+  if (mappingModel) {
+    return (mappingModel == [NSNull null] ? nil : mappingModel);
+  }
+
+  mappingModel = [NSMappingModel mappingModelFromBundles:[NSArray arrayWithObject:plugin] forSourceModel:sourceModel destinationModel:destinationModel];
+  if (!mappingModel && [NSMappingModel respondsToSelector:@selector(inferredMappingModelForSourceModel:destinationModel:error:)]) {
+    NSError *error = nil;
+    mappingModel = [NSMappingModel inferredMappingModelForSourceModel:sourceModel destinationModel:destinationModel error:&error];
+    if (!mappingModel) {
+      DLog(@"%s no inferred mapping for %@: %@", __PRETTY_FUNCTION__, key, [error localizedDescription]);
+    }
+  }
+
+  [lock lock];
+  [mappingModels setObject:(mappingModel ? mappingModel : [NSNull null]) forKey:key];
+  [lock unlock];
+
+  return mappingModel;
+}
+
+- (BOOL)migrateStoreAtPath:(NSString *)path
+                      type:(NSString *)storeType
+                 fromModel:(NSManagedObjectModel *)sourceModel
+                   toModel:(NSManagedObjectModel *)destinationModel
+                    plugin:(NSBundle *)plugin
+                     error:(NSError **)error
+{
+  DLog(@"%s %@", __PRETTY_FUNCTION__, path);
+  NSMappingModel *mappingModel = [self mappingModelFromModel:sourceModel toModel:destinationModel plugin:plugin];
+  if (!mappingModel) {
+    if (error) {
+      NSDictionary *userInfo = [NSDictionary dictionaryWithObject:@"No mapping model between the store and the plugin model" forKey:NSLocalizedDescriptionKey];
+      *error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSMigrationMissingMappingModelError userInfo:userInfo];
+    }
+    return NO;
+  }
+
+  NSFileManager *fileManager = [NSFileManager defaultManager];
+  NSString *migratedPath = [path stringByAppendingPathExtension:@"migrated"];
+  [fileManager removeItemAtPath:migratedPath error:nil];
+
+  NSMigrationManager *migrationManager = [[NSMigrationManager alloc] initWithSourceModel:sourceModel destinationModel:destinationModel];
+  BOOL success = [migrationManager migrateStoreFromURL:[NSURL fileURLWithPath:path]
+                                                  type:storeType
+                                               options:nil
+                                      withMappingModel:mappingModel
+                                      toDestinationURL:[NSURL fileURLWithPath:migratedPath]
+                                       destinationType:storeType
+                                    destinationOptions:nil
+                                                 error:error];
+  [migrationManager release], migrationManager = nil;
+
+  if (!success) {
+    [fileManager removeItemAtPath:migratedPath error:nil];
+    return NO;
+  }
+
+  if (![fileManager removeItemAtPath:path error:error]) {
+    return NO;
+  }
+
+  return [fileManager moveItemAtPath:migratedPath toPath:path error:error];
+}
+
+- (void)flush
+{
+  [lock lock];
+  [models removeAllObjects];
+  [currentModels removeAllObjects];
+  [mappingModels removeAllObjects];
+  [lock unlock];
+}
+
+#pragma mark -
+#pragma mark Memory management and property declarations
+
+- (void)dealloc
+{
+  [lock release], lock = nil;
+  [models release], models = nil;
+  [currentModels release], currentModels = nil;
+  [mappingModels release], mappingModels = nil;
+
+  [super dealloc];
+}
+
+@synthesize mappingHits;
+@synthesize mappingMisses;
+
+@end
@@ -0,0 +1,78 @@
+//
+//  ZSyncStatistics.h
+//  ZSyncDaemon
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import <Foundation/Foundation.h>
+
+#define zsStatConnectionsAccepted @"connectionsAccepted"
+#define zsStatSyncsCompleted @"syncsCompleted"
+#define zsStatSyncsCancelled @"syncsCancelled"
+#define zsStatStoresReceived @"storesReceived"
+#define zsStatStoresSent @"storesSent"
+#define zsStatHistoryWrites @"historyWrites"
+#define zsStatHistoryObjectsWritten @"historyObjectsWritten"
+#define zsStatPluginCacheHits @"pluginCacheHits"
+#define zsStatPluginCacheMisses @"pluginCacheMisses"
+#define zsStatStatisticsRequests @"statisticsRequests"
+
+#define zsStatTimingMerge @"merge"
+#define zsStatTimingMigration @"migration"
+
+/* Counters and timings kept by the daemon for the lifetime of the process.
+ * Gauges are not stored here, ZSyncHandler adds them when a snapshot is taken.
+ *
+ * Migrations record from a worker so every method takes the lock.
+ */
+@interface ZSyncStatistics : NSObject
+{
+  NSLock *lock;
+  NSDate *startDate;
+  NSMutableDictionary *counters;
+  NSMutableDictionary *timings;
+  NSMutableDictionary *devices;
+
+  unsigned long long sampledBytes;
+  unsigned long long sampledCompressedBytes;
+}
+
+- (void)incrementCounter:(NSString *)name;
+- (void)incrementCounter:(NSString *)name by:(unsigned long long)amount;
+
+- (void)recordDuration:(NSTimeInterval)duration forTiming:(NSString *)name;
+
+- (void)addBytesIn:(NSUInteger)length forDevice:(NSString *)deviceIdentifier;
+- (void)addBytesOut:(NSUInteger)length forDevice:(NSString *)deviceIdentifier;
+
+/* BLIP compresses inside the library so the wire size is never seen.  The
+ * ratio is estimated by deflating the head of every outgoing store the same
+ * way BLIP does.
+ */
+- (void)sampleCompressionOfData:(NSData *)data;
+
+/* Property list safe, keyed by counters, timings, devices and compression */
+- (NSMutableDictionary *)snapshot;
+
+@end
@@ -0,0 +1,200 @@
+//
+//  ZSyncStatistics.m
+//  ZSyncDaemon
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import "ZSyncStatistics.h"
+#import "ZSyncShared.h"
+#import <zlib.h>
+
+#define kCompressionSampleSize (64 * 1024)
+
+#define kBytesInKey @"bytesIn"
+#define kBytesOutKey @"bytesOut"
+
+@interface ZSyncStatistics ()
+
+- (void)addBytes:(NSUInteger)length forKey:(NSString *)key device:(NSString *)deviceIdentifier;
+
+@end
+
+@implementation ZSyncStatistics
+
+- (id)init
+{
+  if (!(self = [super init])) return nil;
+
+  lock = [[NSLock alloc] init];
+  startDate = [[NSDate alloc] init];
+  counters = [[NSMutableDictionary alloc] init];
+  timings = [[NSMutableDictionary alloc] init];
+  devices = [[NSMutableDictionary alloc] init];
+
+  return self;
+}
+
+#pragma mark -
+#pragma mark Public methods
+
+- (void)incrementCounter:(NSString *)name
+{
+  [self incrementCounter:name by:1];
+}
+
+- (void)incrementCounter:(NSString *)name by:(unsigned long long)amount
+{
+  [lock lock];
+  unsigned long long value = [[counters objectForKey:name] unsignedLongLongValue] + amount;
+  [counters setObject:[NSNumber numberWithUnsignedLongLong:value] forKey:name];
+  [lock unlock];
+}
+
+- (void)recordDuration:(NSTimeInterval)duration forTiming:(NSString *)name
+{
+  [lock lock];
+  NSMutableDictionary *timing = [timings objectForKey:name];
+  if (!timing) {
+    timing = [NSMutableDictionary dictionary];
+    [timings setObject:timing forKey:name];
+  }
+
+  NSUInteger count = [[timing objectForKey:@"count"] unsignedIntegerValue] + 1;
+  NSTimeInterval total = [[timing objectForKey:@"total"] doubleValue] + duration;
+  NSTimeInterval maximum = MAX([[timing objectForKey:@"max"] doubleValue], duration);
+
+  [timing setObject:[NSNumber numberWithUnsignedInteger:count] forKey:@"count"];
+  [timing setObject:[NSNumber numberWithDouble:total] forKey:@"total"];
+  [timing setObject:[NSNumber numberWithDouble:(total / count)] forKey:@"mean"];
+  [timing setObject:[NSNumber numberWithDouble:maximum] forKey:@"max"];
+  [timing setObject:[NSNumber numberWithDouble:duration] forKey:@"last"];
+  [lock unlock];
+}
+
+- (void)addBytesIn:(NSUInteger)length forDevice:(NSString *)deviceIdentifier
+{
+  [self addBytes:length forKey:kBytesInKey device:deviceIdentifier];
+}
+
+- (void)addBytesOut:(NSUInteger)length forDevice:(NSString *)deviceIdentifier
+{
+  [self addBytes:length forKey:kBytesOutKey device:deviceIdentifier];
+}
+
+- (void)sampleCompressionOfData:(NSData *)data
+{
+  uLong sourceLength = (uLong)MIN([data length], (NSUInteger)kCompressionSampleSize);
+  if (!sourceLength) {
+    return;
+  }
+
+  uLongf compressedLength = compressBound(sourceLength);
+  Bytef *buffer = malloc(compressedLength);
+  if (!buffer) {
+    return;
+  }
+
+  int result = compress2(buffer, &compressedLength, [data bytes], sourceLength, Z_DEFAULT_COMPRESSION);
+  free(buffer);
+  if (result != Z_OK) {
+    DLog(@"%s compress2 failed: %i", __PRETTY_FUNCTION__, result);
+    return;
+  }
+
+  [lock lock];
+  sampledBytes += sourceLength;
+  sampledCompressedBytes += compressedLength;
+  [lock unlock];
+}
+
+- (NSMutableDictionary *)snapshot
+{
+  NSMutableDictionary *snapshot = [NSMutableDictionary dictionary];
+  [snapshot setObject:[NSDate date] forKey:@"timestamp"];
+  [snapshot setObject:[NSNumber numberWithDouble:-[startDate timeIntervalSinceNow]] forKey:@"uptime"];
+
+  [lock lock];
+  [snapshot setObject:[[counters copy] autorelease] forKey:@"counters"];
+
+  // Deep copies, the originals keep changing after the lock is released
+  NSMutableDictionary *timingsCopy = [NSMutableDictionary dictionary];
+  for (NSString *name in timings) {
+    [timingsCopy setObject:[[[timings objectForKey:name] copy] autorelease] forKey:name];
+  }
+  [snapshot setObject:timingsCopy forKey:@"timings"];
+
+  NSMutableDictionary *devicesCopy = [NSMutableDictionary dictionary];
+  for (NSString *deviceIdentifier in devices) {
+    [devicesCopy setObject:[[[devices objectForKey:deviceIdentifier] copy] autorelease] forKey:deviceIdentifier];
+  }
+  [snapshot setObject:devicesCopy forKey:@"devices"];
+
+  NSMutableDictionary *compression = [NSMutableDictionary dictionary];
+  [compression setObject:[NSNumber numberWithUnsignedLongLong:sampledBytes] forKey:@"sampledBytes"];
+  [compression setObject:[NSNumber numberWithUnsignedLongLong:sampledCompressedBytes] forKey:@"compressedBytes"];
+  if (sampledBytes) {
+    [compression setObject:[NSNumber numberWithDouble:((double)sampledCompressedBytes / sampledBytes)] forKey:@"ratio"];
+  }
+  [snapshot setObject:compression forKey:@"compression"];
+  [lock unlock];
+
+  return snapshot;
+}
+
+#pragma mark -
+#pragma mark Local methods
+
+- (void)addBytes:(NSUInteger)length forKey:(NSString *)key device:(NSString *)deviceIdentifier
+{
+  if (!deviceIdentifier) {
+    deviceIdentifier = @"unknown";
+  }
+
+  [lock lock];
+  NSMutableDictionary *device = [devices objectForKey:deviceIdentifier];
+  if (!device) {
+    device = [NSMutableDictionary dictionary];
+    [devices setObject:device forKey:deviceIdentifier];
+  }
+
+  unsigned long long bytes = [[device objectForKey:key] unsignedLongLongValue] + length;
+  [device setObject:[NSNumber numberWithUnsignedLongLong:bytes] forKey:key];
+  [lock unlock];
+}
+
+#pragma mark -
+#pragma mark Memory management and property declarations
+
+- (void)dealloc
+{
+  [lock release], lock = nil;
+  [startDate release], startDate = nil;
+  [counters release], counters = nil;
+  [timings release], timings = nil;
+  [devices release], devices = nil;
+
+  [super dealloc];
+}
+
+@end
@@ -0,0 +1,60 @@
+//
+//  ZSyncLatencyHistory.h
+//  ZSyncTouch
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import "ZSyncShared.h"
+
+/* Persisted histograms of how long the discovery phases have taken on each
+ * network the device has used.  Timeouts are derived from the observed p99
+ * plus a margin so a fast LAN gives up quickly and a congested network is
+ * given the time it has needed before.
+ */
+@interface ZSyncLatencyHistory : NSObject
+{
+  NSString *defaultsKey;
+  NSString *network;
+  NSMutableDictionary *histograms;
+  BOOL dirty;
+}
+
+/* Identifies the network the samples belong to, nil for the default bucket */
+@property (nonatomic, copy) NSString *network;
+
+- (id)initWithDefaultsKey:(NSString *)key;
+
+/* The /24 of the primary interface, good enough to tell home from office */
++ (NSString *)currentNetworkIdentifier;
+
+- (void)recordLatency:(NSTimeInterval)latency forPhase:(NSString *)phase;
+
+/* Returns defaultTimeout until enough samples exist for the phase */
+- (NSTimeInterval)timeoutForPhase:(NSString *)phase defaultTimeout:(NSTimeInterval)defaultTimeout;
+
+- (NSTimeInterval)latencyAtPercentile:(double)percentile forPhase:(NSString *)phase;
+
+- (void)save;
+
+@end
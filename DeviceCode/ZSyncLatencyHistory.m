@@ -0,0 +1,218 @@
+//
+//  ZSyncLatencyHistory.m
+//  ZSyncTouch
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import "ZSyncLatencyHistory.h"
+
+/* Buckets grow by 25% starting at 50ms, 40 of them reach past 60 seconds */
+#define kBucketCount 40
+#define kFirstBucketBound 0.05
+#define kBucketGrowth 1.25
+
+#define kMinimumSamples 10
+#define kDecayThreshold 1000
+#define kTimeoutMultiplier 1.5
+#define kTimeoutMargin 1.0
+#define kMinimumTimeout 2.0
+#define kMaximumTimeout 60.0
+
+#define kDefaultNetwork @"default"
+
+static NSTimeInterval upperBoundOfBucket(NSUInteger bucket)
+{
+  return kFirstBucketBound * pow(kBucketGrowth, bucket);
+}
+
+@interface ZSyncLatencyHistory ()
+
+- (NSMutableArray *)bucketsForPhase:(NSString *)phase create:(BOOL)create;
+
+@end
+
+@implementation ZSyncLatencyHistory
+
++ (NSString *)currentNetworkIdentifier
+{
+  IPAddress *address = [IPAddress localAddress];
+  if (!address || ![address ipv4]) {
+    return nil;
+  }
+
+  NSArray *octets = [[address ipv4name] componentsSeparatedByString:@"."];
+  if ([octets count] != 4) {
+    return nil;
+  }
+
+  return [[octets subarrayWithRange:NSMakeRange(0, 3)] componentsJoinedByString:@"."];
+}
+
+- (id)initWithDefaultsKey:(NSString *)key
+{
+  if (!(self = [super init])) return nil;
+
+  defaultsKey = [key copy];
+  histograms = [[NSMutableDictionary alloc] init];
+
+  NSDictionary *stored = [[NSUserDefaults standardUserDefaults] dictionaryForKey:defaultsKey];
+  for (NSString *networkKey in stored) {
+    NSMutableDictionary *phases = [NSMutableDictionary dictionary];
+    NSDictionary *storedPhases = [stored objectForKey:networkKey];
+    for (NSString *phase in storedPhases) {
+      NSArray *buckets = [storedPhases objectForKey:phase];
+      if ([buckets count] == kBucketCount) {
+        [phases setObject:[NSMutableArray arrayWithArray:buckets] forKey:phase];
+      }
+    }
+    [histograms setObject:phases forKey:networkKey];
+  }
+
+  return self;
+}
+
+#pragma mark -
+#pragma mark Public methods
+
+- (void)recordLatency:(NSTimeInterval)latency forPhase:(NSString *)phase
+{
+  NSMutableArray *buckets = [self bucketsForPhase:phase create:YES];
+
+  NSUInteger bucket = 0;
+  while (bucket < kBucketCount - 1 && latency > upperBoundOfBucket(bucket)) {
+    ++bucket;
+  }
+
+  NSUInteger total = 0;
+  for (NSNumber *count in buckets) {
+    total += [count unsignedIntegerValue];
+  }
+
+  // Halve old samples now and then so the history follows a changing network
+  if (total >= kDecayThreshold) {
+    for (NSUInteger index = 0; index < kBucketCount; ++index) {
+      NSUInteger count = [[buckets objectAtIndex:index] unsignedIntegerValue];
+      [buckets replaceObjectAtIndex:index withObject:[NSNumber numberWithUnsignedInteger:(count / 2)]];
+    }
+  }
+
+  NSUInteger count = [[buckets objectAtIndex:bucket] unsignedIntegerValue];
+  [buckets replaceObjectAtIndex:bucket withObject:[NSNumber numberWithUnsignedInteger:(count + 1)]];
+  dirty = YES;
+}
+
+- (NSTimeInterval)latencyAtPercentile:(double)percentile forPhase:(NSString *)phase
+{
+  NSArray *buckets = [self bucketsForPhase:phase create:NO];
+
+  NSUInteger total = 0;
+  for (NSNumber *count in buckets) {
+    total += [count unsignedIntegerValue];
+  }
+
+  if (!total) {
+    return 0.0;
+  }
+
+  NSUInteger target = (NSUInteger)ceil(total * percentile);
+  NSUInteger seen = 0;
+  for (NSUInteger bucket = 0; bucket < kBucketCount; ++bucket) {
+    seen += [[buckets objectAtIndex:bucket] unsignedIntegerValue];
+    if (seen >= target) {
+      return upperBoundOfBucket(bucket);
+    }
+  }
+
+  return upperBoundOfBucket(kBucketCount - 1);
+}
+
+- (NSTimeInterval)timeoutForPhase:(NSString *)phase defaultTimeout:(NSTimeInterval)defaultTimeout
+{
+  NSUInteger total = 0;
+  for (NSNumber *count in [self bucketsForPhase:phase create:NO]) {
+    total += [count unsignedIntegerValue];
+  }
+
+  if (total < kMinimumSamples) {
+    return defaultTimeout;
+  }
+
+  NSTimeInterval timeout = [self latencyAtPercentile:0.99 forPhase:phase] * kTimeoutMultiplier + kTimeoutMargin;
+  return MIN(MAX(timeout, kMinimumTimeout), kMaximumTimeout);
+}
+
+- (void)save
+{
+  if (!dirty) {
+    return;
+  }
+
+  [[NSUserDefaults standardUserDefaults] setObject:histograms forKey:defaultsKey];
+  dirty = NO;
+}
+
+#pragma mark -
+#pragma mark Local methods
+
+- (NSMutableArray *)bucketsForPhase:(NSString *)phase create:(BOOL)create
+{
+  NSString *networkKey = ([self network] ? [self network] : kDefaultNetwork);
+  NSMutableDictionary *phases = [histograms objectForKey:networkKey];
+  if (!phases) {
+    if (!create) {
+      return nil;
+    }
+    phases = [NSMutableDictionary dictionary];
+    [histograms setObject:phases forKey:networkKey];
+  }
+
+  NSMutableArray *buckets = [phases objectForKey:phase];
+  if (!buckets && create) {
+    buckets = [NSMutableArray arrayWithCapacity:kBucketCount];
+    for (NSUInteger bucket = 0; bucket < kBucketCount; ++bucket) {
+      [buckets addObject:[NSNumber numberWithUnsignedInteger:0]];
+    }
+    [phases setObject:buckets forKey:phase];
+  }
+
+  return buckets;
+}
+
+#pragma mark -
+#pragma mark Memory management and property declarations
+
+- (void)dealloc
+{
+  [self save];
+
+  [defaultsKey release], defaultsKey = nil;
+  [network release], network = nil;
+  [histograms release], histograms = nil;
+
+  [super dealloc];
+}
+
+@synthesize network;
+
+@end
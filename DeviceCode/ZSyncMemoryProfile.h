@@ -0,0 +1,63 @@
+//
+//  ZSyncMemoryProfile.h
+//  ZSyncTouch
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+
+#import "ZSyncShared.h"
+
+/* Follows the process memory through the phases of one sync.  A phase runs
+ * from one -markPhase: to the next and is sampled when it starts, when it
+ * ends and whenever -sample is called in between.  Each phase in
+ * -finishProfile reports residentStart, residentEnd, dirtyStart, dirtyEnd,
+ * peakResident and peakDirty in bytes.
+ *
+ * Sampling only at boundaries would miss a spike in the middle of a phase,
+ * so when the lifetime high water mark of the process rose during a phase
+ * that mark is taken as the phase's resident peak.
+ */
+@interface ZSyncMemoryProfile : NSObject
+{
+  NSMutableDictionary *phases;
+  NSString *currentPhase;
+  NSUInteger lifetimePeakAtStart;
+}
+
+@property (nonatomic, readonly) NSString *currentPhase;
+
+/* Ends the running phase and starts the next one.  Marking the running phase
+ * again does nothing and a phase that is entered twice keeps one entry.
+ */
+- (void)markPhase:(NSString *)phase;
+
+/* Folds the current memory use into the peaks of the running phase */
+- (void)sample;
+
+/* Ends the running phase and returns the phases keyed by name, nil if no
+ * phase was marked.  The profile starts over afterwards.
+ */
+- (NSDictionary *)finishProfile;
+
+@end
@@ -0,0 +1,139 @@
+//
+//  ZSyncMemoryProfile.m
+//  ZSyncTouch
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+
+#import "ZSyncMemoryProfile.h"
+#import "ZSyncMemory.h"
+
+@interface ZSyncMemoryProfile ()
+
+- (void)endCurrentPhase;
+- (void)recordResident:(NSUInteger)resident dirty:(NSUInteger)dirty inEntry:(NSMutableDictionary *)entry;
+
+@end
+
+@implementation ZSyncMemoryProfile
+
+- (id)init
+{
+  if (!(self = [super init])) return nil;
+
+  phases = [[NSMutableDictionary alloc] init];
+
+  return self;
+}
+
+#pragma mark -
+#pragma mark Public methods
+
+- (void)markPhase:(NSString *)phase
+{
+  if ([phase isEqualToString:currentPhase]) return;
+
+  [self endCurrentPhase];
+
+  NSUInteger resident = [ZSyncMemory residentSize];
+  NSUInteger dirty = [ZSyncMemory dirtySize];
+  lifetimePeakAtStart = [ZSyncMemory peakResidentSize];
+
+  NSMutableDictionary *entry = [phases objectForKey:phase];
+  if (!entry) {
+    entry = [NSMutableDictionary dictionary];
+    [entry setValue:[NSNumber numberWithUnsignedInteger:resident] forKey:@"residentStart"];
+    [entry setValue:[NSNumber numberWithUnsignedInteger:dirty] forKey:@"dirtyStart"];
+    [phases setObject:entry forKey:phase];
+  }
+  [self recordResident:resident dirty:dirty inEntry:entry];
+
+  currentPhase = [phase copy];
+}
+
+- (void)sample
+{
+  NSMutableDictionary *entry = [phases objectForKey:currentPhase];
+  if (!entry) return;
+
+  [self recordResident:[ZSyncMemory residentSize] dirty:[ZSyncMemory dirtySize] inEntry:entry];
+}
+
+- (NSDictionary *)finishProfile
+{
+  [self endCurrentPhase];
+  if (![phases count]) return nil;
+
+  NSDictionary *profile = [[phases copy] autorelease];
+  [phases removeAllObjects];
+
+  return profile;
+}
+
+#pragma mark -
+#pragma mark Local methods
+
+- (void)endCurrentPhase
+{
+  NSMutableDictionary *entry = [phases objectForKey:currentPhase];
+  if (!entry) return;
+
+  NSUInteger resident = [ZSyncMemory residentSize];
+  NSUInteger dirty = [ZSyncMemory dirtySize];
+  [self recordResident:resident dirty:dirty inEntry:entry];
+  [entry setValue:[NSNumber numberWithUnsignedInteger:resident] forKey:@"residentEnd"];
+  [entry setValue:[NSNumber numberWithUnsignedInteger:dirty] forKey:@"dirtyEnd"];
+
+  NSUInteger lifetimePeak = [ZSyncMemory peakResidentSize];
+  if (lifetimePeak > lifetimePeakAtStart) {
+    [self recordResident:lifetimePeak dirty:0 inEntry:entry];
+  }
+
+  [currentPhase release], currentPhase = nil;
+}
+
+- (void)recordResident:(NSUInteger)resident dirty:(NSUInteger)dirty inEntry:(NSMutableDictionary *)entry
+{
+  if (resident > [[entry valueForKey:@"peakResident"] unsignedIntegerValue]) {
+    [entry setValue:[NSNumber numberWithUnsignedInteger:resident] forKey:@"peakResident"];
+  }
+  if (dirty > [[entry valueForKey:@"peakDirty"] unsignedIntegerValue]) {
+    [entry setValue:[NSNumber numberWithUnsignedInteger:dirty] forKey:@"peakDirty"];
+  }
+}
+
+#pragma mark -
+#pragma mark Memory management and property declarations
+
+- (void)dealloc
+{
+  [phases release], phases = nil;
+  [currentPhase release], currentPhase = nil;
+
+  [super dealloc];
+}
+
+@synthesize currentPhase;
+
+@end
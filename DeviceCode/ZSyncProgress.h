@@ -0,0 +1,56 @@
+//
+//  ZSyncProgress.h
+//  ZSyncTouch
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+
+#import "ZSyncShared.h"
+
+/* Counts the store bytes moved during one sync and turns them into the
+ * dictionary passed to zSync:updatedProgress:, see the zsProgress keys.
+ *
+ * Throughput is a moving average taken each time a report is built, so it
+ * follows the link without jumping on every chunk.  The server merge moves
+ * no bytes and is not part of the estimate.  Until a store starts coming
+ * back its download is assumed to be as large as its upload.
+ */
+@interface ZSyncProgress : NSObject
+{
+  NSMutableDictionary *stores;
+  unsigned long long lastBytesMoved;
+  CFAbsoluteTime lastReportTime;
+  double bytesPerSecond;
+}
+
+- (void)setLength:(unsigned long long)length ofUploadForStore:(NSString *)storeIdentifier;
+- (void)addBytes:(NSUInteger)length toUploadForStore:(NSString *)storeIdentifier;
+- (void)setLength:(unsigned long long)length ofDownloadForStore:(NSString *)storeIdentifier;
+- (void)addBytes:(NSUInteger)length toDownloadForStore:(NSString *)storeIdentifier;
+
+- (NSDictionary *)report;
+
+- (void)reset;
+
+@end
@@ -0,0 +1,159 @@
+//
+//  ZSyncProgress.m
+//  ZSyncTouch
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+
+#import "ZSyncProgress.h"
+#import "ZSyncTouchHandler.h"
+
+// Weight of the newest sample in the throughput average
+#define kThroughputSmoothing 0.3
+
+@interface ZSyncProgress ()
+
+- (NSMutableDictionary *)entryForStore:(NSString *)storeIdentifier;
+- (void)addBytes:(NSUInteger)length forKey:(NSString *)key store:(NSString *)storeIdentifier;
+
+@end
+
+@implementation ZSyncProgress
+
+- (id)init
+{
+  if (!(self = [super init])) return nil;
+
+  stores = [[NSMutableDictionary alloc] init];
+  lastReportTime = CFAbsoluteTimeGetCurrent();
+
+  return self;
+}
+
+#pragma mark -
+#pragma mark Public methods
+
+- (void)setLength:(unsigned long long)length ofUploadForStore:(NSString *)storeIdentifier
+{
+  [[self entryForStore:storeIdentifier] setValue:[NSNumber numberWithUnsignedLongLong:length] forKey:zsProgressBytesToSend];
+}
+
+- (void)addBytes:(NSUInteger)length toUploadForStore:(NSString *)storeIdentifier
+{
+  [self addBytes:length forKey:zsProgressBytesSent store:storeIdentifier];
+}
+
+- (void)setLength:(unsigned long long)length ofDownloadForStore:(NSString *)storeIdentifier
+{
+  [[self entryForStore:storeIdentifier] setValue:[NSNumber numberWithUnsignedLongLong:length] forKey:zsProgressBytesToReceive];
+}
+
+- (void)addBytes:(NSUInteger)length toDownloadForStore:(NSString *)storeIdentifier
+{
+  [self addBytes:length forKey:zsProgressBytesReceived store:storeIdentifier];
+}
+
+- (NSDictionary *)report
+{
+  unsigned long long sent = 0, toSend = 0, received = 0, toReceive = 0;
+  NSMutableDictionary *storeReports = [NSMutableDictionary dictionary];
+  for (NSString *storeIdentifier in stores) {
+    NSMutableDictionary *entry = [[[stores objectForKey:storeIdentifier] mutableCopy] autorelease];
+    if (![entry valueForKey:zsProgressBytesToReceive]) {
+      [entry setValue:[entry valueForKey:zsProgressBytesToSend] forKey:zsProgressBytesToReceive];
+    }
+    sent += [[entry valueForKey:zsProgressBytesSent] unsignedLongLongValue];
+    toSend += [[entry valueForKey:zsProgressBytesToSend] unsignedLongLongValue];
+    received += [[entry valueForKey:zsProgressBytesReceived] unsignedLongLongValue];
+    toReceive += [[entry valueForKey:zsProgressBytesToReceive] unsignedLongLongValue];
+    [storeReports setValue:entry forKey:storeIdentifier];
+  }
+
+  CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+  unsigned long long moved = sent + received;
+  if (now > lastReportTime && moved > lastBytesMoved) {
+    double rate = (moved - lastBytesMoved) / (now - lastReportTime);
+    bytesPerSecond = (bytesPerSecond > 0.0 ? (kThroughputSmoothing * rate + (1.0 - kThroughputSmoothing) * bytesPerSecond) : rate);
+  }
+  lastBytesMoved = moved;
+  lastReportTime = now;
+
+  NSMutableDictionary *report = [NSMutableDictionary dictionary];
+  [report setValue:storeReports forKey:zsProgressStores];
+  [report setValue:[NSNumber numberWithUnsignedLongLong:sent] forKey:zsProgressBytesSent];
+  [report setValue:[NSNumber numberWithUnsignedLongLong:toSend] forKey:zsProgressBytesToSend];
+  [report setValue:[NSNumber numberWithUnsignedLongLong:received] forKey:zsProgressBytesReceived];
+  [report setValue:[NSNumber numberWithUnsignedLongLong:MAX(toReceive, received)] forKey:zsProgressBytesToReceive];
+  [report setValue:[NSNumber numberWithDouble:bytesPerSecond] forKey:zsProgressBytesPerSecond];
+
+  if (bytesPerSecond > 0.0) {
+    unsigned long long remaining = (toSend > sent ? toSend - sent : 0) + (toReceive > received ? toReceive - received : 0);
+    NSTimeInterval seconds = remaining / bytesPerSecond;
+    [report setValue:[NSNumber numberWithDouble:seconds] forKey:zsProgressSecondsRemaining];
+    [report setValue:[NSDate dateWithTimeIntervalSinceNow:seconds] forKey:zsProgressCompletionDate];
+  }
+
+  return report;
+}
+
+- (void)reset
+{
+  [stores removeAllObjects];
+  lastBytesMoved = 0;
+  lastReportTime = CFAbsoluteTimeGetCurrent();
+  bytesPerSecond = 0.0;
+}
+
+#pragma mark -
+#pragma mark Local methods
+
+- (NSMutableDictionary *)entryForStore:(NSString *)storeIdentifier
+{
+  NSMutableDictionary *entry = [stores objectForKey:storeIdentifier];
+  if (!entry) {
+    entry = [NSMutableDictionary dictionary];
+    [stores setObject:entry forKey:storeIdentifier];
+  }
+
+  return entry;
+}
+
+- (void)addBytes:(NSUInteger)length forKey:(NSString *)key store:(NSString *)storeIdentifier
+{
+  NSMutableDictionary *entry = [self entryForStore:storeIdentifier];
+  unsigned long long total = [[entry valueForKey:key] unsignedLongLongValue] + length;
+  [entry setValue:[NSNumber numberWithUnsignedLongLong:total] forKey:key];
+}
+
+#pragma mark -
+#pragma mark Memory management and property declarations
+
+- (void)dealloc
+{
+  [stores release], stores = nil;
+
+  [super dealloc];
+}
+
+@end
@@ -28,21 +28,67 @@
 
 #import "ServerBrowserDelegate.h"
 #import "ZSyncShared.h"
+#import "ZSyncMessageScheduler.h"
 
 @class ZSyncTouchHandler;
 @class ServerBrowser;
+@class ZSyncStoreAssembler;
+@class ZSyncPeerTrust;
+@class ZSyncLatencyHistory;
+@class ZSyncMemoryProfile;
+@class ZSyncProgress;
+@class Reachability;
+
+/* Keys of the dictionary passed to zSync:connectedWithPhaseDurations:.
+ * The TLS phase is only present when an SSL identity is set, it ends when
+ * the server certificate has been checked and the BLIP phase starts there.
+ */
+#define zsConnectPhaseTCP @"tcp"
+#define zsConnectPhaseTLS @"tls"
+#define zsConnectPhaseBLIP @"blip"
+#define zsConnectPhaseTrustCached @"trustCached"
+
+/* Keys of the dictionary passed to zSync:updatedProgress:.  Byte counts are
+ * NSNumbers, zsProgressStores holds the four counts per store identifier.
+ * The estimate keys are missing until a throughput has been measured.
+ */
+#define zsProgressStores @"stores"
+#define zsProgressBytesSent @"bytesSent"
+#define zsProgressBytesToSend @"bytesToSend"
+#define zsProgressBytesReceived @"bytesReceived"
+#define zsProgressBytesToReceive @"bytesToReceive"
+#define zsProgressBytesPerSecond @"bytesPerSecond"
+#define zsProgressSecondsRemaining @"secondsRemaining"
+#define zsProgressCompletionDate @"estimatedCompletionDate"
+
+/* Phases passed to zSync:timedOutDuringPhase:afterInterval: */
+#define zsDiscoveryPhaseNetwork @"network"
+#define zsDiscoveryPhaseBrowse @"browse"
+#define zsDiscoveryPhaseResolve @"resolve"
+#define zsDiscoveryPhaseConnect @"connect"
 
 @interface ZSyncService : NSObject
 {
   NSString *name;
   NSString *uuid;
   NSNetService *service;
+  NSInteger load;
+  NSInteger queueDepth;
 }
 
 @property (nonatomic, retain) NSString *name;
 @property (nonatomic, retain) NSString *uuid;
 @property (nonatomic, retain) NSNetService *service;
 
+/* Sessions syncing on the server and messages queued across them, as
+ * advertised when the service was resolved.
+ */
+@property (nonatomic, assign) NSInteger load;
+@property (nonatomic, assign) NSInteger queueDepth;
+
+/* Least loaded first */
+- (NSComparisonResult)compareLoad:(ZSyncService *)otherService;
+
 @end
 
 @protocol ZSyncDelegate
@@ -82,7 +128,8 @@
 
 /* This message is sent when a list of servers has been created and there is
  * no server currently paired.  It is expected that the app will present a
- * list of servers or optionally request pairing automatically
+ * list of servers or optionally request pairing automatically.  The list is
+ * sorted with the least loaded server first.
  */
 - (void)zSyncNoServerPaired:(NSArray *)availableServers;
 
@@ -116,6 +163,40 @@
  */
 - (void)zSyncServerUnavailable:(ZSyncTouchHandler *)handler;
 
+/* Sent once a new connection to the server has answered its first request.
+ * The durations are in seconds, see the zsConnectPhase keys.
+ */
+- (void)zSync:(ZSyncTouchHandler *)handler connectedWithPhaseDurations:(NSDictionary *)durations;
+
+/* Sent whenever a discovery timeout fires, before any failure message it
+ * causes.  The timeouts are learned per network from earlier searches so this
+ * is the place to see which phase is slow.
+ */
+- (void)zSync:(ZSyncTouchHandler *)handler timedOutDuringPhase:(NSString *)phase afterInterval:(NSTimeInterval)interval;
+
+/* The paired server has data for this schema that is newer than the last
+ * sync.  Only sent when automatic sync is off, otherwise a sync is started.
+ */
+- (void)zSyncServerDataChanged:(ZSyncTouchHandler *)handler;
+
+/* Sent during a sync each time a store holding high priority entities has
+ * been switched in, ahead of the bulk stores still being transferred.  The
+ * application can refresh the affected displays as it would for
+ * zSyncFinished:.  These stores are kept even if the rest of the sync fails.
+ */
+- (void)zSyncPriorityDataAvailable:(ZSyncTouchHandler *)handler;
+
+/* Sent when a sync that reached the upload ends, before zSyncFinished: or
+ * after the failure was reported.  The profile holds the memory use of each
+ * phase keyed by the zsSpan name, see ZSyncMemoryProfile for the figures.
+ */
+- (void)zSync:(ZSyncTouchHandler *)handler finishedWithMemoryProfile:(NSDictionary *)profile;
+
+/* Sent while stores are uploaded and downloaded, at most four times a second,
+ * and once more when the sync finishes.  See the zsProgress keys.
+ */
+- (void)zSync:(ZSyncTouchHandler *)handler updatedProgress:(NSDictionary *)progress;
+
 @end
 
 typedef enum {
@@ -125,9 +206,23 @@ typedef enum {
   ZSyncServerActionLatentDeregistration
 } ZSyncServerAction;
 
-@interface ZSyncTouchHandler : NSObject <BLIPConnectionDelegate, ServerBrowserDelegate, NSNetServiceDelegate>
+/* Where the search for the paired server currently is.  Every transition
+ * happens on the main run loop, which is also where the browser and the
+ * resolving services deliver their callbacks, so no lock guards it.
+ */
+typedef enum {
+  ZSyncDiscoveryStateIdle = 0,
+  ZSyncDiscoveryStateBrowsing,
+  ZSyncDiscoveryStateResolving,
+  ZSyncDiscoveryStateMatched,
+  ZSyncDiscoveryStateConnecting
+} ZSyncDiscoveryState;
+
+@interface ZSyncTouchHandler : NSObject <BLIPConnectionDelegate, ServerBrowserDelegate, NSNetServiceDelegate, ZSyncMessageSchedulerDelegate>
 {
   NSTimer *networkTimer;
+  NSTimer *heartbeatTimer;
+  NSTimer *reconnectTimer;
   NSDate *findServerTimeoutDate;
 
   NSMutableArray *storeFileIdentifiers;
@@ -135,18 +230,65 @@ typedef enum {
   NSMutableArray *discoveredServers;
   NSMutableArray *resolvedServices;
   NSMutableArray *openConnections;
+  NSMutableDictionary *messageSchedulers;
+  NSMutableDictionary *connectTimings;
+  NSMutableSet *directConnections;
+  NSMutableDictionary *txtRecordCache;
+  NSMutableDictionary *resolveStartTimes;
+  ZSyncLatencyHistory *latencyHistory;
+  ZSyncMemoryProfile *memoryProfile;
+  ZSyncProgress *progress;
+  CFAbsoluteTime lastProgressTime;
+  BOOL progressScheduled;
+  CFAbsoluteTime browseStartTime;
+  BOOL browseSampled;
 
   NSNetService *registeredService;
 
+  /* The verified connection to the paired server.  It is kept open while the
+   * app is in the foreground so that actions do not have to reconnect and
+   * verify the schema every time.
+   */
+  BLIPConnection *sessionConnection;
+  BLIPConnection *pendingSessionConnection;
+  BLIPConnection *optimisticConnection;
+  // The connection the running action was started on, if any
+  BLIPConnection *actionConnection;
+  BOOL heartbeatOutstanding;
+  BOOL racingDiscovery;
+  BOOL suspended;
+  NSInteger missedHeartbeats;
+  NSInteger reconnectAttempts;
+
+  /* Automatic sync.  Saves restart the quiet period timer, requests made
+   * while a sync is running are queued and failures back off.
+   */
+  BOOL automaticSyncEnabled;
+  NSTimeInterval automaticSyncQuietPeriod;
+  NSTimer *automaticSyncTimer;
+  Reachability *automaticSyncReachability;
+  BOOL localChangesPending;
+  BOOL syncQueued;
+  BOOL automaticSyncRunning;
+  NSInteger automaticSyncFailures;
+  NSInteger serverChangeCount;
+
   ServerBrowser *_serviceBrowser;
 
   NSInteger majorVersionNumber;
   NSInteger minorVersionNumber;
 
   NSMutableDictionary *receivedFileLookupDictionary;
+  NSMutableSet *appliedStoreIdentifiers;
+  ZSyncStoreAssembler *storeAssembler;
 
   NSString *passcode;
 
+  SecIdentityRef sslIdentity;
+  ZSyncPeerTrust *peerTrust;
+
+  NSString *captureDirectory;
+
   id _delegate;
 
   /* We are going to start off by trying to swap out the persistent stores
@@ -156,15 +298,17 @@ typedef enum {
   NSPersistentStoreCoordinator *_persistentStoreCoordinator;
 
   ZSyncServerAction serverAction;
+  ZSyncDiscoveryState discoveryState;
 
   NSLock *lock;
-  NSLock *serviceResolutionLock;
 }
 
 @property (nonatomic, assign) ZSyncServerAction serverAction;
+@property (nonatomic, readonly) ZSyncDiscoveryState discoveryState;
 @property (nonatomic, retain) ServerBrowser *serviceBrowser;
 @property (nonatomic, retain) NSMutableArray *openConnections;
 @property (nonatomic, retain) NSNetService *registeredService;
+@property (nonatomic, retain) BLIPConnection *sessionConnection;
 @property (nonatomic, assign) NSInteger majorVersionNumber;
 @property (nonatomic, assign) NSInteger minorVersionNumber;
 @property (nonatomic, copy) NSString *passcode;
@@ -172,9 +316,32 @@ typedef enum {
 @property (retain) NSMutableArray *discoveredServers;
 @property (retain) NSMutableArray *resolvedServices;
 @property (retain) NSLock *lock;
-@property (retain) NSLock *serviceResolutionLock;
 @property (nonatomic, retain) NSMutableArray *storeFileIdentifiers;
 @property (nonatomic, retain) NSMutableDictionary *receivedFileLookupDictionary;
+@property (nonatomic, retain) NSMutableSet *appliedStoreIdentifiers;
+@property (nonatomic, retain) NSMutableDictionary *messageSchedulers;
+@property (nonatomic, retain) ZSyncStoreAssembler *storeAssembler;
+@property (nonatomic, retain) NSMutableDictionary *connectTimings;
+@property (nonatomic, retain) NSMutableSet *directConnections;
+@property (nonatomic, retain) NSMutableDictionary *txtRecordCache;
+@property (nonatomic, retain) NSMutableDictionary *resolveStartTimes;
+@property (nonatomic, retain) ZSyncLatencyHistory *latencyHistory;
+@property (nonatomic, retain) ZSyncMemoryProfile *memoryProfile;
+@property (nonatomic, retain) ZSyncProgress *progress;
+@property (nonatomic, retain) ZSyncPeerTrust *peerTrust;
+
+/* When enabled, saves to any context on the registered coordinator trigger a
+ * sync once no further save has happened for the quiet period.  Nothing is
+ * attempted while the local WiFi is down or before a server is paired.
+ */
+@property (nonatomic, assign, getter=isAutomaticSyncEnabled) BOOL automaticSyncEnabled;
+@property (nonatomic, assign) NSTimeInterval automaticSyncQuietPeriod;
+
+/* When set, every message exchanged with the server is written to a new
+ * capture file in this directory, one file per connection.  The files can be
+ * replayed against a daemon with the ZSyncBench replay benchmark.
+ */
+@property (nonatomic, copy) NSString *captureDirectory;
 
 /* This shared singleton design should probably go away.  We cannot assume
  * that the parent app will want to keep us around all of the time and may
@@ -184,7 +351,16 @@ typedef enum {
 
 - (void)registerDelegate:(id<ZSyncDelegate>)delegate withPersistentStoreCoordinator:(NSPersistentStoreCoordinator *)coordinator;
 
+/* A request made while a sync is already running is queued and started once
+ * that sync ends.
+ */
 - (void)requestSync;
+
+/* Also cancels a sync in progress.  Requests still queued are dropped, the
+ * server is told the sync was cancelled and the connection is dropped
+ * without waiting for the chunks already written to it.  Partially received
+ * stores and received stores that were not applied yet are deleted.
+ */
 - (void)stopRequestingSync;
 - (void)requestPairing:(ZSyncService *)server;
 - (void)cancelPairing;
@@ -198,4 +374,12 @@ typedef enum {
 
 - (NSString *)serverName;
 
+/* When set, connections to the server are made over TLS using this identity.
+ * The server must be configured with an identity as well.  The server
+ * certificate is pinned the first time it is seen and repeat connections only
+ * compare its fingerprint.
+ */
+- (SecIdentityRef)sslIdentity;
+- (void)setSSLIdentity:(SecIdentityRef)identity;
+
 @end
@@ -30,9 +30,40 @@
 #import "ServerBrowser.h"
 #import "ZSyncShared.h"
 #import "ZSyncTouchHandler.h"
+#import "ZSyncMessageScheduler.h"
+#import "ZSyncStoreAssembler.h"
+#import "ZSyncPeerTrust.h"
+#import "ZSyncLatencyHistory.h"
+#import "ZSyncMemoryProfile.h"
+#import "ZSyncProgress.h"
+#import "ZSyncTrace.h"
+#import "ZSyncSessionRecorder.h"
+#import "NSManagedObjectModel+ZSExtensions.h"
 
 #define zsUUIDStringLength 55
 
+#define zsAcceptedSchemasKey @"zsAcceptedSchemasKey"
+#define zsTrustedServersKey @"zsTrustedServersKey"
+#define zsServerAddressesKey @"zsServerAddressesKey"
+#define zsLatencyHistoryKey @"zsLatencyHistoryKey"
+#define zsSyncedChangeCountKey @"zsSyncedChangeCountKey"
+#define zsRejectedSchemasKey @"zsRejectedSchemasKey"
+
+#define kMissedHeartbeatLimit 2
+#define kMaximumReconnectAttempts 6
+#define kMaximumReconnectDelay 60.0
+#define kMaximumCachedAddresses 3
+#define kDirectConnectTimeout 5.0
+#define kTXTRecordCacheLifetime 300.0
+#define kReachabilityWait 15.0
+#define kDefaultBrowseTimeout 7.5
+#define kDefaultResolveTimeout 7.5
+#define kDefaultAutomaticSyncQuietPeriod 10.0
+#define kQueuedSyncDelay 1.0
+#define kMaximumAutomaticSyncBackoff 1800.0
+#define kProgressInterval 0.25
+#define kCancelCloseTimeout 2.0
+
 #pragma mark -
 
 @interface ZSyncTouchHandler ()
@@ -59,13 +90,72 @@
 - (void)processAuthenticatePairingRequest:(BLIPRequest *)request fromConnection:(BLIPConnection *)conn;
 - (void)processCompleteSyncRequest:(BLIPRequest *)request fromConnection:(BLIPConnection *)conn;
 - (void)processStoreUploadRequest:(BLIPRequest *)request fromConnection:(BLIPConnection *)conn;
+- (void)applyPriorityStore:(NSString *)storeIdentifier;
 - (void)processCancelPairingRequest:(BLIPRequest *)request fromConnection:(BLIPConnection *)conn;
+- (BOOL)handleRequest:(BLIPRequest *)request fromConnection:(BLIPConnection *)conn;
+- (ZSyncMessageScheduler *)schedulerForConnection:(BLIPConnection *)conn;
+- (void)closeConnection:(BLIPConnection *)conn;
+- (void)abortConnection:(BLIPConnection *)conn reason:(ZSCancelReason)reason;
+- (void)cancelSyncWithReason:(ZSCancelReason)reason;
+- (void)discardReceivedFiles;
+- (void)forgetConnection:(BLIPConnection *)conn;
+- (BLIPConnection *)openConnectionToService:(NSNetService *)service;
+- (void)performServerActionUsingConnection:(BLIPConnection *)conn;
+- (void)finishActionUsingConnection:(BLIPConnection *)conn;
+- (void)adoptSessionConnection:(BLIPConnection *)conn;
+- (void)scheduleReconnect;
+- (NSString *)schemaSignature;
+- (NSString *)modelFingerprint;
+- (BOOL)schemaPreviouslyAccepted;
+- (void)rememberSchemaAccepted:(BOOL)accepted;
+- (void)noteConnectEvent:(NSString *)event forConnection:(BLIPConnection *)conn;
+- (void)reportConnectTimingsForConnection:(BLIPConnection *)conn;
+- (NSArray *)cachedServerAddresses;
+- (void)rememberServerAddress:(IPAddress *)address;
+- (BOOL)dialCachedServerAddresses;
+- (BOOL)isDirectConnection:(BLIPConnection *)conn;
+- (void)finishDiscoveryRaceWithWinner:(BLIPConnection *)conn;
+- (NSString *)cacheKeyForService:(NSNetService *)service;
+- (void)cacheTXTRecordData:(NSData *)data forService:(NSNetService *)service;
+- (BOOL)cachedTXTRecordRulesOutService:(NSNetService *)service;
+- (void)startBrowser;
+- (void)startNetworkTimer;
+- (NSTimeInterval)resolveTimeout;
+- (NSTimeInterval)connectTimeoutWithDefault:(NSTimeInterval)defaultTimeout;
+- (void)reportTimeoutInPhase:(NSString *)phase afterInterval:(NSTimeInterval)interval;
+- (void)enterDiscoveryState:(ZSyncDiscoveryState)state;
+- (void)connectToMatchedService:(NSNetService *)service;
+- (void)scheduleNoServerPairedNotification;
+- (void)notifyNoServerPaired;
+- (void)notifyServerUnavailable;
+- (void)scheduleAutomaticSyncAfterDelay:(NSTimeInterval)delay;
+- (void)syncActivityEndedWithSuccess:(BOOL)succeeded;
+- (void)watchReachabilityForAutomaticSync;
+- (void)noteServerChangeCount:(NSInteger)changeCount;
+- (void)noteTXTRecordData:(NSData *)data;
+- (BOOL)serverHasNewerData;
+- (BOOL)server:(NSString *)serverUUID mayAcceptSchemaWithTXTRecord:(NSDictionary *)txtRecordDictionary;
+- (void)rememberSchemaRejectedByServer:(NSString *)serverUUID schemaSet:(NSString *)schemaSet;
+- (void)notifySchemaUnsupported;
+- (void)reportMemoryProfile;
+- (void)noteProgress;
+- (void)deliverProgress;
 
 @property (nonatomic, assign) id delegate;
 @property (nonatomic, retain) NSPersistentStoreCoordinator *persistentStoreCoordinator;
 
 @end
 
+static NSString *txtRecordString(NSDictionary *txtRecordDictionary, NSString *key)
+{
+  NSData *data = [txtRecordDictionary objectForKey:key];
+  if (!data) {
+    return nil;
+  }
+
+  return [[[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding] autorelease];
+}
+
 #pragma mark -
 
 @implementation ZSyncTouchHandler
@@ -87,10 +177,19 @@
                          selector:@selector(applicationWillTerminate:)
                            name:UIApplicationWillTerminateNotification
                            object:nil];
+    if (&UIApplicationDidEnterBackgroundNotification != NULL) {
+      [[NSNotificationCenter defaultCenter] addObserver:sharedTouchHandler
+                           selector:@selector(applicationDidEnterBackground:)
+                             name:UIApplicationDidEnterBackgroundNotification
+                             object:nil];
+      [[NSNotificationCenter defaultCenter] addObserver:sharedTouchHandler
+                           selector:@selector(applicationWillEnterForeground:)
+                             name:UIApplicationWillEnterForegroundNotification
+                             object:nil];
+    }
 
     // Initialize our lock objects
     [sharedTouchHandler lock];
-    [sharedTouchHandler serviceResolutionLock];
   }
 
   return sharedTouchHandler;
@@ -109,6 +208,12 @@
 - (void)requestSync
 {
   DLog(@"%s", __PRETTY_FUNCTION__);
+  if ([self serverAction] == ZSyncServerActionSync) {
+    DLog(@"sync in progress, queueing the request");
+    syncQueued = YES;
+    return;
+  }
+
   ZAssert([self serverAction] == ZSyncServerActionNoActivity, @"Attempt to sync while another action is active");
   if ([self serverAction] != ZSyncServerActionNoActivity) {
     if ([[self delegate] respondsToSelector:@selector(zSync:errorOccurred:)]) {
@@ -127,10 +232,20 @@
 - (void)stopRequestingSync
 {
   DLog(@"%s", __PRETTY_FUNCTION__);
+  syncQueued = NO;
   [[self serviceBrowser] setDelegate:nil];
   [[self serviceBrowser] stop];
   [[self resolvedServices] removeAllObjects];
-  [self setRegisteredService:nil];
+  if ([self serverAction] == ZSyncServerActionSync) {
+    [self cancelSyncWithReason:zsCancelReasonUserRequest];
+  }
+  // A deliberate stop is neither a failure nor a reason to try again
+  automaticSyncRunning = NO;
+  [automaticSyncTimer invalidate], automaticSyncTimer = nil;
+  // The session reconnects to the service it was aborted on
+  if (![self sessionConnection] && !reconnectTimer) {
+    [self setRegisteredService:nil];
+  }
   [self setServerAction:ZSyncServerActionNoActivity];
 }
 
@@ -140,13 +255,7 @@
 
   [self setServerAction:ZSyncServerActionSync];
 
-  NSNetService *service = [server service];
-
-  BLIPConnection *conn = [[BLIPConnection alloc] initToNetService:service];
-  [[self openConnections] addObject:conn];
-  [conn setDelegate:self];
-  [conn open];
-  [conn release], conn = nil;
+  [self openConnectionToService:[server service]];
 }
 
 - (void)cancelPairing;
@@ -175,22 +284,24 @@
   [requestPropertiesDictionary setValue:[self schemaID] forKey:zsSchemaIdentifier];
 
   BLIPRequest *request = [BLIPRequest requestWithBody:nil properties:requestPropertiesDictionary];
-  [openConnection sendRequest:request];
+  [[self schedulerForConnection:openConnection] sendRequest:request priority:ZSyncMessagePriorityControl];
 }
 
 - (void)disconnectPairing;
 {
   DLog(@"%s", __PRETTY_FUNCTION__);
+  [[self peerTrust] forgetPeer:[[NSUserDefaults standardUserDefaults] valueForKey:zsServerUUID]];
+  [[NSUserDefaults standardUserDefaults] removeObjectForKey:zsServerAddressesKey];
+  [[NSUserDefaults standardUserDefaults] removeObjectForKey:zsSyncedChangeCountKey];
+  serverChangeCount = 0;
   [[NSUserDefaults standardUserDefaults] removeObjectForKey:zsServerName];
   [[NSUserDefaults standardUserDefaults] removeObjectForKey:zsServerUUID];
 
-  for (BLIPConnection *conn in [self openConnections]) {
-    [conn setDelegate:nil];
-    [conn close];
+  [reconnectTimer invalidate], reconnectTimer = nil;
+  for (BLIPConnection *conn in [[[self openConnections] copy] autorelease]) {
+    [self closeConnection:conn];
   }
 
-  [[self openConnections] removeAllObjects];
-
   [self setRegisteredService:nil];
 
   [self setServerAction:ZSyncServerActionNoActivity];
@@ -234,6 +345,26 @@
   return [[NSUserDefaults standardUserDefaults] valueForKey:zsServerName];
 }
 
+- (SecIdentityRef)sslIdentity
+{
+  return sslIdentity;
+}
+
+- (void)setSSLIdentity:(SecIdentityRef)identity
+{
+  if (identity == sslIdentity) {
+    return;
+  }
+
+  if (sslIdentity) {
+    CFRelease(sslIdentity);
+  }
+  sslIdentity = identity;
+  if (sslIdentity) {
+    CFRetain(sslIdentity);
+  }
+}
+
 #pragma mark -
 #pragma mark Notification and other callback methods
 
@@ -241,13 +372,11 @@
 {
   DLog(@"%s", __PRETTY_FUNCTION__);
   DLog(@"closing connection");
-  for (BLIPConnection *conn in [self openConnections]) {
-    [conn setDelegate:nil];
-    [conn close];
+  [reconnectTimer invalidate], reconnectTimer = nil;
+  for (BLIPConnection *conn in [[[self openConnections] copy] autorelease]) {
+    [self closeConnection:conn];
   }
 
-  [[self openConnections] removeAllObjects];
-
   if ([self serviceBrowser]) {
     [[self serviceBrowser] setDelegate:nil];
     [[self serviceBrowser] stop];
@@ -259,10 +388,170 @@
   }
 }
 
+- (void)applicationDidEnterBackground:(NSNotification *)notification
+{
+  DLog(@"%s", __PRETTY_FUNCTION__);
+  suspended = YES;
+  [reconnectTimer invalidate], reconnectTimer = nil;
+  [automaticSyncTimer invalidate], automaticSyncTimer = nil;
+  [[self latencyHistory] save];
+
+  if ([self sessionConnection] && [self serverAction] == ZSyncServerActionNoActivity) {
+    DLog(@"closing idle session");
+    [self closeConnection:[self sessionConnection]];
+  }
+}
+
+- (void)applicationWillEnterForeground:(NSNotification *)notification
+{
+  DLog(@"%s", __PRETTY_FUNCTION__);
+  suspended = NO;
+  reconnectAttempts = 0;
+  [self scheduleReconnect];
+
+  if (syncQueued || ([self isAutomaticSyncEnabled] && localChangesPending)) {
+    [self scheduleAutomaticSyncAfterDelay:[self automaticSyncQuietPeriod]];
+  }
+}
+
+- (void)managedObjectContextDidSave:(NSNotification *)notification
+{
+  // Saves are observed from any context, so this can arrive on a worker thread
+  if (![NSThread isMainThread]) {
+    [self performSelectorOnMainThread:@selector(managedObjectContextDidSave:) withObject:notification waitUntilDone:NO];
+    return;
+  }
+
+  NSManagedObjectContext *context = [notification object];
+  if ([context persistentStoreCoordinator] != [self persistentStoreCoordinator]) {
+    return;
+  }
+
+  if (![[NSUserDefaults standardUserDefaults] valueForKey:zsServerUUID]) {
+    return;
+  }
+
+  localChangesPending = YES;
+
+  // Backing off, the retry will pick these changes up
+  if (automaticSyncFailures && automaticSyncTimer) {
+    return;
+  }
+
+  [self scheduleAutomaticSyncAfterDelay:[self automaticSyncQuietPeriod]];
+}
+
+- (void)automaticSyncTimerFired:(NSTimer *)timer
+{
+  DLog(@"%s", __PRETTY_FUNCTION__);
+  automaticSyncTimer = nil;
+
+  // The end of a running sync schedules us again
+  if (suspended || [self serverAction] == ZSyncServerActionSync) {
+    return;
+  }
+
+  // Pairing and deregistration do not, so check back once they are done
+  if ([self serverAction] != ZSyncServerActionNoActivity) {
+    [self scheduleAutomaticSyncAfterDelay:[self automaticSyncQuietPeriod]];
+    return;
+  }
+
+  if (![[NSUserDefaults standardUserDefaults] valueForKey:zsServerUUID]) {
+    localChangesPending = NO;
+    syncQueued = NO;
+    return;
+  }
+
+  if ([[Reachability reachabilityForLocalWiFi] currentReachabilityStatus] == NotReachable) {
+    DLog(@"local network not available, waiting for it");
+    [self watchReachabilityForAutomaticSync];
+    return;
+  }
+
+  localChangesPending = NO;
+  syncQueued = NO;
+  automaticSyncRunning = YES;
+  [self requestSync];
+}
+
+- (void)automaticSyncReachabilityChanged:(NSNotification *)notification
+{
+  if ([automaticSyncReachability currentReachabilityStatus] == NotReachable) {
+    return;
+  }
+
+  DLog(@"%s local network now available", __PRETTY_FUNCTION__);
+  [[NSNotificationCenter defaultCenter] removeObserver:self name:kReachabilityChangedNotification object:automaticSyncReachability];
+  [automaticSyncReachability stopNotifer];
+  [automaticSyncReachability autorelease], automaticSyncReachability = nil;
+
+  // Give the interface a moment to settle before hitting the server
+  [self scheduleAutomaticSyncAfterDelay:kQueuedSyncDelay];
+}
+
+- (void)heartbeatTimerFired:(NSTimer *)timer
+{
+  BLIPConnection *conn = [self sessionConnection];
+
+  // The daemon can be blocked inside a sync session and unable to answer
+  if ([self serverAction] != ZSyncServerActionNoActivity) {
+    heartbeatOutstanding = NO;
+    missedHeartbeats = 0;
+    return;
+  }
+
+  if (heartbeatOutstanding) {
+    ++missedHeartbeats;
+    if (missedHeartbeats >= kMissedHeartbeatLimit) {
+      DLog(@"session missed %i heartbeats, reconnecting", missedHeartbeats);
+      [self closeConnection:conn];
+      [self scheduleReconnect];
+      return;
+    }
+  }
+
+  NSMutableDictionary *requestPropertiesDictionary = [NSMutableDictionary dictionary];
+  [requestPropertiesDictionary setValue:zsActID(zsActionHeartbeat) forKey:zsAction];
+
+  BLIPRequest *request = [BLIPRequest requestWithBody:nil properties:requestPropertiesDictionary];
+  [[self schedulerForConnection:conn] sendRequest:request priority:ZSyncMessagePriorityControl];
+  heartbeatOutstanding = YES;
+}
+
+- (void)reconnectTimerFired:(NSTimer *)timer
+{
+  DLog(@"%s", __PRETTY_FUNCTION__);
+  reconnectTimer = nil;
+
+  // Any action started in the meantime opens its own connection
+  if ([self sessionConnection] || pendingSessionConnection || [self serverAction] != ZSyncServerActionNoActivity) {
+    return;
+  }
+
+  if (![self registeredService]) {
+    return;
+  }
+
+  pendingSessionConnection = [self openConnectionToService:[self registeredService]];
+}
+
 - (void)networkTimeout:(NSTimer *)timer
 {
   DLog(@"%s", __PRETTY_FUNCTION__);
   DLog(@"timeout on local network");
+  [self enterDiscoveryState:ZSyncDiscoveryStateIdle];
+
+  if (!browseStartTime) {
+    [self reportTimeoutInPhase:zsDiscoveryPhaseNetwork afterInterval:kReachabilityWait];
+  } else if ([[self discoveredServers] count]) {
+    // Charge the resolve phase with the oldest resolve still outstanding
+    NSArray *starts = [[[self resolveStartTimes] allValues] sortedArrayUsingSelector:@selector(compare:)];
+    CFAbsoluteTime resolveStart = ([starts count] ? [[starts objectAtIndex:0] doubleValue] : browseStartTime);
+    [self reportTimeoutInPhase:zsDiscoveryPhaseResolve afterInterval:(CFAbsoluteTimeGetCurrent() - resolveStart)];
+  } else {
+    [self reportTimeoutInPhase:zsDiscoveryPhaseBrowse afterInterval:(CFAbsoluteTimeGetCurrent() - browseStartTime)];
+  }
 
   if ([self serverAction] == ZSyncServerActionDeregister) {
     DLog(@"[self serverAction] == ZSyncServerActionDeregister");
@@ -301,6 +590,9 @@
   }
 
   networkTimer = nil;
+  if ([self serverAction] == ZSyncServerActionSync) {
+    [self syncActivityEndedWithSuccess:NO];
+  }
   [self setServerAction:ZSyncServerActionNoActivity];
   if ([[self delegate] respondsToSelector:@selector(zSyncServerUnavailable:)]) {
     [[self delegate] zSyncServerUnavailable:self];
@@ -313,6 +605,11 @@
 {
   DLog(@"%s", __PRETTY_FUNCTION__);
   Reachability *reachability = [notification object];
+  // Only the instance the server search is waiting on
+  if (reachability != [networkTimer userInfo]) {
+    return;
+  }
+
   if ([reachability currentReachabilityStatus] == NotReachable) {
     return;
   }
@@ -320,24 +617,18 @@
   DLog(@"local network now available");
   [reachability stopNotifer];
   [networkTimer invalidate], networkTimer = nil;
-  NSString *serverUUID = [[NSUserDefaults standardUserDefaults] valueForKey:zsServerUUID];
-  if (serverUUID) {
-    networkTimer = [NSTimer scheduledTimerWithTimeInterval:15.0
-                            target:self
-                            selector:@selector(networkTimeout:)
-                            userInfo:nil
-                             repeats:NO];
-  }
 
   if ([self registeredService]) {
     [self handleServerActionWithService:[self registeredService]];
   } else {
     NSString *serverUUID = [[NSUserDefaults standardUserDefaults] valueForKey:zsServerUUID];
     if (serverUUID) {
-      networkTimer = [NSTimer scheduledTimerWithTimeInterval:15.0 target:self selector:@selector(networkTimeout:) userInfo:reachability repeats:NO];
+      [self startNetworkTimer];
+      // Bonjour keeps looking in case the server has moved
+      racingDiscovery = [self dialCachedServerAddresses];
     }
 
-    [[self serviceBrowser] start];
+    [self startBrowser];
   }
 }
 
@@ -346,6 +637,19 @@
 
 - (void)handleServerActionWithService:(NSNetService *)service
 {
+  [reconnectTimer invalidate], reconnectTimer = nil;
+
+  if (pendingSessionConnection) {
+    DLog(@"session is reconnecting, the action will start once it is verified");
+    return;
+  }
+
+  if ([self sessionConnection] && [[self sessionConnection] status] == kTCP_Open && [service isEqual:[self registeredService]]) {
+    DLog(@"reusing the open session");
+    [self performServerActionUsingConnection:[self sessionConnection]];
+    return;
+  }
+
   if ([self serverAction] == ZSyncServerActionSync) {
     [self beginSyncWithService:service];
   } else if ([self serverAction] == ZSyncServerActionDeregister) {
@@ -366,18 +670,35 @@
 - (void)startServerSearch
 {
   DLog(@"%s", __PRETTY_FUNCTION__);
+  if ([self sessionConnection] && [[self sessionConnection] status] == kTCP_Open) {
+    DLog(@"reusing the open session");
+    [self performServerActionUsingConnection:[self sessionConnection]];
+    return;
+  }
+
+  racingDiscovery = NO;
+  browseStartTime = 0.0;
+  [self enterDiscoveryState:ZSyncDiscoveryStateIdle];
   DLog(@"Resetting the service browser");
   [[self serviceBrowser] setDelegate:nil];
   [[self serviceBrowser] stop];
   [self setServiceBrowser:nil];
 
+  // The new browse reports every service again, cached TXT records survive
+  for (NSNetService *service in [self discoveredServers]) {
+    [service setDelegate:nil];
+    [service stop];
+  }
+  [[self discoveredServers] removeAllObjects];
+  [[self availableServers] removeAllObjects];
+
   Reachability *reachability = [Reachability reachabilityForLocalWiFi];
   if ([reachability currentReachabilityStatus] == NotReachable) {
     DLog(@"local network not available");
     // Subscribe to changes in reachability
     [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(reachabilityChanged:) name:kReachabilityChangedNotification object:nil];
     [reachability startNotifer];
-    networkTimer = [NSTimer scheduledTimerWithTimeInterval:15.0     target:self selector:@selector(networkTimeout:) userInfo:reachability repeats:NO];
+    networkTimer = [NSTimer scheduledTimerWithTimeInterval:kReachabilityWait target:self selector:@selector(networkTimeout:) userInfo:reachability repeats:NO];
 
     return;
   } else if ([self registeredService]) {
@@ -385,41 +706,48 @@
   } else {
     NSString *serverUUID = [[NSUserDefaults standardUserDefaults] valueForKey:zsServerUUID];
     if (serverUUID) {
-      networkTimer = [NSTimer scheduledTimerWithTimeInterval:15.0 target:self selector:@selector(networkTimeout:) userInfo:reachability repeats:NO];
+      [self startNetworkTimer];
+      // Bonjour keeps looking in case the server has moved
+      racingDiscovery = [self dialCachedServerAddresses];
     }
 
-    [[self serviceBrowser] start];
+    [self startBrowser];
   }
 }
 
-- (void)beginSyncWithService:(NSNetService *)service
+- (BLIPConnection *)openConnectionToService:(NSNetService *)service
 {
   DLog(@"%s", __PRETTY_FUNCTION__);
   BLIPConnection *conn = [[BLIPConnection alloc] initToNetService:service];
   [[self openConnections] addObject:conn];
   [conn setDelegate:self];
+  if ([self sslIdentity]) {
+    [conn setPeerToPeerIdentity:[self sslIdentity]];
+  }
+  // Zero leaves the system default in place until there is some history
+  [conn setOpenTimeout:[self connectTimeoutWithDefault:0.0]];
+  [self noteConnectEvent:@"start" forConnection:conn];
   [conn open];
-  [conn release], conn = nil;
+
+  return [conn autorelease];
+}
+
+- (void)beginSyncWithService:(NSNetService *)service
+{
+  DLog(@"%s", __PRETTY_FUNCTION__);
+  [self openConnectionToService:service];
 }
 
 - (void)beginDeregistrationWithService:(NSNetService *)service
 {
   DLog(@"%s", __PRETTY_FUNCTION__);
-  BLIPConnection *conn = [[BLIPConnection alloc] initToNetService:service];
-  [[self openConnections] addObject:conn];
-  [conn setDelegate:self];
-  [conn open];
-  [conn release], conn = nil;
+  [self openConnectionToService:service];
 }
 
 - (void)beginLatentDeregistrationWithService:(NSNetService *)service
 {
   DLog(@"%s", __PRETTY_FUNCTION__);
-  BLIPConnection *conn = [[BLIPConnection alloc] initToNetService:service];
-  [[self openConnections] addObject:conn];
-  [conn setDelegate:self];
-  [conn open];
-  [conn release], conn = nil;
+  [self openConnectionToService:service];
 }
 
 - (BOOL)switchStore:(NSPersistentStore *)persistentStore withReplacement:(NSDictionary *)replacement error:(NSError **)error
@@ -466,35 +794,37 @@
 {
   DLog(@"%s", __PRETTY_FUNCTION__);
   [[self persistentStoreCoordinator] lock];
+  [[ZSyncTrace sharedTrace] beginSpan:zsSpanSwap detail:nil sync:[self syncGUID]];
+  [[self memoryProfile] markPhase:zsSpanSwap];
 
   // First we need to verify that we received every file.  Otherwise we fail
   for (NSPersistentStore *store in [[self persistentStoreCoordinator] persistentStores]) {
     if ([[self receivedFileLookupDictionary] objectForKey:[store identifier]]) {
       continue;
     }
+    if ([[self appliedStoreIdentifiers] containsObject:[store identifier]]) {
+      continue;
+    }
 
     DLog(@"Store ID: %@\n%@", [store identifier], [[self receivedFileLookupDictionary] allKeys]);
     // Fail
     if ([[self delegate] respondsToSelector:@selector(zSync:errorOccurred:)]) {
-      // Flush the temp files
-      for (NSDictionary *fileDict in [[self receivedFileLookupDictionary] allValues]) {
-        NSError *error = nil;
-        [[NSFileManager defaultManager] removeItemAtPath:[fileDict valueForKey:zsTempFilePath] error:&error];
-
-        // We want to explode on this failure in dev but in prod just note it
-        ZAssert(error == nil, @"Error deleting temp file: %@", [error localizedDescription]);
-      }
+      [self discardReceivedFiles];
       NSDictionary *userInfo = [NSDictionary dictionaryWithObject:[store identifier] forKey:zsStoreIdentifier];
       NSError *error = [NSError errorWithDomain:zsErrorDomain code:zsErrorFailedToReceiveAllFiles userInfo:userInfo];
       [[self delegate] zSync:self errorOccurred:error];
-      [self setReceivedFileLookupDictionary:nil];
     }
+    [self setAppliedStoreIdentifiers:nil];
     [[self persistentStoreCoordinator] unlock];
     return;
   }
 
   // We have all of the files now we need to swap them out.
   for (NSPersistentStore *persistentStore in [[self persistentStoreCoordinator] persistentStores]) {
+    if ([[self appliedStoreIdentifiers] containsObject:[persistentStore identifier]]) {
+      continue;
+    }
+
     NSDictionary *replacement = [[self receivedFileLookupDictionary] valueForKey:[persistentStore identifier]];
 
     ZAssert(replacement != nil, @"Missing the replacement file for %@\n%@", [persistentStore identifier], [[self receivedFileLookupDictionary] allKeys]);
@@ -510,10 +840,12 @@
   }
 
   [self setReceivedFileLookupDictionary:nil];
+  [self setAppliedStoreIdentifiers:nil];
+  [[ZSyncTrace sharedTrace] endSpan:zsSpanSwap detail:nil sync:[self syncGUID]];
 
-  [conn setDelegate:nil];
-  [conn close];
-  [[self openConnections] removeObject:conn];
+  [self finishActionUsingConnection:conn];
+  [self deliverProgress];
+  [self reportMemoryProfile];
 
   if ([[self delegate] respondsToSelector:@selector(zSyncFinished:)]) {
     [[self delegate] zSyncFinished:self];
@@ -521,6 +853,7 @@
 
   [[self persistentStoreCoordinator] unlock];
 
+  [self syncActivityEndedWithSuccess:YES];
   [self setServerAction:ZSyncServerActionNoActivity];
 }
 
@@ -533,9 +866,110 @@
 {
   DLog(@"%s", __PRETTY_FUNCTION__);
 
+  [[self latencyHistory] setNetwork:[ZSyncLatencyHistory currentNetworkIdentifier]];
+  browseStartTime = CFAbsoluteTimeGetCurrent();
+  browseSampled = NO;
+  [self enterDiscoveryState:ZSyncDiscoveryStateBrowsing];
+  [[ZSyncTrace sharedTrace] beginSpan:zsSpanDiscovery detail:nil sync:[self syncGUID]];
   [[self serviceBrowser] start];
 }
 
+- (void)enterDiscoveryState:(ZSyncDiscoveryState)state
+{
+  ZAssert([NSThread isMainThread], @"Discovery state changed off the main thread");
+  if (state == discoveryState) return;
+
+  DLog(@"%s %i -> %i", __PRETTY_FUNCTION__, discoveryState, state);
+  discoveryState = state;
+
+  if (state == ZSyncDiscoveryStateMatched || state == ZSyncDiscoveryStateIdle) {
+    [[ZSyncTrace sharedTrace] endSpan:zsSpanDiscovery detail:nil sync:[self syncGUID]];
+  }
+}
+
+/* Runs on a later pass of the run loop than the resolve that matched so the
+ * resolver has finished with its own state before the action starts.
+ */
+- (void)connectToMatchedService:(NSNetService *)service
+{
+  if (discoveryState != ZSyncDiscoveryStateMatched || ![service isEqual:[self registeredService]]) {
+    DLog(@"%s match was superseded", __PRETTY_FUNCTION__);
+    return;
+  }
+
+  [self enterDiscoveryState:ZSyncDiscoveryStateConnecting];
+  [self handleServerActionWithService:service];
+}
+
+/* Delegate calls out of discovery are deferred and coalesced so that slow
+ * code in the app cannot hold up the resolution of other services.
+ */
+- (void)scheduleNoServerPairedNotification
+{
+  [NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(notifyNoServerPaired) object:nil];
+  [self performSelector:@selector(notifyNoServerPaired) withObject:nil afterDelay:0.0];
+}
+
+- (void)notifyNoServerPaired
+{
+  [[self delegate] zSyncNoServerPaired:[[self availableServers] sortedArrayUsingSelector:@selector(compareLoad:)]];
+}
+
+- (void)notifyServerUnavailable
+{
+  // A later resolve may have found the server in the meantime
+  if (discoveryState != ZSyncDiscoveryStateIdle || [self registeredService]) return;
+
+  if ([self serverAction] == ZSyncServerActionSync) {
+    [self syncActivityEndedWithSuccess:NO];
+  }
+  [self setServerAction:ZSyncServerActionNoActivity];
+  if ([[self delegate] respondsToSelector:@selector(zSyncServerUnavailable:)]) {
+    [[self delegate] zSyncServerUnavailable:self];
+  }
+}
+
+/* Covers finding and resolving the paired server.  Both parts are learned
+ * from earlier searches on the same network.
+ */
+- (void)startNetworkTimer
+{
+  NSTimeInterval browseTimeout = [[self latencyHistory] timeoutForPhase:zsDiscoveryPhaseBrowse defaultTimeout:kDefaultBrowseTimeout];
+  NSTimeInterval interval = browseTimeout + [self resolveTimeout];
+  DLog(@"%s giving up in %.1f seconds", __PRETTY_FUNCTION__, interval);
+
+  [networkTimer invalidate];
+  networkTimer = [NSTimer scheduledTimerWithTimeInterval:interval
+                          target:self
+                          selector:@selector(networkTimeout:)
+                          userInfo:nil
+                           repeats:NO];
+}
+
+- (NSTimeInterval)resolveTimeout
+{
+  return [[self latencyHistory] timeoutForPhase:zsDiscoveryPhaseResolve defaultTimeout:kDefaultResolveTimeout];
+}
+
+- (NSTimeInterval)connectTimeoutWithDefault:(NSTimeInterval)defaultTimeout
+{
+  return [[self latencyHistory] timeoutForPhase:zsDiscoveryPhaseConnect defaultTimeout:defaultTimeout];
+}
+
+/* A timed out attempt is recorded at the time it was given, otherwise only
+ * the attempts that beat the timeout are sampled and it can never grow.
+ */
+- (void)reportTimeoutInPhase:(NSString *)phase afterInterval:(NSTimeInterval)interval
+{
+  DLog(@"%s %@ timed out after %.1f seconds", __PRETTY_FUNCTION__, phase, interval);
+  [[self latencyHistory] recordLatency:interval forPhase:phase];
+  [[self latencyHistory] save];
+
+  if ([[self delegate] respondsToSelector:@selector(zSync:timedOutDuringPhase:afterInterval:)]) {
+    [[self delegate] zSync:self timedOutDuringPhase:phase afterInterval:interval];
+  }
+}
+
 - (void)sendUploadComplete
 {
   DLog(@"%s", __PRETTY_FUNCTION__);
@@ -549,9 +983,15 @@
   [self setServiceBrowser:nil];
 
   [[self delegate] zSyncStarted:self];
+  // Anything applied by an interrupted sync has been replaced on disk already
+  [self setAppliedStoreIdentifiers:nil];
 
   NSAssert([self persistentStoreCoordinator] != nil, @"The persistent store coordinator was nil. Make sure you are calling registerDelegate:withPersistentStoreCoordinator: before trying to sync.");
 
+  ZSyncMessageScheduler *scheduler = [self schedulerForConnection:conn];
+  [[self memoryProfile] markPhase:zsSpanStoreUpload];
+  [[self progress] reset];
+
   for (NSPersistentStore *persistentStore in [[self persistentStoreCoordinator] persistentStores]) {
     NSData *persistentStoreData = [[NSData alloc] initWithContentsOfMappedFile:[[persistentStore URL] path]];
     DLog(@"url %@\nIdentifier: %@\nSize: %i", [persistentStore URL], [persistentStore identifier], [persistentStoreData length]);
@@ -570,10 +1010,10 @@
     [requestPropertiesDictionary setValue:[persistentStore type] forKey:zsStoreType];
     [requestPropertiesDictionary setValue:zsActID(zsActionStoreUpload) forKey:zsAction];
 
-    BLIPRequest *request = [BLIPRequest requestWithBody:persistentStoreData properties:requestPropertiesDictionary];
     // TODO: Compression is not working.  Need to find out why
-    [request setCompressed:YES];
-    [conn sendRequest:request];
+    [[ZSyncTrace sharedTrace] beginSpan:zsSpanStoreUpload detail:[persistentStore identifier] sync:[self syncGUID]];
+    [[self progress] setLength:[persistentStoreData length] ofUploadForStore:[persistentStore identifier]];
+    [scheduler sendStoreData:persistentStoreData properties:requestPropertiesDictionary compressed:YES];
 
     [persistentStoreData release], persistentStoreData = nil;
     [requestPropertiesDictionary release], requestPropertiesDictionary = nil;
@@ -581,6 +1021,7 @@
 
     [[self storeFileIdentifiers] addObject:[persistentStore identifier]];
   }
+  [self noteProgress];
   DLog(@"finished");
 }
 
@@ -597,8 +1038,8 @@
   [requestPropertiesDictionary setValue:[self schemaID] forKey:zsSchemaIdentifier];
 
   NSData *data = [[self passcode] dataUsingEncoding:NSUTF8StringEncoding];
-  BLIPRequest *request = [conn requestWithBody:data properties:requestPropertiesDictionary];
-  [request send];
+  BLIPRequest *request = [BLIPRequest requestWithBody:data properties:requestPropertiesDictionary];
+  [[self schedulerForConnection:conn] sendRequest:request priority:ZSyncMessagePriorityControl];
 
   [requestPropertiesDictionary release], requestPropertiesDictionary = nil;
 
@@ -630,7 +1071,7 @@
   NSData *body = [[self syncGUID] dataUsingEncoding:NSUTF8StringEncoding];
 
   BLIPRequest *request = [BLIPRequest requestWithBody:body properties:requestPropertiesDictionary];
-  [conn sendRequest:request];
+  [[self schedulerForConnection:conn] sendRequest:request priority:ZSyncMessagePriorityControl];
 }
 
 - (void)requestLatentDeregistrationUsingConnection:(BLIPConnection *)conn
@@ -643,7 +1084,7 @@
   NSData *body = [[self syncGUID] dataUsingEncoding:NSUTF8StringEncoding];
 
   BLIPRequest *request = [BLIPRequest requestWithBody:body properties:dictionary];
-  [conn sendRequest:request];
+  [[self schedulerForConnection:conn] sendRequest:request priority:ZSyncMessagePriorityControl];
 }
 
 - (NSString *)syncGUID
@@ -685,9 +1126,7 @@
   [deregisteredServers release], deregisteredServers = nil;
 
   [self setServerAction:ZSyncServerActionNoActivity];
-  [conn setDelegate:nil];
-  [conn close];
-  [[self openConnections] removeObject:conn];
+  [self closeConnection:conn];
 }
 
 - (void)processDeregisterResponse:(BLIPResponse *)response fromConnection:(BLIPConnection *)conn
@@ -699,9 +1138,7 @@
   }
 
   [self setServerAction:ZSyncServerActionNoActivity];
-  [conn setDelegate:nil];
-  [conn close];
-  [[self openConnections] removeObject:conn];
+  [self closeConnection:conn];
 
   [self setRegisteredService:nil];
 }
@@ -711,11 +1148,14 @@
   DLog(@"%s", __PRETTY_FUNCTION__);
 
   ZAssert([self storeFileIdentifiers] != nil, @"zsActionFileReceived with a nil storeFileIdentifiers");
+  [[ZSyncTrace sharedTrace] endSpan:zsSpanStoreUpload detail:[[response properties] valueOfProperty:zsStoreIdentifier] sync:[self syncGUID]];
 
   [[self storeFileIdentifiers] removeObject:[[response properties] valueOfProperty:zsStoreIdentifier]];
+  [[self memoryProfile] sample];
 
   if ([[self storeFileIdentifiers] count] == 0) {
     DLog(@"sending upload complete");
+    [[self memoryProfile] markPhase:zsSpanMerge];
 
     NSMutableDictionary *requestPropertiesDictionary = [[NSMutableDictionary alloc] init];
     [requestPropertiesDictionary setValue:zsActID(zsActionPerformSync) forKey:zsAction];
@@ -723,7 +1163,7 @@
 
     BLIPRequest *request = [BLIPRequest requestWithBody:nil properties:requestPropertiesDictionary];
     [request setNoReply:YES];
-    [conn sendRequest:request];
+    [[self schedulerForConnection:conn] sendRequest:request priority:ZSyncMessagePriorityControl];
 
     [requestPropertiesDictionary release], requestPropertiesDictionary = nil;
 
@@ -734,6 +1174,13 @@
 - (void)processSchemaUnsupportedResponse:(BLIPResponse *)response fromConnection:(BLIPConnection *)conn
 {
   DLog(@"%s", __PRETTY_FUNCTION__);
+  [[ZSyncTrace sharedTrace] endSpan:zsSpanVerifySchema detail:[NSString stringWithFormat:@"%p", conn] sync:[self syncGUID]];
+
+  if (racingDiscovery && [self isDirectConnection:conn]) {
+    // A cached address may now belong to another server, let Bonjour decide
+    [self closeConnection:conn];
+    return;
+  }
 
   if ([[self delegate] respondsToSelector:@selector(zSync:serverVersionUnsupported:)]) {
     NSDictionary *userInfo = [NSDictionary dictionaryWithObject:[response bodyString] forKey:NSLocalizedDescriptionKey];
@@ -742,18 +1189,65 @@
     [[self delegate] zSync:self serverVersionUnsupported:error];
   }
 
+  if (conn == optimisticConnection) {
+    DLog(@"optimistic upload rejected");
+    [self setStoreFileIdentifiers:nil];
+  }
+  [self rememberSchemaAccepted:NO];
+
+  [self rememberSchemaRejectedByServer:[response valueOfProperty:zsServerUUID] schemaSet:[response valueOfProperty:zsSchemaSet]];
+
+  [self syncActivityEndedWithSuccess:NO];
   [self setServerAction:ZSyncServerActionNoActivity];
-  [conn setDelegate:nil];
-  [conn close];
-  [[self openConnections] removeObject:conn];
+  [self closeConnection:conn];
   [self setRegisteredService:nil];
 }
 
 - (void)processSchemaSupportedResponse:(BLIPResponse *)response fromConnection:(BLIPConnection *)conn
+{
+  DLog(@"%s", __PRETTY_FUNCTION__);
+  [[ZSyncTrace sharedTrace] endSpan:zsSpanVerifySchema detail:[NSString stringWithFormat:@"%p", conn] sync:[self syncGUID]];
+
+  if ([self isDirectConnection:conn]) {
+    NSString *serverUUID = [[response properties] valueOfProperty:zsServerUUID];
+    if (![serverUUID isEqualToString:[[NSUserDefaults standardUserDefaults] valueForKey:zsServerUUID]]) {
+      DLog(@"cached address %@ now belongs to %@", [conn address], serverUUID);
+      [self closeConnection:conn];
+      return;
+    }
+  }
+
+  if (racingDiscovery) {
+    [self finishDiscoveryRaceWithWinner:conn];
+  }
+  [self rememberServerAddress:[conn address]];
+
+  if ([self serverAction] != ZSyncServerActionLatentDeregistration) {
+    [self adoptSessionConnection:conn];
+    [self rememberSchemaAccepted:YES];
+  }
+
+  if (conn == optimisticConnection) {
+    // The upload went out right behind the verification
+    optimisticConnection = nil;
+    return;
+  }
+
+  [self performServerActionUsingConnection:conn];
+}
+
+- (void)performServerActionUsingConnection:(BLIPConnection *)conn
 {
   DLog(@"%s", __PRETTY_FUNCTION__);
 
+  if ([self serverAction] != ZSyncServerActionNoActivity) {
+    actionConnection = conn;
+  }
+
   switch ([self serverAction]) {
+    case ZSyncServerActionNoActivity:
+      DLog(@"session established");
+      break;
     case ZSyncServerActionSync:
       if ([[NSUserDefaults standardUserDefaults] valueForKey:zsServerUUID]) {
         // Start a sync by pushing the data file to the server
@@ -782,89 +1276,850 @@
    * The pairing code was not entered correctly so we reset back to a default state
    * so that the user can start all over again.
    */
+  [self closeConnection:conn];
+
+  if ([[self delegate] respondsToSelector:@selector(zSyncPairingCodeRejected:)]) {
+    [[self delegate] zSyncPairingCodeRejected:self];
+  }
+
+  [self setServerAction:ZSyncServerActionNoActivity];
+  [[NSUserDefaults standardUserDefaults] removeObjectForKey:zsServerUUID];
+  [[NSUserDefaults standardUserDefaults] removeObjectForKey:zsServerName];
+}
+
+- (void)processAuthenticatePairingRequest:(BLIPRequest *)request fromConnection:(BLIPConnection *)conn
+{
+  DLog(@"%s", __PRETTY_FUNCTION__);
+
+  if ([[request bodyString] isEqualToString:[self passcode]]) {
+    [[NSUserDefaults standardUserDefaults] setValue:[request valueOfProperty:zsServerUUID] forKey:zsServerUUID];
+    [self performSelector:@selector(uploadDataToServerUsingConnection:) withObject:conn afterDelay:0.1];
+  }
+
+  [[self delegate] zSyncPairingCodeCompleted:self];
+}
+
+- (void)processCompleteSyncRequest:(BLIPRequest *)request fromConnection:(BLIPConnection *)conn
+{
+  DLog(@"%s", __PRETTY_FUNCTION__);
+
+  NSString *changeCount = [request valueOfProperty:zsChangeCount];
+  if (changeCount) {
+    [[NSUserDefaults standardUserDefaults] setInteger:[changeCount integerValue] forKey:zsSyncedChangeCountKey];
+    serverChangeCount = MAX(serverChangeCount, [changeCount integerValue]);
+  }
+
+  [self performSelector:@selector(completeSyncFromConnection:) withObject:conn afterDelay:0.01];
+}
+
+- (void)processStoreUploadRequest:(BLIPRequest *)request fromConnection:(BLIPConnection *)conn
+{
+  DLog(@"%s", __PRETTY_FUNCTION__);
+  ZAssert([request complete], @"Message is incomplete");
+
+  DLog(@"request length: %i", [[request body] length]);
+  NSString *storeIdentifier = [request valueOfProperty:zsStoreIdentifier];
+  if ([[request valueOfProperty:zsChunkIndex] integerValue] == 0) {
+    [[ZSyncTrace sharedTrace] beginSpan:zsSpanStoreDownload detail:storeIdentifier sync:[self syncGUID]];
+    [[self memoryProfile] markPhase:zsSpanStoreDownload];
+  }
+
+  // Daemons that predate zsChunkTotalLength only allow an estimate
+  NSString *totalLength = [request valueOfProperty:zsChunkTotalLength];
+  if (totalLength) {
+    [[self progress] setLength:[totalLength longLongValue] ofDownloadForStore:storeIdentifier];
+  } else if ([[request valueOfProperty:zsChunkIndex] integerValue] == 0) {
+    unsigned long long estimate = (unsigned long long)MAX([[request valueOfProperty:zsChunkCount] integerValue], 1) * [[request body] length];
+    [[self progress] setLength:estimate ofDownloadForStore:storeIdentifier];
+  }
+  [[self progress] addBytes:[[request body] length] toDownloadForStore:storeIdentifier];
+  [self noteProgress];
+
+  NSError *error = nil;
+  NSString *tempPath = [[self storeAssembler] addChunkFromRequest:request error:&error];
+  if (error) {
+    DLog(@"%s store download failed: %@", __PRETTY_FUNCTION__, [error localizedDescription]);
+    int errorCode = ([error code] == zsErrorInvalidChunk ? kBLIPError_BadRequest : kBLIPError_HandlerFailed);
+    [request respondWithErrorCode:errorCode message:[error localizedDescription]];
+    [self cancelSyncWithReason:zsCancelReasonTransferFailed];
+    [self syncActivityEndedWithSuccess:NO];
+    [self setServerAction:ZSyncServerActionNoActivity];
+    if ([[self delegate] respondsToSelector:@selector(zSync:errorOccurred:)]) {
+      [[self delegate] zSync:self errorOccurred:error];
+    }
+    return;
+  }
+  if (!tempPath) {
+    BLIPResponse *response = [request response];
+    [response setValue:zsActID(zsActionChunkReceived) ofProperty:zsAction];
+    [response setUrgent:YES];
+    [response send];
+    return;
+  }
+
+  DLog(@"file received");
+  DLog(@"file written to \n%@", tempPath);
+  [[ZSyncTrace sharedTrace] endSpan:zsSpanStoreDownload detail:storeIdentifier sync:[self syncGUID]];
+  [[self memoryProfile] sample];
+
+  NSMutableDictionary *fileDict = [[NSMutableDictionary alloc] init];
+  [fileDict setValue:[request valueOfProperty:zsStoreIdentifier] forKey:zsStoreIdentifier];
+  if (![[request valueOfProperty:zsStoreConfiguration] isEqualToString:@"PF_DEFAULT_CONFIGURATION_NAME"]) {
+    [fileDict setValue:[request valueOfProperty:zsStoreConfiguration] forKey:zsStoreConfiguration];
+  }
+  [fileDict setValue:[request valueOfProperty:zsStoreType] forKey:zsStoreType];
+  [fileDict setValue:tempPath forKey:zsTempFilePath];
+
+  [[self receivedFileLookupDictionary] setValue:fileDict forKey:[request valueOfProperty:zsStoreIdentifier]];
+  [fileDict release], fileDict = nil;
+
+  BLIPResponse *response = [request response];
+  [response setValue:zsActID(zsActionFileReceived) ofProperty:zsAction];
+  [response setValue:[request valueOfProperty:zsStoreIdentifier] ofProperty:zsStoreIdentifier];
+  [response setUrgent:YES];
+  [response send];
+
+  if ([[request valueOfProperty:zsStorePriority] integerValue] > 0) {
+    [self applyPriorityStore:[request valueOfProperty:zsStoreIdentifier]];
+  }
+}
+
+/* The server has already merged the store by the time it is sent back, so a
+ * high priority store can be switched in without waiting for the bulk stores
+ * queued behind it.
+ */
+- (void)applyPriorityStore:(NSString *)storeIdentifier
+{
+  DLog(@"%s %@", __PRETTY_FUNCTION__, storeIdentifier);
+  [[self persistentStoreCoordinator] lock];
+
+  NSPersistentStore *persistentStore = nil;
+  for (NSPersistentStore *store in [[self persistentStoreCoordinator] persistentStores]) {
+    if ([[store identifier] isEqualToString:storeIdentifier]) {
+      persistentStore = store;
+      break;
+    }
+  }
+
+  NSDictionary *replacement = [[[[self receivedFileLookupDictionary] valueForKey:storeIdentifier] retain] autorelease];
+  if (!persistentStore || !replacement) {
+    DLog(@"%s no store to switch for %@", __PRETTY_FUNCTION__, storeIdentifier);
+    [[self persistentStoreCoordinator] unlock];
+    return;
+  }
+
+  NSError *error = nil;
+  [[ZSyncTrace sharedTrace] beginSpan:zsSpanSwap detail:storeIdentifier sync:[self syncGUID]];
+  if (![self switchStore:persistentStore withReplacement:replacement error:&error]) {
+    // Left in place for completeSyncFromConnection: to try again
+    ZAssert(error == nil, @"Error switching priority store: %@\n%@", [error localizedDescription], [error userInfo]);
+    [[self persistentStoreCoordinator] unlock];
+    return;
+  }
+
+  [[ZSyncTrace sharedTrace] endSpan:zsSpanSwap detail:storeIdentifier sync:[self syncGUID]];
+  [[self receivedFileLookupDictionary] removeObjectForKey:storeIdentifier];
+  [[self appliedStoreIdentifiers] addObject:storeIdentifier];
+  [[self persistentStoreCoordinator] unlock];
+
+  if ([[self delegate] respondsToSelector:@selector(zSyncPriorityDataAvailable:)]) {
+    [[self delegate] zSyncPriorityDataAvailable:self];
+  }
+}
+
+- (void)processCancelPairingRequest:(BLIPRequest *)request fromConnection:(BLIPConnection *)conn
+{
+  DLog(@"%s zsActionCancelPairing", __PRETTY_FUNCTION__);
+  [self closeConnection:conn];
+  //  [self setConnection:nil];
+  if ([[self delegate] respondsToSelector:@selector(zSyncPairingCodeCancelled:)]) {
+    [[self delegate] zSyncPairingCodeCancelled:self];
+  }
+
+  [self setServerAction:ZSyncServerActionNoActivity];
+  [[NSUserDefaults standardUserDefaults] removeObjectForKey:zsServerUUID];
+  [[NSUserDefaults standardUserDefaults] removeObjectForKey:zsServerName];
+
+  [self setRegisteredService:nil];
+}
+
+- (ZSyncMessageScheduler *)schedulerForConnection:(BLIPConnection *)conn
+{
+  NSValue *key = [NSValue valueWithNonretainedObject:conn];
+  ZSyncMessageScheduler *scheduler = [[self messageSchedulers] objectForKey:key];
+  if (!scheduler) {
+    scheduler = [[ZSyncMessageScheduler alloc] initWithConnection:conn];
+    [scheduler setDelegate:self];
+    if ([self captureDirectory]) {
+      [scheduler setRecorder:[ZSyncSessionRecorder recorderInDirectory:[self captureDirectory] role:zsCaptureRoleDevice]];
+    }
+    [[self messageSchedulers] setObject:scheduler forKey:key];
+    [scheduler release];
+  }
+
+  return scheduler;
+}
+
+- (void)forgetConnection:(BLIPConnection *)conn
+{
+  NSValue *key = [NSValue valueWithNonretainedObject:conn];
+  [[[self messageSchedulers] objectForKey:key] cancelAllMessages];
+  [[self messageSchedulers] removeObjectForKey:key];
+  [[self connectTimings] removeObjectForKey:key];
+  [[self directConnections] removeObject:key];
+
+  if (conn == pendingSessionConnection) {
+    pendingSessionConnection = nil;
+  }
+
+  if (conn == optimisticConnection) {
+    optimisticConnection = nil;
+  }
+
+  if (conn == actionConnection) {
+    actionConnection = nil;
+  }
+
+  if (conn == [self sessionConnection]) {
+    [heartbeatTimer invalidate], heartbeatTimer = nil;
+    heartbeatOutstanding = NO;
+    missedHeartbeats = 0;
+    [self setSessionConnection:nil];
+  }
+
+  [[self openConnections] removeObject:conn];
+}
+
+- (void)closeConnection:(BLIPConnection *)conn
+{
+  [[conn retain] autorelease];
   [conn setDelegate:nil];
   [conn close];
-  [[self openConnections] removeObject:conn];
+  [self forgetConnection:conn];
+}
+
+/* Unlike closeConnection: this does not wait for the frames BLIP has already
+ * queued.  The server is told why and the socket is dropped once the cancel
+ * has had a moment to get out.
+ */
+- (void)abortConnection:(BLIPConnection *)conn reason:(ZSCancelReason)reason
+{
+  DLog(@"%s %p reason %i", __PRETTY_FUNCTION__, conn, reason);
+  [[conn retain] autorelease];
+
+  ZSyncMessageScheduler *scheduler = [self schedulerForConnection:conn];
+  [scheduler cancelAllMessages];
+
+  if ([conn status] == kTCP_Open) {
+    NSMutableDictionary *requestPropertiesDictionary = [NSMutableDictionary dictionary];
+    [requestPropertiesDictionary setValue:zsActID(zsActionCancelSync) forKey:zsAction];
+    [requestPropertiesDictionary setValue:zsActID(reason) forKey:zsCancelReason];
+    [requestPropertiesDictionary setValue:[self schemaID] forKey:zsSchemaIdentifier];
+    [requestPropertiesDictionary setValue:[self syncGUID] forKey:zsSyncGUID];
+
+    BLIPRequest *request = [BLIPRequest requestWithBody:nil properties:requestPropertiesDictionary];
+    [request setNoReply:YES];
+    [scheduler sendRequest:request priority:ZSyncMessagePriorityControl];
+  }
+
+  [conn setDelegate:nil];
+  [conn closeWithTimeout:kCancelCloseTimeout];
+  [self forgetConnection:conn];
+}
+
+- (void)cancelSyncWithReason:(ZSCancelReason)reason
+{
+  DLog(@"%s", __PRETTY_FUNCTION__);
+  for (BLIPConnection *conn in [self openConnections]) {
+    [NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(uploadDataToServerUsingConnection:) object:conn];
+    [NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(completeSyncFromConnection:) object:conn];
+  }
+
+  // Idle connections and the ones still racing have nothing to cancel
+  if (actionConnection) {
+    BOOL sessionAborted = (actionConnection == [self sessionConnection]);
+    [self abortConnection:actionConnection reason:reason];
+    if (sessionAborted && !suspended) {
+      reconnectAttempts = 0;
+      [self scheduleReconnect];
+    }
+  }
+
+  [[self storeAssembler] discardAllAssemblies];
+  [self discardReceivedFiles];
+  [self setStoreFileIdentifiers:nil];
+  [[self progress] reset];
+}
+
+/* Deletes the stores received in this sync that have not been switched in */
+- (void)discardReceivedFiles
+{
+  for (NSDictionary *fileDict in [[self receivedFileLookupDictionary] allValues]) {
+    NSError *error = nil;
+    [[NSFileManager defaultManager] removeItemAtPath:[fileDict valueForKey:zsTempFilePath] error:&error];
+
+    // We want to explode on this failure in dev but in prod just note it
+    ZAssert(error == nil, @"Error deleting temp file: %@", [error localizedDescription]);
+  }
+
+  [self setReceivedFileLookupDictionary:nil];
+}
+
+/* Connections that carry the session stay open for the next action,
+ * anything else was opened for a single action and is closed.
+ */
+- (void)finishActionUsingConnection:(BLIPConnection *)conn
+{
+  if (conn == actionConnection) {
+    actionConnection = nil;
+  }
+
+  if (conn == [self sessionConnection]) {
+    return;
+  }
+
+  [self closeConnection:conn];
+}
+
+- (void)adoptSessionConnection:(BLIPConnection *)conn
+{
+  if (conn == pendingSessionConnection) {
+    pendingSessionConnection = nil;
+  }
+
+  if (conn == [self sessionConnection]) {
+    return;
+  }
+
+  if ([self sessionConnection]) {
+    [self closeConnection:[self sessionConnection]];
+  }
+
+  DLog(@"%s", __PRETTY_FUNCTION__);
+  [self setSessionConnection:conn];
+  reconnectAttempts = 0;
+  heartbeatOutstanding = NO;
+  missedHeartbeats = 0;
+
+  [heartbeatTimer invalidate];
+  heartbeatTimer = [NSTimer scheduledTimerWithTimeInterval:zsHeartbeatInterval
+                            target:self
+                            selector:@selector(heartbeatTimerFired:)
+                            userInfo:nil
+                             repeats:YES];
+}
+
+- (void)scheduleAutomaticSyncAfterDelay:(NSTimeInterval)delay
+{
+  DLog(@"%s syncing in %.1f seconds", __PRETTY_FUNCTION__, delay);
+  [automaticSyncTimer invalidate];
+  automaticSyncTimer = [NSTimer scheduledTimerWithTimeInterval:delay
+                                target:self
+                                selector:@selector(automaticSyncTimerFired:)
+                                userInfo:nil
+                                 repeats:NO];
+}
+
+/* Called from the paths that complete or fail a sync, before the action is
+ * reset.  Stopping a sync and the other actions do not come through here.
+ */
+- (void)syncActivityEndedWithSuccess:(BOOL)succeeded
+{
+  if (succeeded) {
+    automaticSyncFailures = 0;
+  } else if (automaticSyncRunning && [self isAutomaticSyncEnabled]) {
+    // The changes did not make it to the server
+    localChangesPending = YES;
+    ++automaticSyncFailures;
+  }
+  automaticSyncRunning = NO;
+
+  if (syncQueued) {
+    [self scheduleAutomaticSyncAfterDelay:kQueuedSyncDelay];
+  } else if ([self isAutomaticSyncEnabled] && (localChangesPending || [self serverHasNewerData])) {
+    NSTimeInterval delay = [self automaticSyncQuietPeriod];
+    if (automaticSyncFailures) {
+      delay = MIN(delay * pow(2.0, automaticSyncFailures), kMaximumAutomaticSyncBackoff);
+    }
+    [self scheduleAutomaticSyncAfterDelay:delay];
+  }
+}
+
+- (BOOL)serverHasNewerData
+{
+  return (serverChangeCount > [[NSUserDefaults standardUserDefaults] integerForKey:zsSyncedChangeCountKey]);
+}
+
+/* Counters come from the TXT record of the paired server and from pushes on
+ * the session, whichever arrives first.
+ */
+- (void)noteServerChangeCount:(NSInteger)changeCount
+{
+  if (changeCount <= serverChangeCount) {
+    return;
+  }
+
+  DLog(@"%s server is at %i", __PRETTY_FUNCTION__, changeCount);
+  serverChangeCount = changeCount;
+
+  // A running action checks again when it ends
+  if (![self serverHasNewerData] || [self serverAction] != ZSyncServerActionNoActivity) {
+    return;
+  }
+
+  if ([self isAutomaticSyncEnabled]) {
+    [self scheduleAutomaticSyncAfterDelay:kQueuedSyncDelay];
+  } else if ([[self delegate] respondsToSelector:@selector(zSyncServerDataChanged:)]) {
+    [[self delegate] zSyncServerDataChanged:self];
+  }
+}
+
+- (void)noteTXTRecordData:(NSData *)data
+{
+  if (!data) {
+    return;
+  }
+
+  NSDictionary *txtRecordDictionary = [NSNetService dictionaryFromTXTRecordData:data];
+  NSData *changeCountData = [txtRecordDictionary objectForKey:zsChangeCountTXTKey([[self schemaID] lowercaseString])];
+  if (!changeCountData) {
+    return;
+  }
+
+  NSString *changeCountString = [[NSString alloc] initWithData:changeCountData encoding:NSUTF8StringEncoding];
+  [self noteServerChangeCount:[changeCountString integerValue]];
+  [changeCountString release], changeCountString = nil;
+}
+
+- (void)watchReachabilityForAutomaticSync
+{
+  if (automaticSyncReachability) {
+    return;
+  }
+
+  automaticSyncReachability = [[Reachability reachabilityForLocalWiFi] retain];
+  [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(automaticSyncReachabilityChanged:) name:kReachabilityChangedNotification object:automaticSyncReachability];
+  [automaticSyncReachability startNotifer];
+}
+
+- (void)scheduleReconnect
+{
+  if (suspended || ![self registeredService] || ![[NSUserDefaults standardUserDefaults] valueForKey:zsServerUUID]) {
+    return;
+  }
+
+  if (reconnectAttempts >= kMaximumReconnectAttempts) {
+    DLog(@"giving up on the session after %i attempts", reconnectAttempts);
+    [self setRegisteredService:nil];
+    return;
+  }
+
+  NSTimeInterval delay = MIN(pow(2.0, reconnectAttempts), kMaximumReconnectDelay);
+  ++reconnectAttempts;
+
+  DLog(@"reconnecting in %.0f seconds", delay);
+  [reconnectTimer invalidate];
+  reconnectTimer = [NSTimer scheduledTimerWithTimeInterval:delay
+                            target:self
+                            selector:@selector(reconnectTimerFired:)
+                            userInfo:nil
+                             repeats:NO];
+}
+
+- (void)noteConnectEvent:(NSString *)event forConnection:(BLIPConnection *)conn
+{
+  NSValue *key = [NSValue valueWithNonretainedObject:conn];
+  NSMutableDictionary *timings = [[self connectTimings] objectForKey:key];
+  if (!timings) {
+    timings = [NSMutableDictionary dictionary];
+    [[self connectTimings] setObject:timings forKey:key];
+  }
+
+  [timings setValue:[NSNumber numberWithDouble:CFAbsoluteTimeGetCurrent()] forKey:event];
+
+  if ([event isEqualToString:@"start"]) {
+    [[ZSyncTrace sharedTrace] beginSpan:zsSpanConnect detail:[NSString stringWithFormat:@"%p", conn] sync:[self syncGUID]];
+  }
+}
+
+/* Splits the time from -open to the first response into the TCP, TLS and
+ * BLIP phases.  The peer is authorized after -connectionDidOpen:, so the
+ * TLS phase runs from open to authorization and BLIP from there on.
+ * Called for every response but only reports once per connection.
+ */
+- (void)reportConnectTimingsForConnection:(BLIPConnection *)conn
+{
+  NSValue *key = [NSValue valueWithNonretainedObject:conn];
+  NSDictionary *timings = [[[[self connectTimings] objectForKey:key] retain] autorelease];
+  if (!timings) {
+    return;
+  }
+  [[self connectTimings] removeObjectForKey:key];
+  [[ZSyncTrace sharedTrace] endSpan:zsSpanConnect detail:[NSString stringWithFormat:@"%p", conn] sync:[self syncGUID]];
+
+  CFAbsoluteTime start = [[timings valueForKey:@"start"] doubleValue];
+  CFAbsoluteTime opened = [[timings valueForKey:@"opened"] doubleValue];
+  NSNumber *authorized = [timings valueForKey:@"authorized"];
+  if (!start || !opened) {
+    return;
+  }
+
+  NSMutableDictionary *durations = [NSMutableDictionary dictionary];
+  [durations setValue:[NSNumber numberWithDouble:(opened - start)] forKey:zsConnectPhaseTCP];
+  CFAbsoluteTime blipStart = opened;
+  if (authorized && [authorized doubleValue] >= opened) {
+    blipStart = [authorized doubleValue];
+    [durations setValue:[NSNumber numberWithDouble:(blipStart - opened)] forKey:zsConnectPhaseTLS];
+    [durations setValue:[timings valueForKey:zsConnectPhaseTrustCached] forKey:zsConnectPhaseTrustCached];
+  }
+  [durations setValue:[NSNumber numberWithDouble:(CFAbsoluteTimeGetCurrent() - blipStart)] forKey:zsConnectPhaseBLIP];
+
+  [[self latencyHistory] recordLatency:(opened - start) forPhase:zsDiscoveryPhaseConnect];
+  [[self latencyHistory] save];
+
+  DLog(@"%s %@", __PRETTY_FUNCTION__, durations);
+  if ([[self delegate] respondsToSelector:@selector(zSync:connectedWithPhaseDurations:)]) {
+    [[self delegate] zSync:self connectedWithPhaseDurations:durations];
+  }
+}
+
+- (NSArray *)cachedServerAddresses
+{
+  NSData *data = [[NSUserDefaults standardUserDefaults] dataForKey:zsServerAddressesKey];
+  if (!data) {
+    return [NSArray array];
+  }
+
+  NSArray *addresses = [NSKeyedUnarchiver unarchiveObjectWithData:data];
+  if (![addresses isKindOfClass:[NSArray class]]) {
+    return [NSArray array];
+  }
+
+  return addresses;
+}
+
+/* The most recently successful addresses of the paired server, newest first */
+- (void)rememberServerAddress:(IPAddress *)address
+{
+  if (![address port]) {
+    return;
+  }
+
+  NSMutableArray *addresses = [NSMutableArray arrayWithArray:[self cachedServerAddresses]];
+  RecentAddress *recentAddress = nil;
+  for (RecentAddress *cachedAddress in addresses) {
+    if ([cachedAddress isEqual:address]) {
+      recentAddress = cachedAddress;
+      break;
+    }
+  }
+
+  if (!recentAddress) {
+    recentAddress = [[[RecentAddress alloc] initWithIPAddress:address] autorelease];
+    [addresses addObject:recentAddress];
+  }
+  [recentAddress noteSuccess];
+
+  NSSortDescriptor *sortDescriptor = [[NSSortDescriptor alloc] initWithKey:@"lastSuccess" ascending:NO];
+  [addresses sortUsingDescriptors:[NSArray arrayWithObject:sortDescriptor]];
+  [sortDescriptor release], sortDescriptor = nil;
+
+  while ([addresses count] > kMaximumCachedAddresses) {
+    [addresses removeLastObject];
+  }
+
+  [[NSUserDefaults standardUserDefaults] setObject:[NSKeyedArchiver archivedDataWithRootObject:addresses] forKey:zsServerAddressesKey];
+}
+
+/* Connects straight to the addresses the paired server was last reached at
+ * while Bonjour browses.  Whichever connection has its schema verified first
+ * is kept, see -finishDiscoveryRaceWithWinner:.  Returns NO if there was
+ * nothing to dial.
+ */
+- (BOOL)dialCachedServerAddresses
+{
+  NSArray *addresses = [self cachedServerAddresses];
+  for (RecentAddress *address in addresses) {
+    DLog(@"%s dialing %@", __PRETTY_FUNCTION__, address);
+    BLIPConnection *conn = [[BLIPConnection alloc] initToAddress:address];
+    [conn setOpenTimeout:MIN([self connectTimeoutWithDefault:kDirectConnectTimeout], kDirectConnectTimeout)];
+    [conn setDelegate:self];
+    if ([self sslIdentity]) {
+      [conn setPeerToPeerIdentity:[self sslIdentity]];
+    }
+
+    [[self openConnections] addObject:conn];
+    [[self directConnections] addObject:[NSValue valueWithNonretainedObject:conn]];
+    [self noteConnectEvent:@"start" forConnection:conn];
+    [conn open];
+    [conn release], conn = nil;
+  }
+
+  return ([addresses count] > 0);
+}
+
+- (BOOL)isDirectConnection:(BLIPConnection *)conn
+{
+  return [[self directConnections] containsObject:[NSValue valueWithNonretainedObject:conn]];
+}
+
+/* Everything else that was racing is cancelled: the other dialed addresses,
+ * a Bonjour connection that is still verifying and the browse itself.
+ */
+- (void)finishDiscoveryRaceWithWinner:(BLIPConnection *)conn
+{
+  DLog(@"%s %@ connection won", __PRETTY_FUNCTION__, ([self isDirectConnection:conn] ? @"direct" : @"Bonjour"));
+  racingDiscovery = NO;
+  [self enterDiscoveryState:ZSyncDiscoveryStateIdle];
+
+  for (BLIPConnection *loser in [[[self openConnections] copy] autorelease]) {
+    if (loser != conn && loser != [self sessionConnection]) {
+      [self closeConnection:loser];
+    }
+  }
+  [[self directConnections] removeAllObjects];
+
+  [networkTimer invalidate], networkTimer = nil;
+  [[self serviceBrowser] setDelegate:nil];
+  [[self serviceBrowser] stop];
+  for (NSNetService *service in [self discoveredServers]) {
+    [service setDelegate:nil];
+    [service stop];
+  }
+}
+
+- (NSString *)cacheKeyForService:(NSNetService *)service
+{
+  return [NSString stringWithFormat:@"%@.%@%@", [service name], [service type], [service domain]];
+}
+
+- (void)cacheTXTRecordData:(NSData *)data forService:(NSNetService *)service
+{
+  if (!data) {
+    return;
+  }
+
+  NSDictionary *entry = [NSDictionary dictionaryWithObjectsAndKeys:data, @"data", [NSDate date], @"date", nil];
+  [[self txtRecordCache] setObject:entry forKey:[self cacheKeyForService:service]];
+}
+
+/* A paired device only cares about one server.  A service whose recent TXT
+ * record names some other server does not need to be resolved again.
+ */
+- (BOOL)cachedTXTRecordRulesOutService:(NSNetService *)service
+{
+  NSString *registeredServerUUID = [[NSUserDefaults standardUserDefaults] valueForKey:zsServerUUID];
+  if (!registeredServerUUID) {
+    return NO;
+  }
+
+  NSDictionary *entry = [[self txtRecordCache] objectForKey:[self cacheKeyForService:service]];
+  if (!entry || [[entry valueForKey:@"date"] timeIntervalSinceNow] < -kTXTRecordCacheLifetime) {
+    return NO;
+  }
+
+  NSDictionary *txtRecordDictionary = [NSNetService dictionaryFromTXTRecordData:[entry valueForKey:@"data"]];
+  NSData *uuidData = [txtRecordDictionary objectForKey:zsServerUUID];
+  if (!uuidData) {
+    return NO;
+  }
+
+  NSString *uuid = [[[NSString alloc] initWithData:uuidData encoding:NSUTF8StringEncoding] autorelease];
+  if ([uuid hasPrefix:registeredServerUUID]) {
+    return NO;
+  }
+
+  NSArray *deregisteredServers = [[NSUserDefaults standardUserDefaults] objectForKey:zsDeregisteredServersKey];
+  return ![deregisteredServers containsObject:uuid];
+}
+
+- (NSString *)modelFingerprint
+{
+  return [[[self persistentStoreCoordinator] managedObjectModel] zsFingerprint];
+}
+
+- (NSString *)schemaSignature
+{
+  return [NSString stringWithFormat:@"%@:%i.%i:%@", [self schemaID], [self majorVersionNumber], [self minorVersionNumber], [self modelFingerprint]];
+}
+
+/* Whether the paired server accepted this schema and version the last time
+ * it was asked.  If so a sync can start uploading without waiting for the
+ * verification to come back.
+ */
+- (BOOL)schemaPreviouslyAccepted
+{
+  NSString *serverUUID = [[NSUserDefaults standardUserDefaults] valueForKey:zsServerUUID];
+  if (!serverUUID) {
+    return NO;
+  }
+
+  NSDictionary *acceptedSchemas = [[NSUserDefaults standardUserDefaults] dictionaryForKey:zsAcceptedSchemasKey];
+  return [[acceptedSchemas valueForKey:serverUUID] isEqualToString:[self schemaSignature]];
+}
+
+- (void)rememberSchemaAccepted:(BOOL)accepted
+{
+  NSString *serverUUID = [[NSUserDefaults standardUserDefaults] valueForKey:zsServerUUID];
+  if (!serverUUID) {
+    return;
+  }
+
+  NSMutableDictionary *acceptedSchemas = [[[NSUserDefaults standardUserDefaults] dictionaryForKey:zsAcceptedSchemasKey] mutableCopy];
+  if (!acceptedSchemas) {
+    acceptedSchemas = [[NSMutableDictionary alloc] init];
+  }
+
+  if (accepted) {
+    [acceptedSchemas setValue:[self schemaSignature] forKey:serverUUID];
+  } else {
+    [acceptedSchemas removeObjectForKey:serverUUID];
+  }
 
-  if ([[self delegate] respondsToSelector:@selector(zSyncPairingCodeRejected:)]) {
-    [[self delegate] zSyncPairingCodeRejected:self];
+  [[NSUserDefaults standardUserDefaults] setObject:acceptedSchemas forKey:zsAcceptedSchemasKey];
+  [acceptedSchemas release], acceptedSchemas = nil;
+}
+
+/* Whether connecting can get anywhere.  A server that turned this schema
+ * away is skipped until its set of plugins or our schema version changes.
+ */
+- (BOOL)server:(NSString *)serverUUID mayAcceptSchemaWithTXTRecord:(NSDictionary *)txtRecordDictionary
+{
+  NSString *protocolVersion = txtRecordString(txtRecordDictionary, zsTXTProtocolVersion);
+  if (protocolVersion && [protocolVersion integerValue] < zsMinimumProtocolVersionNumber) {
+    DLog(@"%s protocol version %@ is too old", __PRETTY_FUNCTION__, protocolVersion);
+    return NO;
   }
 
-  [self setServerAction:ZSyncServerActionNoActivity];
-  [[NSUserDefaults standardUserDefaults] removeObjectForKey:zsServerUUID];
-  [[NSUserDefaults standardUserDefaults] removeObjectForKey:zsServerName];
+  NSString *schemaSet = txtRecordString(txtRecordDictionary, zsTXTSchemaSet);
+  if (!schemaSet) {
+    return YES;
+  }
+
+  NSDictionary *rejection = [[[NSUserDefaults standardUserDefaults] dictionaryForKey:zsRejectedSchemasKey] valueForKey:serverUUID];
+  if (![[rejection valueForKey:@"signature"] isEqualToString:[self schemaSignature]]) {
+    return YES;
+  }
+
+  return ![[rejection valueForKey:@"schemaSet"] isEqualToString:schemaSet];
 }
 
-- (void)processAuthenticatePairingRequest:(BLIPRequest *)request fromConnection:(BLIPConnection *)conn
+- (void)rememberSchemaRejectedByServer:(NSString *)serverUUID schemaSet:(NSString *)schemaSet
 {
-  DLog(@"%s", __PRETTY_FUNCTION__);
+  if (!serverUUID || !schemaSet) {
+    return;
+  }
 
-  if ([[request bodyString] isEqualToString:[self passcode]]) {
-    [[NSUserDefaults standardUserDefaults] setValue:[request valueOfProperty:zsServerUUID] forKey:zsServerUUID];
-    [self performSelector:@selector(uploadDataToServerUsingConnection:) withObject:conn afterDelay:0.1];
+  NSMutableDictionary *rejectedSchemas = [[[NSUserDefaults standardUserDefaults] dictionaryForKey:zsRejectedSchemasKey] mutableCopy];
+  if (!rejectedSchemas) {
+    rejectedSchemas = [[NSMutableDictionary alloc] init];
   }
 
-  [[self delegate] zSyncPairingCodeCompleted:self];
+  NSDictionary *rejection = [NSDictionary dictionaryWithObjectsAndKeys:[self schemaSignature], @"signature", schemaSet, @"schemaSet", nil];
+  [rejectedSchemas setValue:rejection forKey:serverUUID];
+
+  [[NSUserDefaults standardUserDefaults] setObject:rejectedSchemas forKey:zsRejectedSchemasKey];
+  [rejectedSchemas release], rejectedSchemas = nil;
 }
 
-- (void)processCompleteSyncRequest:(BLIPRequest *)request fromConnection:(BLIPConnection *)conn
+/* Does nothing when no sync phase was marked since the last report */
+- (void)reportMemoryProfile
 {
-  DLog(@"%s", __PRETTY_FUNCTION__);
+  NSDictionary *profile = [[self memoryProfile] finishProfile];
+  if (!profile) return;
 
-  [self performSelector:@selector(completeSyncFromConnection:) withObject:conn afterDelay:0.01];
+  DLog(@"%s %@", __PRETTY_FUNCTION__, profile);
+  if ([[self delegate] respondsToSelector:@selector(zSync:finishedWithMemoryProfile:)]) {
+    [[self delegate] zSync:self finishedWithMemoryProfile:profile];
+  }
 }
 
-- (void)processStoreUploadRequest:(BLIPRequest *)request fromConnection:(BLIPConnection *)conn
+/* However often chunks move, the delegate hears about it at most once per
+ * kProgressInterval
+ */
+- (void)noteProgress
 {
-  DLog(@"%s", __PRETTY_FUNCTION__);
-  ZAssert([request complete], @"Message is incomplete");
+  if (progressScheduled || ![[self delegate] respondsToSelector:@selector(zSync:updatedProgress:)]) {
+    return;
+  }
 
-  DLog(@"file received");
+  progressScheduled = YES;
+  NSTimeInterval wait = kProgressInterval - (CFAbsoluteTimeGetCurrent() - lastProgressTime);
+  [self performSelector:@selector(deliverProgress) withObject:nil afterDelay:MAX(wait, 0.0)];
+}
 
-  NSString *tempFilename = [[NSProcessInfo processInfo] globallyUniqueString];
-  NSString *tempPath = [[self cachePath] stringByAppendingPathComponent:tempFilename];
-  DLog(@"file written to \n%@", tempPath);
+- (void)deliverProgress
+{
+  [NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(deliverProgress) object:nil];
+  progressScheduled = NO;
+  lastProgressTime = CFAbsoluteTimeGetCurrent();
 
-  DLog(@"request length: %i", [[request body] length]);
-  [[request body] writeToFile:tempPath atomically:YES];
+  if ([[self delegate] respondsToSelector:@selector(zSync:updatedProgress:)]) {
+    [[self delegate] zSync:self updatedProgress:[[self progress] report]];
+  }
+}
 
-  NSMutableDictionary *fileDict = [[NSMutableDictionary alloc] init];
-  [fileDict setValue:[request valueOfProperty:zsStoreIdentifier] forKey:zsStoreIdentifier];
-  if (![[request valueOfProperty:zsStoreConfiguration] isEqualToString:@"PF_DEFAULT_CONFIGURATION_NAME"]) {
-    [fileDict setValue:[request valueOfProperty:zsStoreConfiguration] forKey:zsStoreConfiguration];
+- (void)notifySchemaUnsupported
+{
+  if ([self serverAction] == ZSyncServerActionSync) {
+    [self syncActivityEndedWithSuccess:NO];
   }
-  [fileDict setValue:[request valueOfProperty:zsStoreType] forKey:zsStoreType];
-  [fileDict setValue:tempPath forKey:zsTempFilePath];
+  [self setServerAction:ZSyncServerActionNoActivity];
 
-  [[self receivedFileLookupDictionary] setValue:fileDict forKey:[request valueOfProperty:zsStoreIdentifier]];
-  [fileDict release], fileDict = nil;
+  if ([[self delegate] respondsToSelector:@selector(zSync:serverVersionUnsupported:)]) {
+    NSString *errorString = NSLocalizedString(@"The server does not support this application", @"schema rejected from TXT record error message");
+    NSDictionary *userInfo = [NSDictionary dictionaryWithObject:errorString forKey:NSLocalizedDescriptionKey];
+    NSError *error = [NSError errorWithDomain:zsErrorDomain code:zsErrorNoSyncClientRegistered userInfo:userInfo];
 
-  BLIPResponse *response = [request response];
-  [response setValue:zsActID(zsActionFileReceived) ofProperty:zsAction];
-  [response setValue:[request valueOfProperty:zsStoreIdentifier] ofProperty:zsStoreIdentifier];
-  [response send];
+    [[self delegate] zSync:self serverVersionUnsupported:error];
+  }
 }
 
-- (void)processCancelPairingRequest:(BLIPRequest *)request fromConnection:(BLIPConnection *)conn
+#pragma mark -
+#pragma mark Overridden getters/setter
+
+- (void)setServerAction:(ZSyncServerAction)action
 {
-  DLog(@"%s zsActionCancelPairing", __PRETTY_FUNCTION__);
-  [conn setDelegate:nil];
-  [conn close];
-  [[self openConnections] removeObject:conn];
-  //  [self setConnection:nil];
-  if ([[self delegate] respondsToSelector:@selector(zSyncPairingCodeCancelled:)]) {
-    [[self delegate] zSyncPairingCodeCancelled:self];
+  ZSyncServerAction previousAction = serverAction;
+  serverAction = action;
+
+  if (previousAction != ZSyncServerActionNoActivity && action == ZSyncServerActionNoActivity) {
+    // Spans a failed action left open would never end
+    [[ZSyncTrace sharedTrace] discardOpenSpansForSync:[self syncGUID]];
+    [self reportMemoryProfile];
+    [NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(deliverProgress) object:nil];
+    progressScheduled = NO;
   }
+}
 
-  [self setServerAction:ZSyncServerActionNoActivity];
-  [[NSUserDefaults standardUserDefaults] removeObjectForKey:zsServerUUID];
-  [[NSUserDefaults standardUserDefaults] removeObjectForKey:zsServerName];
+- (void)setAutomaticSyncEnabled:(BOOL)enabled
+{
+  if (enabled == automaticSyncEnabled) {
+    return;
+  }
 
-  [self setRegisteredService:nil];
+  automaticSyncEnabled = enabled;
+  if (automaticSyncEnabled) {
+    [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(managedObjectContextDidSave:) name:NSManagedObjectContextDidSaveNotification object:nil];
+    return;
+  }
+
+  [[NSNotificationCenter defaultCenter] removeObserver:self name:NSManagedObjectContextDidSaveNotification object:nil];
+  if (!syncQueued) {
+    [automaticSyncTimer invalidate], automaticSyncTimer = nil;
+  }
+  localChangesPending = NO;
+  automaticSyncFailures = 0;
 }
 
-#pragma mark -
-#pragma mark Overridden getters/setter
+- (NSTimeInterval)automaticSyncQuietPeriod
+{
+  if (automaticSyncQuietPeriod <= 0.0) {
+    return kDefaultAutomaticSyncQuietPeriod;
+  }
+
+  return automaticSyncQuietPeriod;
+}
 
 - (ServerBrowser *)serviceBrowser
 {
@@ -912,22 +2167,112 @@
   return lock;
 }
 
-- (NSLock *)serviceResolutionLock
+- (NSMutableDictionary *)receivedFileLookupDictionary
 {
-  if (!serviceResolutionLock) {
-    serviceResolutionLock = [[NSLock alloc] init];
+  if (!receivedFileLookupDictionary) {
+    receivedFileLookupDictionary = [[NSMutableDictionary alloc] init];
   }
 
-  return serviceResolutionLock;
+  return receivedFileLookupDictionary;
 }
 
-- (NSMutableDictionary *)receivedFileLookupDictionary
+- (NSMutableSet *)appliedStoreIdentifiers
 {
-  if (!receivedFileLookupDictionary) {
-    receivedFileLookupDictionary = [[NSMutableDictionary alloc] init];
+  if (!appliedStoreIdentifiers) {
+    appliedStoreIdentifiers = [[NSMutableSet alloc] init];
   }
 
-  return receivedFileLookupDictionary;
+  return appliedStoreIdentifiers;
+}
+
+- (NSMutableDictionary *)messageSchedulers
+{
+  if (!messageSchedulers) {
+    messageSchedulers = [[NSMutableDictionary alloc] init];
+  }
+
+  return messageSchedulers;
+}
+
+- (ZSyncStoreAssembler *)storeAssembler
+{
+  if (!storeAssembler) {
+    storeAssembler = [[ZSyncStoreAssembler alloc] initWithDirectory:[self cachePath] pathExtension:nil];
+  }
+
+  return storeAssembler;
+}
+
+- (ZSyncLatencyHistory *)latencyHistory
+{
+  if (!latencyHistory) {
+    latencyHistory = [[ZSyncLatencyHistory alloc] initWithDefaultsKey:zsLatencyHistoryKey];
+  }
+
+  return latencyHistory;
+}
+
+- (NSMutableDictionary *)resolveStartTimes
+{
+  if (!resolveStartTimes) {
+    resolveStartTimes = [[NSMutableDictionary alloc] init];
+  }
+
+  return resolveStartTimes;
+}
+
+- (NSMutableDictionary *)txtRecordCache
+{
+  if (!txtRecordCache) {
+    txtRecordCache = [[NSMutableDictionary alloc] init];
+  }
+
+  return txtRecordCache;
+}
+
+- (NSMutableSet *)directConnections
+{
+  if (!directConnections) {
+    directConnections = [[NSMutableSet alloc] init];
+  }
+
+  return directConnections;
+}
+
+- (NSMutableDictionary *)connectTimings
+{
+  if (!connectTimings) {
+    connectTimings = [[NSMutableDictionary alloc] init];
+  }
+
+  return connectTimings;
+}
+
+- (ZSyncPeerTrust *)peerTrust
+{
+  if (!peerTrust) {
+    peerTrust = [[ZSyncPeerTrust alloc] initWithDefaultsKey:zsTrustedServersKey];
+  }
+
+  return peerTrust;
+}
+
+- (ZSyncProgress *)progress
+{
+  if (!progress) {
+    progress = [[ZSyncProgress alloc] init];
+  }
+
+  return progress;
+}
+
+- (ZSyncMemoryProfile *)memoryProfile
+{
+  if (!memoryProfile) {
+    memoryProfile = [[ZSyncMemoryProfile alloc] init];
+  }
+
+  return memoryProfile;
 }
 
 - (NSMutableArray *)storeFileIdentifiers
@@ -942,43 +2287,58 @@
 #pragma mark -
 #pragma mark ServerBrowserDelegate methods
 
-- (void)updateServerList
+- (void)serverBrowser:(ServerBrowser *)browser addedServers:(NSArray *)added removedServers:(NSArray *)removed
 {
-  [serviceResolutionLock lock];
-  DLog(@"%s", __PRETTY_FUNCTION__);
+  DLog(@"%s %i added, %i removed", __PRETTY_FUNCTION__, [added count], [removed count]);
+  if (discoveryState >= ZSyncDiscoveryStateMatched) {
+    DLog(@"%s already matched, ignoring", __PRETTY_FUNCTION__);
+    return;
+  }
   [networkTimer invalidate], networkTimer = nil;
 
-  for (NSNetService *service in [self discoveredServers]) {
-    [service setDelegate:nil];
-    [service stop];
-  }
+  BOOL availableChanged = NO;
+  for (NSNetService *service in removed) {
+    NSUInteger index = [[self discoveredServers] indexOfObject:service];
+    if (index != NSNotFound) {
+      NSNetService *discoveredService = [[self discoveredServers] objectAtIndex:index];
+      [discoveredService setDelegate:nil];
+      [discoveredService stop];
+      [[self discoveredServers] removeObjectAtIndex:index];
+    }
 
-  [[self discoveredServers] removeAllObjects];
-  [[self availableServers] removeAllObjects];
+    for (ZSyncService *zSyncService in [[[self availableServers] copy] autorelease]) {
+      if ([[zSyncService service] isEqual:service]) {
+        [[self availableServers] removeObject:zSyncService];
+        availableChanged = YES;
+      }
+    }
+  }
 
-  [[self discoveredServers] addObjectsFromArray:[[self serviceBrowser] servers]];
-  for (NSNetService *service in [self discoveredServers]) {
-    [service setDelegate:self];
-    [service resolveWithTimeout:15.0];
+  if ([added count] && !browseSampled && browseStartTime) {
+    [[self latencyHistory] recordLatency:(CFAbsoluteTimeGetCurrent() - browseStartTime) forPhase:zsDiscoveryPhaseBrowse];
+    browseSampled = YES;
   }
 
-  if ([[self discoveredServers] count] == 0) {
-    NSString *serverUUID = [[NSUserDefaults standardUserDefaults] valueForKey:zsServerUUID];
-    if (!serverUUID) {
-      [[self delegate] zSyncNoServerPaired:[self availableServers]];
-    }
-  } else {
-    NSString *serverUUID = [[NSUserDefaults standardUserDefaults] valueForKey:zsServerUUID];
-    if (serverUUID) {
-      networkTimer = [NSTimer scheduledTimerWithTimeInterval:15.0
-                              target:self
-                              selector:@selector(networkTimeout:)
-                              userInfo:nil
-                               repeats:NO];
+  for (NSNetService *service in added) {
+    if ([self cachedTXTRecordRulesOutService:service]) {
+      DLog(@"%s skipping %@, it is not our server", __PRETTY_FUNCTION__, [service name]);
+      continue;
     }
+
+    [[self discoveredServers] addObject:service];
+    [service setDelegate:self];
+    [[self resolveStartTimes] setObject:[NSNumber numberWithDouble:CFAbsoluteTimeGetCurrent()] forKey:[self cacheKeyForService:service]];
+    [[ZSyncTrace sharedTrace] beginSpan:zsSpanResolve detail:[service name] sync:[self syncGUID]];
+    [service resolveWithTimeout:[self resolveTimeout]];
   }
+  [self enterDiscoveryState:([[self discoveredServers] count] ? ZSyncDiscoveryStateResolving : ZSyncDiscoveryStateBrowsing)];
 
-  [serviceResolutionLock unlock];
+  NSString *serverUUID = [[NSUserDefaults standardUserDefaults] valueForKey:zsServerUUID];
+  if (serverUUID) {
+    [self startNetworkTimer];
+  } else if (availableChanged || [[self discoveredServers] count] == 0) {
+    [self scheduleNoServerPairedNotification];
+  }
 }
 
 #pragma mark -
@@ -992,8 +2352,6 @@
  */
 - (void)netServiceDidResolveAddress:(NSNetService *)bonjourService
 {
-  [serviceResolutionLock lock];
-
   DLog(@"%s", __PRETTY_FUNCTION__);
   DLog(@"%s description:%@", __PRETTY_FUNCTION__, [bonjourService description]);
   DLog(@"%s hostName:%@", __PRETTY_FUNCTION__, [bonjourService hostName]);
@@ -1007,10 +2365,18 @@
   }
   DLog(@"%s type:%@", __PRETTY_FUNCTION__, [bonjourService type]);
   NSString *incomingServerName = [bonjourService name];
+  [self cacheTXTRecordData:[bonjourService TXTRecordData] forService:bonjourService];
+
+  NSString *serviceKey = [self cacheKeyForService:bonjourService];
+  [[ZSyncTrace sharedTrace] endSpan:zsSpanResolve detail:[bonjourService name] sync:[self syncGUID]];
+  NSNumber *resolveStart = [[self resolveStartTimes] objectForKey:serviceKey];
+  if (resolveStart) {
+    [[self latencyHistory] recordLatency:(CFAbsoluteTimeGetCurrent() - [resolveStart doubleValue]) forPhase:zsDiscoveryPhaseResolve];
+    [[self resolveStartTimes] removeObjectForKey:serviceKey];
+  }
 
-  if ([bonjourService isEqual:[self registeredService]]) {
+  if (discoveryState >= ZSyncDiscoveryStateMatched || [bonjourService isEqual:[self registeredService]]) {
     DLog(@"%s We've already resolved our service, bailing out before we start a sync. Service Name:%@", __PRETTY_FUNCTION__, incomingServerName);
-    [serviceResolutionLock unlock];
     return;
   }
 
@@ -1018,14 +2384,12 @@
   NSDictionary *txtRecordDictionary = [NSNetService dictionaryFromTXTRecordData:[bonjourService TXTRecordData]];
   if (!txtRecordDictionary) {
     DLog(@"The NSNetService named %@ did not contain a TXT record", incomingServerName);
-    [serviceResolutionLock unlock];
     return;
   }
 
   NSData *incomingServerUUIDData = [txtRecordDictionary objectForKey:zsServerUUID];
   if (!incomingServerUUIDData) {
     DLog(@"The TXT record did not contain a server UUID.");
-    [serviceResolutionLock unlock];
     return;
   }
 
@@ -1033,32 +2397,51 @@
   if (!incomingServerUUID || [incomingServerUUID length] == 0) {
     DLog(@"The TXT record UUID was zero length.");
     [incomingServerUUID release], incomingServerUUID = nil;
-    [serviceResolutionLock unlock];
+    return;
+  }
+
+  if (![self server:incomingServerUUID mayAcceptSchemaWithTXTRecord:txtRecordDictionary]) {
+    DLog(@"%s %@ cannot serve this schema, skipping it", __PRETTY_FUNCTION__, incomingServerName);
+    NSString *pairedServerUUID = [[NSUserDefaults standardUserDefaults] valueForKey:zsServerUUID];
+    if (pairedServerUUID && [incomingServerUUID hasPrefix:pairedServerUUID]) {
+      // No point waiting for the timeout, this is the server we are paired with
+      [networkTimer invalidate], networkTimer = nil;
+      [self enterDiscoveryState:ZSyncDiscoveryStateIdle];
+      [self performSelector:@selector(notifySchemaUnsupported) withObject:nil afterDelay:0.0];
+    }
+    [incomingServerUUID release], incomingServerUUID = nil;
     return;
   }
 
   NSArray *deregisteredServers = [[NSUserDefaults standardUserDefaults] objectForKey:zsDeregisteredServersKey];
   if (deregisteredServers && [deregisteredServers containsObject:incomingServerUUID]) {
     [self setServerAction:ZSyncServerActionLatentDeregistration];
-    [self beginLatentDeregistrationWithService:bonjourService];
+    [self performSelector:@selector(beginLatentDeregistrationWithService:) withObject:bonjourService afterDelay:0.0];
   }
 
   NSString *registeredServerUUID = [[NSUserDefaults standardUserDefaults] valueForKey:zsServerUUID];
   NSString *registeredServerName = [[NSUserDefaults standardUserDefaults] valueForKey:zsServerName];
 
   if (!registeredServerUUID) {     // See if the server is in the deregistered list
+    for (ZSyncService *existingService in [[[self availableServers] copy] autorelease]) {
+      if ([[existingService service] isEqual:bonjourService]) {
+        [[self availableServers] removeObject:existingService];
+      }
+    }
+
     ZSyncService *zSyncService = [[ZSyncService alloc] init];
     [zSyncService setService:bonjourService];
     [zSyncService setName:incomingServerName];
     [zSyncService setUuid:incomingServerUUID];
+    [zSyncService setLoad:[txtRecordString(txtRecordDictionary, zsTXTLoad) integerValue]];
+    [zSyncService setQueueDepth:[txtRecordString(txtRecordDictionary, zsTXTQueueDepth) integerValue]];
     [[self availableServers] addObject:zSyncService];
     [zSyncService release], zSyncService = nil;
 
-    [[self delegate] zSyncNoServerPaired:[self availableServers]];
+    [self scheduleNoServerPairedNotification];
 
     [incomingServerUUID release], incomingServerUUID = nil;
 
-    [serviceResolutionLock unlock];
     return;
   }
 
@@ -1067,7 +2450,6 @@
     if (!incomingServerNameData) {
       DLog(@"TXT record did not contain server name data");
       [incomingServerUUID release], incomingServerUUID = nil;
-      [serviceResolutionLock unlock];
       return;
     }
 
@@ -1076,7 +2458,6 @@
       DLog(@"Incoming server name did not match registered server name, %@ != %@", incomingServerName, registeredServerName);
       [incomingServerUUID release], incomingServerUUID = nil;
       [incomingServerName release], incomingServerName = nil;
-      [serviceResolutionLock unlock];
       return;
     }
 
@@ -1090,7 +2471,6 @@
       [incomingServerUUID release], incomingServerUUID = nil;
       [incomingServerName release], incomingServerName = nil;
 
-      [serviceResolutionLock unlock];
       return;
     }
   }
@@ -1104,30 +2484,35 @@
   [[self serviceBrowser] stop];
 
   [self setRegisteredService:bonjourService];
+  [self enterDiscoveryState:ZSyncDiscoveryStateMatched];
 
-  [self handleServerActionWithService:bonjourService];
+  // Keep watching the TXT record for change counters
+  [bonjourService startMonitoring];
+  [self noteTXTRecordData:[bonjourService TXTRecordData]];
 
-  [serviceResolutionLock unlock];
-
-  return;
+  [self performSelector:@selector(connectToMatchedService:) withObject:bonjourService afterDelay:0.0];
 }
 
 /* Sent to the NSNetService instance's delegate when an error in resolving the instance occurs. The error dictionary will contain two key/value pairs representing the error domain and code (see the NSNetServicesError enumeration above for error code constants).
  */
 - (void)netService:(NSNetService *)sender didNotResolve:(NSDictionary *)errorDict
 {
-  [serviceResolutionLock lock];
-
   DLog(@"%s", __PRETTY_FUNCTION__);
   [[self discoveredServers] removeObject:sender];
 
-  // Did not find our registered server.  Fail
-  if ([[self discoveredServers] count] == 0) {
-    [[self delegate] zSyncServerUnavailable:self];
-    [self setServerAction:ZSyncServerActionNoActivity];
+  NSString *serviceKey = [self cacheKeyForService:sender];
+  [[ZSyncTrace sharedTrace] endSpan:zsSpanResolve detail:[sender name] sync:[self syncGUID]];
+  NSNumber *resolveStart = [[self resolveStartTimes] objectForKey:serviceKey];
+  [[self resolveStartTimes] removeObjectForKey:serviceKey];
+  if ([[errorDict objectForKey:NSNetServicesErrorCode] integerValue] == NSNetServicesTimeoutError && resolveStart) {
+    [self reportTimeoutInPhase:zsDiscoveryPhaseResolve afterInterval:(CFAbsoluteTimeGetCurrent() - [resolveStart doubleValue])];
   }
 
-  [serviceResolutionLock unlock];
+  // Did not find our registered server.  Fail
+  if (discoveryState == ZSyncDiscoveryStateResolving && [[self discoveredServers] count] == 0) {
+    [self enterDiscoveryState:ZSyncDiscoveryStateIdle];
+    [self performSelector:@selector(notifyServerUnavailable) withObject:nil afterDelay:0.0];
+  }
 }
 
 /* Sent to the NSNetService instance's delegate when the instance's previously running publication or resolution request has stopped.
@@ -1136,7 +2521,14 @@
 
 /* Sent to the NSNetService instance's delegate when the instance is being monitored and the instance's TXT record has been updated. The new record is contained in the data parameter.
  */
-- (void)netService:(NSNetService *)sender didUpdateTXTRecordData:(NSData *)data {}
+- (void)netService:(NSNetService *)sender didUpdateTXTRecordData:(NSData *)data
+{
+  [self cacheTXTRecordData:data forService:sender];
+
+  if ([sender isEqual:[self registeredService]]) {
+    [self noteTXTRecordData:data];
+  }
+}
 
 #pragma mark -
 #pragma mark BLIPConnectionDelegate methods
@@ -1151,6 +2543,10 @@
 {
   DLog(@"%s", __PRETTY_FUNCTION__);
   DLog(@"%s entered", __PRETTY_FUNCTION__);
+  [self noteConnectEvent:@"opened" forConnection:conn];
+  if (discoveryState == ZSyncDiscoveryStateConnecting && ![self isDirectConnection:conn]) {
+    [self enterDiscoveryState:ZSyncDiscoveryStateIdle];
+  }
 
   // Start by confirming that the server still supports our schema and version
   NSMutableDictionary *requestPropertiesDictionary = [[NSMutableDictionary alloc] init];
@@ -1160,13 +2556,22 @@
   [requestPropertiesDictionary setValue:[[UIDevice currentDevice] name] forKey:zsDeviceName];
   [requestPropertiesDictionary setValue:[[UIDevice currentDevice] uniqueIdentifier] forKey:zsDeviceGUID];
   [requestPropertiesDictionary setValue:[self schemaID] forKey:zsSchemaIdentifier];
+  [requestPropertiesDictionary setValue:[self modelFingerprint] forKey:zsModelFingerprint];
 
   NSData *syncGUIDData = [[self syncGUID] dataUsingEncoding:NSUTF8StringEncoding];
-  BLIPRequest *request = [conn requestWithBody:syncGUIDData properties:requestPropertiesDictionary];
-  [request send];
+  BLIPRequest *request = [BLIPRequest requestWithBody:syncGUIDData properties:requestPropertiesDictionary];
+  [[ZSyncTrace sharedTrace] beginSpan:zsSpanVerifySchema detail:[NSString stringWithFormat:@"%p", conn] sync:[self syncGUID]];
+  [[self schedulerForConnection:conn] sendRequest:request priority:ZSyncMessagePriorityControl];
 
   [requestPropertiesDictionary release], requestPropertiesDictionary = nil;
   DLog(@"%s initial send complete", __PRETTY_FUNCTION__);
+
+  // While racing, only the winner may upload
+  if ([self serverAction] == ZSyncServerActionSync && !racingDiscovery && [self schemaPreviouslyAccepted]) {
+    DLog(@"%s schema was accepted before, uploading without waiting", __PRETTY_FUNCTION__);
+    optimisticConnection = conn;
+    [self uploadDataToServerUsingConnection:conn];
+  }
 }
 
 /* We had an error talking to the server.  Push this error on to our delegate
@@ -1175,15 +2580,56 @@
 - (void)connection:(TCPConnection *)conn failedToOpen:(NSError *)error
 {
   DLog(@"%s error:%@", __PRETTY_FUNCTION__, [error localizedDescription]);
-  [conn setDelegate:nil];
-  [conn close];
-  [[self openConnections] removeObject:conn];
+  NSDictionary *timings = [[self connectTimings] objectForKey:[NSValue valueWithNonretainedObject:conn]];
+  NSTimeInterval elapsed = CFAbsoluteTimeGetCurrent() - [[timings valueForKey:@"start"] doubleValue];
+  if (timings && [conn openTimeout] > 0.0 && elapsed >= [conn openTimeout]) {
+    [self reportTimeoutInPhase:zsDiscoveryPhaseConnect afterInterval:elapsed];
+  }
+  [[ZSyncTrace sharedTrace] endSpan:zsSpanConnect detail:[NSString stringWithFormat:@"%p", conn] sync:[self syncGUID]];
+
+  if ([self isDirectConnection:(BLIPConnection *)conn]) {
+    // Bonjour is still looking for the server
+    [self closeConnection:(BLIPConnection *)conn];
+    return;
+  }
+
+  BOOL reconnecting = (conn == pendingSessionConnection);
+  [self closeConnection:(BLIPConnection *)conn];
+  if (discoveryState == ZSyncDiscoveryStateConnecting) {
+    [self enterDiscoveryState:ZSyncDiscoveryStateIdle];
+  }
+
+  if (reconnecting && [self serverAction] == ZSyncServerActionNoActivity) {
+    [self scheduleReconnect];
+    return;
+  }
+
   [[self delegate] zSync:self errorOccurred:error];
   [self setRegisteredService:nil];
 }
 
+/* Only called when an SSL identity is set.  Before pairing there is no
+ * server UUID to pin against so the certificate is only evaluated.
+ */
+- (BOOL)connection:(TCPConnection *)conn authorizeSSLPeer:(SecCertificateRef)peerCert
+{
+  [self noteConnectEvent:@"authorized" forConnection:(BLIPConnection *)conn];
+
+  NSUInteger hits = [[self peerTrust] cacheHits];
+  NSString *serverUUID = [[NSUserDefaults standardUserDefaults] valueForKey:zsServerUUID];
+  BOOL authorized = [[self peerTrust] authorizeCertificate:peerCert forPeer:serverUUID];
+
+  NSValue *key = [NSValue valueWithNonretainedObject:conn];
+  [[[self connectTimings] objectForKey:key] setValue:[NSNumber numberWithBool:([[self peerTrust] cacheHits] > hits)] forKey:zsConnectPhaseTrustCached];
+
+  return authorized;
+}
+
 - (void)connection:(BLIPConnection *)conn receivedResponse:(BLIPResponse *)response;
 {
+  [[self schedulerForConnection:conn] responseReceived:response];
+  [self reportConnectTimingsForConnection:conn];
+
   if (![[response properties] valueOfProperty:zsAction]) {
     DLog(@"%s received empty response, ignoring", __PRETTY_FUNCTION__);
     return;
@@ -1212,13 +2658,21 @@
       [self processSchemaSupportedResponse:response fromConnection:conn];
       return;
 
+    case zsActionChunkReceived:
+      return;
+
+    case zsActionHeartbeat:
+      heartbeatOutstanding = NO;
+      missedHeartbeats = 0;
+      return;
+
     default:
       DLog(@"%s default case encountered", __PRETTY_FUNCTION__);
       ALog(@"%s Unknown response action received: %i", __PRETTY_FUNCTION__, action);
   }
 }
 
-- (BOOL)connection:(BLIPConnection *)conn receivedRequest:(BLIPRequest *)request
+- (BOOL)handleRequest:(BLIPRequest *)request fromConnection:(BLIPConnection *)conn
 {
   NSInteger action = [[[request properties] valueOfProperty:zsAction] integerValue];
   switch (action) {
@@ -1242,6 +2696,10 @@
       [self processCancelPairingRequest:request fromConnection:conn];
       return YES;
 
+    case zsActionDataChanged:
+      [self noteServerChangeCount:[[request valueOfProperty:zsChangeCount] integerValue]];
+      return YES;
+
     default:
       DLog(@"%s default case encountered", __PRETTY_FUNCTION__);
       ALog(@"%s Unknown request action received: %i", __PRETTY_FUNCTION__, action);
@@ -1249,6 +2707,17 @@
   }
 }
 
+- (BOOL)connection:(BLIPConnection *)conn receivedRequest:(BLIPRequest *)request
+{
+  [[self schedulerForConnection:conn] requestReceived:request];
+
+  CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+  BOOL handled = [self handleRequest:request fromConnection:conn];
+  [ZSyncMessageScheduler recordHandlerTime:(CFAbsoluteTimeGetCurrent() - start) forRequest:request];
+
+  return handled;
+}
+
 - (void)connectionDidClose:(TCPConnection *)conn;
 {
   DLog(@"%s", __PRETTY_FUNCTION__);
@@ -1256,8 +2725,25 @@
     return;
   }
 
+  if (racingDiscovery && [self isDirectConnection:(BLIPConnection *)conn]) {
+    [self forgetConnection:(BLIPConnection *)conn];
+    return;
+  }
+
+  BOOL sessionClosed = (conn == [self sessionConnection] || conn == pendingSessionConnection);
+  [self forgetConnection:(BLIPConnection *)conn];
+  [[self storeAssembler] discardAllAssemblies];
+
+  if (sessionClosed && [self serverAction] == ZSyncServerActionNoActivity) {
+    DLog(@"idle session closed by the server");
+    [self scheduleReconnect];
+    return;
+  }
+
   // premature closing
-  [[self openConnections] removeObject:conn];
+  if ([self serverAction] == ZSyncServerActionSync) {
+    [self syncActivityEndedWithSuccess:NO];
+  }
   [self setServerAction:ZSyncServerActionNoActivity];
 
   [self setRegisteredService:nil];
@@ -1271,6 +2757,17 @@
   [[self delegate] zSync:self errorOccurred:error];
 }
 
+#pragma mark -
+#pragma mark ZSyncMessageSchedulerDelegate methods
+
+- (void)messageScheduler:(ZSyncMessageScheduler *)scheduler acknowledgedBytes:(NSUInteger)length ofStore:(NSString *)storeIdentifier
+{
+  if (!storeIdentifier) return;
+
+  [[self progress] addBytes:length toUploadForStore:storeIdentifier];
+  [self noteProgress];
+}
+
 #pragma mark -
 #pragma mark Memory management and property declarations
 
@@ -1283,15 +2780,30 @@
 @synthesize minorVersionNumber;
 @synthesize passcode;
 @synthesize serverAction;
+@synthesize discoveryState;
+@synthesize automaticSyncEnabled;
+@synthesize automaticSyncQuietPeriod;
 @synthesize availableServers;
 @synthesize discoveredServers;
 @synthesize resolvedServices;
 @synthesize lock;
-@synthesize serviceResolutionLock;
 @synthesize storeFileIdentifiers;
 @synthesize receivedFileLookupDictionary;
+@synthesize appliedStoreIdentifiers;
 @synthesize openConnections;
+@synthesize messageSchedulers;
+@synthesize storeAssembler;
+@synthesize connectTimings;
+@synthesize directConnections;
+@synthesize txtRecordCache;
+@synthesize latencyHistory;
+@synthesize memoryProfile;
+@synthesize progress;
+@synthesize resolveStartTimes;
+@synthesize peerTrust;
+@synthesize captureDirectory;
 @synthesize registeredService;
+@synthesize sessionConnection;
 
 @end
 
@@ -1302,6 +2814,21 @@
 @synthesize name;
 @synthesize uuid;
 @synthesize service;
+@synthesize load;
+@synthesize queueDepth;
+
+- (NSComparisonResult)compareLoad:(ZSyncService *)otherService
+{
+  if ([self load] != [otherService load]) {
+    return ([self load] < [otherService load] ? NSOrderedAscending : NSOrderedDescending);
+  }
+
+  if ([self queueDepth] != [otherService queueDepth]) {
+    return ([self queueDepth] < [otherService queueDepth] ? NSOrderedAscending : NSOrderedDescending);
+  }
+
+  return [[self name] compare:[otherService name]];
+}
 
 - (NSString *)description
 {
@@ -1,4 +1,6 @@
 
+@class ZSyncDataGenerator;
+
 @interface AppDelegate : NSObject <NSPersistentStoreCoordinatorSyncing>
 {
   NSPanel *clientSheet;
@@ -7,6 +9,7 @@
   NSPersistentStoreCoordinator *persistentStoreCoordinator;
   NSManagedObjectModel *managedObjectModel;
   NSManagedObjectContext *managedObjectContext;
+  ZSyncDataGenerator *dataGenerator;
   
   NSPanel *syncPanel;
   
@@ -23,6 +26,7 @@
 @property (nonatomic, retain, readonly) NSPersistentStoreCoordinator *persistentStoreCoordinator;
 @property (nonatomic, retain, readonly) NSManagedObjectModel *managedObjectModel;
 @property (nonatomic, retain, readonly) NSManagedObjectContext *managedObjectContext;
+@property (nonatomic, retain, readonly) ZSyncDataGenerator *dataGenerator;
 
 - (void)validateZSync;
 
@@ -1,5 +1,6 @@
 #import "AppDelegate.h"
 #import "ZSyncDaemon.h"
+#import "ZSyncDataGenerator.h"
 
 @interface AppDelegate()
 
@@ -127,113 +128,13 @@
 #pragma mark -
 #pragma mark Core Data
 
-- (void)insertSecondChildren:(NSManagedObject*)parent
+- (ZSyncDataGenerator*)dataGenerator
 {
-	NSManagedObjectContext *context = [self managedObjectContext];
-  NSProcessInfo *info = [NSProcessInfo processInfo];
-  
-  NSInteger count = arc4random() % 10;
-  for (NSInteger index = 0; index < count; ++index) {
-    NSManagedObject *child = [NSEntityDescription insertNewObjectForEntityForName:@"SecondChild" 
-                                                           inManagedObjectContext:context];
-    [child setValue:[info globallyUniqueString] forKey:@"attribute1"];
-    [child setValue:[info globallyUniqueString] forKey:@"attribute2"];
-    [child setValue:[info globallyUniqueString] forKey:@"attribute3"];
-    [child setValue:[info globallyUniqueString] forKey:@"attribute4"];
-    [child setValue:parent forKey:@"parent"];
-  }
-}
-
-- (void)insertFirstChildren:(NSManagedObject*)parent
-{
-	NSManagedObjectContext *context = [self managedObjectContext];
-  NSProcessInfo *info = [NSProcessInfo processInfo];
-  
-  NSInteger count = arc4random() % 10;
-  for (NSInteger index = 0; index < count; ++index) {
-    NSManagedObject *child = [NSEntityDescription insertNewObjectForEntityForName:@"FirstChild" 
-                                                           inManagedObjectContext:context];
-    [child setValue:[info globallyUniqueString] forKey:@"attribute1"];
-    [child setValue:[info globallyUniqueString] forKey:@"attribute2"];
-    [child setValue:[info globallyUniqueString] forKey:@"attribute3"];
-    [child setValue:[info globallyUniqueString] forKey:@"attribute4"];
-    [child setValue:parent forKey:@"parent"];
-    [self insertSecondChildren:child];
-  }
-}
+  if (dataGenerator) return dataGenerator;
 
-- (void)insertNewObject 
-{
-	// Create a new instance of the entity managed by the fetched results controller.
-	NSManagedObjectContext *context = [self managedObjectContext];
-	NSManagedObject *newManagedObject = [NSEntityDescription insertNewObjectForEntityForName:@"TopLevelObject"
-                                                                    inManagedObjectContext:context];
-	
-	// If appropriate, configure the new managed object.
-  NSProcessInfo *info = [NSProcessInfo processInfo];
-  
-  [newManagedObject setValue:[NSDate date] forKey:@"createDate"];
-	[newManagedObject setValue:[info globallyUniqueString] forKey:@"attribute1"];
-	[newManagedObject setValue:[info globallyUniqueString] forKey:@"attribute2"];
-	[newManagedObject setValue:[info globallyUniqueString] forKey:@"attribute3"];
-	[newManagedObject setValue:[info globallyUniqueString] forKey:@"attribute4"];
-  [self insertFirstChildren:newManagedObject];
-	
-	// Save the context.
-  //NSError *error = nil;
-  //ZAssert([context save:&error], @"Error saving context: %@", [error localizedDescription]);
-}
-
-- (void)modifySecondChild:(NSManagedObject*)object
-{
-  NSProcessInfo *info = [NSProcessInfo processInfo];
-  
-	[object setValue:[info globallyUniqueString] forKey:@"attribute1"];
-	[object setValue:[info globallyUniqueString] forKey:@"attribute2"];
-	[object setValue:[info globallyUniqueString] forKey:@"attribute3"];
-	[object setValue:[info globallyUniqueString] forKey:@"attribute4"];
-}
-
-- (void)modifyFirstChild:(NSManagedObject*)object
-{
-  NSProcessInfo *info = [NSProcessInfo processInfo];
-  
-	[object setValue:[info globallyUniqueString] forKey:@"attribute1"];
-	[object setValue:[info globallyUniqueString] forKey:@"attribute2"];
-	[object setValue:[info globallyUniqueString] forKey:@"attribute3"];
-	[object setValue:[info globallyUniqueString] forKey:@"attribute4"];
-  
-  if ((arc4random() % 4) == 1) [self insertSecondChildren:object];
-  for (NSManagedObject *child in [object valueForKey:@"children"]) {
-    switch ((arc4random() % 10)) {
-      case 1:
-        [[self managedObjectContext] deleteObject:child];
-        break;
-      case 5:
-        [self modifySecondChild:child];
-    }
-  }
-}
-
-- (void)modifyTopObject:(NSManagedObject*)object
-{
-  NSProcessInfo *info = [NSProcessInfo processInfo];
-  
-	[object setValue:[info globallyUniqueString] forKey:@"attribute1"];
-	[object setValue:[info globallyUniqueString] forKey:@"attribute2"];
-	[object setValue:[info globallyUniqueString] forKey:@"attribute3"];
-	[object setValue:[info globallyUniqueString] forKey:@"attribute4"];
-  
-  if ((arc4random() % 4) == 1) [self insertFirstChildren:object];
-  for (NSManagedObject *child in [object valueForKey:@"children"]) {
-    switch ((arc4random() % 10)) {
-      case 1:
-        [[self managedObjectContext] deleteObject:child];
-        break;
-      case 5:
-        [self modifyFirstChild:child];
-    }
-  }
+  uint64_t seed = ((uint64_t)arc4random() << 32) | arc4random();
+  dataGenerator = [[ZSyncDataGenerator alloc] initWithManagedObjectContext:[self managedObjectContext] seed:seed];
+  return dataGenerator;
 }
 
 - (NSManagedObjectModel*)managedObjectModel 
@@ -309,10 +210,7 @@
 
 - (IBAction)addData:(id)sender;
 {
-  NSInteger numberOfNewRecords = arc4random() % 100;
-  for (NSInteger index = 0; index < numberOfNewRecords; ++index) {
-    [self insertNewObject];
-  }
+  [[self dataGenerator] insertTopLevelObjects:(arc4random() % 100)];
   //NSError *error = nil;
   //ZAssert([[self managedObjectContext] save:&error], @"Error saving context: %@", [error localizedDescription]);
 }
@@ -327,10 +225,7 @@
   NSArray *array = [moc executeFetchRequest:request error:&error];
   ZAssert(error == nil, @"Error fetching objects: %@", [error localizedDescription]);
   
-  for (NSManagedObject *topLevelObject in array) {
-    if ((arc4random() % 3) == 0) continue;
-    [self modifyTopObject:topLevelObject];
-  }
+  [[self dataGenerator] changeTopLevelObjects:array];
   
   //ZAssert([moc save:&error], @"Error saving context: %@", [error localizedDescription]);
 }
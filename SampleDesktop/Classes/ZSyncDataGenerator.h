@@ -0,0 +1,76 @@
+
+#import <CoreData/CoreData.h>
+
+/* Fills and churns a context built on DataModel.xcdatamodel the way a user
+ * of the sample would: TopLevelObjects with FirstChild and SecondChild trees
+ * below them.  The random source is seeded so two runs with the same seed
+ * produce the same shape of data, which keeps benchmark stores comparable
+ * between releases.
+ */
+@interface ZSyncDataGenerator : NSObject
+{
+  NSManagedObjectContext *managedObjectContext;
+  uint64_t randomState;
+  NSDate *lastCreateDate;
+
+  NSUInteger maximumChildren;
+  double changeRatio;
+  double childChangeRatio;
+  double childDeleteRatio;
+  double childInsertRatio;
+  NSUInteger batchSize;
+
+  NSUInteger insertedCount;
+  NSUInteger updatedCount;
+  NSUInteger deletedCount;
+}
+
+@property (nonatomic, readonly) NSManagedObjectContext *managedObjectContext;
+
+/* Each object gets fewer children than this, default 10 */
+@property (nonatomic, assign) NSUInteger maximumChildren;
+/* Fraction of TopLevelObjects modified by a change pass, default 2/3 */
+@property (nonatomic, assign) double changeRatio;
+/* Chances that a child of a modified object is modified, deleted or gets
+ * new children of its own, defaults 0.1, 0.1 and 0.25
+ */
+@property (nonatomic, assign) double childChangeRatio;
+@property (nonatomic, assign) double childDeleteRatio;
+@property (nonatomic, assign) double childInsertRatio;
+/* TopLevelObjects handled between saves in the populate and change passes,
+ * default 1000.  The context is reset after every save.
+ */
+@property (nonatomic, assign) NSUInteger batchSize;
+
+/* Objects of any entity touched since the last resetCounts */
+@property (nonatomic, readonly) NSUInteger insertedCount;
+@property (nonatomic, readonly) NSUInteger updatedCount;
+@property (nonatomic, readonly) NSUInteger deletedCount;
+
+- (id)initWithManagedObjectContext:(NSManagedObjectContext *)context seed:(uint64_t)seed;
+
+- (NSManagedObject *)insertNewObject;
+- (void)insertFirstChildren:(NSManagedObject *)parent;
+- (void)insertSecondChildren:(NSManagedObject *)parent;
+- (void)insertTopLevelObjects:(NSUInteger)count;
+
+- (void)modifyTopObject:(NSManagedObject *)object;
+- (void)modifyFirstChild:(NSManagedObject *)object;
+- (void)modifySecondChild:(NSManagedObject *)object;
+
+/* Modifies each object with the probability of changeRatio */
+- (void)changeTopLevelObjects:(NSArray *)objects;
+
+/* Inserts TopLevelObjects until at least count objects of all entities have
+ * been inserted, saving every batchSize TopLevelObjects.
+ */
+- (BOOL)populateWithObjectCount:(NSUInteger)count error:(NSError **)error;
+
+/* Runs changeTopLevelObjects: over every TopLevelObject in the store in
+ * batches, saving after each.
+ */
+- (BOOL)changeAllObjects:(NSError **)error;
+
+- (void)resetCounts;
+
+@end
@@ -0,0 +1,275 @@
+
+#import "ZSyncDataGenerator.h"
+
+#define kDefaultMaximumChildren 10
+#define kDefaultChangeRatio (2.0 / 3.0)
+#define kDefaultChildChangeRatio 0.1
+#define kDefaultChildDeleteRatio 0.1
+#define kDefaultChildInsertRatio 0.25
+#define kDefaultBatchSize 1000
+
+@interface ZSyncDataGenerator ()
+
+- (uint64_t)nextRandom;
+- (NSUInteger)randomBelow:(NSUInteger)bound;
+- (BOOL)randomChance:(double)probability;
+- (NSString *)randomString;
+- (NSDate *)nextCreateDate;
+- (void)fillAttributesOfObject:(NSManagedObject *)object;
+- (void)changeChildrenOfObject:(NSManagedObject *)object modifySelector:(SEL)modifySelector;
+- (BOOL)saveBatch:(NSError **)error;
+
+@end
+
+@implementation ZSyncDataGenerator
+
+- (id)initWithManagedObjectContext:(NSManagedObjectContext *)context seed:(uint64_t)seed
+{
+  if (!(self = [super init])) return nil;
+
+  managedObjectContext = [context retain];
+  // xorshift must not start from zero
+  randomState = seed ? seed : 0x9E3779B97F4A7C15ULL;
+
+  maximumChildren = kDefaultMaximumChildren;
+  changeRatio = kDefaultChangeRatio;
+  childChangeRatio = kDefaultChildChangeRatio;
+  childDeleteRatio = kDefaultChildDeleteRatio;
+  childInsertRatio = kDefaultChildInsertRatio;
+  batchSize = kDefaultBatchSize;
+
+  return self;
+}
+
+#pragma mark -
+#pragma mark Random source
+
+- (uint64_t)nextRandom
+{
+  randomState ^= randomState >> 12;
+  randomState ^= randomState << 25;
+  randomState ^= randomState >> 27;
+  return randomState * 2685821657736338717ULL;
+}
+
+- (NSUInteger)randomBelow:(NSUInteger)bound
+{
+  if (!bound) return 0;
+  return (NSUInteger)([self nextRandom] % bound);
+}
+
+- (BOOL)randomChance:(double)probability
+{
+  return ([self nextRandom] >> 11) * (1.0 / 9007199254740992.0) < probability;
+}
+
+/* Stands in for globallyUniqueString, which cannot be seeded */
+- (NSString *)randomString
+{
+  return [NSString stringWithFormat:@"%016qX%016qX", [self nextRandom], [self nextRandom]];
+}
+
+/* Strictly increasing so the change pass can page through objects by date */
+- (NSDate *)nextCreateDate
+{
+  NSDate *date = [NSDate date];
+  if (lastCreateDate && [date timeIntervalSinceDate:lastCreateDate] <= 0.0) {
+    date = [NSDate dateWithTimeIntervalSinceReferenceDate:([lastCreateDate timeIntervalSinceReferenceDate] + 0.001)];
+  }
+  [lastCreateDate release];
+  lastCreateDate = [date retain];
+
+  return date;
+}
+
+#pragma mark -
+#pragma mark Inserting
+
+- (void)fillAttributesOfObject:(NSManagedObject *)object
+{
+  [object setValue:[self randomString] forKey:@"attribute1"];
+  [object setValue:[self randomString] forKey:@"attribute2"];
+  [object setValue:[self randomString] forKey:@"attribute3"];
+  [object setValue:[self randomString] forKey:@"attribute4"];
+}
+
+- (void)insertSecondChildren:(NSManagedObject *)parent
+{
+  NSUInteger count = [self randomBelow:[self maximumChildren]];
+  for (NSUInteger index = 0; index < count; ++index) {
+    NSManagedObject *child = [NSEntityDescription insertNewObjectForEntityForName:@"SecondChild"
+                                                           inManagedObjectContext:[self managedObjectContext]];
+    [self fillAttributesOfObject:child];
+    [child setValue:parent forKey:@"parent"];
+    ++insertedCount;
+  }
+}
+
+- (void)insertFirstChildren:(NSManagedObject *)parent
+{
+  NSUInteger count = [self randomBelow:[self maximumChildren]];
+  for (NSUInteger index = 0; index < count; ++index) {
+    NSManagedObject *child = [NSEntityDescription insertNewObjectForEntityForName:@"FirstChild"
+                                                           inManagedObjectContext:[self managedObjectContext]];
+    [self fillAttributesOfObject:child];
+    [child setValue:parent forKey:@"parent"];
+    ++insertedCount;
+    [self insertSecondChildren:child];
+  }
+}
+
+- (NSManagedObject *)insertNewObject
+{
+  NSManagedObject *object = [NSEntityDescription insertNewObjectForEntityForName:@"TopLevelObject"
+                                                          inManagedObjectContext:[self managedObjectContext]];
+  [object setValue:[self nextCreateDate] forKey:@"createDate"];
+  [self fillAttributesOfObject:object];
+  ++insertedCount;
+  [self insertFirstChildren:object];
+
+  return object;
+}
+
+- (void)insertTopLevelObjects:(NSUInteger)count
+{
+  for (NSUInteger index = 0; index < count; ++index) {
+    [self insertNewObject];
+  }
+}
+
+- (BOOL)populateWithObjectCount:(NSUInteger)count error:(NSError **)error
+{
+  NSUInteger target = [self insertedCount] + count;
+  NSUInteger batched = 0;
+  while ([self insertedCount] < target) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    [self insertNewObject];
+    [pool drain], pool = nil;
+
+    if (++batched < [self batchSize]) continue;
+    batched = 0;
+    if (![self saveBatch:error]) return NO;
+  }
+
+  return [self saveBatch:error];
+}
+
+#pragma mark -
+#pragma mark Changing
+
+- (void)modifySecondChild:(NSManagedObject *)object
+{
+  [self fillAttributesOfObject:object];
+  ++updatedCount;
+}
+
+- (void)modifyFirstChild:(NSManagedObject *)object
+{
+  [self fillAttributesOfObject:object];
+  ++updatedCount;
+
+  if ([self randomChance:[self childInsertRatio]]) [self insertSecondChildren:object];
+  [self changeChildrenOfObject:object modifySelector:@selector(modifySecondChild:)];
+}
+
+- (void)modifyTopObject:(NSManagedObject *)object
+{
+  [self fillAttributesOfObject:object];
+  ++updatedCount;
+
+  if ([self randomChance:[self childInsertRatio]]) [self insertFirstChildren:object];
+  [self changeChildrenOfObject:object modifySelector:@selector(modifyFirstChild:)];
+}
+
+/* One draw per child so a delete and a change never hit the same object */
+- (void)changeChildrenOfObject:(NSManagedObject *)object modifySelector:(SEL)modifySelector
+{
+  NSSet *children = [[[object valueForKey:@"children"] copy] autorelease];
+  for (NSManagedObject *child in children) {
+    double draw = ([self nextRandom] >> 11) * (1.0 / 9007199254740992.0);
+    if (draw < [self childDeleteRatio]) {
+      [[self managedObjectContext] deleteObject:child];
+      ++deletedCount;
+    } else if (draw < [self childDeleteRatio] + [self childChangeRatio]) {
+      [self performSelector:modifySelector withObject:child];
+    }
+  }
+}
+
+- (void)changeTopLevelObjects:(NSArray *)objects
+{
+  for (NSManagedObject *object in objects) {
+    if (![self randomChance:[self changeRatio]]) continue;
+    [self modifyTopObject:object];
+  }
+}
+
+- (BOOL)changeAllObjects:(NSError **)error
+{
+  NSFetchRequest *request = [[NSFetchRequest alloc] init];
+  [request setEntity:[NSEntityDescription entityForName:@"TopLevelObject" inManagedObjectContext:[self managedObjectContext]]];
+  NSSortDescriptor *sort = [[NSSortDescriptor alloc] initWithKey:@"createDate" ascending:YES];
+  [request setSortDescriptors:[NSArray arrayWithObject:sort]];
+  [sort release], sort = nil;
+  [request setFetchLimit:[self batchSize]];
+
+  BOOL success = YES;
+  NSUInteger offset = 0;
+  NSUInteger fetched = 0;
+  do {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    [request setFetchOffset:offset];
+    NSArray *batch = [[self managedObjectContext] executeFetchRequest:request error:error];
+    fetched = [batch count];
+    [self changeTopLevelObjects:batch];
+    offset += fetched;
+    success = (batch && [self saveBatch:error]);
+
+    // The error has to outlive the batch pool
+    if (!success && error) [*error retain];
+    [pool drain], pool = nil;
+    if (!success && error) [*error autorelease];
+  } while (success && fetched);
+  [request release], request = nil;
+
+  return success;
+}
+
+- (BOOL)saveBatch:(NSError **)error
+{
+  if (![[self managedObjectContext] save:error]) return NO;
+  [[self managedObjectContext] reset];
+
+  return YES;
+}
+
+- (void)resetCounts
+{
+  insertedCount = 0;
+  updatedCount = 0;
+  deletedCount = 0;
+}
+
+#pragma mark -
+#pragma mark Memory management and property declarations
+
+- (void)dealloc
+{
+  [managedObjectContext release], managedObjectContext = nil;
+  [lastCreateDate release], lastCreateDate = nil;
+
+  [super dealloc];
+}
+
+@synthesize managedObjectContext;
+@synthesize maximumChildren;
+@synthesize changeRatio;
+@synthesize childChangeRatio;
+@synthesize childDeleteRatio;
+@synthesize childInsertRatio;
+@synthesize batchSize;
+@synthesize insertedCount;
+@synthesize updatedCount;
+@synthesize deletedCount;
+
+@end
@@ -0,0 +1,46 @@
+//
+//  NSData+ZSExtensions.m
+//  ZSync
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import "NSData+ZSExtensions.h"
+#import <CommonCrypto/CommonDigest.h>
+
+@implementation NSData (ZSExtensions)
+
+- (NSString *)zsDigest
+{
+  unsigned char digest[CC_SHA1_DIGEST_LENGTH];
+  CC_SHA1([self bytes], (CC_LONG)[self length], digest);
+
+  NSMutableString *result = [NSMutableString stringWithCapacity:(CC_SHA1_DIGEST_LENGTH * 2)];
+  for (NSUInteger index = 0; index < CC_SHA1_DIGEST_LENGTH; ++index) {
+    [result appendFormat:@"%02x", digest[index]];
+  }
+
+  return result;
+}
+
+@end
@@ -0,0 +1,47 @@
+//
+//  NSManagedObjectModel+ZSExtensions.m
+//  ZSync
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import "NSManagedObjectModel+ZSExtensions.h"
+#import "NSData+ZSExtensions.h"
+
+@implementation NSManagedObjectModel (ZSExtensions)
+
+- (NSString *)zsFingerprint
+{
+  NSDictionary *versionHashes = [self entityVersionHashesByName];
+  NSArray *entityNames = [[versionHashes allKeys] sortedArrayUsingSelector:@selector(compare:)];
+
+  NSMutableData *data = [NSMutableData data];
+  for (NSString *entityName in entityNames) {
+    [data appendData:[entityName dataUsingEncoding:NSUTF8StringEncoding]];
+    [data appendData:[versionHashes objectForKey:entityName]];
+  }
+
+  return [data zsDigest];
+}
+
+@end
@@ -32,6 +32,9 @@
 @interface ServerBrowser : NSObject <NSNetServiceBrowserDelegate> {
   NSNetServiceBrowser* netServiceBrowser;
   NSMutableArray* servers;
+  NSMutableArray* addedServers;
+  NSMutableArray* removedServers;
+  BOOL needsSort;
   id<ServerBrowserDelegate> delegate;
 }
 
@@ -47,17 +47,21 @@
 // Sort services alphabetically
 - (void)sortServers;
 
+// Hand the accumulated changes to our delegate
+- (void)notifyDelegate;
+
 @end
 
 
 @implementation ServerBrowser
 
-@synthesize servers;
 @synthesize delegate;
 
 // Initialize
 - (id)init {
   servers = [[NSMutableArray alloc] init];
+  addedServers = [[NSMutableArray alloc] init];
+  removedServers = [[NSMutableArray alloc] init];
   return self;
 }
 
@@ -68,6 +72,10 @@
     [servers release];
     servers = nil;
   }
+  [addedServers release];
+  addedServers = nil;
+  [removedServers release];
+  removedServers = nil;
   self.delegate = nil;
   [super dealloc];
 }
@@ -103,12 +111,44 @@
   netServiceBrowser = nil;
   
   [servers removeAllObjects];
+  [addedServers removeAllObjects];
+  [removedServers removeAllObjects];
+}
+
+
+// Sorted lazily, only when somebody actually looks at the list
+- (NSArray*)servers {
+  [self sortServers];
+  return servers;
 }
 
 
 // Sort servers array by service names
 - (void)sortServers {
+  if ( ! needsSort ) {
+    return;
+  }
+
   [servers sortUsingSelector:@selector(localizedCaseInsensitiveCompareByName:)];
+  needsSort = NO;
+}
+
+
+- (void)notifyDelegate {
+  if ( [delegate respondsToSelector:@selector(serverBrowser:addedServers:removedServers:)] ) {
+    NSArray* added = [[addedServers copy] autorelease];
+    NSArray* removed = [[removedServers copy] autorelease];
+    [addedServers removeAllObjects];
+    [removedServers removeAllObjects];
+    [delegate serverBrowser:self addedServers:added removedServers:removed];
+    return;
+  }
+
+  [addedServers removeAllObjects];
+  [removedServers removeAllObjects];
+  if ( [delegate respondsToSelector:@selector(updateServerList)] ) {
+    [delegate updateServerList];
+  }
 }
 
 
@@ -121,6 +161,14 @@
   if ( ! [servers containsObject:netService] ) {
     // Add it to our list
     [servers addObject:netService];
+    needsSort = YES;
+
+    // A service that went away and came back within one batch is not a change
+    if ( [removedServers containsObject:netService] ) {
+      [removedServers removeObject:netService];
+    } else {
+      [addedServers addObject:netService];
+    }
   }
 
   // If more entries are coming, no need to update UI just yet
@@ -128,25 +176,29 @@
     return;
   }
   
-  // Sort alphabetically and let our delegate know
-  [self sortServers];
-  [delegate updateServerList];
+  [self notifyDelegate];
 }
 
 
 // Service was removed
 - (void)netServiceBrowser:(NSNetServiceBrowser *)netServiceBrowser didRemoveService:(NSNetService *)netService moreComing:(BOOL)moreServicesComing {
-  // Remove from list
-  [servers removeObject:netService];
+  // Remove from list, removing keeps the remaining order
+  if ( [servers containsObject:netService] ) {
+    [servers removeObject:netService];
+
+    if ( [addedServers containsObject:netService] ) {
+      [addedServers removeObject:netService];
+    } else {
+      [removedServers addObject:netService];
+    }
+  }
 
   // If more entries are coming, no need to update UI just yet
   if ( moreServicesComing ) {
     return;
   }
   
-  // Sort alphabetically and let our delegate know
-  [self sortServers];
-  [delegate updateServerList];
+  [self notifyDelegate];
 }
 
 @end
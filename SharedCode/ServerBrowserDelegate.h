@@ -27,8 +27,17 @@
 
 #import <Foundation/Foundation.h>
 
-@protocol ServerBrowserDelegate
+@class ServerBrowser;
 
+@protocol ServerBrowserDelegate <NSObject>
+
+@optional
+
+// Called with the services that appeared and disappeared since the last call.
+// When implemented, updateServerList is not called.
+- (void)serverBrowser:(ServerBrowser*)browser addedServers:(NSArray*)added removedServers:(NSArray*)removed;
+
+// Called after any change, the full list is in -[ServerBrowser servers]
 - (void)updateServerList;
 
 @end
@@ -0,0 +1,75 @@
+//
+//  ZSyncHistogram.h
+//  ZSync
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import <Foundation/Foundation.h>
+
+/* Histograms are registered by name, round trips are keyed by the zsAction
+ * of the request and handler times by the zsAction being handled.
+ */
+#define zsHistogramRoundTrip(__ACTION__) [NSString stringWithFormat:@"rtt.%@", __ACTION__]
+#define zsHistogramHandler(__ACTION__) [NSString stringWithFormat:@"handler.%@", __ACTION__]
+
+#define kZSyncHistogramSubBucketBits 5
+#define kZSyncHistogramSubBucketCount (1 << kZSyncHistogramSubBucketBits)
+#define kZSyncHistogramSubBucketHalf (kZSyncHistogramSubBucketCount / 2)
+#define kZSyncHistogramBucketCount (32 - kZSyncHistogramSubBucketBits + 1)
+#define kZSyncHistogramCountsLength ((kZSyncHistogramBucketCount + 1) * kZSyncHistogramSubBucketHalf)
+
+/* A log-linear latency histogram in the style of HdrHistogram.  Values are
+ * recorded in microseconds into buckets that keep within six percent of the
+ * value from one microsecond up to 71 minutes, anything longer lands in
+ * the last bucket.  Recording is a lock and an increment so it can stay on in
+ * production, a histogram is a fixed 2 KB.
+ */
+@interface ZSyncHistogram : NSObject
+{
+  uint32_t counts[kZSyncHistogramCountsLength];
+  uint64_t totalCount;
+  uint64_t totalMicroseconds;
+  uint64_t minimum;
+  uint64_t maximum;
+}
+
++ (ZSyncHistogram *)histogramNamed:(NSString *)name;
++ (void)recordValue:(NSTimeInterval)seconds inHistogramNamed:(NSString *)name;
+
+/* The summary of every registered histogram keyed by name */
++ (NSDictionary *)summaries;
++ (void)resetAll;
+
+- (void)recordValue:(NSTimeInterval)seconds;
+- (NSTimeInterval)valueAtPercentile:(double)percentile;
+- (uint64_t)totalCount;
+
+/* Count, mean, min, max and the 50th, 90th, 99th and 99.9th percentiles in
+ * seconds
+ */
+- (NSDictionary *)summary;
+
+- (void)reset;
+
+@end
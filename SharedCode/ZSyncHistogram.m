@@ -0,0 +1,198 @@
+//
+//  ZSyncHistogram.m
+//  ZSync
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import "ZSyncHistogram.h"
+
+static NSMutableDictionary *registeredHistograms;
+
+static NSUInteger indexForValue(uint64_t value)
+{
+  if (value < kZSyncHistogramSubBucketCount) {
+    return (NSUInteger)value;
+  }
+
+  // Position of the highest bit above the sub bucket range picks the bucket
+  NSUInteger bucket = 0;
+  while ((value >> bucket) >= kZSyncHistogramSubBucketCount) {
+    ++bucket;
+  }
+  bucket = MIN(bucket, (NSUInteger)(kZSyncHistogramBucketCount - 1));
+
+  NSUInteger subBucket = (NSUInteger)MIN(value >> bucket, (uint64_t)(kZSyncHistogramSubBucketCount - 1));
+  return ((bucket + 1) * kZSyncHistogramSubBucketHalf) + (subBucket - kZSyncHistogramSubBucketHalf);
+}
+
+static uint64_t highestValueForIndex(NSUInteger index)
+{
+  if (index < kZSyncHistogramSubBucketCount) {
+    return index;
+  }
+
+  NSUInteger bucket = (index / kZSyncHistogramSubBucketHalf) - 1;
+  uint64_t subBucket = (index % kZSyncHistogramSubBucketHalf) + kZSyncHistogramSubBucketHalf;
+  return ((subBucket + 1) << bucket) - 1;
+}
+
+@implementation ZSyncHistogram
+
++ (ZSyncHistogram *)histogramNamed:(NSString *)name
+{
+  @synchronized([ZSyncHistogram class])
+  {
+    if (!registeredHistograms) {
+      registeredHistograms = [[NSMutableDictionary alloc] init];
+    }
+
+    ZSyncHistogram *histogram = [registeredHistograms objectForKey:name];
+    if (!histogram) {
+      histogram = [[ZSyncHistogram alloc] init];
+      [registeredHistograms setObject:histogram forKey:name];
+      [histogram release];
+    }
+
+    return histogram;
+  }
+}
+
++ (void)recordValue:(NSTimeInterval)seconds inHistogramNamed:(NSString *)name
+{
+  [[self histogramNamed:name] recordValue:seconds];
+}
+
++ (NSDictionary *)summaries
+{
+  NSMutableDictionary *summaries = [NSMutableDictionary dictionary];
+  @synchronized([ZSyncHistogram class])
+  {
+    for (NSString *name in registeredHistograms) {
+      [summaries setObject:[[registeredHistograms objectForKey:name] summary] forKey:name];
+    }
+  }
+
+  return summaries;
+}
+
++ (void)resetAll
+{
+  @synchronized([ZSyncHistogram class])
+  {
+    [[registeredHistograms allValues] makeObjectsPerformSelector:@selector(reset)];
+  }
+}
+
+- (id)init
+{
+  if (!(self = [super init])) return nil;
+
+  minimum = UINT64_MAX;
+
+  return self;
+}
+
+#pragma mark -
+#pragma mark Public methods
+
+- (void)recordValue:(NSTimeInterval)seconds
+{
+  uint64_t value = (uint64_t)MAX(seconds * 1000000.0, 0.0);
+
+  @synchronized(self)
+  {
+    ++counts[indexForValue(value)];
+    ++totalCount;
+    totalMicroseconds += value;
+    minimum = MIN(minimum, value);
+    maximum = MAX(maximum, value);
+  }
+}
+
+- (NSTimeInterval)valueAtPercentile:(double)percentile
+{
+  @synchronized(self)
+  {
+    if (!totalCount) {
+      return 0.0;
+    }
+
+    uint64_t target = (uint64_t)ceil((MIN(percentile, 100.0) / 100.0) * totalCount);
+    target = MAX(target, (uint64_t)1);
+
+    uint64_t seen = 0;
+    for (NSUInteger index = 0; index < kZSyncHistogramCountsLength; ++index) {
+      seen += counts[index];
+      if (seen >= target) {
+        return MIN(highestValueForIndex(index), maximum) / 1000000.0;
+      }
+    }
+
+    return maximum / 1000000.0;
+  }
+}
+
+- (uint64_t)totalCount
+{
+  @synchronized(self)
+  {
+    return totalCount;
+  }
+}
+
+- (NSDictionary *)summary
+{
+  NSMutableDictionary *summary = [NSMutableDictionary dictionary];
+  @synchronized(self)
+  {
+    [summary setObject:[NSNumber numberWithUnsignedLongLong:totalCount] forKey:@"count"];
+    if (!totalCount) {
+      return summary;
+    }
+
+    [summary setObject:[NSNumber numberWithDouble:(totalMicroseconds / (double)totalCount / 1000000.0)] forKey:@"mean"];
+    [summary setObject:[NSNumber numberWithDouble:(minimum / 1000000.0)] forKey:@"min"];
+    [summary setObject:[NSNumber numberWithDouble:(maximum / 1000000.0)] forKey:@"max"];
+    [summary setObject:[NSNumber numberWithDouble:[self valueAtPercentile:50.0]] forKey:@"p50"];
+    [summary setObject:[NSNumber numberWithDouble:[self valueAtPercentile:90.0]] forKey:@"p90"];
+    [summary setObject:[NSNumber numberWithDouble:[self valueAtPercentile:99.0]] forKey:@"p99"];
+    [summary setObject:[NSNumber numberWithDouble:[self valueAtPercentile:99.9]] forKey:@"p999"];
+  }
+
+  return summary;
+}
+
+- (void)reset
+{
+  @synchronized(self)
+  {
+    memset(counts, 0, sizeof(counts));
+    totalCount = 0;
+    totalMicroseconds = 0;
+    minimum = UINT64_MAX;
+    maximum = 0;
+  }
+}
+
+@end
@@ -0,0 +1,53 @@
+//
+//  ZSyncMemory.h
+//  ZSync
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import <Foundation/Foundation.h>
+
+/* Memory figures for the current process as the kernel reports them.  Cheap
+ * enough to sample at every sync phase boundary.
+ */
+@interface ZSyncMemory : NSObject
+
+/* Resident size in bytes */
++ (NSUInteger)residentSize;
+
+/* The highest resident size the process has reached since it started */
++ (NSUInteger)peakResidentSize;
+
+/* Bytes in pages the process has written to.  Unlike clean pages, such as
+ * those of a mapped file that was only read, these cannot be dropped under
+ * memory pressure so they are what gets an iPhone application killed.
+ * Walks every VM region so it is slower than -residentSize.
+ */
++ (NSUInteger)dirtySize;
+
+/* Resident, peak resident and dirty size keyed "resident", "peakResident"
+ * and "dirty"
+ */
++ (NSDictionary *)snapshot;
+
+@end
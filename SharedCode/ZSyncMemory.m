@@ -0,0 +1,86 @@
+//
+//  ZSyncMemory.m
+//  ZSync
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import <mach/mach.h>
+#import <sys/resource.h>
+#import "ZSyncMemory.h"
+
+@implementation ZSyncMemory
+
++ (NSUInteger)residentSize
+{
+  struct task_basic_info info;
+  mach_msg_type_number_t count = TASK_BASIC_INFO_COUNT;
+  if (task_info(mach_task_self(), TASK_BASIC_INFO, (task_info_t)&info, &count) != KERN_SUCCESS) {
+    return 0;
+  }
+
+  return info.resident_size;
+}
+
++ (NSUInteger)peakResidentSize
+{
+  // ru_maxrss is in bytes on Darwin, not kilobytes as on Linux
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+
+  return (NSUInteger)usage.ru_maxrss;
+}
+
++ (NSUInteger)dirtySize
+{
+  NSUInteger dirty = 0;
+  vm_address_t address = 0;
+  vm_size_t size = 0;
+  for (;;) {
+    vm_region_extended_info_data_t info;
+    mach_msg_type_number_t count = VM_REGION_EXTENDED_INFO_COUNT;
+    mach_port_t objectName = MACH_PORT_NULL;
+    if (vm_region_64(mach_task_self(), &address, &size, VM_REGION_EXTENDED_INFO, (vm_region_info_t)&info, &count, &objectName) != KERN_SUCCESS) {
+      break;
+    }
+
+    dirty += (NSUInteger)info.pages_dirtied * vm_page_size;
+    address += size;
+  }
+
+  return dirty;
+}
+
++ (NSDictionary *)snapshot
+{
+  NSMutableDictionary *snapshot = [NSMutableDictionary dictionary];
+  [snapshot setValue:[NSNumber numberWithUnsignedInteger:[self residentSize]] forKey:@"resident"];
+  [snapshot setValue:[NSNumber numberWithUnsignedInteger:[self peakResidentSize]] forKey:@"peakResident"];
+  [snapshot setValue:[NSNumber numberWithUnsignedInteger:[self dirtySize]] forKey:@"dirty"];
+
+  return snapshot;
+}
+
+@end
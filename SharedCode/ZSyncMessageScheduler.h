@@ -0,0 +1,126 @@
+//
+//  ZSyncMessageScheduler.h
+//  ZSync
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import "ZSyncShared.h"
+
+@class ZSyncSessionRecorder;
+@class ZSyncMessageScheduler;
+
+@protocol ZSyncMessageSchedulerDelegate <NSObject>
+
+@optional
+
+/* Sent as the peer acknowledges each chunk of a store body */
+- (void)messageScheduler:(ZSyncMessageScheduler *)scheduler acknowledgedBytes:(NSUInteger)length ofStore:(NSString *)storeIdentifier;
+
+@end
+
+typedef enum {
+  ZSyncMessagePriorityControl = 0,
+  ZSyncMessagePriorityNormal,
+  ZSyncMessagePriorityBulk,
+  ZSyncMessagePriorityCount
+} ZSyncMessagePriority;
+
+/* Decides the order in which outgoing requests are handed to a BLIPConnection.
+ * The BLIP writer itself only knows about the urgent flag, so store bodies are
+ * cut into chunks here and only a small window of chunks is allowed inside
+ * BLIP at any one time.  The queues are drained with a weighted round robin
+ * so a control message waits behind at most a window of chunks instead of an
+ * entire store.
+ */
+@interface ZSyncMessageScheduler : NSObject
+{
+  BLIPConnection *_connection;
+  id<ZSyncMessageSchedulerDelegate> delegate;
+
+  NSMutableArray *queues;
+  NSMutableDictionary *outstandingResponses;
+  NSMutableDictionary *pendingRoundTrips;
+  ZSyncSessionRecorder *recorder;
+
+  NSUInteger weights[ZSyncMessagePriorityCount];
+  NSUInteger inFlight[ZSyncMessagePriorityCount];
+
+  NSUInteger dispatchCount[ZSyncMessagePriorityCount];
+  NSTimeInterval totalQueueDelay[ZSyncMessagePriorityCount];
+  NSTimeInterval maximumQueueDelay[ZSyncMessagePriorityCount];
+
+  NSUInteger chunkSize;
+  NSUInteger bulkWindow;
+}
+
+@property (nonatomic, readonly) BLIPConnection *connection;
+@property (nonatomic, assign) id<ZSyncMessageSchedulerDelegate> delegate;
+@property (nonatomic, assign) NSUInteger chunkSize;
+@property (nonatomic, assign) NSUInteger bulkWindow;
+/* When set every request sent, every response received and every request
+ * passed to requestReceived: is written to the capture file
+ */
+@property (nonatomic, retain) ZSyncSessionRecorder *recorder;
+
+- (id)initWithConnection:(BLIPConnection *)connection;
+
+/* Number of messages drained from a class on each pass of the round robin */
+- (void)setWeight:(NSUInteger)weight forPriority:(ZSyncMessagePriority)priority;
+
+/* Control requests are also flagged urgent so BLIP favors their frames */
+- (void)sendRequest:(BLIPRequest *)request priority:(ZSyncMessagePriority)priority;
+
+/* Queues a store body in the bulk class.  The data is sliced lazily as the
+ * window opens up so a mapped file is never copied as a whole.  Every chunk
+ * carries the given properties plus zsChunkIndex, zsChunkCount,
+ * zsChunkOffset and zsChunkTotalLength.
+ */
+- (void)sendStoreData:(NSData *)data properties:(NSDictionary *)properties compressed:(BOOL)compressed;
+
+/* Must be called for every response received on the connection.  Returns YES
+ * if the response acknowledged a chunk sent by the scheduler.  The time from
+ * queueing the request to its response is recorded in the round trip
+ * ZSyncHistogram of the request's zsAction.
+ */
+- (BOOL)responseReceived:(BLIPResponse *)response;
+
+/* Called for every request received on the connection so it can be recorded */
+- (void)requestReceived:(BLIPRequest *)request;
+
+/* Drops everything that has not been handed to BLIP yet */
+- (void)cancelAllMessages;
+
+/* Records how long the receiving side spent handling a request */
++ (void)recordHandlerTime:(NSTimeInterval)duration forRequest:(BLIPRequest *)request;
+
+/* Messages still queued plus chunks waiting for their acknowledgement */
+- (NSUInteger)pendingMessageCount;
+
+/* Per class queueing delay, keyed by class name.  Each entry holds the number
+ * of messages dispatched, the mean and maximum delay in seconds and the
+ * number of messages still queued.
+ */
+- (NSDictionary *)queueStatistics;
+
+@end
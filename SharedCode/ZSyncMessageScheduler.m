@@ -0,0 +1,359 @@
+//
+//  ZSyncMessageScheduler.m
+//  ZSync
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import "ZSyncMessageScheduler.h"
+#import "ZSyncHistogram.h"
+#import "ZSyncSessionRecorder.h"
+
+#define kDefaultChunkSize (128 * 1024)
+#define kDefaultBulkWindow 4
+
+static NSString * const priorityNames[ZSyncMessagePriorityCount] = { @"control", @"normal", @"bulk" };
+
+#pragma mark -
+
+/* A queued message.  Either a single request or a store body that is cut
+ * into chunk requests as the scheduler asks for them.
+ */
+@interface ZSyncScheduledMessage : NSObject
+{
+  BLIPRequest *request;
+
+  NSData *storeData;
+  NSDictionary *properties;
+  BOOL compressed;
+  NSUInteger chunkIndex;
+  NSUInteger chunkCount;
+
+  CFAbsoluteTime enqueueTime;
+}
+
+@property (nonatomic, retain) BLIPRequest *request;
+@property (nonatomic, retain) NSData *storeData;
+@property (nonatomic, copy) NSDictionary *properties;
+@property (nonatomic, assign) BOOL compressed;
+@property (nonatomic, assign) NSUInteger chunkCount;
+@property (nonatomic, assign) CFAbsoluteTime enqueueTime;
+
+- (BLIPRequest *)nextRequestWithChunkSize:(NSUInteger)chunkSize;
+- (BOOL)isFinished;
+
+@end
+
+@implementation ZSyncScheduledMessage
+
+- (BLIPRequest *)nextRequestWithChunkSize:(NSUInteger)chunkSize
+{
+  if ([self request]) {
+    BLIPRequest *result = [[[self request] retain] autorelease];
+    [self setRequest:nil];
+    return result;
+  }
+
+  NSUInteger offset = chunkIndex * chunkSize;
+  NSUInteger length = MIN(chunkSize, [[self storeData] length] - offset);
+  NSData *body = [[self storeData] subdataWithRange:NSMakeRange(offset, length)];
+
+  NSMutableDictionary *chunkProperties = [[self properties] mutableCopy];
+  [chunkProperties setValue:zsActID(chunkIndex) forKey:zsChunkIndex];
+  [chunkProperties setValue:zsActID(chunkCount) forKey:zsChunkCount];
+  [chunkProperties setValue:[NSString stringWithFormat:@"%qu", (unsigned long long)offset] forKey:zsChunkOffset];
+  [chunkProperties setValue:[NSString stringWithFormat:@"%qu", (unsigned long long)[[self storeData] length]] forKey:zsChunkTotalLength];
+
+  BLIPRequest *chunk = [BLIPRequest requestWithBody:body properties:chunkProperties];
+  [chunk setCompressed:[self compressed]];
+  [chunkProperties release], chunkProperties = nil;
+
+  ++chunkIndex;
+  if (chunkIndex == chunkCount) {
+    [self setStoreData:nil];
+  }
+
+  return chunk;
+}
+
+- (BOOL)isFinished
+{
+  return (![self request] && ![self storeData]);
+}
+
+- (void)dealloc
+{
+  [request release], request = nil;
+  [storeData release], storeData = nil;
+  [properties release], properties = nil;
+
+  [super dealloc];
+}
+
+@synthesize request;
+@synthesize storeData;
+@synthesize properties;
+@synthesize compressed;
+@synthesize chunkCount;
+@synthesize enqueueTime;
+
+@end
+
+#pragma mark -
+
+@interface ZSyncMessageScheduler ()
+
+- (void)dispatch;
+- (void)recordQueueDelay:(NSTimeInterval)delay forPriority:(ZSyncMessagePriority)priority;
+
+@end
+
+@implementation ZSyncMessageScheduler
+
+- (id)initWithConnection:(BLIPConnection *)connection
+{
+  if (!(self = [super init])) return nil;
+
+  _connection = [connection retain];
+
+  queues = [[NSMutableArray alloc] init];
+  for (NSUInteger priority = 0; priority < ZSyncMessagePriorityCount; ++priority) {
+    [queues addObject:[NSMutableArray array]];
+  }
+  outstandingResponses = [[NSMutableDictionary alloc] init];
+  pendingRoundTrips = [[NSMutableDictionary alloc] init];
+
+  weights[ZSyncMessagePriorityControl] = 8;
+  weights[ZSyncMessagePriorityNormal] = 4;
+  weights[ZSyncMessagePriorityBulk] = 1;
+
+  chunkSize = kDefaultChunkSize;
+  bulkWindow = kDefaultBulkWindow;
+
+  return self;
+}
+
+#pragma mark -
+#pragma mark Public methods
+
+- (void)setWeight:(NSUInteger)weight forPriority:(ZSyncMessagePriority)priority
+{
+  ZAssert(priority < ZSyncMessagePriorityCount, @"Unknown priority: %i", priority);
+  weights[priority] = MAX(weight, (NSUInteger)1);
+}
+
+- (void)sendRequest:(BLIPRequest *)request priority:(ZSyncMessagePriority)priority
+{
+  ZAssert(priority < ZSyncMessagePriorityCount, @"Unknown priority: %i", priority);
+  if (priority == ZSyncMessagePriorityControl) {
+    [request setUrgent:YES];
+  }
+
+  ZSyncScheduledMessage *message = [[ZSyncScheduledMessage alloc] init];
+  [message setRequest:request];
+  [message setEnqueueTime:CFAbsoluteTimeGetCurrent()];
+  [[queues objectAtIndex:priority] addObject:message];
+  [message release], message = nil;
+
+  [self dispatch];
+}
+
+- (void)sendStoreData:(NSData *)data properties:(NSDictionary *)properties compressed:(BOOL)compressed
+{
+  NSUInteger count = ([data length] + [self chunkSize] - 1) / [self chunkSize];
+
+  ZSyncScheduledMessage *message = [[ZSyncScheduledMessage alloc] init];
+  [message setStoreData:(data ? data : [NSData data])];
+  [message setProperties:properties];
+  [message setCompressed:compressed];
+  [message setChunkCount:MAX(count, (NSUInteger)1)];
+  [message setEnqueueTime:CFAbsoluteTimeGetCurrent()];
+  [[queues objectAtIndex:ZSyncMessagePriorityBulk] addObject:message];
+  [message release], message = nil;
+
+  [self dispatch];
+}
+
+- (BOOL)responseReceived:(BLIPResponse *)response
+{
+  [[self recorder] recordMessage:response kind:zsCaptureKindResponse];
+
+  NSValue *key = [NSValue valueWithNonretainedObject:response];
+  NSArray *roundTrip = [pendingRoundTrips objectForKey:key];
+  if (roundTrip) {
+    NSTimeInterval elapsed = CFAbsoluteTimeGetCurrent() - [[roundTrip objectAtIndex:1] doubleValue];
+    [ZSyncHistogram recordValue:elapsed inHistogramNamed:zsHistogramRoundTrip([roundTrip objectAtIndex:0])];
+    [pendingRoundTrips removeObjectForKey:key];
+  }
+
+  NSArray *chunk = [[[outstandingResponses objectForKey:key] retain] autorelease];
+  if (!chunk) {
+    return NO;
+  }
+
+  [outstandingResponses removeObjectForKey:key];
+  --inFlight[ZSyncMessagePriorityBulk];
+  if ([[self delegate] respondsToSelector:@selector(messageScheduler:acknowledgedBytes:ofStore:)]) {
+    NSString *storeIdentifier = ([chunk count] > 1 ? [chunk objectAtIndex:1] : nil);
+    [[self delegate] messageScheduler:self acknowledgedBytes:[[chunk objectAtIndex:0] unsignedIntegerValue] ofStore:storeIdentifier];
+  }
+  [self dispatch];
+
+  return YES;
+}
+
+- (void)requestReceived:(BLIPRequest *)request
+{
+  [[self recorder] recordMessage:request kind:zsCaptureKindReceived];
+}
+
+- (void)cancelAllMessages
+{
+  DLog(@"%s", __PRETTY_FUNCTION__);
+  for (NSMutableArray *queue in queues) {
+    [queue removeAllObjects];
+  }
+  [outstandingResponses removeAllObjects];
+  [pendingRoundTrips removeAllObjects];
+  inFlight[ZSyncMessagePriorityBulk] = 0;
+}
+
++ (void)recordHandlerTime:(NSTimeInterval)duration forRequest:(BLIPRequest *)request
+{
+  NSString *action = [request valueOfProperty:zsAction];
+  [ZSyncHistogram recordValue:duration inHistogramNamed:zsHistogramHandler(action ? action : @"none")];
+}
+
+- (NSUInteger)pendingMessageCount
+{
+  NSUInteger count = [outstandingResponses count];
+  for (NSMutableArray *queue in queues) {
+    count += [queue count];
+  }
+
+  return count;
+}
+
+- (NSDictionary *)queueStatistics
+{
+  NSMutableDictionary *statistics = [NSMutableDictionary dictionary];
+  for (NSUInteger priority = 0; priority < ZSyncMessagePriorityCount; ++priority) {
+    NSTimeInterval mean = 0.0;
+    if (dispatchCount[priority]) {
+      mean = totalQueueDelay[priority] / dispatchCount[priority];
+    }
+
+    NSMutableDictionary *entry = [NSMutableDictionary dictionary];
+    [entry setValue:[NSNumber numberWithUnsignedInteger:dispatchCount[priority]] forKey:@"count"];
+    [entry setValue:[NSNumber numberWithDouble:mean] forKey:@"meanDelay"];
+    [entry setValue:[NSNumber numberWithDouble:maximumQueueDelay[priority]] forKey:@"maximumDelay"];
+    [entry setValue:[NSNumber numberWithUnsignedInteger:[[queues objectAtIndex:priority] count]] forKey:@"queued"];
+    [statistics setValue:entry forKey:priorityNames[priority]];
+  }
+
+  return statistics;
+}
+
+#pragma mark -
+#pragma mark Local methods
+
+- (void)dispatch
+{
+  TCPConnectionStatus status = [[self connection] status];
+  if (status == kTCP_Closing || status == kTCP_Closed || status == kTCP_Disconnected) {
+    return;
+  }
+
+  BOOL dispatched;
+  do {
+    dispatched = NO;
+    for (NSUInteger priority = 0; priority < ZSyncMessagePriorityCount; ++priority) {
+      NSMutableArray *queue = [queues objectAtIndex:priority];
+      for (NSUInteger sent = 0; sent < weights[priority] && [queue count]; ++sent) {
+        if (priority == ZSyncMessagePriorityBulk && inFlight[priority] >= [self bulkWindow]) {
+          break;
+        }
+
+        ZSyncScheduledMessage *message = [[queue objectAtIndex:0] retain];
+        CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+        CFAbsoluteTime queuedAt = [message enqueueTime];
+        [self recordQueueDelay:(now - queuedAt) forPriority:priority];
+
+        BLIPRequest *request = [message nextRequestWithChunkSize:[self chunkSize]];
+        if ([message isFinished]) {
+          [queue removeObjectAtIndex:0];
+        } else {
+          // The next chunk starts waiting once this one has been handed off
+          [message setEnqueueTime:now];
+        }
+        [message release], message = nil;
+
+        BLIPResponse *response = [[self connection] sendRequest:request];
+        [[self recorder] recordMessage:request kind:zsCaptureKindSent];
+        if (![request noReply]) {
+          // Queueing is part of the latency the caller sees
+          NSString *action = [request valueOfProperty:zsAction];
+          NSArray *roundTrip = [NSArray arrayWithObjects:(action ? action : @"none"), [NSNumber numberWithDouble:queuedAt], nil];
+          [pendingRoundTrips setObject:roundTrip forKey:[NSValue valueWithNonretainedObject:response]];
+        }
+        if (priority == ZSyncMessagePriorityBulk && ![request noReply]) {
+          // The length and store are kept for the delegate's progress report
+          NSArray *chunk = [NSArray arrayWithObjects:[NSNumber numberWithUnsignedInteger:[[request body] length]], [request valueOfProperty:zsStoreIdentifier], nil];
+          [outstandingResponses setObject:chunk forKey:[NSValue valueWithNonretainedObject:response]];
+          ++inFlight[priority];
+        }
+        dispatched = YES;
+      }
+    }
+  } while (dispatched);
+}
+
+- (void)recordQueueDelay:(NSTimeInterval)delay forPriority:(ZSyncMessagePriority)priority
+{
+  ++dispatchCount[priority];
+  totalQueueDelay[priority] += delay;
+  maximumQueueDelay[priority] = MAX(maximumQueueDelay[priority], delay);
+}
+
+#pragma mark -
+#pragma mark Memory management and property declarations
+
+- (void)dealloc
+{
+  [_connection release], _connection = nil;
+  [queues release], queues = nil;
+  [outstandingResponses release], outstandingResponses = nil;
+  [pendingRoundTrips release], pendingRoundTrips = nil;
+  [recorder close];
+  [recorder release], recorder = nil;
+
+  [super dealloc];
+}
+
+@synthesize connection = _connection;
+@synthesize delegate;
+@synthesize chunkSize;
+@synthesize bulkWindow;
+@synthesize recorder;
+
+@end
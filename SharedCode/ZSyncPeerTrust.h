@@ -0,0 +1,60 @@
+//
+//  ZSyncPeerTrust.h
+//  ZSync
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import "ZSyncShared.h"
+
+/* Remembers the certificates that have been authorized for each peer so a
+ * repeat connection only has to compare a fingerprint instead of building and
+ * evaluating a trust chain during the TLS handshake.
+ *
+ * A peer that has been seen before is pinned to the certificates recorded for
+ * it; a different certificate is refused until the peer is forgotten (which
+ * happens when the pairing is removed).  Passing a nil peer uses a shared,
+ * unpinned bucket for callers that cannot identify the peer before the
+ * handshake completes.
+ */
+@interface ZSyncPeerTrust : NSObject
+{
+  NSString *defaultsKey;
+  NSMutableDictionary *fingerprints;
+
+  NSUInteger cacheHits;
+  NSUInteger cacheMisses;
+}
+
+@property (nonatomic, readonly) NSUInteger cacheHits;
+@property (nonatomic, readonly) NSUInteger cacheMisses;
+
+/* The cache is persisted in the standard user defaults under the given key */
+- (id)initWithDefaultsKey:(NSString *)key;
+
++ (NSString *)fingerprintOfCertificate:(SecCertificateRef)certificate;
+
+- (BOOL)authorizeCertificate:(SecCertificateRef)certificate forPeer:(NSString *)peer;
+- (void)forgetPeer:(NSString *)peer;
+
+@end
@@ -0,0 +1,198 @@
+//
+//  ZSyncPeerTrust.m
+//  ZSync
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import "ZSyncPeerTrust.h"
+#import "NSData+ZSExtensions.h"
+
+#define kAnyPeer @"*"
+#define kMaximumUnpinnedFingerprints 64
+
+@interface ZSyncPeerTrust ()
+
+- (BOOL)evaluateCertificate:(SecCertificateRef)certificate;
+- (void)save;
+
+@end
+
+@implementation ZSyncPeerTrust
+
++ (NSString *)fingerprintOfCertificate:(SecCertificateRef)certificate
+{
+#if TARGET_OS_IPHONE
+  NSData *data = [(NSData *)SecCertificateCopyData(certificate) autorelease];
+#else
+  CSSM_DATA cssmData;
+  if (SecCertificateGetData(certificate, &cssmData) != noErr) {
+    return nil;
+  }
+  NSData *data = [NSData dataWithBytes:cssmData.Data length:cssmData.Length];
+#endif
+  if (!data) {
+    return nil;
+  }
+
+  return [data zsDigest];
+}
+
+- (id)initWithDefaultsKey:(NSString *)key
+{
+  if (!(self = [super init])) return nil;
+
+  defaultsKey = [key copy];
+
+  fingerprints = [[NSMutableDictionary alloc] init];
+  NSDictionary *stored = [[NSUserDefaults standardUserDefaults] dictionaryForKey:defaultsKey];
+  for (NSString *peer in stored) {
+    [fingerprints setObject:[NSMutableArray arrayWithArray:[stored objectForKey:peer]] forKey:peer];
+  }
+
+  return self;
+}
+
+#pragma mark -
+#pragma mark Public methods
+
+- (BOOL)authorizeCertificate:(SecCertificateRef)certificate forPeer:(NSString *)peer
+{
+  NSString *fingerprint = [ZSyncPeerTrust fingerprintOfCertificate:certificate];
+  if (!fingerprint) {
+    DLog(@"%s unable to fingerprint certificate", __PRETTY_FUNCTION__);
+    return NO;
+  }
+
+  NSString *key = (peer ? peer : kAnyPeer);
+  NSMutableArray *known = [fingerprints objectForKey:key];
+  if ([known containsObject:fingerprint]) {
+    ++cacheHits;
+    return YES;
+  }
+
+  ++cacheMisses;
+  if (peer && [known count]) {
+    DLog(@"%s certificate %@ does not match the one pinned for %@", __PRETTY_FUNCTION__, fingerprint, peer);
+    return NO;
+  }
+
+  if (![self evaluateCertificate:certificate]) {
+    return NO;
+  }
+
+  if (!known) {
+    known = [NSMutableArray array];
+    [fingerprints setObject:known forKey:key];
+  }
+  [known addObject:fingerprint];
+  if ([known count] > kMaximumUnpinnedFingerprints) {
+    [known removeObjectAtIndex:0];
+  }
+  [self save];
+
+  return YES;
+}
+
+- (void)forgetPeer:(NSString *)peer
+{
+  if (!peer || ![fingerprints objectForKey:peer]) {
+    return;
+  }
+
+  [fingerprints removeObjectForKey:peer];
+  [self save];
+}
+
+#pragma mark -
+#pragma mark Local methods
+
+/* Peers use self signed identities so an untrusted root is expected and
+ * treated as recoverable.  What this catches is a certificate that is
+ * malformed, expired or explicitly distrusted.
+ */
+- (BOOL)evaluateCertificate:(SecCertificateRef)certificate
+{
+  SecPolicyRef policy = NULL;
+#if TARGET_OS_IPHONE
+  policy = SecPolicyCreateBasicX509();
+#else
+  SecPolicySearchRef search = NULL;
+  if (SecPolicySearchCreate(CSSM_CERT_X_509v3, &CSSMOID_APPLE_X509_BASIC, NULL, &search) == noErr) {
+    SecPolicySearchCopyNext(search, &policy);
+    CFRelease(search);
+  }
+#endif
+  if (!policy) {
+    DLog(@"%s unable to create a trust policy", __PRETTY_FUNCTION__);
+    return NO;
+  }
+
+  NSArray *certificates = [NSArray arrayWithObject:(id)certificate];
+  SecTrustRef trust = NULL;
+  OSStatus status = SecTrustCreateWithCertificates((CFArrayRef)certificates, policy, &trust);
+  CFRelease(policy);
+  if (status != noErr) {
+    DLog(@"%s SecTrustCreateWithCertificates failed: %i", __PRETTY_FUNCTION__, status);
+    return NO;
+  }
+
+  SecTrustResultType result = kSecTrustResultInvalid;
+  status = SecTrustEvaluate(trust, &result);
+  CFRelease(trust);
+  if (status != noErr) {
+    DLog(@"%s SecTrustEvaluate failed: %i", __PRETTY_FUNCTION__, status);
+    return NO;
+  }
+
+  switch (result) {
+    case kSecTrustResultProceed:
+    case kSecTrustResultUnspecified:
+    case kSecTrustResultRecoverableTrustFailure:
+      return YES;
+    default:
+      DLog(@"%s certificate rejected with trust result %i", __PRETTY_FUNCTION__, result);
+      return NO;
+  }
+}
+
+- (void)save
+{
+  [[NSUserDefaults standardUserDefaults] setObject:fingerprints forKey:defaultsKey];
+}
+
+#pragma mark -
+#pragma mark Memory management and property declarations
+
+- (void)dealloc
+{
+  [defaultsKey release], defaultsKey = nil;
+  [fingerprints release], fingerprints = nil;
+
+  [super dealloc];
+}
+
+@synthesize cacheHits;
+@synthesize cacheMisses;
+
+@end
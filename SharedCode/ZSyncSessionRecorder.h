@@ -0,0 +1,104 @@
+//
+//  ZSyncSessionRecorder.h
+//  ZSync
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import "ZSyncShared.h"
+
+#define zsCaptureExtension @"zscapture"
+
+#define zsCaptureKind @"kind"
+#define zsCaptureTime @"time"
+#define zsCaptureNumber @"number"
+#define zsCaptureProperties @"properties"
+#define zsCaptureNoReply @"noReply"
+#define zsCaptureUrgent @"urgent"
+#define zsCaptureCompressed @"compressed"
+#define zsCaptureErrorCode @"errorCode"
+#define zsCaptureBody @"body"
+
+#define zsCaptureKindSent @"sent"
+#define zsCaptureKindResponse @"response"
+#define zsCaptureKindReceived @"received"
+
+#define zsCaptureRole @"role"
+#define zsCaptureStartDate @"startDate"
+#define zsCaptureRoleDevice @"device"
+
+/* Appends every BLIP message of one session to a capture file so the session
+ * can be replayed against a daemon later.  The file starts with the four
+ * bytes "ZSC1" followed by records of a big endian 32 bit header length, a
+ * binary plist header, a big endian 32 bit body length and the body.  The
+ * first record holds the session information, every other record one
+ * message.  BLIP itself lives in libMYNetwork so messages are recorded as the
+ * scheduler and the connection delegate see them, not frame by frame.
+ */
+@interface ZSyncSessionRecorder : NSObject
+{
+  NSFileHandle *fileHandle;
+  NSString *path;
+  CFAbsoluteTime startTime;
+}
+
+@property (nonatomic, readonly) NSString *path;
+
+/* Creates a new capture file in the directory, named after the current time
+ * and made unique so concurrent connections never share one.
+ */
++ (id)recorderInDirectory:(NSString *)directory role:(NSString *)role;
+
+/* Returns nil rather than overwriting an existing file */
+- (id)initWithPath:(NSString *)path role:(NSString *)role;
+
+/* kind is one of zsCaptureKindSent, zsCaptureKindResponse or
+ * zsCaptureKindReceived.  Outgoing requests must be recorded after they were
+ * handed to the connection so their message number is known.
+ */
+- (void)recordMessage:(BLIPMessage *)message kind:(NSString *)kind;
+
+- (void)close;
+
+@end
+
+/* Reads a capture file written by ZSyncSessionRecorder */
+@interface ZSyncSessionReader : NSObject
+{
+  NSData *data;
+  NSUInteger offset;
+  NSDictionary *sessionInfo;
+}
+
+/* The first record: zsCaptureRole and zsCaptureStartDate */
+@property (nonatomic, readonly) NSDictionary *sessionInfo;
+
+/* Returns nil if the file is missing or is not a capture file */
+- (id)initWithPath:(NSString *)path;
+
+/* The next message header with its body under zsCaptureBody, nil at the end
+ * of the file.  A truncated last record is treated as the end.
+ */
+- (NSDictionary *)nextEvent;
+
+@end
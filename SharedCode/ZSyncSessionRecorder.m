@@ -0,0 +1,258 @@
+//
+//  ZSyncSessionRecorder.m
+//  ZSync
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import "ZSyncSessionRecorder.h"
+
+static const char captureMagic[4] = { 'Z', 'S', 'C', '1' };
+
+@interface ZSyncSessionRecorder ()
+
+- (void)writeHeader:(NSDictionary *)header body:(NSData *)body;
+
+@end
+
+@implementation ZSyncSessionRecorder
+
++ (id)recorderInDirectory:(NSString *)directory role:(NSString *)role
+{
+  NSFileManager *fileManager = [NSFileManager defaultManager];
+  if (![fileManager fileExistsAtPath:directory]) {
+    NSError *error = nil;
+    if (![fileManager createDirectoryAtPath:directory withIntermediateDirectories:YES attributes:nil error:&error]) {
+      DLog(@"Failed to create capture directory %@: %@", directory, [error localizedDescription]);
+      return nil;
+    }
+  }
+
+  // Connections racing during discovery start in the same second, the time only keeps the files sorted
+  NSString *name = [NSString stringWithFormat:@"%.0f-%@-%@", [NSDate timeIntervalSinceReferenceDate], role, [[NSProcessInfo processInfo] globallyUniqueString]];
+  NSString *capturePath = [[directory stringByAppendingPathComponent:name] stringByAppendingPathExtension:zsCaptureExtension];
+
+  return [[[self alloc] initWithPath:capturePath role:role] autorelease];
+}
+
+- (id)initWithPath:(NSString *)aPath role:(NSString *)role
+{
+  if (!(self = [super init])) return nil;
+
+  if ([[NSFileManager defaultManager] fileExistsAtPath:aPath]) {
+    DLog(@"Capture file %@ already exists", aPath);
+    [self release];
+    return nil;
+  }
+
+  if (![[NSFileManager defaultManager] createFileAtPath:aPath contents:[NSData dataWithBytes:captureMagic length:sizeof(captureMagic)] attributes:nil]) {
+    DLog(@"Failed to create capture file %@", aPath);
+    [self release];
+    return nil;
+  }
+
+  path = [aPath copy];
+  fileHandle = [[NSFileHandle fileHandleForWritingAtPath:path] retain];
+  if (!fileHandle) {
+    DLog(@"Failed to open capture file %@", path);
+    [self release];
+    return nil;
+  }
+  @try {
+    [fileHandle seekToEndOfFile];
+  } @catch (NSException *exception) {
+    DLog(@"Failed to open capture file %@: %@", path, [exception reason]);
+    [self release];
+    return nil;
+  }
+  startTime = CFAbsoluteTimeGetCurrent();
+
+  NSMutableDictionary *info = [NSMutableDictionary dictionary];
+  [info setValue:role forKey:zsCaptureRole];
+  [info setValue:[NSDate date] forKey:zsCaptureStartDate];
+  [self writeHeader:info body:nil];
+
+  DLog(@"capturing session to %@", path);
+  return self;
+}
+
+- (void)recordMessage:(BLIPMessage *)message kind:(NSString *)kind
+{
+  if (!fileHandle) return;
+
+  NSMutableDictionary *header = [NSMutableDictionary dictionary];
+  [header setValue:kind forKey:zsCaptureKind];
+  [header setValue:[NSNumber numberWithDouble:(CFAbsoluteTimeGetCurrent() - startTime)] forKey:zsCaptureTime];
+  [header setValue:[NSNumber numberWithUnsignedInt:[message number]] forKey:zsCaptureNumber];
+  [header setValue:[[message properties] allProperties] forKey:zsCaptureProperties];
+  [header setValue:[NSNumber numberWithBool:[message urgent]] forKey:zsCaptureUrgent];
+  [header setValue:[NSNumber numberWithBool:[message compressed]] forKey:zsCaptureCompressed];
+  if ([message isKindOfClass:[BLIPRequest class]]) {
+    [header setValue:[NSNumber numberWithBool:[(BLIPRequest*)message noReply]] forKey:zsCaptureNoReply];
+  } else if ([(BLIPResponse*)message error]) {
+    [header setValue:[NSNumber numberWithInteger:[[(BLIPResponse*)message error] code]] forKey:zsCaptureErrorCode];
+  }
+
+  [self writeHeader:header body:[message body]];
+}
+
+- (void)close
+{
+  // Capturing is diagnostic only, a failure here must never reach the sync
+  @try {
+    [fileHandle closeFile];
+  } @catch (NSException *exception) {
+    DLog(@"Failed to close capture file %@: %@", path, [exception reason]);
+  }
+  [fileHandle release], fileHandle = nil;
+}
+
+- (void)writeHeader:(NSDictionary *)header body:(NSData *)body
+{
+  if (!fileHandle) return;
+
+  NSString *errorString = nil;
+  NSData *headerData = [NSPropertyListSerialization dataFromPropertyList:header format:NSPropertyListBinaryFormat_v1_0 errorDescription:&errorString];
+  if (!headerData) {
+    DLog(@"Failed to encode capture header: %@", errorString);
+    [errorString release], errorString = nil;
+    return;
+  }
+
+  uint32_t lengths[2];
+  lengths[0] = NSSwapHostIntToBig((uint32_t)[headerData length]);
+  lengths[1] = NSSwapHostIntToBig((uint32_t)[body length]);
+
+  NSMutableData *record = [NSMutableData dataWithCapacity:(sizeof(lengths) + [headerData length] + [body length])];
+  [record appendBytes:&lengths[0] length:sizeof(uint32_t)];
+  [record appendData:headerData];
+  [record appendBytes:&lengths[1] length:sizeof(uint32_t)];
+  if (body) [record appendData:body];
+
+  @try {
+    [fileHandle writeData:record];
+  } @catch (NSException *exception) {
+    DLog(@"Capture to %@ stopped: %@", path, [exception reason]);
+    [self close];
+  }
+}
+
+- (void)dealloc
+{
+  [self close];
+  [path release], path = nil;
+
+  [super dealloc];
+}
+
+@synthesize path;
+
+@end
+
+#pragma mark -
+
+@interface ZSyncSessionReader ()
+
+- (NSDictionary *)readHeaderWithBody:(NSData **)body;
+
+@end
+
+@implementation ZSyncSessionReader
+
+- (id)initWithPath:(NSString *)aPath
+{
+  if (!(self = [super init])) return nil;
+
+  data = [[NSData alloc] initWithContentsOfMappedFile:aPath];
+  if ([data length] < sizeof(captureMagic) || memcmp([data bytes], captureMagic, sizeof(captureMagic)) != 0) {
+    DLog(@"%@ is not a capture file", aPath);
+    [self release];
+    return nil;
+  }
+  offset = sizeof(captureMagic);
+
+  sessionInfo = [[self readHeaderWithBody:NULL] retain];
+  if (!sessionInfo) {
+    [self release];
+    return nil;
+  }
+
+  return self;
+}
+
+- (NSDictionary *)nextEvent
+{
+  NSData *body = nil;
+  NSDictionary *header = [self readHeaderWithBody:&body];
+  if (!header) return nil;
+
+  NSMutableDictionary *event = [[header mutableCopy] autorelease];
+  [event setValue:body forKey:zsCaptureBody];
+  return event;
+}
+
+- (NSDictionary *)readHeaderWithBody:(NSData **)body
+{
+  const uint8_t *bytes = [data bytes];
+  NSUInteger length = [data length];
+
+  uint32_t headerLength;
+  if (length - offset < sizeof(uint32_t)) return nil;
+  memcpy(&headerLength, bytes + offset, sizeof(uint32_t));
+  headerLength = NSSwapBigIntToHost(headerLength);
+  if (length - offset - sizeof(uint32_t) < headerLength + sizeof(uint32_t)) return nil;
+
+  NSData *headerData = [data subdataWithRange:NSMakeRange(offset + sizeof(uint32_t), headerLength)];
+  NSUInteger bodyOffset = offset + sizeof(uint32_t) + headerLength;
+
+  uint32_t bodyLength;
+  memcpy(&bodyLength, bytes + bodyOffset, sizeof(uint32_t));
+  bodyLength = NSSwapBigIntToHost(bodyLength);
+  bodyOffset += sizeof(uint32_t);
+  if (length - bodyOffset < bodyLength) return nil;
+
+  NSString *errorString = nil;
+  id header = [NSPropertyListSerialization propertyListFromData:headerData mutabilityOption:NSPropertyListImmutable format:NULL errorDescription:&errorString];
+  if (![header isKindOfClass:[NSDictionary class]]) {
+    DLog(@"Corrupt capture record at offset %lu: %@", (unsigned long)offset, errorString);
+    [errorString release], errorString = nil;
+    return nil;
+  }
+
+  if (body) *body = [data subdataWithRange:NSMakeRange(bodyOffset, bodyLength)];
+  offset = bodyOffset + bodyLength;
+
+  return header;
+}
+
+- (void)dealloc
+{
+  [data release], data = nil;
+  [sessionInfo release], sessionInfo = nil;
+
+  [super dealloc];
+}
+
+@synthesize sessionInfo;
+
+@end
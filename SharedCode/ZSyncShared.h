@@ -32,11 +32,45 @@
 #define zsDeviceName @"zsDeviceName"
 #define zsDeviceGUID @"zsDeviceGUID"
 #define zsSchemaIdentifier @"ZSyncSchemaIdentifier"
+#define zsChunkIndex @"zsChunkIndex"
+#define zsChunkCount @"zsChunkCount"
+#define zsChunkOffset @"zsChunkOffset"
+#define zsChunkTotalLength @"zsChunkTotalLength"
+#define zsChangeCount @"zsChangeCount"
+#define zsSchemaSet @"zsSchemaSet"
+#define zsModelFingerprint @"zsModelFingerprint"
+#define zsStorePriority @"zsStorePriority"
+
+/* Plugins may map entity names to a priority in their Info.plist under this
+ * key.  A store is as urgent as the most urgent entity in its configuration,
+ * stores above zero are returned first and applied as soon as they arrive.
+ */
+#define zsEntityPriorities @"ZSyncEntityPriorities"
 
 #define zsDeregisteredServersKey @"zsDeregisteredServersKey"
 
+#define zsHeartbeatInterval 30.0
+#define zsSessionIdleTimeout (zsHeartbeatInterval * 4)
+
 #define zsActID(__ENUM__) [NSString stringWithFormat:@"%i", __ENUM__]
 
+/* The server advertises how often the data behind each schema has changed
+ * in its TXT record under this key.
+ */
+#define zsChangeCountTXTKey(__SCHEMA__) [NSString stringWithFormat:@"zc.%@", __SCHEMA__]
+
+/* Capability and load keys of the server TXT record.  Servers that predate
+ * them are assumed to speak the current protocol.
+ */
+#define zsTXTProtocolVersion @"zv"
+#define zsTXTCapabilities @"zf"
+#define zsTXTSchemaSet @"zs"
+#define zsTXTLoad @"zl"
+#define zsTXTQueueDepth @"zq"
+
+#define zsProtocolVersionNumber 2
+#define zsMinimumProtocolVersionNumber 2
+
 enum {
   zsActionRequestPairing = 1123,
   zsActionCancelPairing,	
@@ -53,14 +87,31 @@ enum {
   zsActionTestFileTransfer,
   zsActionDeregisterClient,
   zsActionLatentDeregisterClient,
-  zsActionVerifyPairing
+  zsActionVerifyPairing,
+  zsActionChunkReceived,
+  zsActionHeartbeat,
+  zsActionDataChanged,
+  zsActionStats,
+  zsActionCancelSync
 };
 
+/* Sent with zsActionCancelSync under zsCancelReason */
+#define zsCancelReason @"zsCancelReason"
+
+typedef enum {
+  zsCancelReasonUnknown = 0,
+  zsCancelReasonUserRequest,
+  zsCancelReasonTransferFailed
+} ZSCancelReason;
+
 typedef enum {
   zsErrorFailedToReceiveAllFiles = 1123,
   zsErrorServerHungUp,
   zsErrorAnotherActivityInProgress,
-  zsErrorNoSyncClientRegistered
+  zsErrorNoSyncClientRegistered,
+  zsErrorModelMismatch,
+  zsErrorInvalidChunk,
+  zsErrorStoreWriteFailed
 } ZSErrorCode;
 
 #import "MYNetwork.h"
\ No newline at end of file
@@ -0,0 +1,57 @@
+//
+//  ZSyncStoreAssembler.h
+//  ZSync
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import "ZSyncShared.h"
+
+/* Reassembles store bodies that arrive as zsActionStoreUpload chunks.  Each
+ * chunk is written at its offset as it arrives so a store is never held in
+ * memory as a whole.  Requests without chunk properties are treated as a
+ * store made of a single chunk.
+ */
+@interface ZSyncStoreAssembler : NSObject
+{
+  NSString *directory;
+  NSString *pathExtension;
+  NSMutableDictionary *assemblies;
+}
+
+@property (nonatomic, copy) NSString *directory;
+@property (nonatomic, copy) NSString *pathExtension;
+
+- (id)initWithDirectory:(NSString *)directory pathExtension:(NSString *)pathExtension;
+
+/* Returns the path of the completed file once the final chunk of a store has
+ * been written, nil while chunks are still outstanding.  A chunk that does
+ * not fit the store or cannot be written returns nil with the error set and
+ * the partial file of that store discarded.
+ */
+- (NSString *)addChunkFromRequest:(BLIPRequest *)request error:(NSError **)error;
+
+/* Closes and deletes every partially received store */
+- (void)discardAllAssemblies;
+
+@end
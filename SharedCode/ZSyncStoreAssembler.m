@@ -0,0 +1,264 @@
+//
+//  ZSyncStoreAssembler.m
+//  ZSync
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import "ZSyncStoreAssembler.h"
+
+#pragma mark -
+
+@interface ZSyncStoreAssembly : NSObject
+{
+  NSString *path;
+  NSFileHandle *fileHandle;
+  NSMutableIndexSet *receivedChunks;
+  NSUInteger chunkCount;
+  long long totalLength;
+  unsigned long long bytesReceived;
+}
+
+@property (nonatomic, copy) NSString *path;
+@property (nonatomic, retain) NSFileHandle *fileHandle;
+@property (nonatomic, retain) NSMutableIndexSet *receivedChunks;
+@property (nonatomic, assign) NSUInteger chunkCount;
+// -1 when the sender predates zsChunkTotalLength
+@property (nonatomic, assign) long long totalLength;
+@property (nonatomic, assign) unsigned long long bytesReceived;
+
+@end
+
+@implementation ZSyncStoreAssembly
+
+- (void)dealloc
+{
+  [path release], path = nil;
+  [fileHandle release], fileHandle = nil;
+  [receivedChunks release], receivedChunks = nil;
+
+  [super dealloc];
+}
+
+@synthesize path;
+@synthesize fileHandle;
+@synthesize receivedChunks;
+@synthesize chunkCount;
+@synthesize totalLength;
+@synthesize bytesReceived;
+
+@end
+
+#pragma mark -
+
+@interface ZSyncStoreAssembler ()
+
+- (NSString *)uniqueFilePath;
+- (void)discardAssemblyForStore:(NSString *)storeIdentifier;
+
+@end
+
+static NSError *assemblyError(ZSErrorCode code, NSString *description)
+{
+  NSDictionary *userInfo = [NSDictionary dictionaryWithObject:description forKey:NSLocalizedDescriptionKey];
+  return [NSError errorWithDomain:zsErrorDomain code:code userInfo:userInfo];
+}
+
+@implementation ZSyncStoreAssembler
+
+- (id)initWithDirectory:(NSString *)aDirectory pathExtension:(NSString *)aPathExtension
+{
+  if (!(self = [super init])) return nil;
+
+  [self setDirectory:aDirectory];
+  [self setPathExtension:aPathExtension];
+  assemblies = [[NSMutableDictionary alloc] init];
+
+  return self;
+}
+
+#pragma mark -
+#pragma mark Public methods
+
+- (NSString *)addChunkFromRequest:(BLIPRequest *)request error:(NSError **)error
+{
+  ZAssert([request complete], @"Message is incomplete");
+
+  NSData *body = [request body];
+  NSString *totalLengthValue = [request valueOfProperty:zsChunkTotalLength];
+  long long totalLength = (totalLengthValue ? [totalLengthValue longLongValue] : -1);
+
+  NSInteger chunkCount = [[request valueOfProperty:zsChunkCount] integerValue];
+  if (chunkCount <= 1) {
+    if (totalLength >= 0 && totalLength != (long long)[body length]) {
+      if (error) *error = assemblyError(zsErrorInvalidChunk, @"Store length does not match its body");
+      return nil;
+    }
+
+    NSString *filePath = [self uniqueFilePath];
+    if (![body writeToFile:filePath atomically:YES]) {
+      if (error) *error = assemblyError(zsErrorStoreWriteFailed, @"Failed to write the store");
+      return nil;
+    }
+    return filePath;
+  }
+
+  // Everything below comes off the network, a chunk that does not fit would leave a hole
+  NSString *storeIdentifier = [request valueOfProperty:zsStoreIdentifier];
+  NSInteger chunkIndex = [[request valueOfProperty:zsChunkIndex] integerValue];
+  long long offset = [[request valueOfProperty:zsChunkOffset] longLongValue];
+  ZSyncStoreAssembly *assembly = [assemblies objectForKey:storeIdentifier];
+  if (!storeIdentifier || chunkIndex < 0 || chunkIndex >= chunkCount || offset < 0 ||
+      (totalLength >= 0 && offset + (long long)[body length] > totalLength) ||
+      (assembly && ([assembly chunkCount] != (NSUInteger)chunkCount || [assembly totalLength] != totalLength))) {
+    DLog(@"%s chunk %i of %i at %qi does not fit store %@", __PRETTY_FUNCTION__, chunkIndex, chunkCount, offset, storeIdentifier);
+    [self discardAssemblyForStore:storeIdentifier];
+    if (error) *error = assemblyError(zsErrorInvalidChunk, @"Chunk does not fit the store");
+    return nil;
+  }
+
+  if (!assembly) {
+    NSString *filePath = [self uniqueFilePath];
+    NSFileHandle *fileHandle = nil;
+    if ([[NSFileManager defaultManager] createFileAtPath:filePath contents:nil attributes:nil]) {
+      fileHandle = [NSFileHandle fileHandleForWritingAtPath:filePath];
+    }
+    if (!fileHandle) {
+      [[NSFileManager defaultManager] removeItemAtPath:filePath error:nil];
+      if (error) *error = assemblyError(zsErrorStoreWriteFailed, @"Failed to create the store file");
+      return nil;
+    }
+
+    assembly = [[ZSyncStoreAssembly alloc] init];
+    [assembly setPath:filePath];
+    [assembly setFileHandle:fileHandle];
+    [assembly setReceivedChunks:[NSMutableIndexSet indexSet]];
+    [assembly setChunkCount:chunkCount];
+    [assembly setTotalLength:totalLength];
+    [assemblies setObject:assembly forKey:storeIdentifier];
+    [assembly release];
+  }
+
+  if ([[assembly receivedChunks] containsIndex:chunkIndex]) {
+    DLog(@"%s chunk %i of %@ received twice", __PRETTY_FUNCTION__, chunkIndex, storeIdentifier);
+    return nil;
+  }
+
+  // NSFileHandle raises on a full disk, which must not escape a BLIP callback
+  @try {
+    [[assembly fileHandle] seekToFileOffset:offset];
+    [[assembly fileHandle] writeData:body];
+  } @catch (NSException *exception) {
+    DLog(@"%s failed to write chunk %i of %@: %@", __PRETTY_FUNCTION__, chunkIndex, storeIdentifier, [exception reason]);
+    [self discardAssemblyForStore:storeIdentifier];
+    if (error) *error = assemblyError(zsErrorStoreWriteFailed, @"Failed to write the store");
+    return nil;
+  }
+  [[assembly receivedChunks] addIndex:chunkIndex];
+  [assembly setBytesReceived:([assembly bytesReceived] + [body length])];
+
+  if ([[assembly receivedChunks] count] < (NSUInteger)chunkCount) {
+    return nil;
+  }
+
+  if (totalLength >= 0 && [assembly bytesReceived] != (unsigned long long)totalLength) {
+    DLog(@"%s store %@ has %qu of %qi bytes", __PRETTY_FUNCTION__, storeIdentifier, [assembly bytesReceived], totalLength);
+    [self discardAssemblyForStore:storeIdentifier];
+    if (error) *error = assemblyError(zsErrorInvalidChunk, @"Chunks do not cover the store");
+    return nil;
+  }
+
+  DLog(@"%s store %@ assembled from %i chunks", __PRETTY_FUNCTION__, storeIdentifier, chunkCount);
+  @try {
+    [[assembly fileHandle] closeFile];
+  } @catch (NSException *exception) {
+    DLog(@"%s failed to close %@: %@", __PRETTY_FUNCTION__, storeIdentifier, [exception reason]);
+    [self discardAssemblyForStore:storeIdentifier];
+    if (error) *error = assemblyError(zsErrorStoreWriteFailed, @"Failed to write the store");
+    return nil;
+  }
+  NSString *filePath = [[[assembly path] retain] autorelease];
+  [assemblies removeObjectForKey:storeIdentifier];
+
+  return filePath;
+}
+
+- (void)discardAllAssemblies
+{
+  for (ZSyncStoreAssembly *assembly in [assemblies allValues]) {
+    [[assembly fileHandle] closeFile];
+
+    NSError *error = nil;
+    [[NSFileManager defaultManager] removeItemAtPath:[assembly path] error:&error];
+    ZAssert(error == nil, @"Error deleting partial file: %@", [error localizedDescription]);
+  }
+
+  [assemblies removeAllObjects];
+}
+
+#pragma mark -
+#pragma mark Local methods
+
+- (void)discardAssemblyForStore:(NSString *)storeIdentifier
+{
+  if (!storeIdentifier) return;
+
+  ZSyncStoreAssembly *assembly = [assemblies objectForKey:storeIdentifier];
+  if (!assembly) return;
+
+  @try {
+    [[assembly fileHandle] closeFile];
+  } @catch (NSException *exception) {
+    DLog(@"%s %@", __PRETTY_FUNCTION__, [exception reason]);
+  }
+  [[NSFileManager defaultManager] removeItemAtPath:[assembly path] error:nil];
+  [assemblies removeObjectForKey:storeIdentifier];
+}
+
+- (NSString *)uniqueFilePath
+{
+  NSString *filePath = [[self directory] stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]];
+  if ([self pathExtension]) {
+    filePath = [filePath stringByAppendingPathExtension:[self pathExtension]];
+  }
+
+  return filePath;
+}
+
+#pragma mark -
+#pragma mark Memory management and property declarations
+
+- (void)dealloc
+{
+  [self discardAllAssemblies];
+  [directory release], directory = nil;
+  [pathExtension release], pathExtension = nil;
+  [assemblies release], assemblies = nil;
+
+  [super dealloc];
+}
+
+@synthesize directory;
+@synthesize pathExtension;
+
+@end
@@ -0,0 +1,93 @@
+//
+//  ZSyncTrace.h
+//  ZSync
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import <Foundation/Foundation.h>
+
+/* Span names shared by the device and the daemon */
+#define zsSpanDiscovery @"discovery"
+#define zsSpanResolve @"resolve"
+#define zsSpanConnect @"connect"
+#define zsSpanVerifySchema @"verify schema"
+#define zsSpanStoreUpload @"store upload"
+#define zsSpanMigration @"migration"
+#define zsSpanMerge @"desktop merge"
+#define zsSpanStoreDownload @"store download"
+#define zsSpanSwap @"swap"
+
+#define kZSyncTraceCapacity 2048
+
+typedef struct {
+  NSString *name;
+  NSString *detail;
+  NSString *syncIdentifier;
+  CFAbsoluteTime start;
+  CFTimeInterval duration;
+  unsigned int thread;
+} ZSyncTraceEvent;
+
+/* Records timed spans of a sync into a fixed ring buffer so tracing can stay
+ * on in release builds.  A span is identified by its name, detail and sync
+ * identifier, the zsSyncGUID of the device, so the device and the daemon
+ * traces of one sync can be lined up.  Once the buffer is full the oldest
+ * spans are overwritten.
+ *
+ * Spans may be recorded from any thread.
+ */
+@interface ZSyncTrace : NSObject
+{
+  NSLock *lock;
+  ZSyncTraceEvent events[kZSyncTraceCapacity];
+  NSUInteger nextEvent;
+  NSUInteger eventCount;
+  NSMutableDictionary *openSpans;
+
+  NSString *processName;
+  BOOL enabled;
+}
+
+/* Shown as the process name in the trace viewer */
+@property (copy) NSString *processName;
+@property (assign, getter=isEnabled) BOOL enabled;
+
++ (ZSyncTrace *)sharedTrace;
+
+/* Detail may be nil, ending a span that was never begun does nothing */
+- (void)beginSpan:(NSString *)name detail:(NSString *)detail sync:(NSString *)syncIdentifier;
+- (void)endSpan:(NSString *)name detail:(NSString *)detail sync:(NSString *)syncIdentifier;
+
+/* Drops the spans of a sync that are still open, for syncs that failed */
+- (void)discardOpenSpansForSync:(NSString *)syncIdentifier;
+
+- (void)reset;
+
+/* The completed spans as Chrome trace event JSON, loadable in
+ * chrome://tracing.  Timestamps are microseconds since 1970 so traces from
+ * the device and the daemon can be concatenated.
+ */
+- (NSData *)chromeTraceData;
+
+@end
@@ -0,0 +1,224 @@
+//
+//  ZSyncTrace.m
+//  ZSync
+//
+//  Copyright 2010 Zarra Studios LLC. All rights reserved.
+//
+//  Permission is hereby granted, free of charge, to any person
+//  obtaining a copy of this software and associated documentation
+//  files (the "Software"), to deal in the Software without
+//  restriction, including without limitation the rights to use,
+//  copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following
+//  conditions:
+//
+//  The above copyright notice and this permission notice shall be
+//  included in all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+//  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+//  OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+//  NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//  HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+//  WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+//  OTHER DEALINGS IN THE SOFTWARE.
+
+#import "ZSyncTrace.h"
+#import <pthread.h>
+#import <mach/mach.h>
+
+#define kMaximumOpenSpans 256
+
+static NSString *spanKey(NSString *name, NSString *detail, NSString *syncIdentifier)
+{
+  return [NSString stringWithFormat:@"%@|%@|%@", syncIdentifier, name, (detail ? detail : @"")];
+}
+
+static void appendJSONString(NSMutableString *json, NSString *string)
+{
+  [json appendString:@"\""];
+  NSUInteger length = [string length];
+  for (NSUInteger index = 0; index < length; ++index) {
+    unichar character = [string characterAtIndex:index];
+    switch (character) {
+      case '"':
+        [json appendString:@"\\\""];
+        break;
+      case '\\':
+        [json appendString:@"\\\\"];
+        break;
+      case '\n':
+        [json appendString:@"\\n"];
+        break;
+      default:
+        if (character < 0x20) {
+          [json appendFormat:@"\\u%04x", character];
+        } else {
+          [json appendFormat:@"%C", character];
+        }
+        break;
+    }
+  }
+  [json appendString:@"\""];
+}
+
+@implementation ZSyncTrace
+
++ (ZSyncTrace *)sharedTrace
+{
+  static ZSyncTrace *sharedTrace;
+  @synchronized([ZSyncTrace class])
+  {
+    if (!sharedTrace) {
+      sharedTrace = [[ZSyncTrace alloc] init];
+    }
+  }
+
+  return sharedTrace;
+}
+
+- (id)init
+{
+  if (!(self = [super init])) return nil;
+
+  lock = [[NSLock alloc] init];
+  openSpans = [[NSMutableDictionary alloc] init];
+  processName = [[[NSProcessInfo processInfo] processName] copy];
+  enabled = YES;
+
+  return self;
+}
+
+#pragma mark -
+#pragma mark Public methods
+
+- (void)beginSpan:(NSString *)name detail:(NSString *)detail sync:(NSString *)syncIdentifier
+{
+  if (![self isEnabled]) return;
+
+  NSNumber *start = [[NSNumber alloc] initWithDouble:CFAbsoluteTimeGetCurrent()];
+  NSString *key = spanKey(name, detail, syncIdentifier);
+
+  [lock lock];
+  // Spans of syncs that died without cleaning up must not pile up
+  if ([openSpans count] >= kMaximumOpenSpans) {
+    [openSpans removeAllObjects];
+  }
+  [openSpans setObject:start forKey:key];
+  [lock unlock];
+
+  [start release], start = nil;
+}
+
+- (void)endSpan:(NSString *)name detail:(NSString *)detail sync:(NSString *)syncIdentifier
+{
+  if (![self isEnabled]) return;
+
+  CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+  NSString *key = spanKey(name, detail, syncIdentifier);
+
+  [lock lock];
+  NSNumber *start = [openSpans objectForKey:key];
+  if (!start) {
+    [lock unlock];
+    return;
+  }
+
+  ZSyncTraceEvent *event = &events[nextEvent];
+  [event->name release];
+  [event->detail release];
+  [event->syncIdentifier release];
+  event->name = [name copy];
+  event->detail = [detail copy];
+  event->syncIdentifier = [syncIdentifier copy];
+  event->start = [start doubleValue];
+  event->duration = now - event->start;
+  event->thread = pthread_mach_thread_np(pthread_self());
+
+  nextEvent = (nextEvent + 1) % kZSyncTraceCapacity;
+  eventCount = MIN(eventCount + 1, (NSUInteger)kZSyncTraceCapacity);
+
+  [openSpans removeObjectForKey:key];
+  [lock unlock];
+}
+
+- (void)discardOpenSpansForSync:(NSString *)syncIdentifier
+{
+  NSString *prefix = [NSString stringWithFormat:@"%@|", syncIdentifier];
+
+  [lock lock];
+  for (NSString *key in [openSpans allKeys]) {
+    if ([key hasPrefix:prefix]) {
+      [openSpans removeObjectForKey:key];
+    }
+  }
+  [lock unlock];
+}
+
+- (void)reset
+{
+  [lock lock];
+  for (NSUInteger index = 0; index < kZSyncTraceCapacity; ++index) {
+    [events[index].name release], events[index].name = nil;
+    [events[index].detail release], events[index].detail = nil;
+    [events[index].syncIdentifier release], events[index].syncIdentifier = nil;
+  }
+  nextEvent = 0;
+  eventCount = 0;
+  [openSpans removeAllObjects];
+  [lock unlock];
+}
+
+- (NSData *)chromeTraceData
+{
+  int pid = [[NSProcessInfo processInfo] processIdentifier];
+  NSMutableString *json = [NSMutableString stringWithCapacity:(eventCount * 160)];
+
+  [json appendString:@"{\"traceEvents\":[\n"];
+  [json appendFormat:@"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%i,\"tid\":0,\"args\":{\"name\":", pid];
+  appendJSONString(json, [self processName]);
+  [json appendString:@"}}"];
+
+  [lock lock];
+  NSUInteger first = (nextEvent + kZSyncTraceCapacity - eventCount) % kZSyncTraceCapacity;
+  for (NSUInteger offset = 0; offset < eventCount; ++offset) {
+    ZSyncTraceEvent *event = &events[(first + offset) % kZSyncTraceCapacity];
+    unsigned long long timestamp = (unsigned long long)((event->start + kCFAbsoluteTimeIntervalSince1970) * 1000000.0);
+    unsigned long long duration = (unsigned long long)(event->duration * 1000000.0);
+
+    [json appendString:@",\n{\"name\":"];
+    appendJSONString(json, event->name);
+    [json appendFormat:@",\"cat\":\"zsync\",\"ph\":\"X\",\"ts\":%qu,\"dur\":%qu,\"pid\":%i,\"tid\":%u,\"args\":{\"sync\":", timestamp, duration, pid, event->thread];
+    appendJSONString(json, (event->syncIdentifier ? event->syncIdentifier : @""));
+    if (event->detail) {
+      [json appendString:@",\"detail\":"];
+      appendJSONString(json, event->detail);
+    }
+    [json appendString:@"}}"];
+  }
+  [lock unlock];
+
+  [json appendString:@"\n],\"displayTimeUnit\":\"ms\"}\n"];
+
+  return [json dataUsingEncoding:NSUTF8StringEncoding];
+}
+
+#pragma mark -
+#pragma mark Memory management and property declarations
+
+- (void)dealloc
+{
+  [self reset];
+  [lock release], lock = nil;
+  [openSpans release], openSpans = nil;
+  [processName release], processName = nil;
+
+  [super dealloc];
+}
+
+@synthesize processName;
+@synthesize enabled;
+
+@end